@@ -0,0 +1,20 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdint.h>
+
+constexpr uint32_t SAMPLE_RATE = 22000;
+constexpr uint8_t MAX_VOLUME = 8;
+
+// Samples per generated block, i.e. one half of the double buffer.
+// Output latency is between one and two blocks (override with -D AUDIO_BLOCK_SIZE=n).
+// At 8 a block is 0.36 ms, which keeps key to sound under 2 ms; larger
+// blocks cost less CPU a sample but add their length to every note.
+#ifndef AUDIO_BLOCK_SIZE
+#define AUDIO_BLOCK_SIZE 8
+#endif
+
+// Task function that renders blocks into the AudioSink passed as its parameter.
+void audioGenTask(void *pvParameters);
+
+#endif // AUDIO_H
@@ -0,0 +1,48 @@
+#ifndef AUDIO_SINK_H
+#define AUDIO_SINK_H
+
+#include <stdint.h>
+
+// Samples are unsigned 12-bit, centred on DAC_MIDPOINT
+constexpr uint16_t DAC_MIDPOINT = 2048;
+constexpr uint16_t DAC_MAX = 4095;
+
+// Deadline counters for a double-buffered output
+struct AudioStats {
+  volatile uint32_t blocks;     // Blocks committed
+  volatile uint32_t underruns;  // Output reached a block that was not finished
+  volatile uint32_t overruns;   // Output moved on while a block was being rendered
+};
+
+/**
+ * Destination for rendered audio blocks of AUDIO_BLOCK_SIZE samples.
+ * The generator loops on `acquireBlock()`, fills the block, then `commitBlock()`.
+ */
+class AudioSink {
+public:
+  virtual ~AudioSink() {}
+
+  // Start the output, returns false on failure.
+  virtual bool begin(uint32_t sampleRate) = 0;
+
+  // Return the next block to fill, blocking until the output has room for it.
+  virtual uint16_t* acquireBlock() = 0;
+
+  // Hand the block from the last acquireBlock() to the output.
+  virtual void commitBlock() = 0;
+
+  // Stop the output.
+  virtual void end() {}
+
+  const AudioStats& stats() const { return stats_; }
+
+  // Sample index, counted from begin(), that the block from the last
+  // acquireBlock() starts playing on
+  uint32_t blockClock() const { return blockClock_; }
+
+protected:
+  AudioStats stats_ = {0, 0, 0};
+  uint32_t blockClock_ = 0;
+};
+
+#endif // AUDIO_SINK_H
@@ -0,0 +1,182 @@
+#ifndef CAN_PROTOCOL_H
+#define CAN_PROTOCOL_H
+
+#include <stdint.h>
+
+// ---------------------------------------------------------------------
+//                     CAN NOTE-EVENT PROTOCOL
+// ---------------------------------------------------------------------
+// See doc/canProtocol.md for the frame layout and bus load figures.
+
+// Bus bit rate, up to 1 Mbit/s. Every module in a stack must use the same
+// rate, so the default stays at the original 125 kbit/s (override with -D).
+#ifndef CAN_BIT_RATE
+#define CAN_BIT_RATE 125000
+#endif
+
+// Standard IDs by message class. The bus arbitrates in favour of the lowest
+// ID, so clock sync and stack enumeration beat notes, which beat control
+// changes, which beat telemetry.
+constexpr uint32_t CAN_ID_SYNC = 0x080;
+constexpr uint32_t CAN_ID_NOTE = 0x110;
+constexpr uint32_t CAN_ID_CONTROL = 0x120;
+constexpr uint32_t CAN_ID_TELEMETRY = 0x130;
+
+// Note frames from modules that predate the message classes
+constexpr uint32_t CAN_ID_LEGACY_NOTE = 0x123;
+
+// Receive filters. Notes go to FIFO 0 through a list bank, everything else
+// in 0x120..0x13f to FIFO 1. The list bank wins where the two overlap. Sync
+// and enumeration frames go to FIFO 1 through a list bank of their own.
+constexpr uint32_t CAN_BULK_FILTER_MASK = 0x7e0;
+
+// Carried in the top nibble of byte 0. The legacy 'P'/'R' frames read as
+// version 5, so they can never be mistaken for a versioned frame.
+constexpr uint8_t CAN_PROTOCOL_VERSION = 1;
+
+enum class CanMsgType : uint8_t {
+  KeyDiff = 1,
+  Capacity = 2,
+  Sync = 3,
+  SyncTime = 4,
+  EnumStart = 5,
+  EnumClaim = 6,
+  Handoff = 7
+};
+
+// Key diffs from modules without voice allocation are 6 bytes, the target
+// node makes it 7 and a time to play them at 8
+constexpr uint8_t KEY_DIFF_LENGTH = 6;
+constexpr uint8_t KEY_DIFF_TARGET_LENGTH = 7;
+constexpr uint8_t KEY_DIFF_TIMED_LENGTH = 8;
+constexpr uint8_t CAPACITY_LENGTH = 5;
+constexpr uint8_t SYNC_LENGTH = 3;
+constexpr uint8_t SYNC_TIME_LENGTH = 7;
+constexpr uint8_t ENUM_START_LENGTH = 6;
+constexpr uint8_t ENUM_CLAIM_LENGTH = 7;
+constexpr uint8_t HANDOFF_LENGTH = 4;
+
+// Target of a key diff whose presses every module should play
+constexpr uint8_t CAN_NODE_ALL = 0xff;
+
+// Key diffs carry the low bits of the stack sample clock, which is enough to
+// place them within +-93 ms of the receiver's own clock
+constexpr uint16_t KEY_DIFF_TIME_MASK = 0x0fff;
+
+// Frame payload, wrapped so it can be copied by value. The ID is filled in
+// on receive; on transmit the scheduler sets it from the message class.
+struct CanMessage {
+  uint32_t id;
+  uint8_t data[8];
+  uint8_t length;
+  uint32_t stamp;  // sampleClock() when received
+};
+
+// Every key change from one pass of the key scanner. `state` is the whole
+// keyboard after the changes, so a receiver can resync after a lost frame.
+struct KeyDiff {
+  uint8_t octave;
+  uint8_t sequence;  // Per sender, increments by one every frame
+  uint16_t state;    // Bit n set = key n held
+  uint16_t changed;  // Bit n set = key n changed in this frame
+  uint8_t target;    // Node that plays the presses, or CAN_NODE_ALL
+  bool timed;        // Otherwise the changes play on arrival
+  uint16_t time;     // Stack sample to play them on, KEY_DIFF_TIME_MASK bits
+};
+
+// Voices a module has to offer, advertised on CAN_ID_CONTROL
+struct VoiceCapacity {
+  uint8_t node;
+  uint8_t idle;       // Free voices
+  uint8_t releasing;  // Voices in their release stage, cheap to reuse
+  uint8_t total;
+};
+
+// A press the target module had no free voice for, passed on to another
+// module on CAN_ID_CONTROL. The key is named by the module it is on, so the
+// receiver can check it is still held.
+struct Handoff {
+  uint8_t octave;  // Module the key is on
+  uint8_t key;
+  uint8_t node;    // Module to play it
+};
+
+// Clock sync, in two frames. The master sends a Sync on CAN_ID_SYNC, and
+// every module notes its own sample clock when it arrives. The master then
+// sends the sample clock it noted when the Sync left, in a SyncTime on
+// CAN_ID_CONTROL with the same sequence number.
+struct SyncFrame {
+  uint8_t master;    // Node the stack clock comes from
+  uint8_t sequence;
+  uint32_t time;     // Master's sample clock, SyncTime only
+};
+
+// Stack enumeration, on CAN_ID_SYNC. A Start begins a round on every module,
+// then each module claims its position in turn, from the west end as the
+// handshake lines pass along the stack.
+struct EnumFrame {
+  uint8_t round;     // Claims from an earlier round are ignored
+  uint8_t position;  // Claim only, 0 at the west end
+  bool last;         // Claim only, no module further east
+  uint32_t uid;      // Sender's unique ID
+};
+
+enum class CanDecodeResult : uint8_t {
+  KeyDiff,     // Versioned key diff
+  Legacy,      // 'P'/'R' frame from an old module, converted to a one-key diff
+  BadVersion,  // Versioned frame from a newer protocol
+  Malformed    // Too short, unknown type or out-of-range fields
+};
+
+// Writes `diff` to `data` and returns the frame length
+uint8_t encodeKeyDiff(const KeyDiff& diff, uint8_t data[8]);
+
+// Decodes a received frame into `diff`
+CanDecodeResult decodeFrame(const uint8_t* data, uint8_t length, KeyDiff& diff);
+
+// Sequence numbers seen from the sender on one octave. A receiver keeps one
+// per octave, zeroed, and clears `seen` when the stack is renumbered.
+struct KeyDiffSequence {
+  bool seen;
+  uint8_t next;  // Sequence number expected next
+};
+
+// Takes the sequence number of a key diff and returns how many frames went
+// missing before it, across the 8-bit wrap. The first frame seen loses none.
+uint8_t trackSequence(KeyDiffSequence& tracker, uint8_t sequence);
+
+// Writes a capacity advert to `data` and returns the frame length
+uint8_t encodeCapacity(const VoiceCapacity& capacity, uint8_t data[8]);
+
+// Decodes a frame from CAN_ID_CONTROL, false if it isn't a capacity advert
+bool decodeCapacity(const uint8_t* data, uint8_t length, VoiceCapacity& capacity);
+
+// Writes a handoff to `data` and returns the frame length
+uint8_t encodeHandoff(const Handoff& handoff, uint8_t data[8]);
+
+// False if the frame isn't a handoff
+bool decodeHandoff(const uint8_t* data, uint8_t length, Handoff& handoff);
+
+// Write a Sync or a SyncTime to `data` and return the frame length
+uint8_t encodeSync(const SyncFrame& sync, uint8_t data[8]);
+uint8_t encodeSyncTime(const SyncFrame& sync, uint8_t data[8]);
+
+// False if the frame isn't a Sync or a SyncTime respectively
+bool decodeSync(const uint8_t* data, uint8_t length, SyncFrame& sync);
+bool decodeSyncTime(const uint8_t* data, uint8_t length, SyncFrame& sync);
+
+// Write an enumeration Start or Claim to `data` and return the frame length
+uint8_t encodeEnumStart(const EnumFrame& frame, uint8_t data[8]);
+uint8_t encodeEnumClaim(const EnumFrame& frame, uint8_t data[8]);
+
+// False if the frame isn't a Start or a Claim respectively
+bool decodeEnumStart(const uint8_t* data, uint8_t length, EnumFrame& frame);
+bool decodeEnumClaim(const uint8_t* data, uint8_t length, EnumFrame& frame);
+
+// Worst-case bits on the wire for a standard data frame with `length` data
+// bytes, including stuff bits and interframe space.
+constexpr uint32_t canFrameBits(uint8_t length) {
+  return 47 + 8 * length + (34 + 8 * length - 1) / 4;
+}
+
+#endif // CAN_PROTOCOL_H
@@ -0,0 +1,127 @@
+#ifndef CAN_TX_SCHEDULER_H
+#define CAN_TX_SCHEDULER_H
+
+#include <stdint.h>
+#include "canProtocol.h"
+
+// Outgoing message classes, highest priority first
+enum class CanClass : uint8_t {
+  Sync,       // Clock sync and enumeration: sent alone, into empty mailboxes
+  Note,       // Key diffs: kept in order, dropped only when full or offline
+  Control,    // Controls: a newer value replaces a pending one with its key
+  Telemetry,  // Status: the oldest pending message is dropped when full
+  Count
+};
+
+// Pending messages per class
+constexpr uint8_t CAN_TX_DEPTH = 8;
+
+// Transmit mailboxes on the bxCAN peripheral
+constexpr uint8_t CAN_TX_MAILBOXES = 3;
+
+// Message types that can have a sent hook
+constexpr uint8_t CAN_TX_SENT_HOOKS = 2;
+
+// Coalescing keys of the control messages
+constexpr uint8_t CONTROL_KEY_CAPACITY = 1;
+constexpr uint8_t CONTROL_KEY_SYNC_TIME = 2;
+
+// A handoff's key adds octave * 12 + key, so only a newer handoff of the
+// same key replaces it
+constexpr uint8_t CONTROL_KEY_HANDOFF = 16;
+
+struct CanTxStats {
+  uint32_t sent;
+  uint32_t dropped;
+  uint32_t coalesced;
+  uint32_t lastLatency;  // us from send() to a hardware mailbox
+  uint32_t maxLatency;
+  uint8_t depth;
+  uint8_t maxDepth;
+};
+
+/**
+ * Prioritised transmit queues in front of the three CAN mailboxes.
+ * - `send()`: queues a message by class and wakes the TX task, never blocks
+ * - `onMailboxFree()`: wakes the TX task from the CAN TX interrupt
+ * - `service()`: moves queued messages into free mailboxes, highest class
+ *   first (TX task only)
+ * - `stats()`: per-class depth, latency and drop counters
+ *
+ * A Sync message waits for every mailbox to empty, holding the other
+ * classes back, so it is the next frame this module puts on the bus. The
+ * sent hook for its message type then runs in the TX interrupt the moment
+ * it has been sent.
+ *
+ * While offline, with no other module on the bus to acknowledge a frame,
+ * messages are discarded rather than queued. Going offline also drops the
+ * queues and aborts the mailboxes, as those frames would retry until a
+ * module is plugged in and then go out stale. It starts offline, until
+ * stack enumeration has read the handshake lines.
+ *
+ * `send()` may be called from any task. The queues are guarded by short
+ * critical sections, so it must not be called from an interrupt.
+ */
+class CanTxScheduler {
+public:
+  typedef void (*NotifyFn)(void* context);
+
+  CanTxScheduler();
+
+  // Hooks that wake the TX task, from send() and from the TX interrupt
+  void setNotify(NotifyFn notify, NotifyFn notifyFromISR, void* context);
+
+  // Called from the TX interrupt once a Sync message of `type` has been sent
+  bool setSentHook(CanMsgType type, void (*hook)());
+
+  void setOnline(bool online);
+  bool online() const { return online_; }
+
+  // Called from the TX interrupt when a mailbox has been sent
+  void onMailboxFree();
+
+  // `key` identifies the control for coalescing, the other classes ignore
+  // it
+  bool send(CanClass cls, const CanMessage& msg, uint8_t key = 0);
+
+  void service();
+
+  CanTxStats stats(CanClass cls) const;
+
+private:
+  struct Entry {
+    CanMessage msg;
+    uint8_t key;
+    uint32_t queuedAt;
+  };
+
+  struct Queue {
+    Entry entries[CAN_TX_DEPTH];
+    uint8_t head;
+    uint8_t count;
+    bool sending;  // Head is being handed to a mailbox, leave it in place
+    CanTxStats stats;
+  };
+
+  bool peek(CanClass& cls, Entry& entry, bool mailboxesEmpty);
+  void finish(CanClass cls, bool sent);
+  void notify();
+
+  Queue queues_[(uint8_t) CanClass::Count];
+  struct SentHook {
+    uint8_t type;
+    void (*hook)();
+  };
+
+  SentHook sentHooks_[CAN_TX_SENT_HOOKS];
+  volatile uint8_t syncInFlight_;  // Type of the Sync message sent, 0 if none
+  volatile bool online_;
+  volatile bool flush_;  // Gone offline, service() drops what is pending
+  NotifyFn notify_;
+  NotifyFn notifyFromISR_;
+  void* context_;
+};
+
+extern CanTxScheduler canTx;
+
+#endif // CAN_TX_SCHEDULER_H
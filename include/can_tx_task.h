@@ -1,6 +1,18 @@
 #ifndef CAN_TX_TASK_H
 #define CAN_TX_TASK_H
 
+#include <stdint.h>
+
+// The TX task polls the bus health this often. The controller rejoins the
+// bus by itself after bus-off, and only a poll notices it has.
+constexpr uint32_t CAN_HEALTH_POLL_MS = 100;
+
+// From ES_CAN.h, which has no include guard
+struct CAN_Health;
+
 void CAN_TX_Task(void *pvParameters);
 
+// Bus health as of the last poll, safe to call from any task
+CAN_Health canHealth();
+
 #endif
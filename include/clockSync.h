@@ -0,0 +1,126 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <stdint.h>
+#include <STM32FreeRTOS.h>
+#include "audio.h"
+#include "canProtocol.h"
+
+// The master sends a Sync this often. A module that hears none from a lower
+// node for SYNC_MASTER_TIMEOUT periods takes over.
+constexpr uint32_t SYNC_PERIOD_MS = 100;
+constexpr uint8_t SYNC_MASTER_TIMEOUT = 3;
+
+// A residual this large, in samples, restarts the estimate rather than
+// being slewed out
+constexpr int32_t SYNC_STEP_SAMPLES = 64;
+
+// Loop gains: each Sync corrects the offset by 1/2^n of the residual, and the
+// drift by 1/2^n of the residual over the interval
+constexpr uint8_t SYNC_OFFSET_SHIFT = 2;
+constexpr uint8_t SYNC_DRIFT_SHIFT = 7;
+
+// Every note event plays this long after the key changed, on every module
+// but the one it was played on, so it has time to cross the bus (override
+// with -D NOTE_LATENCY_MS=n, 0 plays notes on arrival as before)
+#ifndef NOTE_LATENCY_MS
+#define NOTE_LATENCY_MS 10
+#endif
+constexpr uint32_t NOTE_LATENCY_SAMPLES = NOTE_LATENCY_MS * SAMPLE_RATE / 1000;
+
+// A timed key diff can wait behind the frames queued ahead of it, so each of
+// those adds its time on the bus to the latency of the notes it carries
+constexpr uint32_t KEY_DIFF_FRAME_SAMPLES =
+    (canFrameBits(KEY_DIFF_TIMED_LENGTH) * SAMPLE_RATE + CAN_BIT_RATE - 1) / CAN_BIT_RATE;
+
+constexpr uint32_t noteLatency(uint32_t framesAhead) {
+  return NOTE_LATENCY_SAMPLES + framesAhead * KEY_DIFF_FRAME_SAMPLES;
+}
+
+struct ClockSyncStats {
+  uint8_t master;     // Node the stack clock comes from
+  bool locked;        // toStack() and toLocal() can be trusted
+  uint32_t syncs;     // Sync pairs used
+  uint32_t steps;     // Times the estimate was restarted
+  int32_t residual;   // Last residual, in 1/256 samples
+  uint32_t jitter;    // Smoothed mean |residual|, in 1/256 samples
+  int32_t driftPpb;   // Stack clock rate against this module's
+};
+
+/**
+ * Estimates the stack's shared sample clock from this module's own.
+ * - `tick()`: every SYNC_PERIOD_MS; true when this module should send a Sync
+ * - `onSync()` / `onSyncTime()`: the two halves of a received clock sync
+ * - `toStack()` / `toLocal()`: converts between the two clocks
+ *
+ * The master is the lowest node sending Syncs, and its sample clock is the
+ * stack clock. Every other module notes its own sample clock when a Sync
+ * arrives, and pairs it with the master's time from the SyncTime. A PI loop
+ * then tracks the offset between the clocks and the drift of the crystals,
+ * so the estimate stays put between Syncs.
+ *
+ * Calls must be serialised by the caller, like VoicePool note on/off.
+ */
+class ClockSync {
+public:
+  ClockSync();
+
+  // A new node ID drops the master, so it is elected again
+  void setNode(uint8_t node);
+
+  bool tick(uint32_t nowMs);
+  bool isMaster() const { return master_ == node_; }
+
+  // Sequence number for the next Sync this module sends as master
+  uint8_t nextSequence() { return sequence_++; }
+
+  void onSync(const SyncFrame& sync, uint32_t localStamp, uint32_t nowMs);
+  void onSyncTime(const SyncFrame& sync);
+
+  bool locked() const { return isMaster() || pairs_ >= 2; }
+
+  // Stack clock at local sample `local`, and back. Both are the identity on
+  // the master or while unlocked.
+  uint32_t toStack(uint32_t local) const;
+  uint32_t toLocal(uint32_t stack) const;
+
+  ClockSyncStats stats() const;
+
+private:
+  void follow(uint8_t master, uint32_t nowMs);
+  int64_t offsetAt(uint32_t local) const;
+
+  uint8_t node_;
+  uint8_t master_;
+  uint8_t sequence_;
+  uint32_t lastHeard_;  // ms, last Sync from the master
+
+  // Local stamp of the last Sync, waiting for its SyncTime
+  bool stampValid_;
+  uint8_t stampSequence_;
+  uint32_t stamp_;
+
+  // Stack minus local clock at local sample base_, in Q16 samples, and its
+  // drift per sample in Q32
+  uint32_t pairs_;
+  uint32_t base_;
+  int64_t offset_;
+  int64_t drift_;
+
+  uint32_t steps_;
+  int32_t residual_;  // Q16
+  uint32_t jitter_;   // Q16
+};
+
+// Pairs a time in the low KEY_DIFF_TIME_MASK bits with the full stack clock
+// value nearest to `stackNow`
+uint32_t expandStackTime(uint16_t time, uint32_t stackNow);
+
+// Lets the CAN TX interrupt wake `task` (running clockSyncTask) as each Sync
+// leaves. Call before the scheduler starts.
+void clockSyncBegin(TaskHandle_t task);
+
+// Task function for sending this module's Syncs while it is the master.
+void clockSyncTask(void *pvParameters);
+
+#endif // CLOCK_SYNC_H
@@ -0,0 +1,48 @@
+#ifndef CONSTEXPR_MATH_H
+#define CONSTEXPR_MATH_H
+
+// Maths for generating lookup tables at compile time. These are slow
+// series expansions and should never be called at runtime.
+namespace constmath {
+
+constexpr double PI = 3.14159265358979323846;
+constexpr double LN2 = 0.69314718055994530942;
+
+// Taylor series sine, accurate to well below 16-bit resolution after
+// reducing the argument to -pi..pi
+constexpr double sin(double x) {
+  while (x > PI) x -= 2 * PI;
+  while (x < -PI) x += 2 * PI;
+  double term = x;
+  double sum = x;
+  for (int n = 1; n < 12; n++) {
+    term *= -x * x / ((2 * n) * (2 * n + 1));
+    sum += term;
+  }
+  return sum;
+}
+
+// Taylor series e^x, accurate for |x| < 1
+constexpr double exp(double x) {
+  double term = 1;
+  double sum = 1;
+  for (int n = 1; n < 24; n++) {
+    term *= x / n;
+    sum += term;
+  }
+  return sum;
+}
+
+// 2^x for any x, split into whole and fractional octaves
+constexpr double exp2(double x) {
+  int whole = (int) x;
+  if (x < whole) whole--;
+  double result = exp((x - whole) * LN2);
+  for (; whole > 0; whole--) result *= 2;
+  for (; whole < 0; whole++) result /= 2;
+  return result;
+}
+
+} // namespace constmath
+
+#endif // CONSTEXPR_MATH_H
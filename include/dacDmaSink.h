@@ -0,0 +1,37 @@
+#ifndef DAC_DMA_SINK_H
+#define DAC_DMA_SINK_H
+
+#include <STM32FreeRTOS.h>
+#include "audio.h"
+#include "audioSink.h"
+
+/**
+ * Streams 12-bit samples to DAC1 channel 1 (OUTR_PIN) with no per-sample CPU work.
+ * TIM6 triggers a conversion at the sample rate and DMA1 channel 3 feeds the DAC
+ * from a circular buffer of two blocks. The half-transfer and transfer-complete
+ * interrupts release the generator to refill the half that has just been played.
+ * The peripherals are driven by startSampleStream() in hardware.cpp.
+ */
+class DacDmaSink : public AudioSink {
+public:
+  bool begin(uint32_t sampleRate) override;
+  uint16_t* acquireBlock() override;
+  void commitBlock() override;
+  void end() override;
+
+  // Called from the DMA interrupt once `half` (0 or 1) has been sent to the DAC.
+  void onHalfSent(uint8_t half);
+
+private:
+  uint16_t buffer_[2 * AUDIO_BLOCK_SIZE];
+  SemaphoreHandle_t blockFree_ = NULL;
+  volatile uint8_t freeHalf_ = 1;  // Half the DMA is not reading
+  volatile bool blockReady_ = true;
+  volatile uint32_t halvesSent_ = 0;
+  uint8_t writeHalf_ = 1;          // Half being rendered
+};
+
+// The audio output on OUTR_PIN
+extern DacDmaSink dacSink;
+
+#endif // DAC_DMA_SINK_H
@@ -1,4 +1,23 @@
 #ifndef DECODE_TASK_H
 #define DECODE_TASK_H
+
+#include <stdint.h>
+
+// Receive counters. A lossless bus shows zero overruns, overflows and lost frames.
+struct CanRxStats {
+  uint32_t fifoOverruns[2];   // Hardware FIFO full when a frame arrived
+  uint32_t ringOverflows[2];  // msgInQ / bulkInQ full when a frame was drained
+  uint32_t lost;              // Gaps in key diff sequence numbers
+  uint32_t badVersion;
+  uint32_t malformed;
+  uint32_t sync;              // Clock sync and enumeration
+  uint32_t control;
+  uint32_t telemetry;
+};
+
 void decodeTask(void *pvParameters);
+
+// Snapshot of the counters, safe to call from any task
+CanRxStats canRxStats();
+
 #endif
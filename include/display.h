@@ -3,7 +3,18 @@
 
 #include <STM32FreeRTOS.h>
 
+// Display transfer counters since start-up
+struct DisplayStats {
+  uint32_t framesSent;     // Frames with at least one changed tile
+  uint32_t framesSkipped;  // Frames identical to the last one sent
+  uint32_t tilesSent;      // 8x8 pixel tiles, 8 bytes each
+  uint32_t i2cMicros;      // Time spent in the transfers
+};
+
 // Task function for updating the display.
 void displayUpdateTask(void *pvParameters);
 
+// Snapshot of the counters, safe to call from any task
+DisplayStats displayStats();
+
 #endif // DISPLAY_H
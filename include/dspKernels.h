@@ -0,0 +1,46 @@
+#ifndef DSP_KERNELS_H
+#define DSP_KERNELS_H
+
+#include <stdint.h>
+
+/**
+ * Block kernels for the audio path. On Cortex-M4 they use the packed SIMD
+ * and saturating instructions (SMLAD, SMUAD, QADD16, SSAT); elsewhere, or
+ * with -D DSP_KERNELS_PORTABLE, they use the *Portable versions, which give
+ * bit-identical results. Gains are Q15.
+ */
+
+// acc[i] += a[i] * gainA + b[i] * gainB, wrapping like SMLAD
+void mixPair(int32_t* acc, const int16_t* a, const int16_t* b,
+             int16_t gainA, int16_t gainB, uint32_t n);
+
+// buf[i] = saturate((buf[i] * gain) >> 15)
+void applyGain(int16_t* buf, int16_t gain, uint32_t n);
+
+// dst[i] = saturate(dst[i] + src[i])
+void addSaturate(int16_t* dst, const int16_t* src, uint32_t n);
+
+// out[i] = x - x^3/3 with x = saturate(in[i] >> shift) in Q15.
+// Unity gain for small signals, rounding off to 2/3 of full scale.
+void softClip(const int32_t* in, int16_t* out, uint32_t n, uint8_t shift);
+
+// buf[i] *= level + (i + 1) * step, with a Q30 level. A single multiply-add
+// per sample, so there is no separate SIMD version.
+void applyRamp(int16_t* buf, uint32_t level, int32_t step, uint32_t n);
+
+void mixPairPortable(int32_t* acc, const int16_t* a, const int16_t* b,
+                     int16_t gainA, int16_t gainB, uint32_t n);
+void applyGainPortable(int16_t* buf, int16_t gain, uint32_t n);
+void addSaturatePortable(int16_t* dst, const int16_t* src, uint32_t n);
+void softClipPortable(const int32_t* in, int16_t* out, uint32_t n, uint8_t shift);
+
+#ifdef PROFILE_ENABLED
+class Print;
+
+// Times each kernel against its portable version over a range of block
+// sizes and writes a table, in profiler ticks: cycles on the board,
+// nanoseconds on the host
+void benchKernels(Print& out);
+#endif
+
+#endif // DSP_KERNELS_H
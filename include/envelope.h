@@ -0,0 +1,68 @@
+#ifndef ENVELOPE_H
+#define ENVELOPE_H
+
+#include <stdint.h>
+
+// Envelope levels are Q30, so full scale is 1 << 30
+constexpr uint32_t ENVELOPE_MAX = 1u << 30;
+
+// Envelope times selectable from a knob rotation of 0..8
+constexpr uint16_t ENVELOPE_KNOB_TIMES_MS[9] = {2, 5, 10, 25, 50, 100, 250, 500, 1000};
+
+// Segment rates are level change per sample
+struct EnvelopeParams {
+  uint32_t attackRate;
+  uint32_t decayRate;
+  uint32_t sustainLevel;
+  uint32_t releaseRate;
+};
+
+enum class EnvelopeStage : uint8_t {
+  Idle,
+  Attack,
+  Decay,
+  Sustain,
+  Release
+};
+
+// Linear ramp across one block: level after sample i is start + (i + 1) * step
+struct EnvelopeRamp {
+  uint32_t start;
+  int32_t step;
+};
+
+/**
+ * Linear ADSR evaluated once per block at control rate.
+ * - `trigger()` / `release()`: gate on and off
+ * - `advance()`: moves the envelope on by a block and returns the ramp to
+ *   apply across it, so the per-sample cost is one multiply-add
+ */
+class Envelope {
+public:
+  Envelope() : stage_(EnvelopeStage::Idle), level_(0) {}
+
+  // Start the attack from the current level, so retriggers don't click
+  void trigger() { stage_ = EnvelopeStage::Attack; }
+
+  void release() {
+    if (stage_ != EnvelopeStage::Idle) stage_ = EnvelopeStage::Release;
+  }
+
+  EnvelopeRamp advance(const EnvelopeParams& params, uint32_t n);
+
+  bool idle() const { return stage_ == EnvelopeStage::Idle; }
+  bool releasing() const { return stage_ == EnvelopeStage::Release; }
+  uint32_t level() const { return level_; }
+
+private:
+  EnvelopeStage stage_;
+  uint32_t level_;
+};
+
+// Rate that covers the full level range in `ms` milliseconds at SAMPLE_RATE
+uint32_t envelopeRate(uint16_t ms);
+
+// Attack 5 ms, decay 100 ms, sustain 70%, release 50 ms
+EnvelopeParams defaultEnvelope();
+
+#endif // ENVELOPE_H
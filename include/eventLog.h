@@ -0,0 +1,49 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+#include <stdint.h>
+
+enum class LogId : uint8_t {
+#define LOG_EVENT(name, format) name,
+#include "logEvents.def"
+#undef LOG_EVENT
+  Count
+};
+
+constexpr uint8_t LOG_MAX_ARGS = 3;
+
+// Records queued between drains (power of two)
+constexpr uint32_t LOG_CAPACITY = 64;
+
+struct LogRecord {
+  uint32_t time;  // micros()
+  LogId id;
+  uint8_t argCount;
+  uint32_t args[LOG_MAX_ARGS];
+};
+
+// On serial each record is a binary frame: LOG_SYNC, id, argCount, then the
+// time and args as little-endian 32-bit words, then the low byte of the sum
+// of every byte before it. Anything else on the line is passed through as text.
+constexpr uint8_t LOG_SYNC = 0xa5;
+
+/**
+ * Queues a record from any task or interrupt. It is stamped and copied
+ * into a lock-free ring, never formatted or blocked on here. If the ring
+ * is full the record is dropped and counted.
+ */
+void logEvent(LogId id, uint8_t argCount, uint32_t a, uint32_t b, uint32_t c);
+
+inline void logEvent(LogId id) { logEvent(id, 0, 0, 0, 0); }
+inline void logEvent(LogId id, uint32_t a) { logEvent(id, 1, a, 0, 0); }
+inline void logEvent(LogId id, uint32_t a, uint32_t b) { logEvent(id, 2, a, b, 0); }
+inline void logEvent(LogId id, uint32_t a, uint32_t b, uint32_t c) { logEvent(id, 3, a, b, c); }
+
+// Records dropped because the ring was full
+uint32_t logDropped();
+
+// Low-priority task that writes queued records to serial as binary frames
+// for tools/logDecode.py, or as text when built with -D LOG_TEXT.
+void logDrainTask(void *pvParameters);
+
+#endif // EVENT_LOG_H
@@ -0,0 +1,67 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <atomic>
+#include <stdint.h>
+
+// Cutoff and resonance are set as positions 0..FILTER_STEPS - 1. Cutoff
+// positions are spaced exponentially over 6.75 octaves from 40 Hz to 4.3 kHz.
+constexpr uint8_t FILTER_STEPS = 128;
+
+// Coefficients are Q30
+constexpr uint8_t FILTER_COEF_BITS = 30;
+
+// Cutoff coefficient f = 2 sin(pi fc / fs) for each position, with a guard
+// entry so interpolation never reads past the end. Generated at compile time.
+struct FilterCutoffTable {
+  int32_t f[FILTER_STEPS + 1];
+};
+extern const FilterCutoffTable filterCutoffTable;
+
+enum class FilterMode : uint8_t {
+  Off,
+  LowPass,
+  HighPass,
+  BandPass
+};
+
+/**
+ * Fixed-point Chamberlin state-variable filter for the audio block path.
+ * - `setMode()`, `setCutoff()`, `setResonance()`: control inputs, safe to
+ *   call from any task
+ * - `process()`: filters a block in place (audio generator only)
+ *
+ * Coefficients are looked up once per block from the smoothed control
+ * positions and ramped linearly across the block, so knob steps don't zip.
+ */
+class Filter {
+public:
+  Filter();
+
+  void setMode(FilterMode mode) { mode_.store(mode, std::memory_order_relaxed); }
+  FilterMode getMode() const { return mode_.load(std::memory_order_relaxed); }
+
+  void setCutoff(uint8_t position);
+  uint8_t getCutoff() const { return cutoff_.load(std::memory_order_relaxed); }
+
+  // 0 is a flat, Q = 1 response, FILTER_STEPS - 1 is Q = 10
+  void setResonance(uint8_t position);
+  uint8_t getResonance() const { return resonance_.load(std::memory_order_relaxed); }
+
+  void process(int16_t* buf, uint32_t n);
+
+private:
+  std::atomic<FilterMode> mode_;
+  std::atomic<uint8_t> cutoff_;
+  std::atomic<uint8_t> resonance_;
+
+  // Owned by process()
+  FilterMode lastMode_;
+  uint32_t cutoffPos_;  // Smoothed cutoff position, Q8
+  int32_t f_;           // Coefficients reached at the end of the last block
+  int32_t q_;
+  int32_t low_;         // Integrator states, 8 bits above the sample scale
+  int32_t band_;
+};
+
+#endif // FILTER_H
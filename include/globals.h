@@ -6,6 +6,18 @@
 #include <STM32FreeRTOS.h>
 #include <queue.h>
 #include <semphr.h>
+#include "voices.h"
+#include "filter.h"
+#include "tuning.h"
+#include "keyScanner.h"
+#include "spscRing.h"
+#include "canProtocol.h"
+#include "knob.h"
+#include "joystick.h"
+#include "voiceAllocator.h"
+#include "clockSync.h"
+#include "stackEnum.h"
+#include "midi.h"
 
 // Our system state
 struct SystemState {
@@ -15,16 +27,50 @@ struct SystemState {
 
 // Global system state
 extern SystemState sysState;
-extern volatile uint32_t currentStepSize;
 
-// runtime config --
-extern bool isSender;         // true => sender, false => receiver
-extern uint8_t moduleOctave;  // e.g. 4, 5, etc.
+// Guards the I2C bus, shared by the display and the knob expander
+extern SemaphoreHandle_t i2cMutex;
 
-// Queues and semaphores
-extern QueueHandle_t msgInQ;
-extern QueueHandle_t msgOutQ;
-extern SemaphoreHandle_t CAN_TX_Semaphore;
+// Voice pool shared by the key scanner, the CAN decoder and the audio generator.
+// Note on/off calls are serialised with sysState.mutex.
+extern VoicePool voices;
+
+// Chooses the module that plays each press, from the capacity adverts.
+// Calls are serialised with sysState.mutex, like note on/off.
+extern VoiceAllocator voiceAlloc;
+
+// Stack sample clock estimate, from the clock sync frames. Calls are
+// serialised with sysState.mutex, like note on/off.
+extern ClockSync clockSync;
+
+// Position of this module in the stack, from the handshake lines. Calls
+// are serialised with sysState.mutex, like note on/off.
+extern StackEnumerator stackEnum;
+
+// Filter stage after the voice mix, set from the knobs
+extern Filter filter;
+
+// The four knobs, decoded by knobInputTask or scanKeysTask and read by anyone
+extern KnobBank knobs;
+
+// Conditioned joystick axes, updated by joystickTask
+extern Joystick joystick;
+
+// runtime config, set by stackEnumTask from the module's place in the stack
+extern uint8_t moduleOctave;  // Also the module's node ID on the bus
+extern Temperament temperament;
+
+typedef SpscRing<CanMessage, 32> CanRing;
+
+// Event rings, each with a single producer and consumer
+extern KeyEventRing keyEventQ;  // Key scanner interrupt -> scanKeysTask
+extern CanRing msgInQ;          // CAN_RX_ISR (FIFO 0, notes) -> decodeTask
+extern CanRing bulkInQ;         // CAN_RX1_ISR (FIFO 1, control and telemetry) -> decodeTask
+#ifdef MIDI_SERIAL
+extern MidiRing midiOutQ;       // scanKeysTask -> midiTask
+#endif
+
+// Last received note change, for the display
 extern uint8_t RX_Message_Global[8];
 
 #endif // GLOBALS_H
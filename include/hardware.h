@@ -4,6 +4,7 @@
 #include <Arduino.h>
 #include <U8g2lib.h>
 #include <STM32FreeRTOS.h>
+#include <semphr.h>
 #include <bitset>
 
 // ---------------------------------------------------------------------
@@ -31,7 +32,11 @@ extern const int OUTR_PIN;
 extern const int JOYY_PIN;
 extern const int JOYX_PIN;
 
+// Knob expander interrupt pin (V2 modules).
+extern const int KNOB_INT_PIN;
+
 // Output multiplexer bits.
+extern const int KNOB_MODE_BIT;
 extern const int DEN_BIT;
 extern const int DRST_BIT;
 extern const int HKOW_BIT;
@@ -44,9 +49,6 @@ extern const int HKOE_BIT;
 // Display object (using hardware I2C).
 extern U8G2_SSD1305_128X32_ADAFRUIT_F_HW_I2C u8g2;
 
-// Hardware timer for audio sampling.
-extern HardwareTimer sampleTimer;
-
 // ---------------------------------------------------------------------
 //                 INITIALIZATION FUNCTIONS
 // ---------------------------------------------------------------------
@@ -57,21 +59,91 @@ void initHardware();
 // Initialize the display (reset and enable).
 void initDisplay();
 
-// Initialize the audio timer.
-void initAudio();
+// 32-bit hash of the microcontroller's 96-bit unique ID, the same on every
+// boot and, in practice, different on every module.
+uint32_t moduleUid();
 
-// Set an output multiplexer bit (used by the display driver).
+// Set an output multiplexer bit (used by the display driver). Only for use
+// before the key scanner starts, after that use keyScanner.setOutBit().
 void setOutMuxBit(const uint8_t bitIdx, const bool value);
 
+// From here on every display I2C transaction holds `mutex`. u8g2 sends a
+// frame as many short transactions, so another user of the bus waits for
+// the one in progress rather than the whole frame.
+void shareDisplayBus(SemaphoreHandle_t mutex);
+
+// ---------------------------------------------------------------------
+//                     KNOB EXPANDER (V2 MODULES)
+// ---------------------------------------------------------------------
+
+// The PCAL6408A reads the A/B pins of all four knobs: knob 3's A in bit 0
+// and B in bit 1, up to knob 0's B in bit 7, the same order as the knob
+// rows of the key matrix. The knobs only reach it with KNOB_MODE_BIT low.
+
+// Configures all pins as pulled-up inputs with the input latch and the
+// change interrupt enabled. Returns false if nothing answers (V1 module).
+bool initKnobExpander();
+
+// Reads the input register, which clears the latch and the interrupt. Hold
+// the I2C mutex once the scheduler is running.
+bool readKnobExpander(uint8_t& pins);
+
+// Calls `isr` when the expander's interrupt line falls.
+void attachKnobInterrupt(void (*isr)());
+
+// True while the interrupt line is held low by an unread change.
+bool knobInterruptPending();
+
 // ---------------------------------------------------------------------
 //            HELPER FUNCTIONS FOR KEY SCANNING
 // ---------------------------------------------------------------------
 
-// Sets the key matrix row.
-void setRow(uint8_t rowIdx);
+// These use the GPIO registers directly, so they are cheap enough for an
+// interrupt. The row needs a few microseconds to settle before reading.
+
+// Sets the key matrix row, latching outBit into that row's output flip-flop.
+void setRow(uint8_t rowIdx, bool outBit = HIGH);
 
 // Reads the state of the key matrix columns.
 std::bitset<4> readCols();
 
+// Same as readCols(), as bits 0..3 of a byte.
+uint8_t readColBits();
+
+// ---------------------------------------------------------------------
+//                      AUDIO SAMPLE STREAM
+// ---------------------------------------------------------------------
+
+// Called from the stream interrupt once `half` (0 or 1) has been played.
+typedef void (*SampleHalfCallback)(uint8_t half);
+
+// Plays `buffer`, two halves of `halfSize` samples, to the DAC on OUTR_PIN
+// in a loop at `sampleRate`, starting with half 0.
+bool startSampleStream(const uint16_t* buffer, uint32_t halfSize, uint32_t sampleRate,
+                       SampleHalfCallback onHalfSent);
+
+void stopSampleStream();
+
+// Samples played since startSampleStream(), wrapping at 2^32. Read from the
+// DMA position, so it is exact to the sample. Safe from any task or
+// interrupt.
+uint32_t sampleClock();
+
+// ---------------------------------------------------------------------
+//                           JOYSTICK ADC
+// ---------------------------------------------------------------------
+
+// Conversions of each axis kept by the DMA, averaged by readJoystick()
+constexpr uint8_t JOYSTICK_DMA_PAIRS = 8;
+
+// ADC1 converts both axes continuously with 16x hardware oversampling, and
+// DMA writes them round a circular buffer, so sampling takes no CPU time.
+bool startJoystickSampling();
+
+// Latest 12-bit position of each axis, averaged over the buffer. False until
+// the DMA has been round the buffer once, as it may still hold placeholders.
+// Safe from any task.
+bool readJoystick(uint16_t& x, uint16_t& y);
+
 #endif // HARDWARE_H
 
@@ -0,0 +1,65 @@
+#ifndef JOYSTICK_H
+#define JOYSTICK_H
+
+#include <atomic>
+#include <stdint.h>
+
+// Axis values run from -JOYSTICK_FULL_SCALE to JOYSTICK_FULL_SCALE
+constexpr int16_t JOYSTICK_FULL_SCALE = 1024;
+
+// In 12-bit ADC counts from the centre: readings inside the dead zone are
+// zero, and full scale is reached this far out
+constexpr int16_t JOYSTICK_DEAD_ZONE = 80;
+constexpr int16_t JOYSTICK_SPAN = 1800;
+
+// Readings averaged for the centre, at the control rate
+constexpr uint8_t JOYSTICK_CENTRE_READINGS = 8;
+
+// One-pole smoothing, each update moves 1/2^n of the way to the new reading
+constexpr uint8_t JOYSTICK_SMOOTHING_SHIFT = 2;
+
+// Control rate of joystickTask
+constexpr uint32_t JOYSTICK_PERIOD_MS = 5;
+
+// What the axes do to every voice
+constexpr int32_t PITCH_BEND_RANGE_CENTS = 200;   // X at full scale
+constexpr int32_t VIBRATO_DEPTH_CENTS = 50;       // Y at full scale, either way
+constexpr uint32_t VIBRATO_RATE_MHZ = 5500;
+
+/**
+ * Joystick conditioning.
+ * - `update()`: takes raw 12-bit readings at the control rate (one task only)
+ * - `x()`, `y()`: the conditioned axes, lock-free from any task
+ *
+ * The centre is the mean of the first JOYSTICK_CENTRE_READINGS readings, and
+ * both axes read zero until it is known. Each axis then goes through the
+ * dead zone, is scaled so full scale starts at JOYSTICK_SPAN, and smoothed.
+ */
+class Joystick {
+public:
+  Joystick();
+
+  void update(uint16_t rawX, uint16_t rawY);
+
+  int16_t x() const { return x_.load(std::memory_order_relaxed); }
+  int16_t y() const { return y_.load(std::memory_order_relaxed); }
+
+private:
+  static int32_t shape(int32_t offset);
+  static int16_t rounded(int32_t q8);
+
+  uint8_t centreReadings_;
+  uint32_t centreSumX_;
+  uint32_t centreSumY_;
+  uint16_t centreX_;
+  uint16_t centreY_;
+  int32_t smoothX_;  // Q8
+  int32_t smoothY_;
+  std::atomic<int16_t> x_;
+  std::atomic<int16_t> y_;
+};
+
+// Task function for applying the joystick to the voices.
+void joystickTask(void *pvParameters);
+
+#endif // JOYSTICK_H
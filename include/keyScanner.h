@@ -0,0 +1,78 @@
+#ifndef KEY_SCANNER_H
+#define KEY_SCANNER_H
+
+#include <atomic>
+#include <bitset>
+#include <stdint.h>
+#include "spscRing.h"
+
+// Timer interrupt rate. One matrix row is read per interrupt.
+constexpr uint32_t KEY_SCAN_RATE = 8000;
+
+constexpr uint8_t NUM_KEYS = 12;
+constexpr uint8_t KEY_ROWS = 3;   // Rows 0..2 hold the keys
+constexpr uint8_t SCAN_ROWS = 7;  // Rows 3..6 hold the knobs and handshake inputs
+
+// A settled key is pressed on the first scan that reads it down, so a press
+// waits for nothing but the scan. A release needs the key to read up this
+// many more times than down, and a key only counts as settled again, ready
+// for the next one-scan press, after this many scans in a row reading up.
+// Key rows are scanned at KEY_SCAN_RATE / 4, so this is 1.5 ms. Chatter
+// inside that lockout goes through the integrator as before.
+constexpr uint8_t KEY_DEBOUNCE_COUNT = 3;
+
+// Debounced key change, timestamped in micros() when it was accepted.
+struct KeyEvent {
+  uint32_t time;
+  uint8_t key;
+  bool pressed;
+};
+
+// Interrupt to scanKeysTask
+typedef SpscRing<KeyEvent, 16> KeyEventRing;
+
+/**
+ * Timer-driven key matrix scanner.
+ * - `begin()`: starts TIM7, key events are pushed to the given ring
+ * - `rowBits()`: latest raw column bits of any row (active low)
+ * - `keys()`: debounced key state, bit set = pressed
+ * - `setOutBit()`: output flip-flop value latched whenever a row is selected
+ *
+ * Each interrupt reads the row selected by the previous one and then selects
+ * the next, so rows get a whole scan period to settle with no busy wait.
+ * The key rows are interleaved with the others so they are read four times
+ * as often. The consumer is woken once per pass over the key rows.
+ */
+class KeyScanner {
+public:
+  KeyScanner();
+
+  bool begin(KeyEventRing& events);
+  void end();
+
+  // Called from the timer interrupt
+  void onTick();
+
+  uint8_t rowBits(uint8_t row) const { return rows_[row].load(std::memory_order_relaxed); }
+  std::bitset<4> readRow(uint8_t row) const { return std::bitset<4>(rowBits(row)); }
+
+  uint32_t keys() const { return keys_.load(std::memory_order_relaxed); }
+
+  void setOutBit(uint8_t bit, bool value);
+
+private:
+  void debounceRow(uint8_t row, uint8_t cols);
+
+  KeyEventRing* events_;
+  std::atomic<uint8_t> rows_[SCAN_ROWS];
+  std::atomic<uint32_t> keys_;
+  std::atomic<uint8_t> outBits_;
+  uint8_t integrator_[NUM_KEYS];
+  uint8_t settled_[NUM_KEYS];  // Scans in a row reading up, up to KEY_DEBOUNCE_COUNT
+  uint8_t slot_;
+  bool pendingEvents_;  // Pushed this pass but not yet notified
+};
+
+extern KeyScanner keyScanner;
+
+#endif // KEY_SCANNER_H
@@ -4,61 +4,66 @@
 #include <atomic>
 #include <stdint.h>
 
+constexpr uint8_t NUM_KNOBS = 4;
+
+// What each knob sets
+constexpr uint8_t KNOB_RESONANCE = 0;
+constexpr uint8_t KNOB_CUTOFF = 1;
+constexpr uint8_t KNOB_RELEASE = 2;
+constexpr uint8_t KNOB_VOLUME = 3;
+
+// Steps this far apart or closer are multiplied, by up to the knob's
+// maxAccel: at 4 ms a step they count 4 times
+constexpr uint32_t KNOB_ACCEL_REFERENCE_US = 16000;
+
+struct KnobConfig {
+  int16_t min;
+  int16_t max;
+  int16_t initial;
+  uint8_t maxAccel;  // 1 turns acceleration off
+};
+
 /**
- * Knob class that manages quadrature encoder state and rotation.
- * Provides:
- * - `updateState()`: Reads A & B inputs, detects rotation
- * - `constrainRotation()`: Clamps the value to 0..8
- * - `getRotation()`: Safely reads the rotation value (thread-safe)
+ * Quadrature decoder for all four knobs.
+ * - `update()`: decodes one reading of the A/B pins (one writer task only)
+ * - `get()`: the latest value of a knob, lock-free from any task or interrupt
+ * - `set()`: moves a knob's value, from the writer task or before it starts
+ *
+ * Each knob's previous and current A/B levels index a 16-entry transition
+ * table. A reading where both pins changed skipped a state; it is counted
+ * as two steps in the knob's last direction and as missed.
  */
-class Knob {
+class KnobBank {
 public:
-    // Constructor, takes a reference to the global rotation variable
-    Knob(std::atomic<int8_t>& knobRotationRef)
-        : knob3Rotation(knobRotationRef), prevKnobState(0b00), lastValidRotation(0) {}
+  explicit KnobBank(const KnobConfig (&configs)[NUM_KNOBS]);
 
-    /**
-     * Reads A & B inputs and updates rotation direction.
-     */
-    void updateState(uint8_t knobA, uint8_t knobB) {
-        uint8_t currentKnobState = (knobB << 1) | knobA;
+  // `pins` holds knob 3's A in bit 0 and B in bit 1, up to knob 0's B in
+  // bit 7. The first reading only sets where each knob starts.
+  void update(uint8_t pins, uint32_t nowUs);
 
-        if (prevKnobState == 0b00 && currentKnobState == 0b01) lastValidRotation = +1;
-        else if (prevKnobState == 0b00 && currentKnobState == 0b10) lastValidRotation = -1;
-        else if (prevKnobState == 0b01 && currentKnobState == 0b11) lastValidRotation = +1;
-        else if (prevKnobState == 0b10 && currentKnobState == 0b11) lastValidRotation = -1;
-        else if (prevKnobState == 0b11 && currentKnobState == 0b10) lastValidRotation = +1;
-        else if (prevKnobState == 0b11 && currentKnobState == 0b01) lastValidRotation = -1;
-        else if ((prevKnobState == 0b11 && currentKnobState == 0b00) ||
-                 (prevKnobState == 0b00 && currentKnobState == 0b11)) {
-            // Impossible state transition, assume last valid direction
-            knob3Rotation.fetch_add(lastValidRotation);
-        }
+  int16_t get(uint8_t knob) const { return values_[knob].load(std::memory_order_relaxed); }
+  void set(uint8_t knob, int16_t value);
 
-        prevKnobState = currentKnobState;
-    }
+  // Counts since start-up
+  uint32_t steps() const { return steps_.load(std::memory_order_relaxed); }
+  uint32_t missed() const { return missed_.load(std::memory_order_relaxed); }
 
-    /**
-     * Ensures rotation value stays within 0..8 range.
-     */
-    void constrainRotation() {
-        int8_t newRotation = knob3Rotation.load() + lastValidRotation;
-        if (newRotation > 8) newRotation = 8;
-        if (newRotation < 0) newRotation = 0;
-        knob3Rotation.store(newRotation);
-    }
+private:
+  struct Decoder {
+    KnobConfig config;
+    int32_t value;       // Owned by update(), published to values_
+    int8_t direction;    // Of the last step, for skipped states
+    uint32_t lastStep;   // micros() of the last step
+  };
 
-    /**
-     * Returns the current rotation value (thread-safe).
-     */
-    int8_t getRotation() {
-        return knob3Rotation.load();
-    }
+  int16_t clamp(const KnobConfig& config, int32_t value) const;
 
-private:
-    std::atomic<int8_t>& knob3Rotation;
-    uint8_t prevKnobState;
-    int8_t lastValidRotation;
+  Decoder decoders_[NUM_KNOBS];
+  std::atomic<int16_t> values_[NUM_KNOBS];
+  std::atomic<uint32_t> steps_;
+  std::atomic<uint32_t> missed_;
+  uint8_t lastPins_;
+  bool primed_;
 };
 
 #endif // KNOB_H
@@ -0,0 +1,35 @@
+#ifndef KNOB_INPUT_H
+#define KNOB_INPUT_H
+
+#include <STM32FreeRTOS.h>
+
+// Knob decoding counters since start-up
+struct KnobStats {
+  uint32_t readings;      // Readings with a change on any knob pin
+  uint32_t transitions;   // KnobBank::steps()
+  uint32_t missed;        // KnobBank::missed()
+  uint32_t interrupts;    // Expander interrupts
+  uint32_t latencyCount;  // Interrupts served by a read
+  uint32_t totalLatency;  // Interrupt to updated knob values, in us
+  uint32_t maxLatency;
+  uint32_t readFailures;  // Expander reads that failed on I2C
+};
+
+// Decodes a reading of the four knobs' A/B pins, in the order given in
+// hardware.h, and applies the settings. Only call from one task.
+void updateKnobs(uint8_t pins);
+
+// Moves the knobs over to the V2 expander, which then wakes `task` (running
+// knobInputTask) on every change. Call once initKnobExpander() succeeded.
+void knobInputBegin(TaskHandle_t task);
+
+// True once the knobs are read through the expander rather than the matrix
+bool knobsOnExpander();
+
+// Task function for reading the knob expander.
+void knobInputTask(void *pvParameters);
+
+// Snapshot of the counters, safe to call from any task
+KnobStats knobStats();
+
+#endif // KNOB_INPUT_H
@@ -0,0 +1,135 @@
+#ifndef MIDI_H
+#define MIDI_H
+
+#include <stdint.h>
+#include <STM32FreeRTOS.h>
+#include "spscRing.h"
+
+// Build with -D MIDI_SERIAL to carry MIDI on the serial port, in and out,
+// instead of the event log and profiler commands. The port runs at
+// MIDI_SERIAL_BAUD (override with -D MIDI_SERIAL_BAUD=n).
+#ifndef MIDI_SERIAL_BAUD
+#define MIDI_SERIAL_BAUD 115200
+#endif
+
+// Serial input is read this often, as many bytes as have arrived, up to
+// MIDI_BATCH_BYTES at a time
+constexpr uint32_t MIDI_POLL_MS = 1;
+constexpr uint32_t MIDI_BATCH_BYTES = 64;
+
+// Local key events go out on this channel (0 is MIDI channel 1), at the
+// velocity MIDI uses for keys that don't sense it. Input is on every channel.
+constexpr uint8_t MIDI_OUT_CHANNEL = 0;
+constexpr uint8_t MIDI_DEFAULT_VELOCITY = 64;
+
+// Status bytes, channel messages with the channel in the low nibble
+constexpr uint8_t MIDI_NOTE_OFF = 0x80;
+constexpr uint8_t MIDI_NOTE_ON = 0x90;
+constexpr uint8_t MIDI_CONTROL_CHANGE = 0xb0;
+constexpr uint8_t MIDI_PROGRAM_CHANGE = 0xc0;
+constexpr uint8_t MIDI_CHANNEL_PRESSURE = 0xd0;
+constexpr uint8_t MIDI_PITCH_BEND = 0xe0;
+constexpr uint8_t MIDI_SYSEX = 0xf0;
+constexpr uint8_t MIDI_SYSEX_END = 0xf7;
+constexpr uint8_t MIDI_REALTIME = 0xf8;
+
+// Controllers that stop every note
+constexpr uint8_t MIDI_CC_ALL_SOUND_OFF = 120;
+constexpr uint8_t MIDI_CC_ALL_NOTES_OFF = 123;
+
+// A channel message. Messages with one data byte leave data2 at 0.
+struct MidiMessage {
+  uint8_t status;
+  uint8_t data1;
+  uint8_t data2;
+
+  uint8_t type() const { return status & 0xf0; }
+  uint8_t channel() const { return status & 0x0f; }
+};
+
+// Data bytes that follow `status`, for channel and system common messages
+constexpr uint8_t midiDataLength(uint8_t status) {
+  return status < MIDI_SYSEX ? ((status & 0xe0) == 0xc0 ? 1 : 2)
+       : status == 0xf2 ? 2
+       : status == 0xf1 || status == 0xf3 ? 1 : 0;
+}
+
+struct MidiParserStats {
+  uint32_t bytes;     // Every byte fed in
+  uint32_t messages;  // Channel messages completed
+  uint32_t stray;     // Data bytes with no status to belong to
+  uint32_t sysex;     // Bytes inside system exclusive messages, skipped
+  uint32_t realtime;  // Clock and transport bytes, skipped
+};
+
+/**
+ * Streaming MIDI byte parser for channel messages.
+ * - `parse()`: a batch of bytes in, the channel messages they complete out
+ *
+ * Running status is kept, so data bytes after a complete message start
+ * another of the same status. System exclusive and system common messages
+ * cancel it and are skipped, as are real-time bytes, which may turn up in
+ * the middle of another message without disturbing it. A message split over
+ * two batches completes in the second.
+ */
+class MidiParser {
+public:
+  MidiParser();
+
+  // Parses `n` bytes into `out`, which has room for `n` messages. Returns
+  // the number of messages.
+  uint32_t parse(const uint8_t* bytes, uint32_t n, MidiMessage* out);
+
+  const MidiParserStats& stats() const { return stats_; }
+
+private:
+  uint8_t status_;  // Running status, or a system common message, 0 for none
+  uint8_t needed_;  // Data bytes the status takes
+  uint8_t count_;   // Data bytes seen of the current message
+  uint8_t data1_;
+  bool sysex_;
+  MidiParserStats stats_;
+};
+
+// Encodes `msg` into `out`, leaving out the status byte if it matches
+// `running`, which is updated. Returns the length, up to 3.
+uint8_t encodeMidi(const MidiMessage& msg, uint8_t& running, uint8_t* out);
+
+// Note events from the local keys. A release goes as a note on with no
+// velocity, so a run of key events shares one running status.
+inline MidiMessage midiKeyMessage(uint8_t note, bool pressed) {
+  return MidiMessage{(uint8_t) (MIDI_NOTE_ON | MIDI_OUT_CHANNEL), note,
+                     pressed ? MIDI_DEFAULT_VELOCITY : (uint8_t) 0};
+}
+
+typedef SpscRing<MidiMessage, 32> MidiRing;
+
+struct MidiStats {
+  MidiParserStats in;
+  uint32_t batches;      // Reads that returned bytes
+  uint32_t maxBatch;     // Most bytes in one read
+  uint32_t outMessages;  // Key events written
+  uint32_t outBytes;
+  uint32_t outDropped;   // Key events lost to a full queue
+};
+
+// Queues a local key event for midiTask. The scan task calls midiFlush()
+// once a pass has been queued, so a chord costs one wake-up and one write.
+// Both do nothing unless built with MIDI_SERIAL, and the task below only
+// exists with it.
+#ifdef MIDI_SERIAL
+void midiSendKey(uint8_t note, bool pressed);
+void midiFlush();
+
+// Task function for the MIDI bridge: writes queued key events and plays
+// the notes that arrive, polling the input every MIDI_POLL_MS.
+void midiTask(void *pvParameters);
+
+// Snapshot of the counters, safe to call from any task
+MidiStats midiStats();
+#else
+inline void midiSendKey(uint8_t note, bool pressed) { (void) note; (void) pressed; }
+inline void midiFlush() {}
+#endif
+
+#endif // MIDI_H
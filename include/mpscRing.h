@@ -0,0 +1,85 @@
+#ifndef MPSC_RING_H
+#define MPSC_RING_H
+
+#include <atomic>
+#include <stdint.h>
+
+/**
+ * Fixed-capacity lock-free ring for any number of producers, tasks or
+ * interrupts, and one consumer.
+ * - `push()`: claims a slot and copies an item in, or counts an overflow
+ *   and returns false
+ * - `pop()`: copies the oldest finished item out, returns false when empty
+ *
+ * Each slot carries a sequence number, so a producer that is interrupted
+ * between claiming its slot and filling it only holds back the consumer,
+ * never another producer. No kernel calls are made.
+ */
+template <typename T, uint32_t Capacity>
+class MpscRing {
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                "MpscRing capacity must be a power of two");
+
+public:
+  MpscRing() : head_(0), tail_(0), overflows_(0) {
+    for (uint32_t i = 0; i < Capacity; i++) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Any producer
+  bool push(const T& item) {
+    uint32_t head = head_.load(std::memory_order_relaxed);
+    Slot* slot;
+
+    while (1) {
+      slot = &slots_[head & (Capacity - 1)];
+      const int32_t lag = (int32_t) (slot->sequence.load(std::memory_order_acquire) - head);
+      if (lag == 0) {
+        // The slot is free for this lap, claim it
+        if (head_.compare_exchange_weak(head, head + 1, std::memory_order_relaxed)) break;
+      } else if (lag < 0) {
+        // The consumer hasn't freed it yet, the ring is full
+        overflows_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      } else {
+        // Another producer claimed it first
+        head = head_.load(std::memory_order_relaxed);
+      }
+    }
+
+    slot->item = item;
+    slot->sequence.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only
+  bool pop(T& item) {
+    const uint32_t tail = tail_.load(std::memory_order_relaxed);
+    Slot& slot = slots_[tail & (Capacity - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != tail + 1) return false;
+
+    item = slot.item;
+    slot.sequence.store(tail + Capacity, std::memory_order_release);
+    tail_.store(tail + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  static constexpr uint32_t capacity() { return Capacity; }
+
+  // Items dropped because the ring was full
+  uint32_t overflows() const { return overflows_.load(std::memory_order_relaxed); }
+
+private:
+  struct Slot {
+    std::atomic<uint32_t> sequence;  // Slot index + laps * Capacity, +1 once filled
+    T item;
+  };
+
+  Slot slots_[Capacity];
+  std::atomic<uint32_t> head_;       // Next slot to claim, shared by producers
+  std::atomic<uint32_t> tail_;       // Written by the consumer
+  std::atomic<uint32_t> overflows_;
+};
+
+#endif // MPSC_RING_H
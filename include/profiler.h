@@ -0,0 +1,95 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <stdint.h>
+
+// Code sections that keep their own execution time statistics
+enum class ProfileSite : uint8_t {
+  ScanKeys,    // scanKeysTask, one wake-up
+  Display,     // displayUpdateTask, one frame
+  Decode,      // decodeTask, one frame
+  CanTx,       // CAN_TX_Task, one mailbox refill
+  AudioGen,    // audioGenTask, one block
+  Knobs,       // knobInputTask, one expander read
+  KeyScanISR,  // Key scanner timer tick
+  DacISR,      // Sample stream half-buffer interrupt
+  CanRxISR,    // CAN FIFO 0
+  CanRx1ISR,   // CAN FIFO 1
+  CanTxISR,    // CAN mailbox free
+  KnobISR,     // Knob expander interrupt
+  Midi,        // midiTask, one wake-up
+  Count
+};
+
+// Build with -D PROFILE_ENABLED to time the sections. Otherwise
+// PROFILE_SCOPE() expands to nothing and none of this is compiled.
+#ifdef PROFILE_ENABLED
+
+#include <Arduino.h>
+#ifndef ARDUINO
+#include <chrono>
+#endif
+
+// Durations are histogrammed by their top set bit, bucket b holds [2^b, 2^(b+1)) ticks
+constexpr uint8_t PROFILE_BUCKETS = 32;
+
+struct ProfileStats {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t total;
+  uint32_t histogram[PROFILE_BUCKETS];
+};
+
+// Time source: the DWT cycle counter on the board, nanoseconds on the host
+inline uint32_t profileNow() {
+#ifdef ARDUINO
+  return DWT->CYCCNT;
+#else
+  return (uint32_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+uint32_t profileTicksPerUs();
+
+// Starts the cycle counter, call once before any section runs
+void profilerBegin();
+
+// Adds one duration to a site, safe from tasks and interrupts
+void profileRecord(ProfileSite site, uint32_t ticks);
+
+ProfileStats profileStats(ProfileSite site);
+void profilerReset();
+
+// Writes a table of every site that has run, with its histogram
+void profilerDump(Print& out);
+
+// Reads serial commands: 'p' dumps the statistics, 'r' resets them, 'k'
+// times the DSP kernels
+void profilerTask(void *pvParameters);
+
+/**
+ * Times the rest of the enclosing block and records it against `site`.
+ */
+class ProfileScope {
+public:
+  explicit ProfileScope(ProfileSite site) : site_(site), start_(profileNow()) {}
+  ~ProfileScope() { profileRecord(site_, profileNow() - start_); }
+
+private:
+  ProfileSite site_;
+  uint32_t start_;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(site) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(site)
+
+#else
+
+#define PROFILE_SCOPE(site) do {} while (0)
+
+#endif // PROFILE_ENABLED
+
+#endif // PROFILER_H
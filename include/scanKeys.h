@@ -3,8 +3,6 @@
 
 #include <STM32FreeRTOS.h>
 
-extern const uint32_t stepSizes[12];
-
 // Task function for scanning keys.
 void scanKeysTask(void *pvParameters);
 
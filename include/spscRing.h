@@ -0,0 +1,83 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <stdint.h>
+
+/**
+ * Fixed-capacity lock-free ring for one producer and one consumer, either
+ * of which may be an interrupt.
+ * - `push()`: copies an item in, or counts an overflow and returns false
+ * - `pop()`: copies the oldest item out, returns false when empty
+ * - `setNotify()`: hook called by the producer after every push, e.g. to
+ *   wake the consumer task. A producer that batches can push without
+ *   notifying and call `notify()` once at the end.
+ *
+ * The head and tail are free-running counters, so all `Capacity` slots are
+ * usable and full/empty need no extra flag. No kernel calls are made.
+ */
+template <typename T, uint32_t Capacity>
+class SpscRing {
+  static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                "SpscRing capacity must be a power of two");
+
+public:
+  typedef void (*NotifyFn)(void* context);
+
+  // The counters start at `start`, which only tests need, to run them
+  // across the wrap
+  explicit SpscRing(uint32_t start = 0)
+      : head_(start), tail_(start), overflows_(0), notify_(nullptr), context_(nullptr) {}
+
+  // Set before the producer starts
+  void setNotify(NotifyFn notify, void* context) {
+    notify_ = notify;
+    context_ = context;
+  }
+
+  // Producer only
+  bool push(const T& item, bool wake = true) {
+    const uint32_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == Capacity) {
+      overflows_.store(overflows_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return false;
+    }
+    buffer_[head & (Capacity - 1)] = item;
+    head_.store(head + 1, std::memory_order_release);
+    if (wake) notify();
+    return true;
+  }
+
+  // Producer only
+  void notify() {
+    if (notify_) notify_(context_);
+  }
+
+  // Consumer only
+  bool pop(T& item) {
+    const uint32_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return false;
+    item = buffer_[tail & (Capacity - 1)];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  uint32_t size() const {
+    return head_.load(std::memory_order_acquire) - tail_.load(std::memory_order_acquire);
+  }
+  bool empty() const { return size() == 0; }
+  static constexpr uint32_t capacity() { return Capacity; }
+
+  // Items dropped because the ring was full
+  uint32_t overflows() const { return overflows_.load(std::memory_order_relaxed); }
+
+private:
+  T buffer_[Capacity];
+  std::atomic<uint32_t> head_;       // Written by the producer
+  std::atomic<uint32_t> tail_;       // Written by the consumer
+  std::atomic<uint32_t> overflows_;  // Written by the producer
+  NotifyFn notify_;
+  void* context_;
+};
+
+#endif // SPSC_RING_H
@@ -0,0 +1,161 @@
+#ifndef STACK_ENUM_H
+#define STACK_ENUM_H
+
+#include <stdint.h>
+#include <STM32FreeRTOS.h>
+#include "canProtocol.h"
+
+// Modules a stack can number. The voice allocator tracks as many.
+constexpr uint8_t STACK_MAX_MODULES = 8;
+
+// The west end of a stack of up to five plays octave 4 and each module
+// east of it the next one up. Bigger stacks start lower, so the east end
+// stays within MIDI notes.
+constexpr uint8_t STACK_BASE_OCTAVE = 4;
+constexpr uint8_t STACK_TOP_OCTAVE = 8;
+
+// The handshake inputs are polled this often, and must read the same on
+// ENUM_DEBOUNCE_POLLS polls in a row to count
+constexpr uint32_t ENUM_POLL_MS = 2;
+constexpr uint8_t ENUM_DEBOUNCE_POLLS = 3;
+
+// Time for the modules of a stack to power up and turn their handshake
+// outputs on, at boot or after a module is plugged in
+constexpr uint32_t ENUM_BOOT_MS = 100;
+
+// After a Start, every module waits this long with both outputs on before
+// the west end claims. Neighbours are compared this long after a round.
+constexpr uint32_t ENUM_SETTLE_MS = 20;
+
+// A round that hasn't finished in this time is started again
+constexpr uint32_t ENUM_ROUND_TIMEOUT_MS = 300;
+
+// Octave of the module at `position` in a stack of `count`
+constexpr uint8_t stackOctave(uint8_t position, uint8_t count) {
+  uint8_t base = count > STACK_TOP_OCTAVE + 1 ? 0 : STACK_TOP_OCTAVE + 1 - count;
+  if (base > STACK_BASE_OCTAVE) base = STACK_BASE_OCTAVE;
+  const uint8_t octave = base + position;
+  return octave > STACK_TOP_OCTAVE ? STACK_TOP_OCTAVE : octave;
+}
+
+enum class EnumState : uint8_t {
+  Booting,   // Waiting for the stack to power up
+  Settling,  // Round started, every output on
+  Waiting,   // For the west neighbour to pass the turn on
+  Claiming,  // Claim queued
+  Passed,    // Claim sent and the east output off, waiting for the east end
+  Done
+};
+
+// What poll() wants sent
+enum class EnumSend : uint8_t {
+  None,
+  Start,
+  Claim
+};
+
+struct EnumStats {
+  uint32_t rounds;    // Rounds taken part in
+  uint32_t starts;    // Starts sent
+  uint32_t claims;    // Claims sent
+  uint32_t timeouts;  // Rounds that never finished
+  uint32_t doneAt;    // ms, when the last round finished
+};
+
+/**
+ * Numbers the modules of a stack from west to east with the handshake lines.
+ * - `poll()`: every ENUM_POLL_MS with the handshake inputs, may ask for a
+ *   frame to be sent
+ * - `onStart()` / `onClaim()`: enumeration frames from the other modules
+ * - `onClaimSent()`: this module's Claim has left the bus
+ * - `eastOutput()`: level for the east handshake output. The west one is
+ *   always on.
+ *
+ * A round begins with a Start from any module, after which every module
+ * holds both outputs on. The module with no west neighbour claims position
+ * 0 and, once the Claim has left the bus, turns its east output off. Its
+ * east neighbour sees its west input go and claims the next position, and
+ * so on. The Claim from the module with no east neighbour ends the round,
+ * so a stack of n modules is numbered with one or two Starts and n Claims.
+ *
+ * The west end sends the Start at boot. Later, a module that sees a
+ * neighbour come or go starts a round, giving a new one time to boot. A
+ * lone module numbers itself without sending anything.
+ *
+ * Calls must be serialised by the caller, like VoicePool note on/off.
+ */
+class StackEnumerator {
+public:
+  StackEnumerator();
+
+  void begin(uint32_t uid, uint32_t nowMs);
+
+  // `west` and `east` are true while that neighbour's output is on
+  EnumSend poll(bool west, bool east, uint32_t nowMs, EnumFrame& frame);
+
+  void onStart(const EnumFrame& frame, uint32_t nowMs);
+  void onClaim(const EnumFrame& frame, uint32_t nowMs);
+  void onClaimSent(uint32_t nowMs);
+
+  bool eastOutput() const { return eastOn_; }
+
+  // A neighbour is there to acknowledge CAN frames. In a round the west
+  // input going off is the turn passing, not the neighbour leaving.
+  bool online() const {
+    return west_ || east_ || (state_ != EnumState::Booting && state_ != EnumState::Done);
+  }
+
+  EnumState state() const { return state_; }
+
+  // Result of the last round that finished. The generation counts them.
+  uint16_t generation() const { return generation_; }
+  uint8_t position() const { return position_; }
+  uint8_t count() const { return count_; }
+  uint8_t octave() const { return stackOctave(position_, count_); }
+  uint32_t uidAt(uint8_t position) const { return position < STACK_MAX_MODULES ? uids_[position] : 0; }
+
+  const EnumStats& stats() const { return stats_; }
+
+private:
+  void debounce(bool west, bool east);
+  void enterRound(uint8_t round, uint32_t nowMs);
+  EnumSend start(uint32_t nowMs, EnumFrame& frame);
+  EnumSend claim(uint8_t position, EnumFrame& frame);
+  void finish(uint8_t count, uint32_t nowMs);
+  EnumSend alone(uint32_t nowMs);
+
+  uint32_t uid_;
+  EnumState state_;
+  uint8_t round_;
+  uint32_t roundStart_;  // ms, or boot
+  uint32_t deadline_;    // ms, end of the settle or quiet time
+  bool restart_;         // Start a new round at the next poll
+  bool joinPending_;     // A neighbour appeared, Start once it has booted
+  uint32_t joinAt_;
+
+  // Debounced handshake inputs, and what they read as the round began
+  bool west_, east_;
+  uint8_t westCount_, eastCount_;
+  bool roundWest_, roundEast_;
+
+  bool eastOn_;
+  int16_t highest_;  // Highest position claimed this round, -1 for none
+  uint8_t claimed_;  // Position this module claimed this round
+  bool last_;        // Its claim ends the round
+
+  uint16_t generation_;
+  uint8_t position_;
+  uint8_t count_;
+  uint32_t uids_[STACK_MAX_MODULES];
+
+  EnumStats stats_;
+};
+
+// Lets the CAN TX interrupt wake `task` (running stackEnumTask) as each
+// Claim leaves. Call before the scheduler starts.
+void stackEnumBegin(TaskHandle_t task);
+
+// Task function for numbering the stack and applying the result.
+void stackEnumTask(void *pvParameters);
+
+#endif // STACK_ENUM_H
@@ -0,0 +1,14 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+#include <stdint.h>
+#include "voices.h"
+#include "filter.h"
+
+/**
+ * Renders `n` output samples from the voice pool through the filter at the given
+ * volume (0..MAX_VOLUME) as unsigned 12-bit values ready for an AudioSink.
+ */
+void renderBlock(VoicePool& pool, Filter& filter, uint8_t volume, uint16_t* out, uint32_t n);
+
+#endif // SYNTH_H
@@ -0,0 +1,19 @@
+#ifndef TASK_NOTIFY_H
+#define TASK_NOTIFY_H
+
+#include <STM32FreeRTOS.h>
+
+// SpscRing notify hooks that wake a consumer task blocked in ulTaskNotifyTake().
+// The context is the consumer's TaskHandle_t.
+
+inline void notifyTask(void* task) {
+  xTaskNotifyGive((TaskHandle_t) task);
+}
+
+inline void notifyTaskFromISR(void* task) {
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+  vTaskNotifyGiveFromISR((TaskHandle_t) task, &xHigherPriorityTaskWoken);
+  portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
+
+#endif // TASK_NOTIFY_H
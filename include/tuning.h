@@ -0,0 +1,38 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stdint.h>
+
+constexpr uint8_t NUM_MIDI_NOTES = 128;
+constexpr uint8_t NOTES_PER_OCTAVE = 12;
+
+// Reference pitch: MIDI note 69 (A4) in equal temperament
+constexpr double REFERENCE_FREQ = 440.0;
+constexpr uint8_t REFERENCE_NOTE = 69;
+
+// Alternate temperaments are tuned relative to C, which matches equal temperament
+enum class Temperament : uint8_t {
+  Equal,
+  Just,         // 5-limit just intonation
+  Pythagorean,
+  Meantone,     // Quarter-comma meantone
+  Count
+};
+
+// MIDI note number for a key (0..11) in an octave, so octave 4 key 0 is middle C
+constexpr uint8_t midiNote(uint8_t octave, uint8_t key) {
+  return (octave + 1) * NOTES_PER_OCTAVE + key;
+}
+
+/**
+ * Phase increment for `note` at SAMPLE_RATE, from compile-time tables.
+ */
+uint32_t noteStepSize(uint8_t note, Temperament temperament = Temperament::Equal);
+
+/**
+ * Offsets a phase increment by `cents` (any sign) using two small lookup
+ * tables and two multiplies. Used for pitch bend and detune.
+ */
+uint32_t bendStepSize(uint32_t stepSize, int32_t cents);
+
+#endif // TUNING_H
@@ -0,0 +1,97 @@
+#ifndef VOICE_ALLOCATOR_H
+#define VOICE_ALLOCATOR_H
+
+#include <stdint.h>
+#include "canProtocol.h"
+
+// Synthesising modules the allocator keeps track of, this one included
+constexpr uint8_t MAX_SYNTH_NODES = 8;
+
+// Every module advertises its capacity when it changes, checked at this
+// period, and at least every heartbeat. A module that misses several
+// heartbeats is dropped.
+constexpr uint32_t CAPACITY_POLL_MS = 10;
+constexpr uint32_t CAPACITY_HEARTBEAT_MS = 200;
+constexpr uint32_t CAPACITY_TIMEOUT_MS = 1000;
+
+struct AllocatorStats {
+  uint32_t local;      // Presses played on this module
+  uint32_t remote;     // Presses sent to another module
+  uint32_t broadcast;  // Presses left to every module, none advertised
+  uint32_t steals;     // Presses made with every voice in the stack held
+  uint32_t handoffs;   // Presses passed on for want of a free voice here
+  uint32_t nodesLost;  // Modules that stopped advertising
+};
+
+/**
+ * Stack-wide voice allocation.
+ * - `setLocal()`: this module's own capacity, from its voice pool
+ * - `onAdvert()`: a capacity advert from another module
+ * - `assign()`: picks the module that plays a new note
+ * - `handOff()`: picks another module for a press this one has no voice for
+ *
+ * Each press goes to the module with the most idle voices, then the most
+ * releasing ones, then the lowest node ID, so every module that sees the
+ * same adverts makes the same choice. The choice is charged against the
+ * cached capacity straight away, so the notes of a chord spread out before
+ * any advert comes back. When every voice in the stack is held, the full
+ * modules take the steal in turn, and each picks its victim with its own
+ * StealPolicy.
+ *
+ * Two modules pressing keys before the target's next advert can both pick
+ * it for its last free voice. Rather than steal, the target hands the
+ * press it can't place on to the module it would pick itself, once, and
+ * that module plays it whatever it holds.
+ *
+ * Calls must be serialised by the caller, like VoicePool note on/off.
+ */
+class VoiceAllocator {
+public:
+  VoiceAllocator();
+
+  void setLocal(const VoiceCapacity& capacity, uint32_t nowMs);
+  void onAdvert(const VoiceCapacity& capacity, uint32_t nowMs);
+
+  // Drops every other module until it advertises again, when the stack has
+  // been renumbered
+  void forget();
+
+  // Node to play the next press, or CAN_NODE_ALL while no other module has
+  // advertised, so a stack of older modules keeps playing every note
+  uint8_t assign(uint32_t nowMs);
+
+  // Another module with an idle or releasing voice to play a press this one
+  // was picked for, charged like assign(), or CAN_NODE_ALL if there is none
+  uint8_t handOff(uint32_t nowMs);
+
+  // Modules currently taking notes, this one included
+  uint8_t nodeCount() const;
+
+  // Voices across those modules
+  uint16_t totalVoices() const;
+
+  const AllocatorStats& stats() const { return stats_; }
+
+private:
+  struct Node {
+    VoiceCapacity capacity;
+    uint32_t lastSeen;  // ms, for remote nodes
+    bool active;
+  };
+
+  Node* find(uint8_t node);
+  Node* add();
+  void expire(uint32_t nowMs);
+  Node* pickSteal();
+  static bool better(const VoiceCapacity& c, const VoiceCapacity& best);
+  static void charge(VoiceCapacity& capacity);
+
+  Node nodes_[MAX_SYNTH_NODES];  // Slot 0 is this module
+  uint8_t lastSteal_;
+  AllocatorStats stats_;
+};
+
+// Task function for advertising this module's capacity.
+void voiceAllocTask(void *pvParameters);
+
+#endif // VOICE_ALLOCATOR_H
@@ -0,0 +1,192 @@
+#ifndef VOICES_H
+#define VOICES_H
+
+#include <atomic>
+#include <stdint.h>
+#include "audio.h"
+#include "envelope.h"
+#include "wavetable.h"
+
+// Number of simultaneous voices (override with -D MAX_VOICES=n)
+#ifndef MAX_VOICES
+#define MAX_VOICES 8
+#endif
+
+// Each voice is scaled by 2^-n before summing, giving 2^n voices of
+// headroom before the mixer's soft clip.
+constexpr uint8_t VOICE_MIX_SHIFT = 2;
+constexpr int16_t VOICE_GAIN = 32768 >> VOICE_MIX_SHIFT;  // Q15
+
+// What to do with a note-on when every voice is busy
+enum class StealPolicy : uint8_t {
+    None,    // Drop the new note
+    Oldest,  // Reuse the voice that was started first
+    Newest,  // Reuse the voice that was started last
+    Quietest // Reuse the voice with the lowest envelope level
+};
+
+// Held and Released are set by note on/off, and say which note owns the
+// voice. Only the mixer moves a voice from Released to Idle, once its
+// release stage has finished.
+enum class VoiceState : uint8_t {
+    Idle,
+    Held,
+    Released
+};
+
+// A note-on given a later sample doesn't change what the voice plays until
+// then, so the note it takes over keeps its pitch and its release. Each
+// note's step size is kept in the slot for the parity of its trigger count.
+struct Voice {
+    std::atomic<VoiceState> state;
+    std::atomic<uint32_t> triggers;        // Bumped by every note-on
+    std::atomic<uint32_t> stepSize[2];     // Phase increment
+    std::atomic<const int16_t*> table[2];  // Band-limited table for this step size
+    std::atomic<uint32_t> level;           // Envelope level published by the mixer
+    std::atomic<uint32_t> startAt;         // Sample the latest note-on lands on
+    std::atomic<uint32_t> stopAt;          // Sample the latest note-off lands on
+    std::atomic<uint32_t> stopped;         // Trigger count the latest note-off releases
+
+    // Owned by note on/off
+    uint32_t baseStep[2];                  // Step sizes before pitch bend
+    uint32_t age;                          // Start order stamp, used for stealing
+    uint8_t note;
+
+    // Owned by the mixer
+    uint32_t phaseAcc;
+    uint32_t lastTrigger;
+    Envelope env;
+};
+
+struct VoiceCounts {
+    uint8_t held;
+    uint8_t releasing;
+};
+
+// Gates given a sample to land on, since start-up
+struct GateStats {
+    uint32_t timed;    // Note on/off calls with a sample index
+    uint32_t late;     // Arrived after their block had started rendering
+    uint32_t maxLate;  // Samples, the most any of those was late by
+};
+
+// A gate further ahead of the output than this is taken as a bad sample
+// index and lands on the next block instead
+constexpr uint32_t MAX_GATE_AHEAD = SAMPLE_RATE;
+
+/**
+ * Fixed-capacity pool of oscillator voices.
+ * - `noteOn()` / `noteOff()`: allocation-free voice assignment (task context)
+ * - `mixBlock()`: sums every sounding voice into a block (audio generator)
+ *
+ * Note on/off calls must be serialised by the caller; `mixBlock()` may run
+ * concurrently with them because voices are handed over through atomics.
+ *
+ * Samples are counted on the output's clock, set by `setClock()` before each
+ * block. A note on/off given a sample index lands on exactly that sample, so
+ * the block size no longer quantises it. One that is already due lands at
+ * the start of the next block rendered.
+ */
+class VoicePool {
+public:
+    explicit VoicePool(StealPolicy policy = StealPolicy::Oldest);
+
+    void setStealPolicy(StealPolicy policy) { policy_ = policy; }
+    StealPolicy getStealPolicy() const { return policy_; }
+
+    // Waveform used by subsequent note-ons
+    void setWaveform(Waveform wave) { waveform_ = wave; }
+    Waveform getWaveform() const { return waveform_; }
+
+    /**
+     * Envelope applied to every voice from the next block on. Set with the
+     * note on/off lock held; the mixer copies it once at the top of a block,
+     * so a block never sees half an update.
+     */
+    void setEnvelope(const EnvelopeParams& params);
+    EnvelopeParams getEnvelope() const;
+
+    /**
+     * Offsets every voice, sounding and future, by `cents`.
+     */
+    void setPitchBend(int32_t cents);
+    int32_t getPitchBend() const { return pitchBend_; }
+
+    /**
+     * Starts a voice for `note`, or retriggers it if it is already sounding.
+     * Returns false if the note was dropped because no voice was available.
+     * With `at` the envelope starts on that sample, otherwise on the next
+     * block.
+     */
+    bool noteOn(uint8_t note, uint32_t stepSize);
+    bool noteOn(uint8_t note, uint32_t stepSize, uint32_t at);
+
+    /**
+     * Releases every voice playing `note`. The voice stays allocated until
+     * its release stage has finished.
+     */
+    void noteOff(uint8_t note);
+    void noteOff(uint8_t note, uint32_t at);
+
+    void allNotesOff();
+
+    /**
+     * Sample index of the next block's first sample. The audio generator
+     * sets it from the output, otherwise the clock moves on by each block.
+     */
+    void setClock(uint32_t sample) { nextBlock_ = sample; }
+
+    // First sample that hasn't started rendering, safe from any task
+    uint32_t clock() const { return rendered_.load(std::memory_order_acquire); }
+
+    /**
+     * Advances every voice by `n` samples (up to AUDIO_BLOCK_SIZE) and writes
+     * the soft-clipped 16-bit mix to `out`.
+     */
+    void mixBlock(int16_t* out, uint32_t n);
+
+    // Voices that are held or still releasing
+    uint8_t activeCount() const;
+
+    // The same split by state, safe to call without the note on/off lock
+    VoiceCounts counts() const;
+
+    // False if noteOn(note) would have to steal a held voice
+    bool hasVoiceFor(uint8_t note) const;
+
+    // Read with the note on/off lock held
+    const GateStats& gateStats() const { return gateStats_; }
+
+    // Held voices taken for a new note, read with the note on/off lock held
+    uint32_t steals() const { return steals_; }
+
+private:
+    Voice* findVoice(uint8_t note);
+    Voice* allocateVoice();
+    void setStep(Voice& v, uint8_t slot);
+    uint32_t countGate(uint32_t at);
+    bool startNote(uint8_t note, uint32_t stepSize, uint32_t at);
+    void stopNote(uint8_t note, uint32_t at);
+    bool renderVoice(Voice& v, const EnvelopeParams& envelope, int16_t* out, uint32_t n,
+                     uint32_t blockStart);
+    void renderSegment(Voice& v, const EnvelopeParams& envelope, int16_t* out, uint32_t n);
+
+    Voice voices_[MAX_VOICES];
+    int32_t mixBuffer_[AUDIO_BLOCK_SIZE];
+    int16_t voiceBuffer_[2][AUDIO_BLOCK_SIZE];  // Voices are mixed in pairs
+    uint32_t ageCounter_;
+    StealPolicy policy_;
+    Waveform waveform_;
+    int32_t pitchBend_;
+    // Envelope double-buffered: setEnvelope() writes the slot the version
+    // doesn't point at, then bumps it. The mixer retries its copy if the
+    // version moved meanwhile, as the slot it read may have been rewritten.
+    EnvelopeParams envelopes_[2];
+    std::atomic<uint32_t> envelopeVersion_;
+    uint32_t nextBlock_;       // Owned by the mixer and setClock()
+    std::atomic<uint32_t> rendered_;
+    GateStats gateStats_;      // Owned by note on/off
+    uint32_t steals_;          // Owned by note on/off
+};
+
+#endif // VOICES_H
@@ -0,0 +1,37 @@
+#ifndef WAV_FILE_SINK_H
+#define WAV_FILE_SINK_H
+
+#include <stdio.h>
+#include "audio.h"
+#include "audioSink.h"
+
+/**
+ * Host-side AudioSink that writes 16-bit mono PCM to a WAV file.
+ * Blocks are written as fast as they are rendered, so the render path
+ * can be run and timed without a board.
+ */
+class WavFileSink : public AudioSink {
+public:
+  explicit WavFileSink(const char* path) : path_(path) {}
+  ~WavFileSink() { end(); }
+
+  bool begin(uint32_t sampleRate) override;
+  uint16_t* acquireBlock() override;
+  void commitBlock() override;
+
+  // Patch the header sizes and close the file.
+  void end() override;
+
+  uint32_t samplesWritten() const { return samples_; }
+
+private:
+  void writeHeader();
+
+  const char* path_;
+  FILE* file_ = nullptr;
+  uint32_t sampleRate_ = 0;
+  uint32_t samples_ = 0;
+  uint16_t block_[AUDIO_BLOCK_SIZE];
+};
+
+#endif // WAV_FILE_SINK_H
@@ -0,0 +1,51 @@
+#ifndef WAVETABLE_H
+#define WAVETABLE_H
+
+#include <stdint.h>
+
+// Samples per cycle; each table has one guard sample so interpolation never wraps
+constexpr uint8_t WAVETABLE_BITS = 8;
+constexpr uint32_t WAVETABLE_SIZE = 1u << WAVETABLE_BITS;
+
+// One band-limited table per octave of phase increment. Level 0 holds the most
+// harmonics, each level above halves the harmonic count down to a pure sine.
+constexpr uint8_t WAVETABLE_LEVELS = 8;
+
+// Phase increments below 2^WAVETABLE_LOWEST_BIT all use level 0
+constexpr uint8_t WAVETABLE_LOWEST_BIT = 31 - WAVETABLE_LEVELS;
+
+enum class Waveform : uint8_t {
+  Saw,
+  Square,
+  Triangle,
+  Sine
+};
+
+struct WavetableSet {
+  int16_t level[WAVETABLE_LEVELS][WAVETABLE_SIZE + 1];
+};
+
+// Tables are generated at compile time and stored in flash
+extern const WavetableSet sawTables;
+extern const WavetableSet squareTables;
+extern const WavetableSet triangleTables;
+extern const WavetableSet sineTables;
+
+/**
+ * Returns the table for `wave` with as many harmonics as fit below Nyquist
+ * for a voice with phase increment `stepSize`.
+ */
+const int16_t* wavetableFor(Waveform wave, uint32_t stepSize);
+
+/**
+ * Linearly interpolated table lookup, returns a 16-bit sample.
+ */
+inline int32_t wavetableLookup(const int16_t* table, uint32_t phase) {
+  uint32_t index = phase >> (32 - WAVETABLE_BITS);
+  int32_t frac = (phase >> (17 - WAVETABLE_BITS)) & 0x7fff;  // Q15
+  int32_t s0 = table[index];
+  int32_t s1 = table[index + 1];
+  return s0 + (((s1 - s0) * frac) >> 15);
+}
+
+#endif // WAVETABLE_H
@@ -3,17 +3,39 @@
 #include <stm32l4xx_hal_rcc.h>
 #include <stm32l4xx_hal_gpio.h>
 #include <stm32l4xx_hal_cortex.h>
+#include "ES_CAN.h"
 
 //Overwrite the weak default IRQ Handlers and callabcks
 extern "C" void CAN1_RX0_IRQHandler(void);
+extern "C" void CAN1_RX1_IRQHandler(void);
 extern "C" void CAN1_TX_IRQHandler(void);
+extern "C" void CAN1_SCE_IRQHandler(void);
 
 //Pointer to user ISRS
 void (*CAN_RX_ISR)() = NULL;
+void (*CAN_RX1_ISR)() = NULL;
 void (*CAN_TX_ISR)() = NULL;
+void (*CAN_SCE_ISR)() = NULL;
+
+//FIFO overrun counts
+volatile uint32_t CAN_RXOverruns[2] = {0, 0};
+
+//Error event counts
+volatile uint32_t CAN_WarningEvents = 0;
+volatile uint32_t CAN_PassiveEvents = 0;
+volatile uint32_t CAN_BusOffEvents = 0;
+volatile uint32_t CAN_Recoveries = 0;
+volatile bool CAN_InBusOff = false;
+
+//Error state flags in ESR as last seen, so each is counted once as it rises
+//The flags are levels, and the HAL reports every one still set on each error
+volatile uint32_t CAN_ErrorFlags = 0;
+
+uint32_t CAN_BitRate = 0;
 
 //CAN handle struct with initialisation parameters
-//Timing from http://www.bittiming.can-wiki.info/ with bit rate = 125kHz and clock frequency = 80MHz
+//The bit timing fields are filled in by CAN_Init for the requested bit rate
+//AutoBusOff lets the controller rejoin the bus on its own after bus-off
 CAN_HandleTypeDef CAN_Handle = {
     CAN1,
     {
@@ -23,7 +45,7 @@ CAN_HandleTypeDef CAN_Handle = {
         CAN_BS1_13TQ, //TimeSeg1
         CAN_BS2_2TQ,  //TimeSeg2
         DISABLE,      //TimeTriggeredMode
-        DISABLE,      //AutoBusOff
+        ENABLE,       //AutoBusOff
         ENABLE,       //AutoWakeUp
         ENABLE,       //AutoRetransmission
         DISABLE,      //ReceiveFifoLocked
@@ -64,24 +86,73 @@ void HAL_CAN_MspInit(CAN_HandleTypeDef* CAN_Handle) {
 }
 
 
-uint32_t CAN_Init(bool loopback=false) {
+uint32_t CAN_Init(bool loopback, uint32_t bitRate) {
   if (loopback)
     CAN_Handle.Init.Mode = CAN_MODE_LOOPBACK;
+
+  if (bitRate == 0 || bitRate > 1000000)
+    return (uint32_t) HAL_ERROR;
+
+  //Try every bit length from 8 to 25 time quanta that divides the clock
+  //exactly, keeping the one with the sample point closest to 87.5%
+  uint32_t clock = HAL_RCC_GetPCLK1Freq();
+  uint32_t bestQuanta = 0, bestSeg2 = 0, bestError = 1000;
+  for (uint32_t quanta = 25; quanta >= 8; quanta--) {
+    if (clock % (bitRate * quanta) || clock / (bitRate * quanta) > 1024)
+      continue;
+
+    uint32_t seg2 = (quanta + 4) / 8;      //Round(quanta / 8)
+    uint32_t seg1 = quanta - 1 - seg2;
+    if (seg1 > 16)
+      continue;
+
+    //Sample point in tenths of a percent
+    uint32_t samplePoint = 1000 * (1 + seg1) / quanta;
+    uint32_t error = samplePoint > 875 ? samplePoint - 875 : 875 - samplePoint;
+    if (error < bestError) {
+      bestQuanta = quanta;
+      bestSeg2 = seg2;
+      bestError = error;
+    }
+  }
+
+  //No exact timing for this clock
+  if (!bestQuanta)
+    return (uint32_t) HAL_ERROR;
+
+  uint32_t seg1 = bestQuanta - 1 - bestSeg2;
+  uint32_t sjw = bestSeg2 < 4 ? bestSeg2 : 4;
+  CAN_Handle.Init.Prescaler = clock / (bitRate * bestQuanta);
+  CAN_Handle.Init.TimeSeg1 = (seg1 - 1) << CAN_BTR_TS1_Pos;
+  CAN_Handle.Init.TimeSeg2 = (bestSeg2 - 1) << CAN_BTR_TS2_Pos;
+  CAN_Handle.Init.SyncJumpWidth = (sjw - 1) << CAN_BTR_SJW_Pos;
+  CAN_BitRate = bitRate;
+
   return (uint32_t) HAL_CAN_Init(&CAN_Handle);
 }
 
 
-uint32_t setCANFilter(uint32_t filterID, uint32_t maskID, uint32_t filterBank) {
+uint32_t CAN_GetBitRate() {
+  return CAN_BitRate;
+}
+
+
+uint32_t setCANFilterBank(uint32_t filterBank, bool listMode, uint32_t id1, uint32_t id2, uint32_t fifo) {
+
+  //CAN1 has 14 filter banks
+  if (filterBank > 13 || fifo > 1)
+    return (uint32_t) HAL_ERROR;
 
   //Set up the filter definition
+  //In list mode the mask registers hold the second ID
   CAN_FilterTypeDef filterInfo = {
-    (filterID << 5) & 0xffe0,   //Filter ID
+    (id1 << 5) & 0xffe0,        //Filter ID
     0,                          //Filter ID LSBs = 0
-    (maskID << 5) & 0xffe0,     //Mask MSBs
-    0,                          //Mask LSBs = 0
-    0,                          //FIFO selection
-    filterBank & 0xf,           //Filter bank selection
-    CAN_FILTERMODE_IDMASK,      //Mask mode
+    (id2 << 5) & 0xffe0,        //Mask or second ID MSBs
+    0,                          //Mask or second ID LSBs = 0
+    fifo,                       //FIFO selection
+    filterBank,                 //Filter bank selection
+    listMode ? CAN_FILTERMODE_IDLIST : CAN_FILTERMODE_IDMASK,
     CAN_FILTERSCALE_32BIT,      //32 bit IDs
     CAN_FILTER_ENABLE,          //Enable filter
     0                           //uint32_t SlaveStartFilterBank
@@ -91,12 +162,17 @@ uint32_t setCANFilter(uint32_t filterID, uint32_t maskID, uint32_t filterBank) {
 }
 
 
+uint32_t setCANFilter(uint32_t filterID, uint32_t maskID, uint32_t filterBank) {
+  return setCANFilterBank(filterBank, false, filterID, maskID, 0);
+}
+
+
 uint32_t CAN_Start() {
   return (uint32_t) HAL_CAN_Start(&CAN_Handle);
 }
 
 
-uint32_t CAN_TX(uint32_t ID, uint8_t data[8]) {
+uint32_t CAN_TX(uint32_t ID, uint8_t data[8], uint8_t length) {
 
   //Set up the message header
   CAN_TxHeaderTypeDef txHeader = {
@@ -104,34 +180,49 @@ uint32_t CAN_TX(uint32_t ID, uint8_t data[8]) {
     0,                          //Ext ID = 0
     CAN_ID_STD,                 //Use Standard ID
     CAN_RTR_DATA,               //Data Frame
-    8,                          //Send 8 bytes
+    length > 8 ? 8u : length,   //Data length
     DISABLE                     //No time triggered mode
   };
 
-  //Wait for free mailbox
-  while (!HAL_CAN_GetTxMailboxesFreeLevel(&CAN_Handle));
+  //Don't wait for a free mailbox, the caller retries from the TX interrupt
+  if (!HAL_CAN_GetTxMailboxesFreeLevel(&CAN_Handle))
+    return (uint32_t) HAL_BUSY;
 
   //Start the transmission
-  return (uint32_t) HAL_CAN_AddTxMessage(&CAN_Handle, &txHeader, data, NULL);
+  uint32_t mailbox;
+  return (uint32_t) HAL_CAN_AddTxMessage(&CAN_Handle, &txHeader, data, &mailbox);
+}
+
+
+uint32_t CAN_TXFreeMailboxes() {
+  return HAL_CAN_GetTxMailboxesFreeLevel(&CAN_Handle);
 }
 
 
-uint32_t CAN_CheckRXLevel() {
-  return HAL_CAN_GetRxFifoFillLevel(&CAN_Handle, 0);
+uint32_t CAN_AbortTX() {
+  return (uint32_t) HAL_CAN_AbortTxRequest(&CAN_Handle, CAN_TX_MAILBOX0 | CAN_TX_MAILBOX1 | CAN_TX_MAILBOX2);
 }
 
 
-uint32_t CAN_RX(uint32_t &ID, uint8_t data[8]) {
+uint32_t CAN_CheckRXLevel(uint32_t fifo) {
+  return HAL_CAN_GetRxFifoFillLevel(&CAN_Handle, fifo);
+}
+
+
+uint32_t CAN_RX(uint32_t &ID, uint8_t data[8], uint8_t *length, uint32_t fifo) {
   CAN_RxHeaderTypeDef rxHeader;
 
-  //Wait for message in FIFO
-  while (!HAL_CAN_GetRxFifoFillLevel(&CAN_Handle, 0));
-  
+  //Don't wait for a message, the caller drains the FIFO from its interrupt
+  if (!HAL_CAN_GetRxFifoFillLevel(&CAN_Handle, fifo))
+    return (uint32_t) HAL_ERROR;
+
   //Get the message from the FIFO
-  uint32_t result = (uint32_t) HAL_CAN_GetRxMessage(&CAN_Handle, 0, &rxHeader, data);
+  uint32_t result = (uint32_t) HAL_CAN_GetRxMessage(&CAN_Handle, fifo, &rxHeader, data);
 
-  //Store the ID from the header
+  //Store the ID and length from the header
   ID = rxHeader.StdId;
+  if (length)
+    *length = rxHeader.DLC;
 
   return result;
 }
@@ -141,8 +232,8 @@ uint32_t CAN_RegisterRX_ISR(void(& callback)()) {
   //Store pointer to user ISR
   CAN_RX_ISR = &callback;
 
-  //Enable message received interrupt in HAL
-  uint32_t status = (uint32_t) HAL_CAN_ActivateNotification (&CAN_Handle, CAN_IT_RX_FIFO0_MSG_PENDING);
+  //Enable message received and overrun interrupts in HAL
+  uint32_t status = (uint32_t) HAL_CAN_ActivateNotification (&CAN_Handle, CAN_IT_RX_FIFO0_MSG_PENDING | CAN_IT_RX_FIFO0_OVERRUN);
 
   //Switch on the interrupt
   HAL_NVIC_SetPriority (CAN1_RX0_IRQn, 6, 0);
@@ -152,6 +243,73 @@ uint32_t CAN_RegisterRX_ISR(void(& callback)()) {
 }
 
 
+uint32_t CAN_RegisterRX1_ISR(void(& callback)()) {
+  //Store pointer to user ISR
+  CAN_RX1_ISR = &callback;
+
+  //Enable message received and overrun interrupts in HAL
+  uint32_t status = (uint32_t) HAL_CAN_ActivateNotification (&CAN_Handle, CAN_IT_RX_FIFO1_MSG_PENDING | CAN_IT_RX_FIFO1_OVERRUN);
+
+  //Switch on the interrupt
+  HAL_NVIC_SetPriority (CAN1_RX1_IRQn, 6, 0);
+  HAL_NVIC_EnableIRQ (CAN1_RX1_IRQn);
+
+  return status;
+}
+
+
+uint32_t CAN_GetRXOverruns(uint32_t fifo) {
+  return fifo < 2 ? CAN_RXOverruns[fifo] : 0;
+}
+
+
+uint32_t CAN_RegisterSCE_ISR(void(* callback)()) {
+  //Store pointer to user ISR
+  CAN_SCE_ISR = callback;
+
+  //Enable error state change interrupts in HAL
+  //Per-frame protocol errors are left off, a broken bus would flood the CPU
+  uint32_t status = (uint32_t) HAL_CAN_ActivateNotification (&CAN_Handle, CAN_IT_ERROR_WARNING | CAN_IT_ERROR_PASSIVE | CAN_IT_BUSOFF | CAN_IT_ERROR);
+
+  //Switch on the interrupt
+  HAL_NVIC_SetPriority (CAN1_SCE_IRQn, 6, 0);
+  HAL_NVIC_EnableIRQ (CAN1_SCE_IRQn);
+
+  return status;
+}
+
+
+CAN_Health CAN_GetHealth() {
+  uint32_t esr = CAN1->ESR;
+  CAN_Health health;
+
+  health.txErrors = (esr & CAN_ESR_TEC) >> CAN_ESR_TEC_Pos;
+  health.rxErrors = (esr & CAN_ESR_REC) >> CAN_ESR_REC_Pos;
+  health.lastErrorCode = (esr & CAN_ESR_LEC) >> CAN_ESR_LEC_Pos;
+  health.errorPassive = esr & CAN_ESR_EPVF;
+  health.busOff = esr & CAN_ESR_BOFF;
+
+  //Nor on a flag falling, so forget the ones that have fallen here to count
+  //them again when they next rise
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  CAN_ErrorFlags &= esr;
+  __set_PRIMASK(primask);
+
+  //There is no interrupt on leaving bus-off, so recovery is noticed here
+  if (CAN_InBusOff && !health.busOff) {
+    CAN_InBusOff = false;
+    CAN_Recoveries++;
+  }
+
+  health.warningEvents = CAN_WarningEvents;
+  health.passiveEvents = CAN_PassiveEvents;
+  health.busOffEvents = CAN_BusOffEvents;
+  health.recoveries = CAN_Recoveries;
+  return health;
+}
+
+
 uint32_t CAN_RegisterTX_ISR(void(& callback)()) {
   //Store pointer to user ISR
   CAN_TX_ISR = &callback;
@@ -175,6 +333,44 @@ void HAL_CAN_RxFifo0MsgPendingCallback (CAN_HandleTypeDef * hcan){
 }
 
 
+void HAL_CAN_RxFifo1MsgPendingCallback (CAN_HandleTypeDef * hcan){
+
+  //Call the user ISR if it has been registered
+  if (CAN_RX1_ISR)
+    CAN_RX1_ISR();
+}
+
+
+void HAL_CAN_ErrorCallback (CAN_HandleTypeDef * hcan){
+
+  //Count FIFO overruns and clear them from the accumulated error code
+  if (hcan->ErrorCode & HAL_CAN_ERROR_RX_FOV0)
+    CAN_RXOverruns[0]++;
+  if (hcan->ErrorCode & HAL_CAN_ERROR_RX_FOV1)
+    CAN_RXOverruns[1]++;
+  hcan->ErrorCode &= ~(HAL_CAN_ERROR_RX_FOV0 | HAL_CAN_ERROR_RX_FOV1);
+
+  //Count error states as they are entered, not each time one is reported
+  uint32_t stateErrors = hcan->ErrorCode & (HAL_CAN_ERROR_EWG | HAL_CAN_ERROR_EPV | HAL_CAN_ERROR_BOF);
+  uint32_t flags = hcan->Instance->ESR & (CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF);
+  uint32_t risen = flags & ~CAN_ErrorFlags;
+  CAN_ErrorFlags = flags;
+  if (risen & CAN_ESR_EWGF)
+    CAN_WarningEvents++;
+  if (risen & CAN_ESR_EPVF)
+    CAN_PassiveEvents++;
+  if (risen & CAN_ESR_BOFF) {
+    CAN_BusOffEvents++;
+    CAN_InBusOff = true;
+  }
+  hcan->ErrorCode &= ~(HAL_CAN_ERROR_EWG | HAL_CAN_ERROR_EPV | HAL_CAN_ERROR_BOF);
+
+  //Call the user ISR if it has been registered
+  if (stateErrors && CAN_SCE_ISR)
+    CAN_SCE_ISR();
+}
+
+
 void HAL_CAN_TxMailbox0CompleteCallback (CAN_HandleTypeDef * hcan){
 
   //Call the user ISR if it has been registered
@@ -207,9 +403,25 @@ void CAN1_RX0_IRQHandler(void){
 }
 
 
+//This is the base ISR at the interrupt vector
+void CAN1_RX1_IRQHandler(void){
+
+  //Use the HAL interrupt handler
+  HAL_CAN_IRQHandler(&CAN_Handle);
+}
+
+
 //This is the base ISR at the interrupt vector
 void CAN1_TX_IRQHandler(void){
 
   //Use the HAL interrupt handler
   HAL_CAN_IRQHandler(&CAN_Handle);
 }
+
+
+//This is the base ISR at the interrupt vector
+void CAN1_SCE_IRQHandler(void){
+
+  //Use the HAL interrupt handler
+  HAL_CAN_IRQHandler(&CAN_Handle);
+}
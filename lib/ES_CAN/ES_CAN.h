@@ -1,7 +1,24 @@
 #include <stm32l4xx_hal_cortex.h>
 
-//Initialise the CAN module
-uint32_t CAN_Init(bool loopback=false);
+//Bus health from the error counters and error interrupts
+struct CAN_Health {
+  uint8_t txErrors;         //Transmit error counter (TEC)
+  uint8_t rxErrors;         //Receive error counter (REC)
+  uint8_t lastErrorCode;    //Last protocol error (LEC), 0 = none
+  bool errorPassive;        //Either counter above 127
+  bool busOff;              //TEC above 255, the controller has left the bus
+  uint32_t warningEvents;   //Times a counter reached 96
+  uint32_t passiveEvents;   //Times the controller went error passive
+  uint32_t busOffEvents;    //Times the controller went bus-off
+  uint32_t recoveries;      //Times it rejoined the bus after bus-off
+};
+
+//Initialise the CAN module at a bit rate of up to 1000000
+//The bit timing is computed for the APB1 clock, fails if it can't be met exactly
+uint32_t CAN_Init(bool loopback=false, uint32_t bitRate=125000);
+
+//Get the bit rate set by CAN_Init
+uint32_t CAN_GetBitRate();
 
 //Enable the CAN module
 uint32_t CAN_Start();
@@ -10,17 +27,44 @@ uint32_t CAN_Start();
 //Defaults to receive everything
 uint32_t setCANFilter(uint32_t filterID=0, uint32_t maskID=0, uint32_t filterBank=0);
 
-//Send a message
-uint32_t CAN_TX(uint32_t ID, uint8_t data[8]);
+//Set up a filter bank (0 to 13) with two standard IDs, routed to FIFO 0 or 1
+//Mask mode: accept IDs where (ID & id2) == (id1 & id2)
+//List mode: accept exactly id1 or id2
+uint32_t setCANFilterBank(uint32_t filterBank, bool listMode, uint32_t id1, uint32_t id2, uint32_t fifo=0);
+
+//Send a message of up to 8 bytes
+//Returns an error straight away if no mailbox is free
+uint32_t CAN_TX(uint32_t ID, uint8_t data[8], uint8_t length=8);
+
+//Get the number of free transmit mailboxes (0 to 3)
+uint32_t CAN_TXFreeMailboxes();
+
+//Abort the messages waiting in the transmit mailboxes
+//A message already being sent still finishes
+uint32_t CAN_AbortTX();
 
-//Get the number of received messages
-uint32_t CAN_CheckRXLevel();
+//Get the number of received messages in a FIFO
+uint32_t CAN_CheckRXLevel(uint32_t fifo=0);
 
-//Get a received message from the FIFO
-uint32_t CAN_RX(uint32_t &ID, uint8_t data[8]);
+//Get a received message from a FIFO, optionally with its length
+//Returns an error straight away if the FIFO is empty
+uint32_t CAN_RX(uint32_t &ID, uint8_t data[8], uint8_t *length=NULL, uint32_t fifo=0);
 
-//Set up an interrupt on received messages
+//Get the number of times a FIFO overflowed, each loses at least one message
+uint32_t CAN_GetRXOverruns(uint32_t fifo);
+
+//Set up an interrupt on received messages in FIFO 0
 uint32_t CAN_RegisterRX_ISR(void(& callback)());
 
+//Set up an interrupt on received messages in FIFO 1
+uint32_t CAN_RegisterRX1_ISR(void(& callback)());
+
 //Set up an interrupt on transmitted messages
-uint32_t CAN_RegisterTX_ISR(void(& callback)());
\ No newline at end of file
+uint32_t CAN_RegisterTX_ISR(void(& callback)());
+
+//Set up an interrupt on error state changes (warning, passive, bus-off)
+//Bus-off is recovered from automatically, the callback is optional
+uint32_t CAN_RegisterSCE_ISR(void(* callback)()=NULL);
+
+//Get the current bus health and error event counts
+CAN_Health CAN_GetHealth();
\ No newline at end of file
@@ -0,0 +1,147 @@
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+// Host stand-in for the parts of the stm32duino core the firmware uses.
+// Time is the simulation's virtual clock.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <functional>
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+#define INPUT_ANALOG 3
+
+#define DEC 10
+#define HEX 16
+#define BIN 2
+
+// Nucleo-32 pin numbers, only used as identifiers on the host
+enum {
+  D0, D1, D2, D3, D4, D5, D6, D7, D8, D9, D10, D11, D12, D13,
+  A0, A1, A2, A3, A4, A5, A6, A7
+};
+#define LED_BUILTIN D13
+
+uint32_t micros();
+uint32_t millis();
+void delayMicroseconds(uint32_t us);
+
+void pinMode(uint32_t pin, uint32_t mode);
+void digitalWrite(uint32_t pin, uint32_t value);
+int digitalRead(uint32_t pin);
+void digitalToggle(uint32_t pin);
+uint32_t analogRead(uint32_t pin);
+void analogWrite(uint32_t pin, uint32_t value);
+
+// ---------------------------------------------------------------------
+//                              PRINT
+// ---------------------------------------------------------------------
+
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+
+  size_t write(const char* str);
+  size_t write(const uint8_t* buffer, size_t size);
+
+  size_t print(const char* str) { return write(str); }
+  size_t print(char c) { return write((uint8_t) c); }
+  size_t print(unsigned char n, int base = DEC) { return print((unsigned long) n, base); }
+  size_t print(int n, int base = DEC) { return print((long) n, base); }
+  size_t print(unsigned int n, int base = DEC) { return print((unsigned long) n, base); }
+  size_t print(long n, int base = DEC);
+  size_t print(unsigned long n, int base = DEC);
+  size_t print(double n, int digits = 2);
+
+  template<typename T>
+  size_t println(T value) { return print(value) + println(); }
+  template<typename T>
+  size_t println(T value, int format) { return print(value, format) + println(); }
+  size_t println() { return write("\r\n"); }
+};
+
+// Serial output is dropped unless simSerialEcho() sends it to stdout.
+// Input comes from simSerialInput() or simSerialReceive().
+class SimSerial : public Print {
+public:
+  SimSerial() : baud_(9600), txFreeAt_(0) {}
+
+  void begin(uint32_t baud) { baud_ = baud; }
+  size_t write(uint8_t c) override;
+  using Print::write;
+
+  int available();
+  int read();
+  size_t readBytes(uint8_t* buffer, size_t length);
+
+  // Time for one byte on the line: a start bit, 8 data bits and a stop bit
+  uint32_t byteMicros() const { return (10 * 1000000 + baud_ - 1) / baud_; }
+
+private:
+  uint32_t baud_;
+  uint64_t txFreeAt_;  // When the line is done with what was written so far
+};
+
+extern SimSerial Serial;
+
+// Sends Serial output to stdout
+void simSerialEcho(bool enable);
+
+// Queues bytes for Serial.read()
+void simSerialInput(const char* data);
+
+// Bytes arriving one after another at the baud rate, the first done at `at`
+void simSerialReceive(uint64_t at, const uint8_t* data, size_t n);
+
+// Called for every byte written, with the time it has left the line. Pass
+// nullptr to stop.
+void simSerialSetOutputHook(std::function<void(uint8_t, uint64_t)> hook);
+
+// ---------------------------------------------------------------------
+//                          HARDWARE TIMER
+// ---------------------------------------------------------------------
+
+// Timer instances are only identifiers on the host
+struct TIM_TypeDef;
+#define TIM6 ((TIM_TypeDef*) 6)
+#define TIM7 ((TIM_TypeDef*) 7)
+
+enum TimerFormat_t {
+  TICK_FORMAT,
+  MICROSEC_FORMAT,
+  HERTZ_FORMAT
+};
+
+typedef std::function<void(void)> callback_function_t;
+
+/**
+ * Periodic interrupt on the virtual clock. Ticks are counted in
+ * microseconds, TICK_FORMAT is treated the same as MICROSEC_FORMAT.
+ */
+class HardwareTimer {
+public:
+  explicit HardwareTimer(TIM_TypeDef* instance);
+
+  void setOverflow(uint32_t value, TimerFormat_t format = TICK_FORMAT);
+  void setInterruptPriority(uint32_t preemptPriority, uint32_t subPriority);
+  void attachInterrupt(callback_function_t callback);
+  void resume();
+  void pause();
+
+private:
+  void tick(uint32_t generation);
+
+  uint32_t periodUs_;
+  uint32_t generation_;  // Bumped by pause(), so ticks already scheduled lapse
+  bool running_;
+  callback_function_t callback_;
+};
+
+#endif // SIM_ARDUINO_H
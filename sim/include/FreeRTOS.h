@@ -0,0 +1,37 @@
+#ifndef SIM_FREERTOS_H
+#define SIM_FREERTOS_H
+
+// Host stand-in for the FreeRTOS kernel. Each task is a thread and time is
+// the simulation's virtual clock, see simRtos.cpp.
+
+#include <stdint.h>
+
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE ((BaseType_t) 0)
+#define pdTRUE  ((BaseType_t) 1)
+#define pdPASS  pdTRUE
+#define pdFAIL  pdFALSE
+
+#define portMAX_DELAY ((TickType_t) 0xffffffffUL)
+#define configTICK_RATE_HZ ((TickType_t) 1000)
+#define portTICK_PERIOD_MS ((TickType_t) 1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t) (ms) * configTICK_RATE_HZ / 1000)
+
+#define configMAX_SYSCALL_INTERRUPT_PRIORITY 5
+
+// Interrupts only run while every task is blocked, so there is nothing to yield to
+#define portYIELD_FROM_ISR(woken) ((void) (woken))
+
+// Critical sections are one recursive lock shared by tasks and interrupts
+void simEnterCritical();
+void simExitCritical();
+
+#define taskENTER_CRITICAL() simEnterCritical()
+#define taskEXIT_CRITICAL() simExitCritical()
+#define taskENTER_CRITICAL_FROM_ISR() (simEnterCritical(), (UBaseType_t) 0)
+#define taskEXIT_CRITICAL_FROM_ISR(state) ((void) (state), simExitCritical())
+
+#endif // SIM_FREERTOS_H
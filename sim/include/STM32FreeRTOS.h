@@ -0,0 +1,9 @@
+#ifndef SIM_STM32_FREERTOS_H
+#define SIM_STM32_FREERTOS_H
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "queue.h"
+
+#endif // SIM_STM32_FREERTOS_H
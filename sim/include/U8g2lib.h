@@ -0,0 +1,59 @@
+#ifndef SIM_U8G2LIB_H
+#define SIM_U8G2LIB_H
+
+// Host stand-in for the display. Text drawn since the last clearBuffer()
+// is kept as a string so the simulation can show or check it. Each character
+// also marks a glyph-sized cell of the frame buffer, so tile updates see the
+// same changed areas a real frame would have.
+
+#include <string>
+#include <string.h>
+#include "Arduino.h"
+
+struct u8g2_cb_t;
+#define U8G2_R0 ((const u8g2_cb_t*) 0)
+
+extern const uint8_t u8g2_font_ncenB08_tr[];
+
+class U8G2_SSD1305_128X32_ADAFRUIT_F_HW_I2C : public Print {
+public:
+  explicit U8G2_SSD1305_128X32_ADAFRUIT_F_HW_I2C(const u8g2_cb_t* rotation) { (void) rotation; }
+
+  bool begin() { return true; }
+  void setPowerSave(uint8_t enable) { (void) enable; }
+  void setFont(const uint8_t* font) { (void) font; }
+  void clearBuffer() { text_.clear(); memset(buffer_, 0, sizeof(buffer_)); }
+  void setCursor(int x, int y) { x_ = x; y_ = y; separate(); }
+  void drawStr(int x, int y, const char* str) { setCursor(x, y); while (*str) write(*str++); }
+  void sendBuffer();
+
+  uint8_t* getBufferPtr() { return buffer_; }
+  uint8_t getBufferTileWidth() const { return TILE_WIDTH; }
+  uint8_t getBufferTileHeight() const { return TILE_HEIGHT; }
+  void updateDisplayArea(uint8_t tx, uint8_t ty, uint8_t tw, uint8_t th);
+
+  size_t write(uint8_t c) override;
+  using Print::write;
+
+  // Text of the last frame sent, the number of transfers and tiles sent
+  std::string lastFrame() const;
+  uint32_t frames() const { return frames_; }
+  uint32_t tiles() const { return tiles_; }
+
+private:
+  void separate() { if (!text_.empty()) text_ += ' '; }
+
+  static constexpr uint8_t TILE_WIDTH = 16;
+  static constexpr uint8_t TILE_HEIGHT = 4;
+  static constexpr uint8_t GLYPH_WIDTH = 6;
+
+  uint8_t buffer_[TILE_WIDTH * TILE_HEIGHT * 8] = {};
+  int x_ = 0;
+  int y_ = 0;
+  std::string text_;
+  std::string sent_;
+  uint32_t frames_ = 0;
+  uint32_t tiles_ = 0;
+};
+
+#endif // SIM_U8G2LIB_H
@@ -0,0 +1,20 @@
+#ifndef SIM_QUEUE_H
+#define SIM_QUEUE_H
+
+// The firmware passes events through SpscRing rather than kernel queues.
+// These are only for the simulation's benchmark of one against the other:
+// items are copied in and out under the kernel lock, as on the board.
+#include "FreeRTOS.h"
+
+#define errQUEUE_FULL pdFALSE
+#define errQUEUE_EMPTY pdFALSE
+
+struct SimQueue;
+typedef SimQueue* QueueHandle_t;
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize);
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticksToWait);
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticksToWait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+
+#endif // SIM_QUEUE_H
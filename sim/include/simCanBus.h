@@ -0,0 +1,216 @@
+#ifndef SIM_CAN_BUS_H
+#define SIM_CAN_BUS_H
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include "canProtocol.h"
+#include "voiceAllocator.h"
+#include "clockSync.h"
+#include "stackEnum.h"
+
+// Transmit mailboxes per node, as on the bxCAN peripheral
+constexpr uint8_t SIM_CAN_MAILBOXES = 3;
+
+class SimCanNode {
+public:
+  virtual ~SimCanNode() {}
+
+  // A frame from another node, or from this one in loopback, was received
+  virtual void onReceive(const CanMessage& msg) = 0;
+
+  // One of this node's frames has left the bus and freed its mailbox
+  virtual void onTransmitted(const CanMessage& msg) { (void) msg; }
+};
+
+struct SimCanBusStats {
+  uint32_t frames;      // Frames that completed
+  uint64_t busyMicros;  // Time the bus spent carrying them
+  uint32_t aborted;     // Frames taken back from a mailbox
+};
+
+/**
+ * In-process CAN bus. Pending frames from every node arbitrate by ID, lowest
+ * first, and each takes its worst-case stuffed length (canFrameBits()) at the
+ * bus bit rate. Delivery and mailbox release happen in interrupt context.
+ */
+class SimCanBus {
+public:
+  SimCanBus();
+
+  void setBitRate(uint32_t bitRate) { bitRate_ = bitRate; }
+  uint32_t bitRate() const { return bitRate_; }
+
+  // A loopback node also receives its own frames
+  void attach(SimCanNode* node, bool loopback = false);
+
+  // Queues a frame for arbitration, false if the node has no free mailbox
+  bool transmit(SimCanNode* node, const CanMessage& msg);
+  uint32_t freeMailboxes(SimCanNode* node);
+
+  // Takes back the node's frames that haven't started arbitration. One
+  // already on the bus still finishes.
+  void abort(SimCanNode* node);
+
+  // A node in bus-off neither sends nor receives. Its mailboxes keep their
+  // frames, which arbitrate again once it is back.
+  void setBusOff(SimCanNode* node, bool busOff);
+
+  SimCanBusStats stats();
+
+private:
+  struct Attached {
+    SimCanNode* node;
+    bool loopback;
+    bool busOff;
+    uint8_t pending;
+  };
+  struct Pending {
+    SimCanNode* from;
+    CanMessage msg;
+    uint64_t order;
+  };
+
+  Attached* find(SimCanNode* node);
+  void startNext();  // Called with lock_ held
+  void finish();
+
+  std::mutex lock_;
+  std::vector<Attached> nodes_;
+  std::vector<Pending> pending_;
+  Pending current_;
+  bool busy_;
+  uint64_t order_;
+  uint32_t bitRate_;
+  SimCanBusStats stats_;
+};
+
+extern SimCanBus simCan;
+
+// Takes the firmware's node bus-off at virtual time `at`, as a run of
+// transmit errors would, passing error warning and error passive on the way.
+// Like the bxCAN with AutoBusOff it rejoins after 128 x 11 recessive bits.
+void simCanBusOff(uint64_t at);
+
+/**
+ * Another StackSynth module on the bus, played from a script. Key changes
+ * are sent as KeyDiff frames on CAN_ID_NOTE like the firmware sends them.
+ *
+ * With `enableSynth()` it also synthesises like the firmware: it advertises
+ * its capacity, plays the presses assigned to it, hands on those it has no
+ * voice for and sends its own presses through a VoiceAllocator. Its voices
+ * are only counted, a released voice stays busy for the release time.
+ *
+ * With `enableClock()` it has a sample clock of its own, which drifts
+ * against the firmware's, and follows the stack clock through a ClockSync
+ * like the firmware does. Its presses are then sent timed.
+ *
+ * With `enableEnumeration()` it numbers itself into the stack through a
+ * StackEnumerator like the firmware does, and takes on the octave it gets.
+ */
+class SimPeerModule : public SimCanNode {
+public:
+  SimPeerModule(SimCanBus& bus, uint8_t octave);
+
+  uint8_t octave() const { return diff_.octave; }
+
+  // Call before the run starts
+  void enableSynth(uint8_t voices, uint32_t releaseUs);
+
+  // Call before the run starts. The clock runs `ppm` parts per million fast
+  // from `start`, and receive stamps are up to `jitterUs` late, as from an
+  // interrupt that had to wait.
+  void enableClock(int32_t ppm, uint32_t start, uint32_t jitterUs);
+
+  // Call before the run starts. The module's handshake outputs come on and
+  // it starts numbering at `bootAt`. `westIn` / `eastIn` read its
+  // neighbours' outputs.
+  void enableEnumeration(uint32_t uid, uint64_t bootAt, std::function<bool()> westIn,
+                         std::function<bool()> eastIn);
+
+  // Handshake outputs, for the neighbours' inputs
+  bool westOutput() const { return powered_; }
+  bool eastOutput() const { return powered_ && (!enumerated_ || enum_.eastOutput()); }
+  const StackEnumerator& stackEnum() const { return enum_; }
+
+  // This module's sample clock at virtual time `us`
+  uint32_t localClock(uint64_t us) const;
+  const ClockSync& clockSync() const { return sync_; }
+
+  // Voices sounding a held note now, and notes that took a held voice
+  uint8_t heldVoices();
+  uint32_t steals() const { return steals_; }
+  const AllocatorStats& allocStats() const { return alloc_.stats(); }
+
+  // Presses or releases a key in interrupt context at virtual time `at`.
+  // Keys changed at the same time are sent together, as one scanner pass.
+  void scheduleKey(uint64_t at, uint8_t key, bool pressed);
+
+  // Called for each KeyDiff received, with its virtual arrival time
+  void setKeyDiffHook(std::function<void(const KeyDiff&, uint64_t)> hook) { hook_ = hook; }
+
+  // Called for each KeyDiff this module sends, as the keys change, with the
+  // samples from the change to the sample it is timed for
+  void setKeySentHook(std::function<void(const KeyDiff&, uint32_t)> hook) { sentHook_ = hook; }
+
+  void onReceive(const CanMessage& msg) override;
+  void onTransmitted(const CanMessage& msg) override;
+
+private:
+  struct SimVoice {
+    bool active;
+    bool held;
+    uint8_t note;
+    uint64_t start;
+    uint64_t freeAt;  // End of the release, once let go
+  };
+
+  uint16_t frameKeys(uint16_t left, uint8_t& target) const;
+  void sendPass();
+  void sendPending();
+  void queue(const CanMessage& msg);
+  VoiceCapacity capacity();
+  void advertise();
+  void heartbeat();
+  bool hasVoiceFor(uint8_t note) const;
+  void noteOn(uint8_t note);
+  void onHandoff(const Handoff& handoff);
+  void noteOff(uint8_t note);
+  void syncTick();
+  void enumPoll();
+  void renumber();
+
+  SimCanBus& bus_;
+  KeyDiff diff_;
+  std::deque<CanMessage> backlog_;  // Waiting for a mailbox
+  std::function<void(const KeyDiff&, uint64_t)> hook_;
+  std::function<void(const KeyDiff&, uint32_t)> sentHook_;
+  uint8_t targets_[12];  // Module picked to play each key of the pass
+  uint16_t remoteKeys_[10];  // Keys held on each octave, from their key diffs
+
+  bool synth_;
+  uint32_t releaseUs_;
+  std::vector<SimVoice> voices_;
+  VoiceAllocator alloc_;
+  uint32_t steals_;
+
+  bool clocked_;
+  int32_t ppm_;
+  uint32_t clockStart_;
+  uint32_t jitterUs_;
+  uint32_t noise_;
+  ClockSync sync_;
+  SyncFrame sentSync_;  // Our last Sync as master, until it has gone
+  bool syncPending_;
+
+  bool powered_;
+  bool enumerated_;
+  StackEnumerator enum_;
+  std::function<bool()> westIn_;
+  std::function<bool()> eastIn_;
+  uint16_t enumGeneration_;
+};
+
+#endif // SIM_CAN_BUS_H
@@ -0,0 +1,36 @@
+#ifndef SIM_CLOCK_H
+#define SIM_CLOCK_H
+
+#include <stdint.h>
+#include <functional>
+
+// ---------------------------------------------------------------------
+//                          VIRTUAL CLOCK
+// ---------------------------------------------------------------------
+
+// Tasks take no virtual time: the clock only moves on to the next event once
+// every task has blocked, so latencies come from the scheduling structure
+// (scan period, block size, bus time) and are the same on every run. The
+// exception is a blocking transfer, which a task sits out with simSleep().
+
+// Virtual time in microseconds since the simulation started
+uint64_t simMicros();
+
+// Runs `fn` in interrupt context once virtual time reaches `at`. Events at
+// the same time run in the order they were added.
+void simAt(uint64_t at, std::function<void()> fn);
+
+// Called in interrupt context whenever the tasks have settled after an event
+void simSetObserver(std::function<void()> fn);
+
+// Blocks the calling task for `us` of virtual time. Returns at once outside
+// a task, e.g. in setup().
+void simSleep(uint64_t us);
+
+// Runs events until virtual time reaches `until`
+void simRunUntil(uint64_t until);
+
+// Flushes output and ends the process. Tasks never return, so they are not joined.
+[[noreturn]] void simExit(int code);
+
+#endif // SIM_CLOCK_H
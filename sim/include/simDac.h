@@ -0,0 +1,16 @@
+#ifndef SIM_DAC_H
+#define SIM_DAC_H
+
+#include <stdint.h>
+#include <functional>
+
+// Called in interrupt context as each half of the sample stream starts
+// playing, with the virtual time of its first sample.
+typedef std::function<void(const uint16_t* samples, uint32_t n, uint64_t startUs)> SimDacObserver;
+
+void simSetDacObserver(SimDacObserver fn);
+
+// Samples played since the stream started
+uint64_t simDacSamples();
+
+#endif // SIM_DAC_H
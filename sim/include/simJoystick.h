@@ -0,0 +1,42 @@
+#ifndef SIM_JOYSTICK_H
+#define SIM_JOYSTICK_H
+
+#include <mutex>
+#include <stdint.h>
+
+/**
+ * Scripted joystick behind the ADC and its DMA buffer.
+ * - `scheduleMove()`: both axes jump to new raw positions at a virtual time
+ * - `start()`: conversions begin, the buffer holds the midpoint until then
+ * - `read()`: the buffer mean, as readJoystick() gets it, false until every
+ *   pair in the buffer has been converted once, about 1 ms each
+ *
+ * Every conversion in the buffer gets its own noise, spread evenly over
+ * +-noise counts from a fixed seed, so runs repeat exactly.
+ */
+class SimJoystick {
+public:
+  SimJoystick();
+
+  void setNoise(uint16_t counts) { noise_ = counts; }
+  void scheduleMove(uint64_t at, uint16_t x, uint16_t y);
+
+  // Hardware side
+  void start();
+  bool read(uint16_t& x, uint16_t& y);
+
+private:
+  int32_t noise();
+
+  std::mutex lock_;
+  uint16_t x_;
+  uint16_t y_;
+  uint16_t noise_;
+  uint32_t seed_;
+  bool started_;
+  uint64_t filledAt_;
+};
+
+extern SimJoystick simJoystick;
+
+#endif // SIM_JOYSTICK_H
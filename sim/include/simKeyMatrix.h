@@ -0,0 +1,44 @@
+#ifndef SIM_KEY_MATRIX_H
+#define SIM_KEY_MATRIX_H
+
+#include <atomic>
+#include <stdint.h>
+
+constexpr uint8_t SIM_MATRIX_ROWS = 8;
+
+/**
+ * Scripted stand-in for the key matrix behind setRow() and readCols().
+ * Column inputs are active low like the real switches. The out bit given
+ * with each row select is latched per row, as the handshake flip-flops do.
+ */
+class SimKeyMatrix {
+public:
+  SimKeyMatrix();
+
+  // Presses or releases key 0..11 straight away
+  void setKey(uint8_t key, bool pressed);
+
+  // Sets a raw column input, for the knobs and handshake rows
+  void setInput(uint8_t row, uint8_t col, bool high);
+
+  // Changes a key at virtual time `at`. The contact chatters `bounces` times,
+  // `bounceUs` apart, before it settles.
+  void scheduleKey(uint64_t at, uint8_t key, bool pressed,
+                   uint8_t bounces = 0, uint32_t bounceUs = 200);
+
+  // Hardware side
+  void select(uint8_t row, bool outBit);
+  uint8_t read() const;
+
+  // Last value latched into a row's output flip-flop
+  bool outBit(uint8_t row) const { return (outBits_.load(std::memory_order_relaxed) >> row) & 1; }
+
+private:
+  std::atomic<uint8_t> cols_[SIM_MATRIX_ROWS];
+  std::atomic<uint8_t> row_;
+  std::atomic<uint8_t> outBits_;
+};
+
+extern SimKeyMatrix simKeys;
+
+#endif // SIM_KEY_MATRIX_H
@@ -0,0 +1,56 @@
+#ifndef SIM_KNOBS_H
+#define SIM_KNOBS_H
+
+#include <mutex>
+#include <stdint.h>
+
+/**
+ * Scripted knobs and the V2 PCAL6408A expander that reads them.
+ * - `scheduleTurn()`: quadrature steps on one knob, evenly spaced
+ * - `scheduleReadFailure()`: the first read from then on isn't answered
+ * - `read()`: the input register, as readKnobExpander() gets it
+ *
+ * Pins are in the order given in hardware.h. The expander latches a pin
+ * when it changes, so the register holds that value until it is read, and
+ * holds its interrupt line low while any change is unread. The knob pins
+ * also drive rows 3 and 4 of the key matrix, as on a V1 module.
+ */
+class SimKnobExpander {
+public:
+  SimKnobExpander();
+
+  // A V1 module has no expander, so it doesn't answer
+  void setPresent(bool present) { present_ = present; }
+  bool present() const { return present_; }
+
+  // Turns knob 0..3 by `steps` quadrature transitions, up if positive, one
+  // every `stepUs` starting at virtual time `at`
+  void scheduleTurn(uint64_t at, uint8_t knob, int16_t steps, uint32_t stepUs);
+
+  // The first read at or after virtual time `at` fails, as on a NACK, and
+  // leaves the latch and the interrupt line as they were
+  void scheduleReadFailure(uint64_t at);
+
+  // Hardware side
+  void attach(void (*isr)());
+  bool readFails();
+  uint8_t read();
+  bool interruptActive();
+
+private:
+  void step(uint8_t knob, int8_t direction);
+  void latch(uint8_t changed);
+
+  std::mutex lock_;
+  bool present_;
+  uint8_t phase_[4];  // Position in the Gray code cycle of each knob
+  uint8_t pins_;      // Live pin levels
+  uint8_t latched_;   // Values held by the input latch
+  uint8_t latchMask_; // Pins with an unread change
+  uint8_t failures_;  // Reads due to fail
+  void (*isr_)();
+};
+
+extern SimKnobExpander simKnobs;
+
+#endif // SIM_KNOBS_H
@@ -0,0 +1,46 @@
+#ifndef SIM_STM32_DEF_H
+#define SIM_STM32_DEF_H
+
+// Host stand-in for the CMSIS SIMD intrinsics dspKernels uses, written from
+// the instruction descriptions rather than from the portable kernels, so
+// the unit tests can check one against the other. Halfwords are signed,
+// bottom then top.
+
+#include <stdint.h>
+
+static inline int32_t simBottom(uint32_t x) { return (int16_t) (x & 0xffff); }
+static inline int32_t simTop(uint32_t x) { return (int16_t) (x >> 16); }
+
+static inline int32_t simSaturate(int64_t x, uint8_t bits) {
+  const int64_t max = (1ll << (bits - 1)) - 1;
+  return x > max ? max : x < -max - 1 ? -max - 1 : x;
+}
+
+// Bottom of a with the top of b shifted left
+static inline uint32_t __PKHBT(uint32_t a, uint32_t b, uint8_t shift) {
+  return (a & 0xffff) | ((b << shift) & 0xffff0000);
+}
+
+// Top of a with the bottom of b shifted right arithmetically
+static inline uint32_t __PKHTB(uint32_t a, uint32_t b, uint8_t shift) {
+  return (a & 0xffff0000) | ((uint32_t) ((int32_t) b >> shift) & 0xffff);
+}
+
+// Dual 16 x 16 multiply, products summed into a wrapping 32-bit result
+static inline uint32_t __SMUAD(uint32_t x, uint32_t y) {
+  return (uint32_t) (simBottom(x) * simBottom(y)) + (uint32_t) (simTop(x) * simTop(y));
+}
+
+static inline uint32_t __SMLAD(uint32_t x, uint32_t y, uint32_t acc) {
+  return acc + __SMUAD(x, y);
+}
+
+#define __SSAT(x, bits) simSaturate((int64_t) (x), (bits))
+
+static inline uint32_t __QADD16(uint32_t a, uint32_t b) {
+  const uint32_t bottom = (uint16_t) simSaturate(simBottom(a) + simBottom(b), 16);
+  const uint32_t top = (uint16_t) simSaturate(simTop(a) + simTop(b), 16);
+  return bottom | top << 16;
+}
+
+#endif // SIM_STM32_DEF_H
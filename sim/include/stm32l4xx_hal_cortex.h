@@ -0,0 +1,8 @@
+#ifndef SIM_STM32L4XX_HAL_CORTEX_H
+#define SIM_STM32L4XX_HAL_CORTEX_H
+
+// ES_CAN.h only needs the integer types on the host
+#include <stdint.h>
+#include <stddef.h>
+
+#endif // SIM_STM32L4XX_HAL_CORTEX_H
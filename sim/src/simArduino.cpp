@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <stdio.h>
+#include "Arduino.h"
+#include "simClock.h"
+
+SimSerial Serial;
+
+static bool serialEcho = false;
+static std::deque<uint8_t> serialInput;
+static std::mutex serialInputLock;
+static std::function<void(uint8_t, uint64_t)> serialOutputHook;
+
+// Pin levels, for code that reads back what it wrote
+static uint8_t pinLevels[A7 + 1];
+
+uint32_t micros() {
+  return (uint32_t) simMicros();
+}
+
+uint32_t millis() {
+  return (uint32_t) (simMicros() / 1000);
+}
+
+// Settling delays are instant on the host
+void delayMicroseconds(uint32_t us) {
+  (void) us;
+}
+
+void pinMode(uint32_t pin, uint32_t mode) {
+  (void) pin;
+  (void) mode;
+}
+
+void digitalWrite(uint32_t pin, uint32_t value) {
+  if (pin <= A7) pinLevels[pin] = value ? HIGH : LOW;
+}
+
+int digitalRead(uint32_t pin) {
+  return pin <= A7 ? pinLevels[pin] : LOW;
+}
+
+void digitalToggle(uint32_t pin) {
+  digitalWrite(pin, !digitalRead(pin));
+}
+
+uint32_t analogRead(uint32_t pin) {
+  (void) pin;
+  return 512;
+}
+
+void analogWrite(uint32_t pin, uint32_t value) {
+  (void) pin;
+  (void) value;
+}
+
+// ---------------------------------------------------------------------
+//                              PRINT
+// ---------------------------------------------------------------------
+
+size_t Print::write(const char* str) {
+  size_t n = 0;
+  while (*str) n += write((uint8_t) *str++);
+  return n;
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size) {
+  size_t n = 0;
+  while (n < size) n += write(buffer[n]);
+  return n;
+}
+
+size_t Print::print(long n, int base) {
+  if (n < 0 && base == DEC) return write('-') + print((unsigned long) -n, base);
+  return print((unsigned long) n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+  char buf[8 * sizeof(long) + 1];
+  char* p = buf + sizeof(buf) - 1;
+  *p = '\0';
+  if (base < 2) base = DEC;
+
+  do {
+    const uint8_t digit = n % base;
+    *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    n /= base;
+  } while (n);
+  return write(p);
+}
+
+size_t Print::print(double n, int digits) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "%.*f", digits, n);
+  return write(buf);
+}
+
+size_t SimSerial::write(uint8_t c) {
+  if (serialEcho && c != '\r') putchar(c);
+  if (serialOutputHook) {
+    // Writes don't block, the line just queues them
+    txFreeAt_ = std::max(txFreeAt_, simMicros()) + byteMicros();
+    serialOutputHook(c, txFreeAt_);
+  }
+  return 1;
+}
+
+int SimSerial::available() {
+  std::lock_guard<std::mutex> guard(serialInputLock);
+  return serialInput.size();
+}
+
+int SimSerial::read() {
+  std::lock_guard<std::mutex> guard(serialInputLock);
+  if (serialInput.empty()) return -1;
+  const uint8_t c = serialInput.front();
+  serialInput.pop_front();
+  return c;
+}
+
+size_t SimSerial::readBytes(uint8_t* buffer, size_t length) {
+  std::lock_guard<std::mutex> guard(serialInputLock);
+  size_t n = 0;
+  while (n < length && !serialInput.empty()) {
+    buffer[n++] = serialInput.front();
+    serialInput.pop_front();
+  }
+  return n;
+}
+
+void simSerialEcho(bool enable) {
+  serialEcho = enable;
+}
+
+void simSerialInput(const char* data) {
+  std::lock_guard<std::mutex> guard(serialInputLock);
+  while (*data) serialInput.push_back((uint8_t) *data++);
+}
+
+// Each byte lands and times the next, so the baud rate is the one set by
+// the time the bytes arrive
+static void receiveFrom(std::shared_ptr<std::vector<uint8_t>> bytes, size_t i) {
+  {
+    std::lock_guard<std::mutex> guard(serialInputLock);
+    serialInput.push_back((*bytes)[i]);
+  }
+  if (i + 1 < bytes->size()) {
+    simAt(simMicros() + Serial.byteMicros(), [bytes, i]() { receiveFrom(bytes, i + 1); });
+  }
+}
+
+void simSerialReceive(uint64_t at, const uint8_t* data, size_t n) {
+  if (n == 0) return;
+  auto bytes = std::make_shared<std::vector<uint8_t>>(data, data + n);
+  simAt(at, [bytes]() { receiveFrom(bytes, 0); });
+}
+
+void simSerialSetOutputHook(std::function<void(uint8_t, uint64_t)> hook) {
+  serialOutputHook = hook;
+}
+
+// ---------------------------------------------------------------------
+//                          HARDWARE TIMER
+// ---------------------------------------------------------------------
+
+HardwareTimer::HardwareTimer(TIM_TypeDef* instance)
+    : periodUs_(1000), generation_(0), running_(false) {
+  (void) instance;
+}
+
+void HardwareTimer::setOverflow(uint32_t value, TimerFormat_t format) {
+  periodUs_ = format == HERTZ_FORMAT ? 1000000 / value : value;
+  if (periodUs_ == 0) periodUs_ = 1;
+}
+
+void HardwareTimer::setInterruptPriority(uint32_t preemptPriority, uint32_t subPriority) {
+  (void) preemptPriority;
+  (void) subPriority;
+}
+
+void HardwareTimer::attachInterrupt(callback_function_t callback) {
+  callback_ = callback;
+}
+
+void HardwareTimer::resume() {
+  if (running_) return;
+  running_ = true;
+
+  const uint32_t generation = generation_;
+  simAt(simMicros() + periodUs_, [this, generation]() { tick(generation); });
+}
+
+void HardwareTimer::pause() {
+  running_ = false;
+  generation_++;
+}
+
+void HardwareTimer::tick(uint32_t generation) {
+  if (generation != generation_) return;
+
+  if (callback_) callback_();
+  simAt(simMicros() + periodUs_, [this, generation]() { tick(generation); });
+}
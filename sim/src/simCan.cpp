@@ -0,0 +1,667 @@
+#include <deque>
+#include <string.h>
+#include <ES_CAN.h>
+#include "simCanBus.h"
+#include "simClock.h"
+#include "tuning.h"
+
+// ---------------------------------------------------------------------
+//                                BUS
+// ---------------------------------------------------------------------
+
+SimCanBus simCan;
+
+SimCanBus::SimCanBus()
+    : current_(), busy_(false), order_(0), bitRate_(CAN_BIT_RATE), stats_() {}
+
+void SimCanBus::attach(SimCanNode* node, bool loopback) {
+  std::lock_guard<std::mutex> guard(lock_);
+  nodes_.push_back(Attached{node, loopback, false, 0});
+}
+
+SimCanBus::Attached* SimCanBus::find(SimCanNode* node) {
+  for (Attached& a : nodes_) {
+    if (a.node == node) return &a;
+  }
+  return nullptr;
+}
+
+bool SimCanBus::transmit(SimCanNode* node, const CanMessage& msg) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Attached* from = find(node);
+  if (!from || from->pending >= SIM_CAN_MAILBOXES) return false;
+
+  from->pending++;
+  pending_.push_back(Pending{node, msg, order_++});
+  if (!busy_) startNext();
+  return true;
+}
+
+void SimCanBus::setBusOff(SimCanNode* node, bool busOff) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Attached* a = find(node);
+  if (!a) return;
+  a->busOff = busOff;
+  if (!busy_) startNext();
+}
+
+void SimCanBus::abort(SimCanNode* node) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Attached* a = find(node);
+  if (!a) return;
+  for (size_t i = 0; i < pending_.size();) {
+    if (pending_[i].from != node) {
+      i++;
+      continue;
+    }
+    pending_.erase(pending_.begin() + i);
+    a->pending--;
+    stats_.aborted++;
+  }
+}
+
+uint32_t SimCanBus::freeMailboxes(SimCanNode* node) {
+  std::lock_guard<std::mutex> guard(lock_);
+  Attached* a = find(node);
+  return a ? SIM_CAN_MAILBOXES - a->pending : 0;
+}
+
+SimCanBusStats SimCanBus::stats() {
+  std::lock_guard<std::mutex> guard(lock_);
+  return stats_;
+}
+
+void SimCanBus::startNext() {
+  // Arbitration: the lowest ID wins, mailboxes with equal IDs go in order.
+  // Nodes in bus-off sit it out.
+  size_t winner = pending_.size();
+  for (size_t i = 0; i < pending_.size(); i++) {
+    const Pending& p = pending_[i];
+    if (find(p.from)->busOff) continue;
+    if (winner == pending_.size()) {
+      winner = i;
+      continue;
+    }
+    const Pending& w = pending_[winner];
+    if (p.msg.id < w.msg.id || (p.msg.id == w.msg.id && p.order < w.order)) winner = i;
+  }
+  if (winner == pending_.size()) return;
+  current_ = pending_[winner];
+  pending_.erase(pending_.begin() + winner);
+  busy_ = true;
+
+  const uint64_t duration = ((uint64_t) canFrameBits(current_.msg.length) * 1000000 + bitRate_ - 1) / bitRate_;
+  stats_.busyMicros += duration;
+  simAt(simMicros() + duration, [this]() { finish(); });
+}
+
+void SimCanBus::finish() {
+  std::vector<Attached> receivers;
+  Pending done;
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    done = current_;
+    busy_ = false;
+    stats_.frames++;
+
+    Attached* from = find(done.from);
+    if (from) from->pending--;
+    receivers = nodes_;
+    startNext();
+  }
+
+  // Callbacks run without the lock, they may queue the next frame
+  for (const Attached& a : receivers) {
+    if (a.busOff) continue;
+    if (a.node != done.from || a.loopback) a.node->onReceive(done.msg);
+  }
+  done.from->onTransmitted(done.msg);
+}
+
+// ---------------------------------------------------------------------
+//                            PEER MODULES
+// ---------------------------------------------------------------------
+
+SimPeerModule::SimPeerModule(SimCanBus& bus, uint8_t octave)
+    : bus_(bus), diff_(), targets_(), remoteKeys_(), synth_(false), releaseUs_(0), steals_(0),
+      clocked_(false), ppm_(0), clockStart_(0), jitterUs_(0), noise_(octave),
+      sentSync_(), syncPending_(false), powered_(true), enumerated_(false), enum_(),
+      enumGeneration_(0) {
+  diff_.octave = octave;
+  diff_.target = CAN_NODE_ALL;
+  sync_.setNode(octave);
+  bus_.attach(this);
+}
+
+void SimPeerModule::enableSynth(uint8_t voices, uint32_t releaseUs) {
+  synth_ = true;
+  releaseUs_ = releaseUs;
+  voices_.assign(voices, SimVoice{false, false, 0, 0, 0});
+
+  // Heartbeats start a little apart, as modules never power up together
+  simAt(simMicros() + diff_.octave * 1000, [this]() { heartbeat(); });
+}
+
+void SimPeerModule::enableClock(int32_t ppm, uint32_t start, uint32_t jitterUs) {
+  clocked_ = true;
+  ppm_ = ppm;
+  clockStart_ = start;
+  jitterUs_ = jitterUs;
+  simAt(simMicros() + SYNC_PERIOD_MS * 1000, [this]() { syncTick(); });
+}
+
+void SimPeerModule::enableEnumeration(uint32_t uid, uint64_t bootAt, std::function<bool()> westIn,
+                                      std::function<bool()> eastIn) {
+  enumerated_ = true;
+  powered_ = false;
+  westIn_ = westIn;
+  eastIn_ = eastIn;
+  simAt(bootAt, [this, uid]() {
+    powered_ = true;
+    enum_.begin(uid, simMicros() / 1000);
+    enumPoll();
+  });
+}
+
+// Polls the handshake inputs like stackEnumTask
+void SimPeerModule::enumPoll() {
+  EnumFrame frame;
+  const EnumSend send = enum_.poll(westIn_(), eastIn_(), simMicros() / 1000, frame);
+  if (send != EnumSend::None) {
+    CanMessage msg;
+    msg.id = CAN_ID_SYNC;
+    msg.length = send == EnumSend::Start ? encodeEnumStart(frame, msg.data)
+                                         : encodeEnumClaim(frame, msg.data);
+    queue(msg);
+  }
+  renumber();
+  simAt(simMicros() + ENUM_POLL_MS * 1000, [this]() { enumPoll(); });
+}
+
+// Takes on the octave from a finished round. A new node ID starts the
+// voice allocation and clock master election again.
+void SimPeerModule::renumber() {
+  if (enum_.generation() == enumGeneration_) return;
+  enumGeneration_ = enum_.generation();
+
+  const uint8_t octave = enum_.octave();
+  if (octave == diff_.octave) return;
+  diff_.octave = octave;
+  sync_.setNode(octave);
+  alloc_.forget();
+  if (synth_) advertise();
+}
+
+uint32_t SimPeerModule::localClock(uint64_t us) const {
+  return clockStart_ + (uint32_t) (us * SAMPLE_RATE * (1000000 + ppm_) / 1000000000000ull);
+}
+
+// Sends a Sync while this module is the master, like clockSyncTask
+void SimPeerModule::syncTick() {
+  if (sync_.tick(simMicros() / 1000)) {
+    sentSync_ = SyncFrame{diff_.octave, sync_.nextSequence(), 0};
+    syncPending_ = true;
+    CanMessage msg;
+    msg.id = CAN_ID_SYNC;
+    msg.length = encodeSync(sentSync_, msg.data);
+    queue(msg);
+  }
+  simAt(simMicros() + SYNC_PERIOD_MS * 1000, [this]() { syncTick(); });
+}
+
+void SimPeerModule::scheduleKey(uint64_t at, uint8_t key, bool pressed) {
+  simAt(at, [this, key, pressed]() {
+    // Keys that change at the same time go out together, like one scanner
+    // pass, once every change has been made
+    if (!diff_.changed) simAt(simMicros(), [this]() { sendPass(); });
+
+    const uint16_t bit = 1u << key;
+    diff_.changed |= bit;
+    if (pressed) diff_.state |= bit;
+    else diff_.state &= ~bit;
+
+    const uint8_t note = midiNote(diff_.octave, key);
+    if (!synth_) {
+      targets_[key] = CAN_NODE_ALL;
+    } else if (pressed) {
+      alloc_.setLocal(capacity(), simMicros() / 1000);
+      targets_[key] = alloc_.assign(simMicros() / 1000);
+      if (targets_[key] == diff_.octave || targets_[key] == CAN_NODE_ALL) noteOn(note);
+    } else {
+      noteOff(note);
+    }
+  });
+}
+
+// Keys of `left` for the next frame of a pass: the releases, and the
+// presses assigned to the same module as the lowest one
+uint16_t SimPeerModule::frameKeys(uint16_t left, uint8_t& target) const {
+  uint16_t keys = left & ~diff_.state;
+  target = CAN_NODE_ALL;
+  bool targeted = false;
+  for (uint8_t key = 0; key < 12; key++) {
+    const uint16_t bit = 1u << key;
+    if (!(left & diff_.state & bit)) continue;
+    if (!targeted) {
+      target = targets_[key];
+      targeted = true;
+    }
+    if (targets_[key] == target) keys |= bit;
+  }
+  return keys;
+}
+
+// Sends the pass's changes as scanKeysTask does, one frame for each module
+// the presses were assigned to, played noteLatency() from now on the stack
+// clock
+void SimPeerModule::sendPass() {
+  uint8_t target;
+  uint32_t frames = 0;
+  for (uint16_t left = diff_.changed; left; frames++) left &= ~frameKeys(left, target);
+
+  const uint32_t latency = noteLatency(backlog_.size() + frames - 1);
+  diff_.timed = clocked_ && NOTE_LATENCY_SAMPLES > 0 && sync_.locked();
+  if (diff_.timed) {
+    diff_.time = sync_.toStack(localClock(simMicros()) + latency) & KEY_DIFF_TIME_MASK;
+  }
+
+  uint16_t left = diff_.changed;
+  while (left) {
+    diff_.changed = frameKeys(left, target);
+    diff_.target = target;
+    left &= ~diff_.changed;
+
+    CanMessage msg;
+    msg.id = CAN_ID_NOTE;
+    msg.length = encodeKeyDiff(diff_, msg.data);
+    if (sentHook_) sentHook_(diff_, latency);
+    diff_.sequence++;
+    queue(msg);
+  }
+  diff_.changed = 0;
+}
+
+void SimPeerModule::queue(const CanMessage& msg) {
+  backlog_.push_back(msg);
+  sendPending();
+}
+
+void SimPeerModule::sendPending() {
+  while (!backlog_.empty() && bus_.transmit(this, backlog_.front())) {
+    backlog_.pop_front();
+  }
+}
+
+void SimPeerModule::onReceive(const CanMessage& msg) {
+  SyncFrame sync;
+  EnumFrame frame;
+  if (msg.id == CAN_ID_SYNC) {
+    if (enumerated_ && powered_ && decodeEnumStart(msg.data, msg.length, frame)) {
+      enum_.onStart(frame, simMicros() / 1000);
+      return;
+    }
+    if (enumerated_ && powered_ && decodeEnumClaim(msg.data, msg.length, frame)) {
+      enum_.onClaim(frame, simMicros() / 1000);
+      renumber();
+      return;
+    }
+
+    // The stamp is taken in the receive interrupt, a little after the frame
+    noise_ = noise_ * 1103515245 + 12345;
+    const uint32_t late = jitterUs_ ? (noise_ >> 16) % (jitterUs_ + 1) : 0;
+    if (clocked_ && decodeSync(msg.data, msg.length, sync)) {
+      sync_.onSync(sync, localClock(simMicros() + late), simMicros() / 1000);
+    }
+    return;
+  }
+  if (msg.id == CAN_ID_CONTROL) {
+    VoiceCapacity advert;
+    Handoff handoff;
+    if (synth_ && decodeCapacity(msg.data, msg.length, advert)) alloc_.onAdvert(advert, simMicros() / 1000);
+    if (synth_ && decodeHandoff(msg.data, msg.length, handoff)) onHandoff(handoff);
+    if (clocked_ && decodeSyncTime(msg.data, msg.length, sync)) sync_.onSyncTime(sync);
+    return;
+  }
+
+  KeyDiff diff;
+  if (decodeFrame(msg.data, msg.length, diff) != CanDecodeResult::KeyDiff) return;
+  if (hook_) hook_(diff, simMicros());
+
+  if (diff.octave < 10) remoteKeys_[diff.octave] = diff.state;
+  if (!synth_) return;
+  for (uint8_t key = 0; key < 12; key++) {
+    const uint16_t bit = 1u << key;
+    if (!(diff.changed & bit)) continue;
+    const uint8_t note = midiNote(diff.octave, key);
+    if (!(diff.state & bit)) {
+      noteOff(note);
+      continue;
+    }
+    if (diff.target != diff_.octave && diff.target != CAN_NODE_ALL) continue;
+
+    // Like applyKeys(), hand on a press this module would have to steal for
+    uint8_t node = CAN_NODE_ALL;
+    if (diff.target == diff_.octave && !hasVoiceFor(note)) node = alloc_.handOff(simMicros() / 1000);
+    if (node == CAN_NODE_ALL) {
+      noteOn(note);
+      continue;
+    }
+    CanMessage handoff;
+    handoff.id = CAN_ID_CONTROL;
+    handoff.length = encodeHandoff(Handoff{diff.octave, key, node}, handoff.data);
+    queue(handoff);
+  }
+}
+
+// Plays a press handed on to this module if its key is still held, like
+// playHandoff()
+void SimPeerModule::onHandoff(const Handoff& handoff) {
+  if (handoff.node != diff_.octave || handoff.octave >= 10) return;
+  const uint16_t held = handoff.octave == diff_.octave ? diff_.state : remoteKeys_[handoff.octave];
+  if (held & (1u << handoff.key)) noteOn(midiNote(handoff.octave, handoff.key));
+}
+
+// ---------------------------------------------------------------------
+//                          PEER VOICES
+// ---------------------------------------------------------------------
+
+VoiceCapacity SimPeerModule::capacity() {
+  const uint64_t now = simMicros();
+  VoiceCapacity c = {diff_.octave, 0, 0, (uint8_t) voices_.size()};
+  for (const SimVoice& v : voices_) {
+    if (!v.active || (!v.held && now >= v.freeAt)) c.idle++;
+    else if (!v.held) c.releasing++;
+  }
+  return c;
+}
+
+void SimPeerModule::advertise() {
+  CanMessage msg;
+  msg.id = CAN_ID_CONTROL;
+  msg.length = encodeCapacity(capacity(), msg.data);
+  queue(msg);
+}
+
+void SimPeerModule::heartbeat() {
+  advertise();
+  simAt(simMicros() + CAPACITY_HEARTBEAT_MS * 1000, [this]() { heartbeat(); });
+}
+
+bool SimPeerModule::hasVoiceFor(uint8_t note) const {
+  for (const SimVoice& v : voices_) {
+    if (!v.active || !v.held || v.note == note) return true;
+  }
+  return false;
+}
+
+// Like VoicePool: the same note retriggers, then an idle voice, then one
+// that is releasing, then the oldest held one
+void SimPeerModule::noteOn(uint8_t note) {
+  const uint64_t now = simMicros();
+  SimVoice* chosen = nullptr;
+  for (SimVoice& v : voices_) {
+    if (v.active && v.note == note && (v.held || now < v.freeAt)) chosen = &v;
+  }
+  for (SimVoice& v : voices_) {
+    if (chosen) break;
+    if (!v.active || (!v.held && now >= v.freeAt)) chosen = &v;
+  }
+  for (SimVoice& v : voices_) {
+    if (chosen) break;
+    if (!v.held) chosen = &v;
+  }
+  if (!chosen) {
+    chosen = &voices_[0];
+    for (SimVoice& v : voices_) {
+      if (v.start < chosen->start) chosen = &v;
+    }
+    steals_++;
+  }
+
+  *chosen = SimVoice{true, true, note, now, 0};
+  advertise();
+}
+
+void SimPeerModule::noteOff(uint8_t note) {
+  const uint64_t now = simMicros();
+  bool released = false;
+  for (SimVoice& v : voices_) {
+    if (v.active && v.held && v.note == note) {
+      v.held = false;
+      v.freeAt = now + releaseUs_;
+      released = true;
+    }
+  }
+  if (!released) return;
+
+  // Advertise when the release ends as well
+  advertise();
+  simAt(now + releaseUs_, [this]() { advertise(); });
+}
+
+uint8_t SimPeerModule::heldVoices() {
+  uint8_t held = 0;
+  for (const SimVoice& v : voices_) {
+    if (v.active && v.held) held++;
+  }
+  return held;
+}
+
+void SimPeerModule::onTransmitted(const CanMessage& msg) {
+  // Our Claim has gone, pass the turn east
+  EnumFrame frame;
+  if (msg.id == CAN_ID_SYNC && decodeEnumClaim(msg.data, msg.length, frame)) {
+    enum_.onClaimSent(simMicros() / 1000);
+    renumber();
+    sendPending();
+    return;
+  }
+
+  // Our Sync has gone, follow it with the time it went at
+  if (msg.id == CAN_ID_SYNC && syncPending_) {
+    syncPending_ = false;
+    sentSync_.time = localClock(simMicros());
+    CanMessage time;
+    time.id = CAN_ID_CONTROL;
+    time.length = encodeSyncTime(sentSync_, time.data);
+    queue(time);
+  }
+  sendPending();
+}
+
+// ---------------------------------------------------------------------
+//                      ES_CAN ON THE SIMULATED BUS
+// ---------------------------------------------------------------------
+
+// The firmware's own node: filter banks, two three-deep receive FIFOs and
+// the interrupt callbacks, like the bxCAN peripheral behind ES_CAN.
+namespace {
+
+constexpr uint8_t FILTER_BANKS = 14;
+constexpr uint8_t RX_FIFO_DEPTH = 3;
+
+struct FilterBank {
+  bool active;
+  bool listMode;
+  uint32_t id1;
+  uint32_t id2;
+  uint32_t fifo;
+};
+
+class FirmwareNode : public SimCanNode {
+public:
+  void onReceive(const CanMessage& msg) override;
+  void onTransmitted(const CanMessage& msg) override;
+
+  FilterBank banks[FILTER_BANKS] = {};
+  std::deque<CanMessage> fifos[2];
+  uint32_t overruns[2] = {0, 0};
+  std::mutex fifoLock;
+  void (*rxISR[2])() = {nullptr, nullptr};
+  void (*txISR)() = nullptr;
+
+  // Error state, as the ESR register and ES_CAN's interrupt counts
+  CAN_Health health = {};
+  bool inBusOff = false;  // Seen going bus-off, not yet seen back
+  std::mutex healthLock;
+  void (*sceISR)() = nullptr;
+};
+
+FirmwareNode firmware;
+
+void FirmwareNode::onReceive(const CanMessage& msg) {
+  // The first matching bank decides the FIFO, unmatched frames are dropped
+  int32_t fifo = -1;
+  for (const FilterBank& bank : banks) {
+    if (!bank.active) continue;
+    const bool match = bank.listMode ? (msg.id == bank.id1 || msg.id == bank.id2)
+                                     : ((msg.id & bank.id2) == (bank.id1 & bank.id2));
+    if (match) {
+      fifo = bank.fifo;
+      break;
+    }
+  }
+  if (fifo < 0) return;
+
+  {
+    std::lock_guard<std::mutex> guard(fifoLock);
+    if (fifos[fifo].size() == RX_FIFO_DEPTH) {
+      overruns[fifo]++;
+      return;
+    }
+    fifos[fifo].push_back(msg);
+  }
+  if (rxISR[fifo]) rxISR[fifo]();
+}
+
+void FirmwareNode::onTransmitted(const CanMessage& msg) {
+  (void) msg;
+  if (txISR) txISR();
+}
+
+} // namespace
+
+uint32_t CAN_Init(bool loopback, uint32_t bitRate) {
+  simCan.setBitRate(bitRate);
+  simCan.attach(&firmware, loopback);
+  return 0;
+}
+
+uint32_t CAN_GetBitRate() {
+  return simCan.bitRate();
+}
+
+uint32_t CAN_Start() {
+  return 0;
+}
+
+uint32_t setCANFilterBank(uint32_t filterBank, bool listMode, uint32_t id1, uint32_t id2, uint32_t fifo) {
+  if (filterBank >= FILTER_BANKS || fifo > 1) return 1;
+  firmware.banks[filterBank] = FilterBank{true, listMode, id1, id2, fifo};
+  return 0;
+}
+
+uint32_t setCANFilter(uint32_t filterID, uint32_t maskID, uint32_t filterBank) {
+  return setCANFilterBank(filterBank, false, filterID, maskID, 0);
+}
+
+uint32_t CAN_TX(uint32_t ID, uint8_t data[8], uint8_t length) {
+  CanMessage msg;
+  msg.id = ID;
+  msg.length = length;
+  memcpy(msg.data, data, length);
+  return simCan.transmit(&firmware, msg) ? 0 : 2;
+}
+
+uint32_t CAN_TXFreeMailboxes() {
+  return simCan.freeMailboxes(&firmware);
+}
+
+uint32_t CAN_AbortTX() {
+  simCan.abort(&firmware);
+  return 0;
+}
+
+uint32_t CAN_CheckRXLevel(uint32_t fifo) {
+  std::lock_guard<std::mutex> guard(firmware.fifoLock);
+  return fifo < 2 ? firmware.fifos[fifo].size() : 0;
+}
+
+uint32_t CAN_RX(uint32_t &ID, uint8_t data[8], uint8_t *length, uint32_t fifo) {
+  std::lock_guard<std::mutex> guard(firmware.fifoLock);
+  if (fifo > 1 || firmware.fifos[fifo].empty()) return 1;
+
+  const CanMessage& msg = firmware.fifos[fifo].front();
+  ID = msg.id;
+  memcpy(data, msg.data, msg.length);
+  if (length) *length = msg.length;
+  firmware.fifos[fifo].pop_front();
+  return 0;
+}
+
+uint32_t CAN_GetRXOverruns(uint32_t fifo) {
+  std::lock_guard<std::mutex> guard(firmware.fifoLock);
+  return fifo < 2 ? firmware.overruns[fifo] : 0;
+}
+
+uint32_t CAN_RegisterRX_ISR(void(& callback)()) {
+  firmware.rxISR[0] = &callback;
+  return 0;
+}
+
+uint32_t CAN_RegisterRX1_ISR(void(& callback)()) {
+  firmware.rxISR[1] = &callback;
+  return 0;
+}
+
+uint32_t CAN_RegisterTX_ISR(void(& callback)()) {
+  firmware.txISR = &callback;
+  return 0;
+}
+
+uint32_t CAN_RegisterSCE_ISR(void(* callback)()) {
+  firmware.sceISR = callback;
+  return 0;
+}
+
+// The simulated bus only has errors when simCanBusOff() asks for them
+CAN_Health CAN_GetHealth() {
+  std::lock_guard<std::mutex> guard(firmware.healthLock);
+  if (firmware.inBusOff && !firmware.health.busOff) {
+    firmware.inBusOff = false;
+    firmware.health.recoveries++;
+  }
+  return firmware.health;
+}
+
+void simCanBusOff(uint64_t at) {
+  simAt(at, []() {
+    {
+      std::lock_guard<std::mutex> guard(firmware.healthLock);
+      CAN_Health& h = firmware.health;
+      h.txErrors = 255;
+      h.lastErrorCode = 3;  // Acknowledgment error, as with nobody listening
+      h.errorPassive = true;
+      h.busOff = true;
+      h.warningEvents++;
+      h.passiveEvents++;
+      h.busOffEvents++;
+      firmware.inBusOff = true;
+    }
+    simCan.setBusOff(&firmware, true);
+    if (firmware.sceISR) firmware.sceISR();
+
+    const uint64_t recovery = (128ull * 11 * 1000000 + simCan.bitRate() - 1) / simCan.bitRate();
+    simAt(simMicros() + recovery, []() {
+      {
+        std::lock_guard<std::mutex> guard(firmware.healthLock);
+        CAN_Health& h = firmware.health;
+        h.txErrors = 0;
+        h.rxErrors = 0;
+        h.errorPassive = false;
+        h.busOff = false;
+      }
+      simCan.setBusOff(&firmware, false);
+    });
+  });
+}
@@ -0,0 +1,261 @@
+#include <algorithm>
+#include <mutex>
+#include "hardware.h"
+#include "simClock.h"
+#include "simDac.h"
+#include "simKeyMatrix.h"
+#include "simKnobs.h"
+#include "simJoystick.h"
+
+// Host build of hardware.h: the key matrix, knobs and joystick are scripted,
+// the sample stream runs on the virtual clock and the display keeps its
+// text. I2C transfers take their time on the bus.
+
+// ---------------------------------------------------------------------
+//                        PIN DEFINITIONS
+// ---------------------------------------------------------------------
+
+const int RA0_PIN = D3;
+const int RA1_PIN = D6;
+const int RA2_PIN = D12;
+const int REN_PIN = A5;
+
+const int C0_PIN = A2;
+const int C1_PIN = D9;
+const int C2_PIN = A6;
+const int C3_PIN = D1;
+const int OUT_PIN = D11;
+
+const int OUTL_PIN = A4;
+const int OUTR_PIN = A3;
+
+const int JOYY_PIN = A0;
+const int JOYX_PIN = A1;
+
+const int KNOB_INT_PIN = D0;
+
+const int KNOB_MODE_BIT = 2;
+const int DEN_BIT  = 3;
+const int DRST_BIT = 4;
+const int HKOW_BIT = 5;
+const int HKOE_BIT = 6;
+
+// ---------------------------------------------------------------------
+//                                I2C
+// ---------------------------------------------------------------------
+
+// 400 kHz, nine clocks a byte with the acknowledge
+constexpr uint32_t I2C_BYTE_NS = 22500;
+
+// u8g2 splits display data into transactions of at most this many bytes
+constexpr uint32_t I2C_DISPLAY_CHUNK = 24;
+
+static SemaphoreHandle_t displayBusMutex = NULL;
+
+// One transaction: start, address and `bytes` more, stop
+static void i2cTransaction(uint32_t bytes) {
+  simSleep(((bytes + 1) * I2C_BYTE_NS + 999) / 1000);
+}
+
+void shareDisplayBus(SemaphoreHandle_t mutex) {
+  displayBusMutex = mutex;
+}
+
+// ---------------------------------------------------------------------
+//                              DISPLAY
+// ---------------------------------------------------------------------
+
+U8G2_SSD1305_128X32_ADAFRUIT_F_HW_I2C u8g2(U8G2_R0);
+
+const uint8_t u8g2_font_ncenB08_tr[] = {0};
+
+static std::mutex displayLock;
+
+void U8G2_SSD1305_128X32_ADAFRUIT_F_HW_I2C::sendBuffer() {
+  updateDisplayArea(0, 0, TILE_WIDTH, TILE_HEIGHT);
+}
+
+// Each tile row is a command transaction setting the page and column, then
+// the data in short transactions, each holding the bus mutex once shared
+void U8G2_SSD1305_128X32_ADAFRUIT_F_HW_I2C::updateDisplayArea(uint8_t tx, uint8_t ty, uint8_t tw, uint8_t th) {
+  (void) tx;
+  (void) ty;
+  for (uint8_t row = 0; row < th; row++) {
+    uint32_t commands = 4;
+    uint32_t data = tw * 8;
+    while (commands || data) {
+      const uint32_t chunk = commands ? commands : std::min(data, I2C_DISPLAY_CHUNK);
+      if (displayBusMutex) xSemaphoreTake(displayBusMutex, portMAX_DELAY);
+      i2cTransaction(1 + chunk);
+      if (displayBusMutex) xSemaphoreGive(displayBusMutex);
+      if (commands) commands = 0;
+      else data -= chunk;
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(displayLock);
+  sent_ = text_;
+  frames_++;
+  tiles_ += tw * th;
+}
+
+// The glyph cell gets the character code in every column, so changing a
+// character changes the tile it lands in
+size_t U8G2_SSD1305_128X32_ADAFRUIT_F_HW_I2C::write(uint8_t c) {
+  text_ += (char) c;
+  const int row = (y_ - 1) / 8;
+  if (row >= 0 && row < TILE_HEIGHT) {
+    for (int i = 0; i < GLYPH_WIDTH; i++) {
+      if (x_ + i >= 0 && x_ + i < TILE_WIDTH * 8) buffer_[row * TILE_WIDTH * 8 + x_ + i] = c;
+    }
+  }
+  x_ += GLYPH_WIDTH;
+  return 1;
+}
+
+std::string U8G2_SSD1305_128X32_ADAFRUIT_F_HW_I2C::lastFrame() const {
+  std::lock_guard<std::mutex> guard(displayLock);
+  return sent_;
+}
+
+// ---------------------------------------------------------------------
+//                    INITIALIZATION AND KEY MATRIX
+// ---------------------------------------------------------------------
+
+void initHardware() {
+}
+
+void initDisplay() {
+  setOutMuxBit(DRST_BIT, HIGH);
+  u8g2.begin();
+  setOutMuxBit(DEN_BIT, HIGH);
+}
+
+// Peer modules have IDs of their own
+uint32_t moduleUid() {
+  return 0x5eed0001;
+}
+
+void setOutMuxBit(const uint8_t bitIdx, const bool value) {
+  simKeys.select(bitIdx, value);
+}
+
+// ---------------------------------------------------------------------
+//                            KNOB EXPANDER
+// ---------------------------------------------------------------------
+
+bool initKnobExpander() {
+  return simKnobs.present();
+}
+
+// Address and register, then a repeated start, address and the data byte
+bool readKnobExpander(uint8_t& pins) {
+  if (!simKnobs.present()) return false;
+  i2cTransaction(1);
+  if (simKnobs.readFails()) return false;
+  i2cTransaction(0);
+  pins = simKnobs.read();
+  simSleep((I2C_BYTE_NS + 999) / 1000);
+  return true;
+}
+
+void attachKnobInterrupt(void (*isr)()) {
+  simKnobs.attach(isr);
+}
+
+bool knobInterruptPending() {
+  return simKnobs.interruptActive();
+}
+
+void setRow(uint8_t rowIdx, bool outBit) {
+  simKeys.select(rowIdx, outBit);
+}
+
+std::bitset<4> readCols() {
+  return std::bitset<4>(readColBits());
+}
+
+uint8_t readColBits() {
+  return simKeys.read();
+}
+
+// ---------------------------------------------------------------------
+//                      AUDIO SAMPLE STREAM
+// ---------------------------------------------------------------------
+
+// The stream plays one half every halfSize / sampleRate seconds. Event times
+// are worked out from the sample count, so they don't drift.
+namespace {
+
+const uint16_t* streamBuffer = nullptr;
+uint32_t streamHalfSize = 0;
+uint32_t streamRate = 0;
+uint64_t streamStart = 0;
+uint64_t streamHalves = 0;
+uint32_t streamGeneration = 0;
+SampleHalfCallback streamCallback = nullptr;
+SimDacObserver dacObserver;
+
+uint64_t halfStartTime(uint64_t halves) {
+  return streamStart + halves * streamHalfSize * 1000000 / streamRate;
+}
+
+void scheduleHalf(uint32_t generation) {
+  simAt(halfStartTime(streamHalves + 1), [generation]() {
+    if (generation != streamGeneration) return;
+
+    // The half that was playing is done and the other one starts
+    const uint8_t done = streamHalves % 2;
+    streamHalves++;
+    if (dacObserver) {
+      dacObserver(streamBuffer + (1 - done) * streamHalfSize, streamHalfSize, simMicros());
+    }
+    if (streamCallback) streamCallback(done);
+    scheduleHalf(generation);
+  });
+}
+
+} // namespace
+
+bool startSampleStream(const uint16_t* buffer, uint32_t halfSize, uint32_t sampleRate,
+                       SampleHalfCallback onHalfSent) {
+  streamBuffer = buffer;
+  streamHalfSize = halfSize;
+  streamRate = sampleRate;
+  streamCallback = onHalfSent;
+  streamStart = simMicros();
+  streamHalves = 0;
+
+  if (dacObserver) dacObserver(streamBuffer, streamHalfSize, streamStart);
+  scheduleHalf(++streamGeneration);
+  return true;
+}
+
+void stopSampleStream() {
+  streamGeneration++;
+}
+
+uint32_t sampleClock() {
+  return (simMicros() - streamStart) * streamRate / 1000000;
+}
+
+void simSetDacObserver(SimDacObserver fn) {
+  dacObserver = fn;
+}
+
+uint64_t simDacSamples() {
+  return streamHalves * streamHalfSize;
+}
+
+// ---------------------------------------------------------------------
+//                           JOYSTICK ADC
+// ---------------------------------------------------------------------
+
+bool startJoystickSampling() {
+  simJoystick.start();
+  return true;
+}
+
+bool readJoystick(uint16_t& x, uint16_t& y) {
+  return simJoystick.read(x, y);
+}
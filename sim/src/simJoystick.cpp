@@ -0,0 +1,56 @@
+#include "simJoystick.h"
+#include "simClock.h"
+#include "hardware.h"
+
+SimJoystick simJoystick;
+
+// Raw 12-bit readings, a little off the midpoint like a real stick
+static const uint16_t REST_X = 2071;
+static const uint16_t REST_Y = 2030;
+
+// Each pair of oversampled conversions takes about 1 ms
+static const uint64_t PAIR_US = 1000;
+
+SimJoystick::SimJoystick()
+    : x_(REST_X), y_(REST_Y), noise_(0), seed_(1), started_(false), filledAt_(0) {}
+
+void SimJoystick::start() {
+  std::lock_guard<std::mutex> guard(lock_);
+  started_ = true;
+  filledAt_ = simMicros() + JOYSTICK_DMA_PAIRS * PAIR_US;
+}
+
+void SimJoystick::scheduleMove(uint64_t at, uint16_t x, uint16_t y) {
+  simAt(at, [this, x, y]() {
+    std::lock_guard<std::mutex> guard(lock_);
+    x_ = x;
+    y_ = y;
+  });
+}
+
+int32_t SimJoystick::noise() {
+  if (!noise_) return 0;
+  seed_ = seed_ * 1664525 + 1013904223;
+  return (int32_t) ((seed_ >> 8) % (2 * noise_ + 1)) - noise_;
+}
+
+static uint16_t clampReading(int32_t value) {
+  return value < 0 ? 0 : value > 4095 ? 4095 : value;
+}
+
+bool SimJoystick::read(uint16_t& x, uint16_t& y) {
+  std::lock_guard<std::mutex> guard(lock_);
+  if (!started_ || simMicros() < filledAt_) {
+    x = y = 2048;
+    return false;
+  }
+
+  int32_t sumX = 0, sumY = 0;
+  for (uint8_t i = 0; i < JOYSTICK_DMA_PAIRS; i++) {
+    sumX += clampReading(x_ + noise());
+    sumY += clampReading(y_ + noise());
+  }
+  x = sumX / JOYSTICK_DMA_PAIRS;
+  y = sumY / JOYSTICK_DMA_PAIRS;
+  return true;
+}
@@ -0,0 +1,43 @@
+#include "simKeyMatrix.h"
+#include "simClock.h"
+
+SimKeyMatrix simKeys;
+
+SimKeyMatrix::SimKeyMatrix() : row_(0), outBits_(0) {
+  // Every switch open, knob contacts high, no neighbours detected
+  for (uint8_t row = 0; row < SIM_MATRIX_ROWS; row++) {
+    cols_[row].store(0x0f, std::memory_order_relaxed);
+  }
+}
+
+void SimKeyMatrix::setInput(uint8_t row, uint8_t col, bool high) {
+  const uint8_t mask = 1 << col;
+  if (high) cols_[row].fetch_or(mask, std::memory_order_relaxed);
+  else cols_[row].fetch_and(~mask, std::memory_order_relaxed);
+}
+
+void SimKeyMatrix::setKey(uint8_t key, bool pressed) {
+  setInput(key / 4, key % 4, !pressed);
+}
+
+void SimKeyMatrix::scheduleKey(uint64_t at, uint8_t key, bool pressed,
+                               uint8_t bounces, uint32_t bounceUs) {
+  // Chatter alternates the contact, starting with the new state
+  for (uint8_t i = 0; i < bounces; i++) {
+    const bool level = (i % 2) ? !pressed : pressed;
+    simAt(at + i * bounceUs, [this, key, level]() { setKey(key, level); });
+  }
+  simAt(at + bounces * bounceUs, [this, key, pressed]() { setKey(key, pressed); });
+}
+
+void SimKeyMatrix::select(uint8_t row, bool outBit) {
+  row_.store(row, std::memory_order_relaxed);
+
+  const uint8_t mask = 1 << row;
+  if (outBit) outBits_.fetch_or(mask, std::memory_order_relaxed);
+  else outBits_.fetch_and(~mask, std::memory_order_relaxed);
+}
+
+uint8_t SimKeyMatrix::read() const {
+  return cols_[row_.load(std::memory_order_relaxed)].load(std::memory_order_relaxed);
+}
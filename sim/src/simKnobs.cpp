@@ -0,0 +1,92 @@
+#include "simKnobs.h"
+#include "simClock.h"
+#include "simKeyMatrix.h"
+
+SimKnobExpander simKnobs;
+
+// A/B levels (B << 1 | A) in the order a knob turning up passes through them
+static const uint8_t GRAY_CYCLE[4] = {0b00, 0b01, 0b11, 0b10};
+
+SimKnobExpander::SimKnobExpander()
+    : present_(true), pins_(0xff), latched_(0xff), latchMask_(0), failures_(0), isr_(nullptr) {
+  // Every knob resting with both contacts open
+  for (uint8_t& phase : phase_) phase = 2;
+}
+
+void SimKnobExpander::scheduleTurn(uint64_t at, uint8_t knob, int16_t steps, uint32_t stepUs) {
+  const int8_t direction = steps < 0 ? -1 : 1;
+  const int16_t count = steps < 0 ? -steps : steps;
+  for (int16_t i = 0; i < count; i++) {
+    simAt(at + (uint64_t) i * stepUs, [this, knob, direction]() { step(knob, direction); });
+  }
+}
+
+void SimKnobExpander::scheduleReadFailure(uint64_t at) {
+  simAt(at, [this]() {
+    std::lock_guard<std::mutex> guard(lock_);
+    failures_++;
+  });
+}
+
+bool SimKnobExpander::readFails() {
+  std::lock_guard<std::mutex> guard(lock_);
+  if (!failures_) return false;
+  failures_--;
+  return true;
+}
+
+void SimKnobExpander::step(uint8_t knob, int8_t direction) {
+  std::unique_lock<std::mutex> guard(lock_);
+  phase_[knob] = (phase_[knob] + 4 + direction) % 4;
+
+  const uint8_t shift = 2 * (3 - knob);
+  const uint8_t pins = (pins_ & ~(0b11 << shift)) | GRAY_CYCLE[phase_[knob]] << shift;
+  const uint8_t changed = pins ^ pins_;
+  pins_ = pins;
+
+  // The same contacts on the key matrix rows
+  for (uint8_t bit = 0; bit < 8; bit++) {
+    simKeys.setInput(3 + bit / 4, bit % 4, (pins >> bit) & 1);
+  }
+
+  const bool wasActive = latchMask_ != 0;
+  latch(changed);
+  void (*isr)() = isr_;
+  guard.unlock();
+
+  // The interrupt line falls on the first unread change
+  if (!wasActive && present_ && isr) isr();
+}
+
+// Holds the new value of each changed pin that isn't already latched
+void SimKnobExpander::latch(uint8_t changed) {
+  const uint8_t fresh = changed & ~latchMask_;
+  latched_ = (latched_ & ~fresh) | (pins_ & fresh);
+  latchMask_ |= fresh;
+}
+
+void SimKnobExpander::attach(void (*isr)()) {
+  std::lock_guard<std::mutex> guard(lock_);
+  isr_ = isr;
+}
+
+uint8_t SimKnobExpander::read() {
+  std::unique_lock<std::mutex> guard(lock_);
+  const uint8_t value = (pins_ & ~latchMask_) | (latched_ & latchMask_);
+
+  // Pins that moved on since they were latched differ from what was just
+  // read, so they count as a new change and the line falls again
+  latchMask_ = 0;
+  latch(pins_ ^ value);
+  void (*isr)() = isr_;
+  const bool active = latchMask_ != 0;
+  guard.unlock();
+
+  if (active && isr) simAt(simMicros(), isr);
+  return value;
+}
+
+bool SimKnobExpander::interruptActive() {
+  std::lock_guard<std::mutex> guard(lock_);
+  return latchMask_ != 0;
+}
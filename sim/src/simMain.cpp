@@ -0,0 +1,925 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "globals.h"
+#include "audio.h"
+#include "synth.h"
+#include "hardware.h"
+#include "dacDmaSink.h"
+#include "dspKernels.h"
+#include <ES_CAN.h>
+#include "canTxScheduler.h"
+#include "can_tx_task.h"
+#include "decodeTask.h"
+#include "display.h"
+#include "knobInput.h"
+#include "midi.h"
+#include "profiler.h"
+#include "wavFileSink.h"
+#include "simCanBus.h"
+#include "simClock.h"
+#include "simDac.h"
+#include "simKeyMatrix.h"
+#include "simKnobs.h"
+#include "simJoystick.h"
+
+// The unit tests under test/ link the same sources with their own main()
+#ifndef PIO_UNIT_TESTING
+
+// Runs the firmware's own setup() and tasks against the simulated key matrix,
+// knobs, CAN bus and sample clock, plays a script of key presses and knob
+// turns on this module and presses on peer modules, and reports throughput
+// and end-to-end latency. Exits with 1 if any press went missing, a slow
+// knob turn was misread, the joystick bent a note it shouldn't have, a peer
+// lost the stack clock, the stack was numbered wrongly, MIDI was parsed
+// wrongly, a bus-off went unnoticed, local keys took 2 ms or more on
+// average to sound or any queue lost data, so CI can gate on it.
+
+// Defined in main.cpp
+void setup();
+
+// Each script cycle presses a key here, then one on a peer module
+constexpr uint64_t CYCLE_US = 500000;
+constexpr uint64_t PEER_OFFSET_US = 250000;
+constexpr uint64_t HOLD_US = 100000;
+constexpr uint64_t SCRIPT_START_US = 100000;
+
+// Every fourth cycle plays a chord
+constexpr uint8_t CHORD_EVERY = 4;
+constexpr uint8_t CHORD_KEYS = 4;
+
+// Switch chatter on every local press and release
+constexpr uint8_t BOUNCES = 3;
+constexpr uint32_t BOUNCE_US = 300;
+
+// Every knob cycle turns the resonance knob slowly, up and down on alternate
+// cycles, and flicks the release knob up and back faster than a display
+// transfer. The cutoff stays open so the sound checks still hear the notes.
+constexpr uint64_t KNOB_CYCLE_US = 1000000;
+constexpr uint64_t KNOB_SLOW_OFFSET_US = 370000;
+constexpr uint64_t KNOB_FAST_OFFSET_US = 700100;
+constexpr int16_t KNOB_SLOW_STEPS = 4;
+constexpr uint32_t KNOB_SLOW_STEP_US = 40000;
+constexpr int16_t KNOB_FAST_STEPS = 4;
+constexpr uint32_t KNOB_FAST_STEP_US = 100;
+
+// One knob cycle's slow turn starts with the expander failing a read, which
+// leaves its interrupt line low with no edge to come
+constexpr uint32_t KNOB_FAIL_CYCLE = 1;
+
+// The joystick rests with ADC noise, is held fully right for a while and
+// later fully up, then let go each time
+constexpr uint16_t JOY_NOISE = 40;
+constexpr uint16_t JOY_REST_X = 2071;
+constexpr uint16_t JOY_REST_Y = 2030;
+constexpr uint16_t JOY_PUSH = 1900;
+constexpr uint64_t JOY_BEND_AT_US = 2050000;
+constexpr uint64_t JOY_VIBRATO_AT_US = 3050000;
+constexpr uint64_t JOY_HOLD_US = 400000;
+constexpr uint64_t JOY_SETTLE_US = 150000;
+constexpr uint64_t JOY_PROBE_US = 1000;
+
+// One script cycle holds a cluster instead: this module presses
+// CLUSTER_KEYS keys, then each peer does the same CLUSTER_STAGGER_US later
+// than the one before, filling every voice in the stack. The first two
+// peers hold back their last key, leaving two voices free, and press it
+// together at CLUSTER_CONTEST_US, so both may pick the same module. It must
+// hand one on rather than steal. One more key on this module then has to
+// steal, once.
+constexpr uint32_t CLUSTER_CYCLE = 7;
+constexpr uint8_t CLUSTER_KEYS = MAX_VOICES;
+constexpr uint64_t CLUSTER_STAGGER_US = 20000;
+constexpr uint64_t CLUSTER_HOLD_US = 200000;
+constexpr uint64_t CLUSTER_CONTEST_US = 120000;
+constexpr uint64_t CLUSTER_STEAL_US = 150000;
+
+// Built with MIDI_SERIAL, every MIDI_EVERY script cycles from MIDI_FIRST
+// plays notes over MIDI instead of on the keys and lets them go HOLD_US
+// later. Chords, as note ons sharing one running status, alternate with
+// single notes a semitone higher each time. Each arrives MIDI_STAGGER_US
+// later than the one before, wrapping at MIDI_STAGGER_SPAN_US, so they land
+// at different points of the input poll and the audio block.
+constexpr uint32_t MIDI_FIRST = 1;
+constexpr uint32_t MIDI_EVERY = 4;
+constexpr uint32_t MIDI_STAGGER_US = 373;
+constexpr uint32_t MIDI_STAGGER_SPAN_US = 3000;
+constexpr uint8_t MIDI_CHORD[] = {60, 64, 67, 72};
+
+// One script cycle starts with this module going bus-off BUS_OFF_LEAD_US
+// before its press, so the key diff waits out the recovery in a mailbox
+constexpr uint32_t BUS_OFF_CYCLE = 2;
+constexpr uint64_t BUS_OFF_LEAD_US = 2000;
+
+// Peer modules release in the firmware's default time
+constexpr uint32_t PEER_RELEASE_US = 50000;
+
+// Peers sit east of this module and power up a little after it, each
+// PEER_BOOT_US after the one before. The handshake lines are copied to this
+// module's inputs every HANDSHAKE_COPY_US.
+constexpr uint64_t PEER_BOOT_US = 3000;
+constexpr uint64_t HANDSHAKE_COPY_US = 500;
+
+// Peer sample clocks run this far off the firmware's, in turn, and start
+// from far apart values, the first close to wrapping. Their receive stamps
+// are up to PEER_STAMP_JITTER_US late.
+constexpr int32_t PEER_CLOCK_PPM[] = {80, -120, 45, -60};
+constexpr uint32_t PEER_CLOCK_START[] = {0xffff0000, 1234567, 0x80000000, 42};
+constexpr uint32_t PEER_STAMP_JITTER_US = 20;
+
+// A peer's stack clock is compared with the firmware's every
+// SYNC_PROBE_US once SYNC_SETTLE_US has passed, and must stay within
+// SYNC_MAX_ERROR samples
+constexpr uint64_t SYNC_PROBE_US = 10000;
+constexpr uint64_t SYNC_SETTLE_US = 2000000;
+constexpr int32_t SYNC_MAX_ERROR = 2;
+
+// A DAC sample this far from the midpoint counts as sound. The output is
+// rounded, so the filter's leftovers after a note sit on the midpoint.
+constexpr uint16_t SOUND_THRESHOLD = 1;
+
+// Local key -> DAC must average under the key scanner's 2 ms goal. A press
+// whose first read lands in its chatter waits another scan, and the first
+// DAC step trails the note's first sample by the attack, so the worst one
+// is only held under LOCAL_SOUND_MAX_US.
+constexpr uint64_t LOCAL_SOUND_MEAN_US = 2000;
+constexpr uint64_t LOCAL_SOUND_MAX_US = 2500;
+
+constexpr uint32_t RENDER_BENCH_BLOCKS = 20000;
+
+// Frames passed through a ring and a kernel queue, RING_BENCH_BATCH at a
+// time
+constexpr uint32_t RING_BENCH_ITEMS = 1000000;
+constexpr uint32_t RING_BENCH_BATCH = 16;
+
+struct Options {
+  uint32_t seconds = 10;
+  uint8_t peers = 2;
+  const char* wavPath = nullptr;
+  bool serial = false;
+  bool v1 = false;
+};
+
+// ---------------------------------------------------------------------
+//                             MEASUREMENT
+// ---------------------------------------------------------------------
+
+class LatencyStats {
+public:
+  void add(uint64_t us) { samples_.push_back(us); }
+  size_t count() const { return samples_.size(); }
+  uint64_t max() const { return samples_.empty() ? 0 : *std::max_element(samples_.begin(), samples_.end()); }
+  uint64_t mean() const {
+    uint64_t sum = 0;
+    for (uint64_t s : samples_) sum += s;
+    return samples_.empty() ? 0 : sum / samples_.size();
+  }
+
+  void print(const char* name, size_t expected) {
+    std::sort(samples_.begin(), samples_.end());
+    if (samples_.empty()) {
+      printf("  %-24s %5zu/%-5zu\n", name, samples_.size(), expected);
+      return;
+    }
+    uint64_t sum = 0;
+    for (uint64_t s : samples_) sum += s;
+    const size_t p99 = std::min(samples_.size() - 1, samples_.size() * 99 / 100);
+    printf("  %-24s %5zu/%-5zu %8llu %8llu %8llu %8llu\n", name, samples_.size(), expected,
+           (unsigned long long) samples_.front(),
+           (unsigned long long) (sum / samples_.size()),
+           (unsigned long long) samples_[p99],
+           (unsigned long long) samples_.back());
+  }
+
+private:
+  std::vector<uint64_t> samples_;
+};
+
+// A press waiting to be seen at some point downstream
+struct Probe {
+  uint64_t at;
+  uint16_t keys;
+  bool done;
+};
+
+// Matches the oldest outstanding probe that started by `now`
+static Probe* nextProbe(std::vector<Probe>& probes, uint64_t now) {
+  for (Probe& p : probes) {
+    if (!p.done && p.at <= now) return &p;
+  }
+  return nullptr;
+}
+
+// ---------------------------------------------------------------------
+//                          RENDER THROUGHPUT
+// ---------------------------------------------------------------------
+
+// Host time stamp counter, for cycle counts. Hosts without one count
+// nanoseconds instead.
+static uint64_t hostCycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Times `blocks` calls of `render`, one block each. Returns host cycles per
+// sample, and the time per block in `perBlockUs`.
+template <typename Render>
+static double timeBlocks(uint32_t blocks, double& perBlockUs, Render render) {
+  const auto start = std::chrono::steady_clock::now();
+  const uint64_t startCycles = hostCycles();
+  for (uint32_t i = 0; i < blocks; i++) render();
+  const uint64_t cycles = hostCycles() - startCycles;
+  const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+
+  perBlockUs = elapsed.count() / blocks;
+  return (double) cycles / ((double) blocks * AUDIO_BLOCK_SIZE);
+}
+
+// Wall-clock time of the host's render path. This is the host CPU, not the
+// board, but it tracks changes to the DSP code. The voice mix is timed on
+// its own from one voice sounding up to MAX_VOICES, then the filter alone
+// in each mode on the full mix, then the whole of renderBlock().
+static void benchRender() {
+  static VoicePool pool;
+  static Filter benchFilter;
+  static int16_t mix[AUDIO_BLOCK_SIZE];
+  static int16_t filtered[AUDIO_BLOCK_SIZE];
+  uint16_t block[AUDIO_BLOCK_SIZE];
+  const double blockPeriod = 1e6 * AUDIO_BLOCK_SIZE / SAMPLE_RATE;
+  double perBlock;
+
+  char label[32];
+  auto report = [&](const char* name, double cycles) {
+    printf("  %-26s %8.2f %12.0f %14.1f %12.0f\n", name, perBlock, cycles * AUDIO_BLOCK_SIZE,
+           cycles, blockPeriod / perBlock);
+  };
+
+  printf("Render throughput (host)   us/block cycles/block  cycles/sample  x real time\n");
+  for (uint8_t v = 0; v < MAX_VOICES; v++) {
+    const uint8_t note = midiNote(4, v);
+    pool.noteOn(note, noteStepSize(note, Temperament::Equal));
+    const double cycles = timeBlocks(RENDER_BENCH_BLOCKS, perBlock, [&]() {
+      pool.mixBlock(mix, AUDIO_BLOCK_SIZE);
+    });
+    snprintf(label, sizeof(label), "voice mix, %u voice%s", v + 1, v ? "s" : "");
+    report(label, cycles);
+  }
+
+  // The filter on a copy of the last mix, so each block has the same input
+  static const char* const modes[] = {"filter low pass", "filter high pass", "filter band pass"};
+  const FilterMode filterModes[] = {FilterMode::LowPass, FilterMode::HighPass, FilterMode::BandPass};
+  benchFilter.setResonance(FILTER_STEPS / 2);
+  benchFilter.setCutoff(FILTER_STEPS / 2);
+  for (uint8_t m = 0; m < 3; m++) {
+    benchFilter.setMode(filterModes[m]);
+    const double cycles = timeBlocks(RENDER_BENCH_BLOCKS, perBlock, [&]() {
+      memcpy(filtered, mix, sizeof(filtered));
+      benchFilter.process(filtered, AUDIO_BLOCK_SIZE);
+    });
+    report(modes[m], cycles);
+  }
+
+  benchFilter.setMode(FilterMode::LowPass);
+  const double cycles = timeBlocks(RENDER_BENCH_BLOCKS, perBlock, [&]() {
+    renderBlock(pool, benchFilter, MAX_VOLUME, block, AUDIO_BLOCK_SIZE);
+  });
+  snprintf(label, sizeof(label), "renderBlock, %u voices", MAX_VOICES);
+  report(label, cycles);
+  printf("\n");
+}
+
+// A CAN frame's hop from producer to consumer through SpscRing, against
+// xQueueSend/xQueueReceive on the host kernel stand-in, which copies under
+// a lock like the board's. Neither side ever waits.
+static void benchRings() {
+  static CanRing ring;
+  QueueHandle_t queue = xQueueCreate(CanRing::capacity(), sizeof(CanMessage));
+  CanMessage msg = {}, out = {};
+  uint32_t check = 0;
+
+  auto timeHops = [&](std::function<void()> batch) {
+    const auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < RING_BENCH_ITEMS / RING_BENCH_BATCH; i++) batch();
+    const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / RING_BENCH_ITEMS;
+  };
+
+  const double ringNs = timeHops([&]() {
+    for (uint32_t i = 0; i < RING_BENCH_BATCH; i++) {
+      msg.data[0] = i;
+      ring.push(msg, false);
+    }
+    while (ring.pop(out)) check += out.data[0];
+  });
+  const double queueNs = timeHops([&]() {
+    for (uint32_t i = 0; i < RING_BENCH_BATCH; i++) {
+      msg.data[0] = i;
+      xQueueSend(queue, &msg, 0);
+    }
+    while (xQueueReceive(queue, &out, 0) == pdPASS) check += out.data[0];
+  });
+
+  const uint32_t expected = 2 * RING_BENCH_ITEMS / RING_BENCH_BATCH * (RING_BENCH_BATCH * (RING_BENCH_BATCH - 1) / 2);
+  printf("Event hop (host)           ns/frame\n");
+  printf("  SpscRing                 %8.1f\n", ringNs);
+  printf("  xQueueSend/xQueueReceive %8.1f  %.1fx the ring%s\n\n", queueNs, queueNs / ringNs,
+         check == expected ? "" : ", frames lost");
+}
+
+// ---------------------------------------------------------------------
+//                          MIDI PARSER THROUGHPUT
+// ---------------------------------------------------------------------
+
+// A long stream of random channel messages, mostly on running status, with
+// real-time bytes inside them and system exclusive and system common
+// messages between them. test/test_midi checks the same kind of stream
+// comes back as it was made.
+constexpr uint32_t MIDI_STREAM_MESSAGES = 300000;
+constexpr uint32_t MIDI_BENCH_PASSES = 10;
+
+static std::vector<uint8_t> midiStream() {
+  static const uint8_t TYPES[] = {MIDI_NOTE_ON, MIDI_NOTE_ON, MIDI_NOTE_ON, MIDI_NOTE_OFF,
+                                  MIDI_CONTROL_CHANGE, MIDI_PROGRAM_CHANGE, MIDI_CHANNEL_PRESSURE, MIDI_PITCH_BEND};
+  std::vector<uint8_t> bytes;
+  uint32_t noise = 1;
+  auto next = [&](uint32_t range) {
+    noise = noise * 1103515245 + 12345;
+    return (noise >> 8) % range;
+  };
+  uint8_t running = 0;
+
+  for (uint32_t i = 0; i < MIDI_STREAM_MESSAGES; i++) {
+    const uint32_t roll = next(100);
+    if (roll < 2) {
+      bytes.push_back(MIDI_SYSEX);
+      for (uint32_t n = next(12); n > 0; n--) bytes.push_back(next(0x80));
+      bytes.push_back(MIDI_SYSEX_END);
+      running = 0;
+    } else if (roll < 3) {
+      bytes.push_back(0xf2);
+      bytes.push_back(next(0x80));
+      bytes.push_back(next(0x80));
+      running = 0;
+    }
+
+    const uint8_t status = TYPES[next(8)] | (next(8) ? 0 : next(16));
+    const MidiMessage msg = {status, (uint8_t) next(0x80),
+                             (uint8_t) (midiDataLength(status) == 2 ? next(0x80) : 0)};
+    uint8_t encoded[3];
+    const uint8_t n = encodeMidi(msg, running, encoded);
+    const uint32_t clockAt = next(20) == 0 ? next(n) : n;
+    for (uint8_t b = 0; b < n; b++) {
+      if (b == clockAt) bytes.push_back(MIDI_REALTIME);
+      bytes.push_back(encoded[b]);
+    }
+  }
+  return bytes;
+}
+
+// The parser in the task's batch size, in wall-clock time on the host
+static void benchMidi() {
+  const std::vector<uint8_t> stream = midiStream();
+  MidiMessage out[MIDI_BATCH_BYTES];
+  uint32_t messages = 0;
+  const auto start = std::chrono::steady_clock::now();
+  for (uint32_t pass = 0; pass < MIDI_BENCH_PASSES; pass++) {
+    MidiParser bench;
+    for (size_t i = 0; i < stream.size(); i += MIDI_BATCH_BYTES) {
+      messages += bench.parse(&stream[i], std::min<size_t>(MIDI_BATCH_BYTES, stream.size() - i), out);
+    }
+  }
+  const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+  const double perByte = elapsed.count() / ((double) stream.size() * MIDI_BENCH_PASSES);
+  const double lineBytes = MIDI_SERIAL_BAUD / 10.0;
+  printf("MIDI parser (host)\n");
+  printf("  %u bytes, %u messages: %8.2f ns/byte, %6.1f MB/s, %8.0fx the line at %u baud\n\n",
+         (unsigned) stream.size(), messages / MIDI_BENCH_PASSES, perByte, 1000.0 / perByte,
+         1e9 / perByte / lineBytes, MIDI_SERIAL_BAUD);
+}
+
+// ---------------------------------------------------------------------
+//                                MAIN
+// ---------------------------------------------------------------------
+
+static Options parseOptions(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--seconds") && i + 1 < argc) {
+      options.seconds = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--peers") && i + 1 < argc) {
+      options.peers = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--wav") && i + 1 < argc) {
+      options.wavPath = argv[++i];
+    } else if (!strcmp(argv[i], "--serial")) {
+      options.serial = true;
+    } else if (!strcmp(argv[i], "--v1")) {
+      options.v1 = true;
+    } else {
+      fprintf(stderr, "usage: %s [--seconds n] [--peers n] [--wav file] [--serial] [--v1]\n", argv[0]);
+      simExit(2);
+    }
+  }
+  if (options.peers < 1) options.peers = 1;
+  return options;
+}
+
+int main(int argc, char** argv) {
+  const Options options = parseOptions(argc, argv);
+  simSerialEcho(options.serial);
+
+  printf("StackSynth host simulation: %u s, %u peer modules, CAN %u bit/s, %s knobs\n\n",
+         options.seconds, options.peers, CAN_BIT_RATE, options.v1 ? "V1 matrix" : "V2 expander");
+  benchRender();
+  benchRings();
+  benchMidi();
+#ifdef PROFILE_ENABLED
+  // The firmware's own kernel table. The host runs the SIMD kernels on
+  // stand-in intrinsics, so only the board's speedups mean anything.
+  printf("DSP kernels against portable (host)\n");
+  simSerialEcho(true);
+  benchKernels(Serial);
+  simSerialEcho(options.serial);
+  printf("\n");
+#endif
+
+  // Peer modules sit east of this one, so the stack numbers them on the
+  // octaves above it and this module is the clock master
+  const uint8_t clockKinds = sizeof(PEER_CLOCK_PPM) / sizeof(PEER_CLOCK_PPM[0]);
+  std::vector<std::unique_ptr<SimPeerModule>> peers;
+  for (uint8_t i = 0; i < options.peers; i++) {
+    peers.emplace_back(new SimPeerModule(simCan, moduleOctave + 1 + i));
+    peers.back()->enableSynth(MAX_VOICES, PEER_RELEASE_US);
+    peers.back()->enableClock(PEER_CLOCK_PPM[i % clockKinds], PEER_CLOCK_START[i % clockKinds],
+                              PEER_STAMP_JITTER_US);
+  }
+  for (size_t i = 0; i < peers.size(); i++) {
+    auto westIn = [&peers, i]() {
+      return i == 0 ? simKeys.outBit(HKOE_BIT) : peers[i - 1]->eastOutput();
+    };
+    auto eastIn = [&peers, i]() {
+      return i + 1 < peers.size() && peers[i + 1]->westOutput();
+    };
+    peers[i]->enableEnumeration(0x5eed0100 + i, (i + 1) * PEER_BOOT_US, westIn, eastIn);
+  }
+
+  std::unique_ptr<WavFileSink> wav;
+  if (options.wavPath) {
+    wav.reset(new WavFileSink(options.wavPath));
+    if (!wav->begin(SAMPLE_RATE)) {
+      fprintf(stderr, "Can't open %s\n", options.wavPath);
+      simExit(2);
+    }
+  }
+
+  // Script the presses before anything runs
+  std::vector<Probe> wireProbes, localSound, peerSound;
+  const uint64_t end = (uint64_t) options.seconds * 1000000;
+  uint32_t chords = 0;
+
+  const uint64_t clusterAt = SCRIPT_START_US + CLUSTER_CYCLE * CYCLE_US;
+  const bool clusterScripted = clusterAt + CYCLE_US <= end;
+  const uint8_t clusterNotes = CLUSTER_KEYS * (1 + options.peers);
+  uint8_t clusterHeld = 0;
+  uint32_t clusterSteals = 0;
+
+  // Held voices taken for a new note, across the stack
+  auto voiceSteals = [&]() {
+    uint32_t steals = voices.steals();
+    for (auto& peer : peers) steals += peer->steals();
+    return steals;
+  };
+  const bool busOffScripted = SCRIPT_START_US + (BUS_OFF_CYCLE + 1) * CYCLE_US <= end;
+
+#ifdef MIDI_SERIAL
+  // Every local press and release also goes out as MIDI
+  std::vector<Probe> midiSound, midiOutProbes;
+  const uint32_t byteUs = (10 * 1000000 + MIDI_SERIAL_BAUD - 1) / MIDI_SERIAL_BAUD;
+  uint32_t midiEvents = 0, midiMessages = 0;
+  uint32_t localPresses = clusterScripted ? CLUSTER_KEYS + 1 : 0;
+#endif
+
+  for (uint32_t cycle = 0; SCRIPT_START_US + (cycle + 1) * CYCLE_US <= end; cycle++) {
+    const uint64_t t = SCRIPT_START_US + cycle * CYCLE_US;
+    if (cycle == CLUSTER_CYCLE) {
+      for (uint8_t key = 0; key < CLUSTER_KEYS; key++) {
+        simKeys.scheduleKey(t, key, true, BOUNCES, BOUNCE_US);
+        simKeys.scheduleKey(t + CLUSTER_HOLD_US, key, false, BOUNCES, BOUNCE_US);
+        for (size_t i = 0; i < peers.size(); i++) {
+          const bool contest = i < 2 && key == CLUSTER_KEYS - 1;
+          peers[i]->scheduleKey(t + (contest ? CLUSTER_CONTEST_US : (i + 1) * CLUSTER_STAGGER_US), key, true);
+          peers[i]->scheduleKey(t + CLUSTER_HOLD_US, key, false);
+        }
+      }
+      simAt(t - 1, [&]() { clusterSteals = voiceSteals(); });
+      simAt(t + CLUSTER_HOLD_US - 1, [&]() { clusterSteals = voiceSteals() - clusterSteals; });
+
+      // Count what the stack holds just before the extra key
+      simAt(t + CLUSTER_STEAL_US - 1, [&]() {
+        clusterHeld = voices.counts().held;
+        for (auto& peer : peers) clusterHeld += peer->heldVoices();
+      });
+      simKeys.scheduleKey(t + CLUSTER_STEAL_US, CLUSTER_KEYS, true, BOUNCES, BOUNCE_US);
+      simKeys.scheduleKey(t + CLUSTER_HOLD_US, CLUSTER_KEYS, false, BOUNCES, BOUNCE_US);
+      continue;
+    }
+
+    const uint8_t key = cycle % NUM_KEYS;
+    const bool chord = cycle % CHORD_EVERY == CHORD_EVERY - 1;
+    if (cycle == BUS_OFF_CYCLE) simCanBusOff(t - BUS_OFF_LEAD_US);
+
+#ifdef MIDI_SERIAL
+    if (cycle % MIDI_EVERY == MIDI_FIRST) {
+      // The first note is heard once its last byte is in
+      const uint8_t notes = midiEvents % 2 ? 1 : sizeof(MIDI_CHORD);
+      const uint64_t at = t + midiEvents * MIDI_STAGGER_US % MIDI_STAGGER_SPAN_US;
+      uint8_t on[1 + 2 * sizeof(MIDI_CHORD)], off[sizeof(on)];
+      on[0] = off[0] = MIDI_NOTE_ON;
+      for (uint8_t i = 0; i < notes; i++) {
+        on[1 + 2 * i] = off[1 + 2 * i] = MIDI_CHORD[i] + midiEvents % 12;
+        on[2 + 2 * i] = MIDI_DEFAULT_VELOCITY;
+        off[2 + 2 * i] = 0;
+      }
+      simSerialReceive(at, on, 1 + 2 * notes);
+      simSerialReceive(at + HOLD_US, off, 1 + 2 * notes);
+      midiSound.push_back(Probe{at + 2 * byteUs, 0, false});
+      midiMessages += 2 * notes;
+      midiEvents++;
+    } else
+#endif
+    {
+      uint16_t keys = 0;
+      for (uint8_t k = 0; k < (chord ? CHORD_KEYS : 1); k++) {
+        const uint8_t chordKey = (key + 3 * k) % NUM_KEYS;
+        keys |= 1u << chordKey;
+        simKeys.scheduleKey(t, chordKey, true, BOUNCES, BOUNCE_US);
+        simKeys.scheduleKey(t + HOLD_US, chordKey, false, BOUNCES, BOUNCE_US);
+      }
+      if (chord) chords++;
+      wireProbes.push_back(Probe{t, keys, false});
+      localSound.push_back(Probe{t, keys, false});
+#ifdef MIDI_SERIAL
+      midiOutProbes.push_back(Probe{t, keys, false});
+      localPresses += chord ? CHORD_KEYS : 1;
+#endif
+    }
+
+    SimPeerModule& peer = *peers[cycle % peers.size()];
+    peer.scheduleKey(t + PEER_OFFSET_US, key, true);
+    peer.scheduleKey(t + PEER_OFFSET_US + HOLD_US, key, false);
+    peerSound.push_back(Probe{t + PEER_OFFSET_US, (uint16_t) (1u << key), false});
+  }
+
+  // Knob turns. The resonance knob starts fully down, so it alternates
+  // between there and KNOB_SLOW_STEPS up.
+  simKnobs.setPresent(!options.v1);
+  uint32_t knobSteps = 0;
+  int16_t expectedResonance = knobs.get(KNOB_RESONANCE);
+  for (uint32_t cycle = 0; (cycle + 1) * KNOB_CYCLE_US <= end; cycle++) {
+    const uint64_t t = cycle * KNOB_CYCLE_US;
+    const int16_t slow = cycle % 2 ? -KNOB_SLOW_STEPS : KNOB_SLOW_STEPS;
+    const uint64_t flickBack = t + KNOB_FAST_OFFSET_US + KNOB_FAST_STEPS * KNOB_FAST_STEP_US;
+    simKnobs.scheduleTurn(t + KNOB_SLOW_OFFSET_US, KNOB_RESONANCE, slow, KNOB_SLOW_STEP_US);
+    simKnobs.scheduleTurn(t + KNOB_FAST_OFFSET_US, KNOB_RELEASE, KNOB_FAST_STEPS, KNOB_FAST_STEP_US);
+    simKnobs.scheduleTurn(flickBack, KNOB_RELEASE, -KNOB_FAST_STEPS, KNOB_FAST_STEP_US);
+    knobSteps += KNOB_SLOW_STEPS + 2 * KNOB_FAST_STEPS;
+    expectedResonance += slow;
+  }
+  const uint32_t knobFailures = !options.v1 && (KNOB_FAIL_CYCLE + 1) * KNOB_CYCLE_US <= end ? 1 : 0;
+  if (knobFailures) simKnobs.scheduleReadFailure(KNOB_FAIL_CYCLE * KNOB_CYCLE_US + KNOB_SLOW_OFFSET_US);
+
+  // Joystick moves, and the pitch bend watched every JOY_PROBE_US. Readings
+  // within JOY_SETTLE_US of a move don't count.
+  simJoystick.setNoise(JOY_NOISE);
+  const bool joyScripted = JOY_VIBRATO_AT_US + JOY_HOLD_US + JOY_SETTLE_US <= end;
+  if (joyScripted) {
+    simJoystick.scheduleMove(JOY_BEND_AT_US, JOY_REST_X + JOY_PUSH, JOY_REST_Y);
+    simJoystick.scheduleMove(JOY_BEND_AT_US + JOY_HOLD_US, JOY_REST_X, JOY_REST_Y);
+    simJoystick.scheduleMove(JOY_VIBRATO_AT_US, JOY_REST_X, JOY_REST_Y + JOY_PUSH);
+    simJoystick.scheduleMove(JOY_VIBRATO_AT_US + JOY_HOLD_US, JOY_REST_X, JOY_REST_Y);
+  }
+  int32_t restBendMax = 0, heldBendMin = INT32_MAX, heldBendMax = INT32_MIN;
+  int32_t vibratoMin = INT32_MAX, vibratoMax = INT32_MIN;
+  std::function<void(uint64_t)> probeBend = [&](uint64_t at) {
+    const int32_t bend = voices.getPitchBend();
+    auto settledIn = [at](uint64_t from) {
+      return at >= from + JOY_SETTLE_US && at < from + JOY_HOLD_US;
+    };
+    auto near = [at](uint64_t from) {
+      return at + JOY_SETTLE_US >= from && at < from + JOY_HOLD_US + JOY_SETTLE_US;
+    };
+    if (settledIn(JOY_BEND_AT_US)) {
+      heldBendMin = std::min(heldBendMin, bend);
+      heldBendMax = std::max(heldBendMax, bend);
+    } else if (settledIn(JOY_VIBRATO_AT_US)) {
+      vibratoMin = std::min(vibratoMin, bend);
+      vibratoMax = std::max(vibratoMax, bend);
+    } else if (!near(JOY_BEND_AT_US) && !near(JOY_VIBRATO_AT_US)) {
+      restBendMax = std::max(restBendMax, std::abs(bend));
+    }
+    if (at + JOY_PROBE_US < end) simAt(at + JOY_PROBE_US, [&, at]() { probeBend(at + JOY_PROBE_US); });
+  };
+  simAt(JOY_PROBE_US, [&]() { probeBend(JOY_PROBE_US); });
+
+  // The east handshake input follows the first peer's west output
+  std::function<void(uint64_t)> copyHandshake = [&](uint64_t at) {
+    simKeys.setInput(HKOE_BIT, 3, !peers[0]->westOutput());
+    if (at + HANDSHAKE_COPY_US < end) simAt(at + HANDSHAKE_COPY_US, [&, at]() { copyHandshake(at + HANDSHAKE_COPY_US); });
+  };
+  simAt(0, [&]() { copyHandshake(0); });
+
+  // Each peer's view of the stack clock against the firmware's own, once
+  // settled
+  std::vector<int32_t> syncMaxError(peers.size(), 0);
+  std::vector<uint64_t> syncErrorSum(peers.size(), 0);
+  uint32_t syncProbes = 0;
+  bool syncLost = false;
+  std::function<void(uint64_t)> probeSync = [&](uint64_t at) {
+    for (size_t i = 0; i < peers.size(); i++) {
+      const ClockSync& sync = peers[i]->clockSync();
+      if (!sync.locked() || sync.isMaster()) {
+        syncLost = true;
+        continue;
+      }
+      const int32_t error = std::abs((int32_t) (sync.toStack(peers[i]->localClock(at)) - sampleClock()));
+      syncMaxError[i] = std::max(syncMaxError[i], error);
+      syncErrorSum[i] += error;
+    }
+    syncProbes++;
+    if (at + SYNC_PROBE_US < end) simAt(at + SYNC_PROBE_US, [&, at]() { probeSync(at + SYNC_PROBE_US); });
+  };
+  const bool syncScripted = SYNC_SETTLE_US < end;
+  if (syncScripted) simAt(SYNC_SETTLE_US, [&]() { probeSync(SYNC_SETTLE_US); });
+
+  // Where peers schedule their presses on the stack clock, against where
+  // the latency they picked from the press is on the firmware's
+  uint32_t timedPresses = 0;
+  int32_t scheduleMin = INT32_MAX, scheduleMax = INT32_MIN;
+  for (auto& peer : peers) {
+    peer->setKeySentHook([&](const KeyDiff& diff, uint32_t latency) {
+      if (!diff.timed) return;
+      const uint32_t now = sampleClock();
+      const int32_t error = (int32_t) (expandStackTime(diff.time, now) - (now + latency));
+      scheduleMin = std::min(scheduleMin, error);
+      scheduleMax = std::max(scheduleMax, error);
+      timedPresses++;
+    });
+  }
+
+  // Local key -> frame seen by the first peer
+  LatencyStats wireLatency;
+  uint32_t pressFrames = 0;
+  peers[0]->setKeyDiffHook([&](const KeyDiff& diff, uint64_t now) {
+    if (diff.octave != moduleOctave || !(diff.changed & diff.state)) return;
+    if (now >= clusterAt && now < clusterAt + CYCLE_US) return;
+    pressFrames++;
+
+    Probe* p = nextProbe(wireProbes, now);
+    if (p && (diff.state & p->keys) == p->keys) {
+      wireLatency.add(now - p->at);
+      p->done = true;
+    }
+  });
+
+#ifdef MIDI_SERIAL
+  // Local key -> note on leaving the serial line, read back with a parser of
+  // its own
+  LatencyStats midiOutLatency;
+  MidiParser midiOut;
+  uint32_t midiOutOn = 0, midiOutOff = 0;
+  simSerialSetOutputHook([&](uint8_t byte, uint64_t at) {
+    MidiMessage msg;
+    if (!midiOut.parse(&byte, 1, &msg) || msg.type() != MIDI_NOTE_ON) return;
+    if (!msg.data2) {
+      midiOutOff++;
+      return;
+    }
+    midiOutOn++;
+    Probe* p = nextProbe(midiOutProbes, at);
+    if (p) {
+      midiOutLatency.add(at - p->at);
+      p->done = true;
+    }
+  });
+  LatencyStats midiSoundLatency;
+#endif
+
+  // Key -> first audible DAC sample. Local and peer presses alternate, so
+  // whichever outstanding press is older made the sound.
+  LatencyStats localSoundLatency, peerSoundLatency;
+  simSetDacObserver([&](const uint16_t* samples, uint32_t n, uint64_t startUs) {
+    if (wav) {
+      memcpy(wav->acquireBlock(), samples, n * sizeof(uint16_t));
+      wav->commitBlock();
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+      const int32_t deviation = (int32_t) samples[i] - DAC_MIDPOINT;
+      if (deviation < SOUND_THRESHOLD && deviation > -(int32_t) SOUND_THRESHOLD) continue;
+
+      const uint64_t at = startUs + (uint64_t) i * 1000000 / SAMPLE_RATE;
+      Probe* local = nextProbe(localSound, at);
+      Probe* peer = nextProbe(peerSound, at);
+#ifdef MIDI_SERIAL
+      Probe* midi = nextProbe(midiSound, at);
+      if (midi && (!local || midi->at <= local->at) && (!peer || midi->at <= peer->at)) {
+        midiSoundLatency.add(at - midi->at);
+        midi->done = true;
+        break;
+      }
+#endif
+      if (local && (!peer || local->at <= peer->at)) {
+        localSoundLatency.add(at - local->at);
+        local->done = true;
+      } else if (peer) {
+        peerSoundLatency.add(at - peer->at);
+        peer->done = true;
+      }
+      break;
+    }
+  });
+
+  // The firmware's own start-up, then full volume so notes reach the DAC
+  setup();
+  knobs.set(KNOB_VOLUME, MAX_VOLUME);
+
+  const auto wallStart = std::chrono::steady_clock::now();
+  simRunUntil(end);
+  const std::chrono::duration<double> wall = std::chrono::steady_clock::now() - wallStart;
+
+  if (wav) wav->end();
+
+  printf("  simulated %u s in %.2f s    %8.1fx real time\n\n", options.seconds, wall.count(),
+         options.seconds / wall.count());
+
+  printf("Latency (virtual us)             seen      min     mean      p99      max\n");
+  wireLatency.print("local key -> CAN frame", wireProbes.size());
+  localSoundLatency.print("local key -> DAC", localSound.size());
+  peerSoundLatency.print("peer key -> DAC", peerSound.size());
+#ifdef MIDI_SERIAL
+  midiSoundLatency.print("MIDI in -> DAC", midiSound.size());
+  midiOutLatency.print("local key -> MIDI out", midiOutProbes.size());
+#endif
+  printf("  frames per press         %8.2f (%u chords, keys on different rows may\n"
+         "                           debounce on different passes)\n\n",
+         (double) pressFrames / wireProbes.size(), chords);
+
+  // One sample is 1/SAMPLE_RATE, 45 us
+  const GateStats gates = voices.gateStats();
+  const ClockSyncStats master = clockSync.stats();
+  printf("Clock sync (samples)              ppm   drift est   steps  mean |err|  max |err|\n");
+  for (size_t i = 0; i < peers.size(); i++) {
+    const ClockSyncStats stats = peers[i]->clockSync().stats();
+    printf("  peer octave %-12u %+8d %+11.1f %7u %11.2f %10d\n", peers[i]->octave(),
+           PEER_CLOCK_PPM[i % clockKinds], -stats.driftPpb / 1000.0, stats.steps,
+           syncProbes ? (double) syncErrorSum[i] / syncProbes : 0.0, syncMaxError[i]);
+  }
+  printf("  master node %u, note latency %u samples (%u ms) and %u for each frame queued ahead\n",
+         master.master, NOTE_LATENCY_SAMPLES, NOTE_LATENCY_MS, KEY_DIFF_FRAME_SAMPLES);
+  if (timedPresses) {
+    printf("  timed peer frames %u, scheduled %d..%d samples from the firmware's clock\n",
+           timedPresses, scheduleMin, scheduleMax);
+  }
+  printf("  firmware gates %u timed, %u late (by up to %u samples)\n\n",
+         gates.timed, gates.late, gates.maxLate);
+
+  const AudioStats& audio = dacSink.stats();
+  const CanTxStats note = canTx.stats(CanClass::Note);
+  const CanRxStats rx = canRxStats();
+  const SimCanBusStats bus = simCan.stats();
+  printf("Counters\n");
+  printf("  audio blocks %u, underruns %u, overruns %u\n",
+         (unsigned) audio.blocks, (unsigned) audio.underruns, (unsigned) audio.overruns);
+  printf("  CAN frames %u, bus load %.2f%%, %u aborted\n", bus.frames, 100.0 * bus.busyMicros / end, bus.aborted);
+  printf("  note tx sent %u, dropped %u, max queue latency %u us\n",
+         note.sent, note.dropped, note.maxLatency);
+  printf("  rx lost %u, ring overflows %u/%u, FIFO overruns %u/%u\n", rx.lost,
+         rx.ringOverflows[0], rx.ringOverflows[1], rx.fifoOverruns[0], rx.fifoOverruns[1]);
+  const CAN_Health health = canHealth();
+  printf("  CAN bus-off %u times, rejoined %u times, tec %u, rec %u\n", health.busOffEvents,
+         health.recoveries, health.txErrors, health.rxErrors);
+  const DisplayStats display = displayStats();
+  const KnobStats knobCounts = knobStats();
+  printf("  knob steps %u of %u scripted, %u missed, %u interrupts, %u of %u reads failed\n",
+         knobCounts.transitions, knobSteps, knobCounts.missed, knobCounts.interrupts,
+         knobCounts.readFailures, knobFailures);
+  if (knobCounts.latencyCount) {
+    printf("  knob interrupt -> update mean %u us, max %u us\n",
+           knobCounts.totalLatency / knobCounts.latencyCount, knobCounts.maxLatency);
+  }
+  printf("  knobs resonance %d (expected %d), release %d\n", knobs.get(KNOB_RESONANCE),
+         expectedResonance, knobs.get(KNOB_RELEASE));
+  uint32_t stackSteals = voiceAlloc.stats().steals;
+  uint32_t remoteNotes = voiceAlloc.stats().remote;
+  uint32_t handoffs = voiceAlloc.stats().handoffs;
+  for (auto& peer : peers) {
+    stackSteals += peer->allocStats().steals;
+    remoteNotes += peer->allocStats().remote;
+    handoffs += peer->allocStats().handoffs;
+  }
+  printf("  voice allocation %u modules, %u voices, %u presses played on another module, %u stack steals, "
+         "%u handed on\n",
+         voiceAlloc.nodeCount(), voiceAlloc.totalVoices(), remoteNotes, stackSteals, handoffs);
+  if (clusterScripted) {
+    printf("  cluster held %u of %u notes, %u voices stolen (expected 1)\n", clusterHeld, clusterNotes,
+           clusterSteals);
+  }
+  const EnumStats numbering = stackEnum.stats();
+  printf("  stack position %u of %u, octave %u, numbered at %u ms in %u rounds, %u Starts and %u Claims sent\n",
+         stackEnum.position(), stackEnum.count(), moduleOctave, numbering.doneAt, numbering.rounds,
+         numbering.starts, numbering.claims);
+  printf("  joystick bend at rest max %d cents", restBendMax);
+  if (joyScripted) {
+    printf(", held right %d..%d (expected %d), vibrato %d..%d",
+           heldBendMin, heldBendMax, PITCH_BEND_RANGE_CENTS, vibratoMin, vibratoMax);
+  }
+  printf("\n");
+  printf("  display frames sent %u, skipped %u, %u of %u bytes sent\n", display.framesSent,
+         display.framesSkipped, display.tilesSent * 8,
+         (display.framesSent + display.framesSkipped) * u8g2.getBufferTileWidth() * u8g2.getBufferTileHeight() * 8);
+  printf("  display last \"%s\"\n", u8g2.lastFrame().c_str());
+#ifdef MIDI_SERIAL
+  const MidiStats midi = midiStats();
+  printf("  MIDI in %u bytes, %u messages in %u reads of up to %u bytes, %u stray\n",
+         midi.in.bytes, midi.in.messages, midi.batches, midi.maxBatch, midi.in.stray);
+  printf("  MIDI out %u key events in %u bytes, %u dropped, %u note ons and %u offs for %u presses\n",
+         midi.outMessages, midi.outBytes, midi.outDropped, midiOutOn, midiOutOff, localPresses);
+#endif
+
+#ifdef PROFILE_ENABLED
+  // Host CPU time per section, through the firmware's own serial dump
+#ifdef MIDI_SERIAL
+  simSerialSetOutputHook(nullptr);
+#endif
+  printf("\nExecution time (host)\n");
+  simSerialEcho(true);
+  profilerDump(Serial);
+  simSerialEcho(options.serial);
+#endif
+
+  const bool complete = wireLatency.count() == wireProbes.size()
+                     && localSoundLatency.count() == localSound.size()
+                     && peerSoundLatency.count() == peerSound.size()
+                     && knobs.get(KNOB_RESONANCE) == expectedResonance
+                     && knobCounts.readFailures == knobFailures;
+  const bool lossless = audio.underruns == 0 && audio.overruns == 0 && note.dropped == 0
+                     && rx.lost == 0 && rx.ringOverflows[0] == 0 && rx.ringOverflows[1] == 0
+                     && rx.fifoOverruns[0] == 0 && rx.fifoOverruns[1] == 0;
+  const bool joystickOk = restBendMax == 0
+      && (!joyScripted || (heldBendMin == PITCH_BEND_RANGE_CENTS && heldBendMax == PITCH_BEND_RANGE_CENTS
+                           && vibratoMax - vibratoMin >= VIBRATO_DEPTH_CENTS * 2 * 9 / 10
+                           && vibratoMax <= VIBRATO_DEPTH_CENTS && vibratoMin >= -VIBRATO_DEPTH_CENTS));
+  const bool allocationOk = voiceAlloc.nodeCount() == 1 + options.peers
+      && (!clusterScripted || (clusterHeld == clusterNotes && stackSteals == 1 && clusterSteals == 1));
+  bool stackOk = stackEnum.position() == 0 && stackEnum.count() == 1 + options.peers
+      && moduleOctave == stackEnum.octave() && numbering.timeouts == 0;
+  for (size_t i = 0; i < peers.size(); i++) {
+    const StackEnumerator& e = peers[i]->stackEnum();
+    stackOk = stackOk && e.position() == i + 1 && e.count() == stackEnum.count()
+           && peers[i]->octave() == stackOctave(i + 1, stackEnum.count());
+  }
+  int32_t worstSync = 0;
+  for (int32_t error : syncMaxError) worstSync = std::max(worstSync, error);
+  const bool syncOk = master.master == moduleOctave && gates.late == 0
+      && (!syncScripted || (!syncLost && worstSync <= SYNC_MAX_ERROR))
+      && (!timedPresses || (scheduleMin >= -SYNC_MAX_ERROR && scheduleMax <= SYNC_MAX_ERROR));
+  const uint32_t busOffs = busOffScripted ? 1 : 0;
+  const bool busHealthOk = health.busOffEvents == busOffs && health.recoveries == busOffs
+      && !health.busOff && health.txErrors == 0;
+  const bool latencyOk = localSoundLatency.mean() < LOCAL_SOUND_MEAN_US
+                      && localSoundLatency.max() < LOCAL_SOUND_MAX_US;
+  bool midiOk = true;
+#ifdef MIDI_SERIAL
+  midiOk = midiOutLatency.count() == midiOutProbes.size()
+        && midiOutOn == localPresses && midiOutOff == localPresses
+        && midi.outDropped == 0 && midi.in.stray == 0
+        && midiSoundLatency.count() == midiSound.size() && midi.in.messages == midiMessages;
+#endif
+  if (!complete || !lossless || !joystickOk || !allocationOk || !syncOk || !stackOk
+      || !midiOk || !busHealthOk || !latencyOk) {
+    printf("\nFAIL: %s\n", !midiOk ? "MIDI parsed or sent wrongly"
+                          : !stackOk ? "stack numbered wrongly"
+                          : !syncOk ? "stack clock sync out of range"
+                          : !allocationOk ? "stack voice allocation wrong"
+                          : !joystickOk ? "joystick bend out of range"
+                          : !busHealthOk ? "bus-off or its recovery went unnoticed"
+                          : !latencyOk ? "local key -> DAC too slow"
+                          : !complete ? "presses or knob steps went missing" : "data was dropped");
+    simExit(1);
+  }
+  printf("\nOK\n");
+  simExit(0);
+}
+
+#endif // PIO_UNIT_TESTING
@@ -0,0 +1,377 @@
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "semphr.h"
+#include "queue.h"
+#include "simClock.h"
+
+// ---------------------------------------------------------------------
+//                          SCHEDULER STATE
+// ---------------------------------------------------------------------
+
+// Each task runs on its own thread. A task counts as running until it blocks
+// in the kernel, and whoever wakes it counts it as running again before it
+// has been scheduled, so the clock never sees a gap between the two.
+
+struct SimTask {
+  TaskFunction_t code;
+  void* parameters;
+  const char* name;
+  uint32_t stackDepth;
+  uint32_t notifyCount;
+  const void* waitingOn;  // Object that can wake the task while it is blocked
+  uint32_t waitId;        // Bumped on every block, so stale timeouts lapse
+  bool blocked;
+};
+
+// A give goes to a task already blocked on the semaphore before the giver
+// can take it back. On the board a waiting task of higher priority gets it
+// the same way, by preempting the giver.
+struct SimSemaphore {
+  UBaseType_t count;
+  UBaseType_t maxCount;
+  SimTask* heir;
+};
+
+// Items are stored end to end, `count` of them from `head`
+struct SimQueue {
+  std::vector<uint8_t> storage;
+  UBaseType_t length;
+  UBaseType_t itemSize;
+  UBaseType_t head;
+  UBaseType_t count;
+};
+
+namespace {
+
+struct Event {
+  uint64_t at;
+  uint64_t order;
+  std::function<void()> fn;
+};
+
+struct Later {
+  bool operator()(const Event& a, const Event& b) const {
+    return a.at != b.at ? a.at > b.at : a.order > b.order;
+  }
+};
+
+std::mutex lock_;                  // Guards everything below
+std::condition_variable changed_;  // Signalled on every change of task state
+std::priority_queue<Event, std::vector<Event>, Later> events_;
+uint64_t now_ = 0;
+uint64_t eventOrder_ = 0;
+uint32_t running_ = 0;
+bool started_ = false;
+std::vector<SimTask*> tasks_;
+std::function<void()> observer_;
+
+std::recursive_mutex critical_;
+
+thread_local SimTask* current_ = nullptr;
+
+// Marks a blocked task as running. Called with lock_ held.
+void wake(SimTask* task) {
+  if (!task->blocked) return;
+  task->blocked = false;
+  running_++;
+  changed_.notify_all();
+}
+
+// Wakes every task blocked on `object`, and any other thread waiting for a
+// change. Called with lock_ held.
+void wakeWaiters(const void* object) {
+  for (SimTask* task : tasks_) {
+    if (task->blocked && task->waitingOn == object) wake(task);
+  }
+  changed_.notify_all();
+}
+
+void addEvent(uint64_t at, std::function<void()> fn) {
+  events_.push(Event{at, eventOrder_++, fn});
+}
+
+// Blocks the caller on `object` until `ready()` or virtual time reaches
+// `deadline`. Threads that are not tasks just wait.
+template<typename Ready>
+bool waitUntil(std::unique_lock<std::mutex>& lk, const void* object, Ready ready, uint64_t deadline) {
+  SimTask* self = current_;
+
+  while (!ready() && now_ < deadline) {
+    if (!self) {
+      changed_.wait(lk);
+      continue;
+    }
+
+    const uint32_t id = ++self->waitId;
+    if (deadline != UINT64_MAX) {
+      addEvent(deadline, [self, id]() {
+        std::lock_guard<std::mutex> guard(lock_);
+        if (self->waitId == id) wake(self);
+      });
+    }
+    self->waitingOn = object;
+    self->blocked = true;
+    running_--;
+    changed_.notify_all();
+    changed_.wait(lk, [self]() { return !self->blocked; });
+  }
+  return ready();
+}
+
+uint64_t deadlineAfter(TickType_t ticks) {
+  if (ticks == portMAX_DELAY) return UINT64_MAX;
+  return now_ + (uint64_t) ticks * 1000 * portTICK_PERIOD_MS;
+}
+
+void taskEntry(SimTask* task) {
+  current_ = task;
+  {
+    std::unique_lock<std::mutex> lk(lock_);
+    changed_.wait(lk, []() { return started_; });
+  }
+  task->code(task->parameters);
+
+  // Tasks are not meant to return, stop counting this one
+  std::lock_guard<std::mutex> guard(lock_);
+  running_--;
+  changed_.notify_all();
+}
+
+} // namespace
+
+// ---------------------------------------------------------------------
+//                           VIRTUAL CLOCK
+// ---------------------------------------------------------------------
+
+uint64_t simMicros() {
+  std::lock_guard<std::mutex> guard(lock_);
+  return now_;
+}
+
+void simAt(uint64_t at, std::function<void()> fn) {
+  std::lock_guard<std::mutex> guard(lock_);
+  addEvent(at, fn);
+}
+
+void simSetObserver(std::function<void()> fn) {
+  std::lock_guard<std::mutex> guard(lock_);
+  observer_ = fn;
+}
+
+void simSleep(uint64_t us) {
+  std::unique_lock<std::mutex> lk(lock_);
+  if (!current_ || !started_) return;
+  waitUntil(lk, nullptr, []() { return false; }, now_ + us);
+}
+
+void simRunUntil(uint64_t until) {
+  std::unique_lock<std::mutex> lk(lock_);
+
+  while (true) {
+    changed_.wait(lk, []() { return running_ == 0; });
+    if (observer_) {
+      std::function<void()> observer = observer_;
+      lk.unlock();
+      observer();
+      lk.lock();
+    }
+    if (events_.empty() || events_.top().at > until) break;
+
+    Event event = events_.top();
+    events_.pop();
+    if (event.at > now_) now_ = event.at;
+
+    lk.unlock();
+    event.fn();
+    lk.lock();
+  }
+  if (until > now_) now_ = until;
+}
+
+void simExit(int code) {
+  fflush(stdout);
+  fflush(stderr);
+  _Exit(code);
+}
+
+void simEnterCritical() {
+  critical_.lock();
+}
+
+void simExitCritical() {
+  critical_.unlock();
+}
+
+// ---------------------------------------------------------------------
+//                               TASKS
+// ---------------------------------------------------------------------
+
+BaseType_t xTaskCreate(TaskFunction_t code, const char* name, uint32_t stackDepth,
+                       void* parameters, UBaseType_t priority, TaskHandle_t* created) {
+  // Priorities are not modelled, tasks take no virtual time to run
+  (void) priority;
+  SimTask* task = new SimTask{code, parameters, name, stackDepth, 0, nullptr, 0, false};
+
+  {
+    std::lock_guard<std::mutex> guard(lock_);
+    tasks_.push_back(task);
+    if (started_) running_++;
+  }
+  std::thread(taskEntry, task).detach();
+
+  if (created) *created = task;
+  return pdPASS;
+}
+
+void vTaskStartScheduler() {
+  std::lock_guard<std::mutex> guard(lock_);
+  started_ = true;
+  running_ += tasks_.size();
+  changed_.notify_all();
+}
+
+TickType_t xTaskGetTickCount() {
+  std::lock_guard<std::mutex> guard(lock_);
+  return (TickType_t) (now_ / (1000 * portTICK_PERIOD_MS));
+}
+
+void vTaskDelay(TickType_t ticks) {
+  std::unique_lock<std::mutex> lk(lock_);
+  waitUntil(lk, nullptr, []() { return false; }, deadlineAfter(ticks));
+}
+
+void vTaskDelayUntil(TickType_t* previousWakeTime, TickType_t increment) {
+  *previousWakeTime += increment;
+  const uint64_t deadline = (uint64_t) *previousWakeTime * 1000 * portTICK_PERIOD_MS;
+
+  std::unique_lock<std::mutex> lk(lock_);
+  waitUntil(lk, nullptr, []() { return false; }, deadline);
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticksToWait) {
+  SimTask* self = current_;
+  if (!self) return 0;
+
+  std::unique_lock<std::mutex> lk(lock_);
+  waitUntil(lk, self, [self]() { return self->notifyCount > 0; }, deadlineAfter(ticksToWait));
+
+  const uint32_t value = self->notifyCount;
+  if (value) self->notifyCount = clearOnExit ? 0 : value - 1;
+  return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+  std::lock_guard<std::mutex> guard(lock_);
+  task->notifyCount++;
+  wakeWaiters(task);
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* higherPriorityTaskWoken) {
+  xTaskNotifyGive(task);
+  if (higherPriorityTaskWoken) *higherPriorityTaskWoken = pdTRUE;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+  return task ? task->stackDepth : 0;
+}
+
+// ---------------------------------------------------------------------
+//                             SEMAPHORES
+// ---------------------------------------------------------------------
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+  return new SimSemaphore{1, 1, nullptr};
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+  return new SimSemaphore{0, 1, nullptr};
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t maxCount, UBaseType_t initialCount) {
+  return new SimSemaphore{initialCount, maxCount, nullptr};
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticksToWait) {
+  SimTask* self = current_;
+  std::unique_lock<std::mutex> lk(lock_);
+  auto ready = [sem, self]() { return sem->count > 0 && (!sem->heir || sem->heir == self); };
+  if (!waitUntil(lk, sem, ready, deadlineAfter(ticksToWait))) {
+    return pdFALSE;
+  }
+  sem->count--;
+  if (sem->heir == self) sem->heir = nullptr;
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem) {
+  std::lock_guard<std::mutex> guard(lock_);
+  if (sem->count >= sem->maxCount) return pdFALSE;
+  sem->count++;
+  if (!sem->heir) {
+    for (SimTask* task : tasks_) {
+      if (task->blocked && task->waitingOn == sem) {
+        sem->heir = task;
+        break;
+      }
+    }
+  }
+  wakeWaiters(sem);
+  return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t* higherPriorityTaskWoken) {
+  BaseType_t given = xSemaphoreGive(sem);
+  if (higherPriorityTaskWoken) *higherPriorityTaskWoken = given;
+  return given;
+}
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t sem) {
+  std::lock_guard<std::mutex> guard(lock_);
+  return sem->count;
+}
+
+// ---------------------------------------------------------------------
+//                               QUEUES
+// ---------------------------------------------------------------------
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  return new SimQueue{std::vector<uint8_t>(length * itemSize), length, itemSize, 0, 0};
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticksToWait) {
+  std::unique_lock<std::mutex> lk(lock_);
+  auto ready = [queue]() { return queue->count < queue->length; };
+  if (!waitUntil(lk, queue, ready, deadlineAfter(ticksToWait))) return errQUEUE_FULL;
+
+  const UBaseType_t slot = (queue->head + queue->count) % queue->length;
+  memcpy(&queue->storage[slot * queue->itemSize], item, queue->itemSize);
+  queue->count++;
+  wakeWaiters(queue);
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticksToWait) {
+  std::unique_lock<std::mutex> lk(lock_);
+  auto ready = [queue]() { return queue->count > 0; };
+  if (!waitUntil(lk, queue, ready, deadlineAfter(ticksToWait))) return errQUEUE_EMPTY;
+
+  memcpy(item, &queue->storage[queue->head * queue->itemSize], queue->itemSize);
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+  wakeWaiters(queue);
+  return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+  std::lock_guard<std::mutex> guard(lock_);
+  return queue->count;
+}
@@ -0,0 +1,22 @@
+#include <Arduino.h>
+#include "audio.h"
+#include "audioSink.h"
+#include "globals.h"
+#include "synth.h"
+#include "profiler.h"
+
+void audioGenTask(void *pvParameters) {
+  AudioSink* sink = static_cast<AudioSink*>(pvParameters);
+
+  while (1) {
+    // Blocks until the output has finished with a block
+    uint16_t* block = sink->acquireBlock();
+    {
+      PROFILE_SCOPE(ProfileSite::AudioGen);
+      // Scheduled note on/off land on the output's own sample count
+      voices.setClock(sink->blockClock());
+      renderBlock(voices, filter, knobs.get(KNOB_VOLUME), block, AUDIO_BLOCK_SIZE);
+    }
+    sink->commitBlock();
+  }
+}
@@ -0,0 +1,219 @@
+#include "canProtocol.h"
+
+constexpr uint16_t KEY_MASK = 0x0fff;
+constexpr uint8_t MAX_OCTAVE = 9;
+
+// The target shares byte 6 with the top of the time, 0xf meaning every module
+constexpr uint8_t TARGET_ALL = 0x0f;
+
+// Byte layout of a key diff:
+//   0: version << 4 | type
+//   1: octave
+//   2: sequence
+//   3: state bits 0..7
+//   4: state bits 8..11 | changed bits 0..3 << 4
+//   5: changed bits 4..11
+//   6: target node, 0x0f for every module | time bits 8..11 << 4
+//   7: time bits 0..7, timed frames only
+uint8_t encodeKeyDiff(const KeyDiff& diff, uint8_t data[8]) {
+  const uint16_t state = diff.state & KEY_MASK;
+  const uint16_t changed = diff.changed & KEY_MASK;
+
+  data[0] = (CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::KeyDiff;
+  data[1] = diff.octave;
+  data[2] = diff.sequence;
+  data[3] = state & 0xff;
+  data[4] = (state >> 8) | ((changed & 0x0f) << 4);
+  data[5] = changed >> 4;
+  data[6] = diff.target == CAN_NODE_ALL ? TARGET_ALL : diff.target & TARGET_ALL;
+  if (!diff.timed) return KEY_DIFF_TARGET_LENGTH;
+
+  data[6] |= (diff.time >> 8 & 0x0f) << 4;
+  data[7] = diff.time & 0xff;
+  return KEY_DIFF_TIMED_LENGTH;
+}
+
+CanDecodeResult decodeFrame(const uint8_t* data, uint8_t length, KeyDiff& diff) {
+  if (length < 3) return CanDecodeResult::Malformed;
+
+  // Legacy frame: 'P'/'R', octave, note
+  if (data[0] == 'P' || data[0] == 'R') {
+    if (data[1] > MAX_OCTAVE || data[2] >= 12) return CanDecodeResult::Malformed;
+    diff.octave = data[1];
+    diff.sequence = 0;
+    diff.changed = 1u << data[2];
+    diff.state = data[0] == 'P' ? diff.changed : 0;
+    diff.target = CAN_NODE_ALL;
+    diff.timed = false;
+    return CanDecodeResult::Legacy;
+  }
+
+  if ((data[0] >> 4) != CAN_PROTOCOL_VERSION) return CanDecodeResult::BadVersion;
+  if ((data[0] & 0x0f) != (uint8_t) CanMsgType::KeyDiff || length < KEY_DIFF_LENGTH) {
+    return CanDecodeResult::Malformed;
+  }
+  if (data[1] > MAX_OCTAVE) return CanDecodeResult::Malformed;
+
+  diff.octave = data[1];
+  diff.sequence = data[2];
+  diff.state = data[3] | ((data[4] & 0x0f) << 8);
+  diff.changed = (data[4] >> 4) | (data[5] << 4);
+  diff.target = CAN_NODE_ALL;
+  if (length >= KEY_DIFF_TARGET_LENGTH && (data[6] & 0x0f) != TARGET_ALL) diff.target = data[6] & 0x0f;
+  diff.timed = length >= KEY_DIFF_TIMED_LENGTH;
+  diff.time = diff.timed ? (data[6] >> 4) << 8 | data[7] : 0;
+  return CanDecodeResult::KeyDiff;
+}
+
+uint8_t trackSequence(KeyDiffSequence& tracker, uint8_t sequence) {
+  const uint8_t lost = tracker.seen ? (uint8_t) (sequence - tracker.next) : 0;
+  tracker.seen = true;
+  tracker.next = sequence + 1;
+  return lost;
+}
+
+// Byte layout of a capacity advert:
+//   0: version << 4 | type
+//   1: node
+//   2: idle voices
+//   3: releasing voices
+//   4: total voices
+uint8_t encodeCapacity(const VoiceCapacity& capacity, uint8_t data[8]) {
+  data[0] = (CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::Capacity;
+  data[1] = capacity.node;
+  data[2] = capacity.idle;
+  data[3] = capacity.releasing;
+  data[4] = capacity.total;
+  return CAPACITY_LENGTH;
+}
+
+bool decodeCapacity(const uint8_t* data, uint8_t length, VoiceCapacity& capacity) {
+  if (length < CAPACITY_LENGTH) return false;
+  if (data[0] != ((CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::Capacity)) return false;
+  if (data[2] + data[3] > data[4]) return false;
+
+  capacity.node = data[1];
+  capacity.idle = data[2];
+  capacity.releasing = data[3];
+  capacity.total = data[4];
+  return true;
+}
+
+// Byte layout of a handoff:
+//   0: version << 4 | type
+//   1: octave of the key
+//   2: key
+//   3: node to play it
+uint8_t encodeHandoff(const Handoff& handoff, uint8_t data[8]) {
+  data[0] = (CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::Handoff;
+  data[1] = handoff.octave;
+  data[2] = handoff.key;
+  data[3] = handoff.node;
+  return HANDOFF_LENGTH;
+}
+
+bool decodeHandoff(const uint8_t* data, uint8_t length, Handoff& handoff) {
+  if (length < HANDOFF_LENGTH) return false;
+  if (data[0] != ((CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::Handoff)) return false;
+  if (data[2] >= 12) return false;
+
+  handoff.octave = data[1];
+  handoff.key = data[2];
+  handoff.node = data[3];
+  return true;
+}
+
+// Byte layout of a Sync:
+//   0: version << 4 | type
+//   1: master node
+//   2: sequence
+// A SyncTime adds:
+//   3..6: master's sample clock when the Sync left, little-endian
+uint8_t encodeSync(const SyncFrame& sync, uint8_t data[8]) {
+  data[0] = (CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::Sync;
+  data[1] = sync.master;
+  data[2] = sync.sequence;
+  return SYNC_LENGTH;
+}
+
+uint8_t encodeSyncTime(const SyncFrame& sync, uint8_t data[8]) {
+  encodeSync(sync, data);
+  data[0] = (CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::SyncTime;
+  for (uint8_t i = 0; i < 4; i++) data[3 + i] = sync.time >> (8 * i);
+  return SYNC_TIME_LENGTH;
+}
+
+bool decodeSync(const uint8_t* data, uint8_t length, SyncFrame& sync) {
+  if (length < SYNC_LENGTH) return false;
+  if (data[0] != ((CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::Sync)) return false;
+
+  sync.master = data[1];
+  sync.sequence = data[2];
+  sync.time = 0;
+  return true;
+}
+
+bool decodeSyncTime(const uint8_t* data, uint8_t length, SyncFrame& sync) {
+  if (length < SYNC_TIME_LENGTH) return false;
+  if (data[0] != ((CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::SyncTime)) return false;
+
+  sync.master = data[1];
+  sync.sequence = data[2];
+  sync.time = 0;
+  for (uint8_t i = 0; i < 4; i++) sync.time |= (uint32_t) data[3 + i] << (8 * i);
+  return true;
+}
+
+// Byte layout of an enumeration Start:
+//   0: version << 4 | type
+//   1: round
+//   2..5: sender's unique ID, little-endian
+// A Claim puts the position in byte 2 and moves the ID along:
+//   2: bits 0..6 position, bit 7 last
+//   3..6: sender's unique ID, little-endian
+static void putUid(uint32_t uid, uint8_t* data) {
+  for (uint8_t i = 0; i < 4; i++) data[i] = uid >> (8 * i);
+}
+
+static uint32_t getUid(const uint8_t* data) {
+  uint32_t uid = 0;
+  for (uint8_t i = 0; i < 4; i++) uid |= (uint32_t) data[i] << (8 * i);
+  return uid;
+}
+
+uint8_t encodeEnumStart(const EnumFrame& frame, uint8_t data[8]) {
+  data[0] = (CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::EnumStart;
+  data[1] = frame.round;
+  putUid(frame.uid, data + 2);
+  return ENUM_START_LENGTH;
+}
+
+uint8_t encodeEnumClaim(const EnumFrame& frame, uint8_t data[8]) {
+  data[0] = (CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::EnumClaim;
+  data[1] = frame.round;
+  data[2] = (frame.position & 0x7f) | (frame.last ? 0x80 : 0);
+  putUid(frame.uid, data + 3);
+  return ENUM_CLAIM_LENGTH;
+}
+
+bool decodeEnumStart(const uint8_t* data, uint8_t length, EnumFrame& frame) {
+  if (length < ENUM_START_LENGTH) return false;
+  if (data[0] != ((CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::EnumStart)) return false;
+
+  frame.round = data[1];
+  frame.position = 0;
+  frame.last = false;
+  frame.uid = getUid(data + 2);
+  return true;
+}
+
+bool decodeEnumClaim(const uint8_t* data, uint8_t length, EnumFrame& frame) {
+  if (length < ENUM_CLAIM_LENGTH) return false;
+  if (data[0] != ((CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::EnumClaim)) return false;
+
+  frame.round = data[1];
+  frame.position = data[2] & 0x7f;
+  frame.last = data[2] & 0x80;
+  frame.uid = getUid(data + 3);
+  return true;
+}
@@ -0,0 +1,195 @@
+#include <Arduino.h>
+#include <STM32FreeRTOS.h>
+#include <ES_CAN.h>
+#include "canTxScheduler.h"
+#include "eventLog.h"
+
+static const uint32_t classIds[(uint8_t) CanClass::Count] = {
+  CAN_ID_SYNC,
+  CAN_ID_NOTE,
+  CAN_ID_CONTROL,
+  CAN_ID_TELEMETRY
+};
+
+CanTxScheduler canTx;
+
+CanTxScheduler::CanTxScheduler()
+    : queues_(), sentHooks_(), syncInFlight_(0), online_(false), flush_(false), notify_(nullptr), notifyFromISR_(nullptr),
+      context_(nullptr) {}
+
+void CanTxScheduler::setNotify(NotifyFn notify, NotifyFn notifyFromISR, void* context) {
+  notify_ = notify;
+  notifyFromISR_ = notifyFromISR;
+  context_ = context;
+}
+
+bool CanTxScheduler::setSentHook(CanMsgType type, void (*hook)()) {
+  for (SentHook& h : sentHooks_) {
+    if (h.hook == nullptr || h.type == (uint8_t) type) {
+      h.type = (uint8_t) type;
+      h.hook = hook;
+      return true;
+    }
+  }
+  return false;
+}
+
+void CanTxScheduler::notify() {
+  if (notify_) notify_(context_);
+}
+
+void CanTxScheduler::setOnline(bool online) {
+  if (online == online_) return;
+  online_ = online;
+  if (!online) {
+    flush_ = true;
+    notify();
+  }
+}
+
+void CanTxScheduler::onMailboxFree() {
+  // A Sync only goes out with the mailboxes empty, so it is the first to finish
+  const uint8_t type = syncInFlight_;
+  if (type) {
+    syncInFlight_ = 0;
+    for (const SentHook& h : sentHooks_) {
+      if (h.hook && h.type == type) h.hook();
+    }
+  }
+  if (notifyFromISR_) notifyFromISR_(context_);
+}
+
+bool CanTxScheduler::send(CanClass cls, const CanMessage& msg, uint8_t key) {
+  Queue& q = queues_[(uint8_t) cls];
+  const uint32_t now = micros();
+  bool queued = true;
+  bool dropped = false;
+
+  // Nobody to hear it
+  if (!online_) return false;
+
+  taskENTER_CRITICAL();
+  if (cls == CanClass::Control) {
+    // A pending value for the same control is stale, overwrite it in place.
+    // The head may already be on its way to a mailbox, so it stays as it is.
+    for (uint8_t i = q.sending ? 1 : 0; i < q.count; i++) {
+      Entry& e = q.entries[(q.head + i) % CAN_TX_DEPTH];
+      if (e.key == key) {
+        e.msg = msg;
+        q.stats.coalesced++;
+        taskEXIT_CRITICAL();
+        notify();
+        return true;
+      }
+    }
+  }
+
+  if (q.count == CAN_TX_DEPTH) {
+    q.stats.dropped++;
+    dropped = true;
+    if (cls == CanClass::Telemetry && !q.sending) {
+      q.head = (q.head + 1) % CAN_TX_DEPTH;
+      q.count--;
+    } else {
+      queued = false;
+    }
+  }
+
+  if (queued) {
+    Entry& e = q.entries[(q.head + q.count) % CAN_TX_DEPTH];
+    e.msg = msg;
+    e.key = key;
+    e.queuedAt = now;
+    q.count++;
+    if (q.count > q.stats.maxDepth) q.stats.maxDepth = q.count;
+  }
+  taskEXIT_CRITICAL();
+
+  if (dropped) logEvent(LogId::TxDropped, (uint32_t) cls);
+  if (queued) notify();
+  return queued;
+}
+
+bool CanTxScheduler::peek(CanClass& cls, Entry& entry, bool mailboxesEmpty) {
+  bool found = false;
+
+  taskENTER_CRITICAL();
+  for (uint8_t c = 0; c < (uint8_t) CanClass::Count; c++) {
+    Queue& q = queues_[c];
+    if (q.count == 0) continue;
+    // A waiting Sync holds everything else back until the mailboxes drain
+    if ((CanClass) c == CanClass::Sync && !mailboxesEmpty) break;
+    entry = q.entries[q.head];
+    q.sending = true;
+    cls = (CanClass) c;
+    found = true;
+    break;
+  }
+  taskEXIT_CRITICAL();
+
+  return found;
+}
+
+// Releases the head taken by peek(), removing it once it is in a mailbox
+void CanTxScheduler::finish(CanClass cls, bool sent) {
+  Queue& q = queues_[(uint8_t) cls];
+  taskENTER_CRITICAL();
+  q.sending = false;
+  if (sent) {
+    q.head = (q.head + 1) % CAN_TX_DEPTH;
+    q.count--;
+  }
+  taskEXIT_CRITICAL();
+}
+
+void CanTxScheduler::service() {
+  // The TX task owns the heads, so the queues are only dropped here. A Sync
+  // that was aborted rather than sent won't finish, so its hook is cleared
+  // once the mailboxes are.
+  if (flush_) {
+    flush_ = false;
+    CAN_AbortTX();
+    syncInFlight_ = 0;
+    taskENTER_CRITICAL();
+    for (Queue& q : queues_) {
+      q.stats.dropped += q.count;
+      q.head = 0;
+      q.count = 0;
+    }
+    taskEXIT_CRITICAL();
+  }
+
+  // Only take a message once there is a mailbox for it, so a higher class
+  // queued in the meantime still goes first
+  uint32_t free;
+  while ((free = CAN_TXFreeMailboxes())) {
+    CanClass cls;
+    Entry entry;
+    if (!peek(cls, entry, free == CAN_TX_MAILBOXES)) break;
+
+    // A rejected frame stays at the head of its queue, to be tried again
+    // when a mailbox frees or the next message is queued
+    Queue& q = queues_[(uint8_t) cls];
+    if (cls == CanClass::Sync) syncInFlight_ = entry.msg.data[0] & 0x0f;
+    const bool sent = CAN_TX(classIds[(uint8_t) cls], entry.msg.data, entry.msg.length) == 0;
+    finish(cls, sent);
+    if (!sent) {
+      if (cls == CanClass::Sync) syncInFlight_ = 0;
+      break;
+    }
+
+    const uint32_t latency = micros() - entry.queuedAt;
+    q.stats.sent++;
+    q.stats.lastLatency = latency;
+    if (latency > q.stats.maxLatency) q.stats.maxLatency = latency;
+  }
+}
+
+CanTxStats CanTxScheduler::stats(CanClass cls) const {
+  const Queue& q = queues_[(uint8_t) cls];
+  taskENTER_CRITICAL();
+  CanTxStats stats = q.stats;
+  stats.depth = q.count;
+  taskEXIT_CRITICAL();
+  return stats;
+}
@@ -1,30 +1,61 @@
 #include "globals.h"
+#include "can_tx_task.h"
+#include "canTxScheduler.h"
+#include "profiler.h"
+#include "eventLog.h"
+#include <ES_CAN.h>
 #include <FreeRTOS.h>
 #include <task.h>
-#include <semphr.h>
-#include <ES_CAN.h>
 
-void CAN_TX_Task(void *pvParameters) {
-    uint8_t msgOut[8];
+static CAN_Health health;
 
-    while(1) {
-        // 1) Block until a message is available in msgOutQ
-        xQueueReceive(msgOutQ, msgOut, portMAX_DELAY);
+// Logs the error counters whenever they move, and every bus-off and
+// recovery since the last poll
+static void pollHealth() {
+    const CAN_Health current = CAN_GetHealth();
+    if (current.busOffEvents != health.busOffEvents) {
+        logEvent(LogId::CanBusOff, current.busOffEvents - health.busOffEvents, current.txErrors);
+    }
+    if (current.recoveries != health.recoveries) {
+        logEvent(LogId::CanRecovered, current.recoveries - health.recoveries, current.txErrors);
+    }
+    if (current.txErrors != health.txErrors || current.rxErrors != health.rxErrors) {
+        logEvent(LogId::CanErrors, current.txErrors, current.rxErrors, current.lastErrorCode);
+    }
 
-        // 2) Wait for a free mailbox
-        xSemaphoreTake(CAN_TX_Semaphore, portMAX_DELAY);
+    taskENTER_CRITICAL();
+    health = current;
+    taskEXIT_CRITICAL();
+}
+
+CAN_Health canHealth() {
+    taskENTER_CRITICAL();
+    CAN_Health result = health;
+    taskEXIT_CRITICAL();
+    return result;
+}
 
-        // 3) Now it's safe to call CAN_TX
-        CAN_TX(0x123, msgOut);
+void CAN_TX_Task(void *pvParameters) {
+    const TickType_t pollPeriod = CAN_HEALTH_POLL_MS / portTICK_PERIOD_MS;
+    TickType_t nextPoll = xTaskGetTickCount() + pollPeriod;
+    logEvent(LogId::CanBitRate, CAN_GetBitRate());
 
-        // debug print
-        Serial.print("Sent: ");
-        for (int i=0; i<8; i++) {
-            Serial.print(msgOut[i], HEX);
-            Serial.print(" ");
+    while(1) {
+        // 1) Sleep until a message is queued or a mailbox frees up, or the
+        // health poll is due
+        TickType_t now = xTaskGetTickCount();
+        TickType_t wait = (int32_t) (nextPoll - now) > 0 ? nextPoll - now : 0;
+        if (ulTaskNotifyTake(pdTRUE, wait)) {
+            PROFILE_SCOPE(ProfileSite::CanTx);
+
+            // 2) Fill the free mailboxes, highest priority class first
+            canTx.service();
         }
-        Serial.println();
 
-        
+        // 3) Error counters, bus-off and recovery
+        if ((int32_t) (xTaskGetTickCount() - nextPoll) >= 0) {
+            nextPoll += pollPeriod;
+            pollHealth();
+        }
     }
 }
@@ -0,0 +1,219 @@
+#include <Arduino.h>
+#include <atomic>
+#include <STM32FreeRTOS.h>
+#include "clockSync.h"
+#include "globals.h"
+#include "hardware.h"
+#include "LockGuard.h"
+#include "canTxScheduler.h"
+#include "taskNotify.h"
+#include "eventLog.h"
+
+// A locked module logs its sync figures this often
+constexpr uint32_t SYNC_REPORT_PERIODS = 100;
+
+ClockSync::ClockSync()
+    : node_(0), master_(CAN_NODE_ALL), sequence_(0), lastHeard_(0),
+      stampValid_(false), stampSequence_(0), stamp_(0),
+      pairs_(0), base_(0), offset_(0), drift_(0),
+      steps_(0), residual_(0), jitter_(0) {}
+
+// Keeps the integer part of a Q16 offset to 32 bits, as the clocks wrap
+static int64_t wrapOffset(int64_t offset) {
+  return (int64_t) ((uint64_t) offset << 16) >> 16;
+}
+
+void ClockSync::setNode(uint8_t node) {
+  if (node == node_) return;
+  node_ = node;
+  master_ = CAN_NODE_ALL;
+  stampValid_ = false;
+  pairs_ = 0;
+}
+
+void ClockSync::follow(uint8_t master, uint32_t nowMs) {
+  master_ = master;
+  lastHeard_ = nowMs;
+  stampValid_ = false;
+  pairs_ = 0;
+  offset_ = 0;
+  drift_ = 0;
+}
+
+bool ClockSync::tick(uint32_t nowMs) {
+  if (isMaster()) {
+    lastHeard_ = nowMs;
+    return true;
+  }
+
+  // Nothing from a lower node for a while, so this one takes over
+  if (nowMs - lastHeard_ >= SYNC_MASTER_TIMEOUT * SYNC_PERIOD_MS) {
+    follow(node_, nowMs);
+    return true;
+  }
+  return false;
+}
+
+void ClockSync::onSync(const SyncFrame& sync, uint32_t localStamp, uint32_t nowMs) {
+  // From a module on our node while the stack renumbers
+  if (sync.master == node_) return;
+
+  // A lower node takes over straight away, a higher one only once the
+  // current master has gone quiet
+  if (sync.master != master_) {
+    const bool quiet = nowMs - lastHeard_ >= SYNC_MASTER_TIMEOUT * SYNC_PERIOD_MS;
+    if (sync.master > master_ && !quiet) return;
+    follow(sync.master, nowMs);
+  }
+
+  lastHeard_ = nowMs;
+  stampValid_ = true;
+  stampSequence_ = sync.sequence;
+  stamp_ = localStamp;
+}
+
+int64_t ClockSync::offsetAt(uint32_t local) const {
+  return offset_ + ((drift_ * (int32_t) (local - base_)) >> 16);
+}
+
+void ClockSync::onSyncTime(const SyncFrame& sync) {
+  if (isMaster() || sync.master != master_) return;
+  if (!stampValid_ || sync.sequence != stampSequence_) return;
+  stampValid_ = false;
+
+  const uint32_t local = stamp_;
+  const int64_t measured = (int64_t) (int32_t) (sync.time - local) * 65536;
+  if (pairs_ == 0) {
+    base_ = local;
+    offset_ = measured;
+    pairs_ = 1;
+    return;
+  }
+
+  const int64_t predicted = offsetAt(local);
+  const int64_t residual = wrapOffset(measured - predicted);
+  const int64_t step = (int64_t) SYNC_STEP_SAMPLES << 16;
+  if (residual > step || residual < -step) {
+    // The master restarted or a stamp was badly late, start again from here
+    steps_++;
+    base_ = local;
+    offset_ = measured;
+    drift_ = 0;
+    pairs_ = 1;
+    return;
+  }
+
+  // PI loop: the offset takes part of the residual now, and the drift the
+  // rest spread over the interval, so a steady drift leaves no residual
+  const int32_t interval = local - base_;
+  offset_ = wrapOffset(predicted + (residual >> SYNC_OFFSET_SHIFT));
+  if (interval > 0) drift_ += residual * 65536 / interval >> SYNC_DRIFT_SHIFT;
+  base_ = local;
+  pairs_++;
+
+  residual_ = residual;
+  const uint32_t size = residual < 0 ? -residual : residual;
+  jitter_ = jitter_ + ((int32_t) (size - jitter_) >> 4);
+}
+
+uint32_t ClockSync::toStack(uint32_t local) const {
+  if (isMaster() || !locked()) return local;
+  return local + (uint32_t) ((offsetAt(local) + 0x8000) >> 16);
+}
+
+uint32_t ClockSync::toLocal(uint32_t stack) const {
+  if (isMaster() || !locked()) return stack;
+  const uint32_t local = stack - (uint32_t) (offset_ >> 16);
+  return stack - (uint32_t) ((offsetAt(local) + 0x8000) >> 16);
+}
+
+ClockSyncStats ClockSync::stats() const {
+  ClockSyncStats stats;
+  stats.master = master_;
+  stats.locked = locked();
+  stats.syncs = pairs_;
+  stats.steps = steps_;
+  stats.residual = residual_ >> 8;
+  stats.jitter = jitter_ >> 8;
+  stats.driftPpb = (drift_ * 1000000000) >> 32;
+  return stats;
+}
+
+uint32_t expandStackTime(uint16_t time, uint32_t stackNow) {
+  // Sign-extend the difference from the low bits of now
+  int32_t delta = (time - stackNow) & KEY_DIFF_TIME_MASK;
+  if (delta > (int32_t) (KEY_DIFF_TIME_MASK >> 1)) delta -= KEY_DIFF_TIME_MASK + 1;
+  return stackNow + delta;
+}
+
+// ---------------------------------------------------------------------
+//                             MASTER SIDE
+// ---------------------------------------------------------------------
+
+static TaskHandle_t syncTaskHandle = NULL;
+static std::atomic<uint32_t> sentStamp(0);
+
+// Runs in the CAN TX interrupt as the Sync leaves the bus, the same moment
+// the other modules take their receive stamps
+static void syncSent() {
+  sentStamp.store(sampleClock(), std::memory_order_relaxed);
+  notifyTaskFromISR(syncTaskHandle);
+}
+
+void clockSyncBegin(TaskHandle_t task) {
+  syncTaskHandle = task;
+  canTx.setSentHook(CanMsgType::Sync, syncSent);
+}
+
+void clockSyncTask(void *pvParameters) {
+  // Every period the master sends a Sync. The TX interrupt wakes the task
+  // once it has gone, to follow it with the time it went at.
+  const TickType_t period = SYNC_PERIOD_MS / portTICK_PERIOD_MS;
+  TickType_t nextSync = xTaskGetTickCount() + period;
+  uint8_t sentSequence = 0;
+  bool awaitingSent = false;
+  uint8_t reportedMaster = CAN_NODE_ALL;
+  uint32_t periods = 0;
+
+  while (1) {
+    TickType_t now = xTaskGetTickCount();
+    TickType_t wait = (int32_t) (nextSync - now) > 0 ? nextSync - now : 0;
+
+    if (ulTaskNotifyTake(pdTRUE, wait) && awaitingSent) {
+      SyncFrame sync = {moduleOctave, sentSequence, sentStamp.load(std::memory_order_relaxed)};
+      CanMessage msg;
+      msg.length = encodeSyncTime(sync, msg.data);
+      canTx.send(CanClass::Control, msg, CONTROL_KEY_SYNC_TIME);
+      awaitingSent = false;
+    }
+
+    if ((int32_t) (xTaskGetTickCount() - nextSync) < 0) continue;
+    nextSync += period;
+
+    bool send;
+    ClockSyncStats stats;
+    SyncFrame sync = {moduleOctave, 0, 0};
+    {
+      LockGuard lock(sysState.mutex);
+      send = clockSync.tick(millis());
+      if (send) sync.sequence = clockSync.nextSequence();
+      stats = clockSync.stats();
+    }
+
+    if (send) {
+      CanMessage msg;
+      msg.length = encodeSync(sync, msg.data);
+      sentSequence = sync.sequence;
+      awaitingSent = true;
+      canTx.send(CanClass::Sync, msg);
+    }
+
+    if (stats.master != reportedMaster) {
+      logEvent(LogId::SyncMaster, stats.master);
+      reportedMaster = stats.master;
+    }
+    if (++periods % SYNC_REPORT_PERIODS == 0 && !send && stats.locked) {
+      logEvent(LogId::SyncReport, stats.residual, stats.jitter, stats.driftPpb);
+    }
+  }
+}
@@ -0,0 +1,62 @@
+#include <Arduino.h>
+#include "dacDmaSink.h"
+#include "hardware.h"
+#include "profiler.h"
+
+DacDmaSink dacSink;
+
+static void dacHalfSent(uint8_t half) {
+  PROFILE_SCOPE(ProfileSite::DacISR);
+  dacSink.onHalfSent(half);
+}
+
+bool DacDmaSink::begin(uint32_t sampleRate) {
+  blockFree_ = xSemaphoreCreateBinary();
+  if (!blockFree_) return false;
+
+  for (uint32_t i = 0; i < 2 * AUDIO_BLOCK_SIZE; i++) buffer_[i] = DAC_MIDPOINT;
+
+  // The DMA starts on half 0, so half 1 can be rendered straight away
+  freeHalf_ = 1;
+  blockReady_ = true;
+  halvesSent_ = 0;
+  xSemaphoreGive(blockFree_);
+
+  return startSampleStream(buffer_, AUDIO_BLOCK_SIZE, sampleRate, dacHalfSent);
+}
+
+void DacDmaSink::end() {
+  stopSampleStream();
+}
+
+uint16_t* DacDmaSink::acquireBlock() {
+  xSemaphoreTake(blockFree_, portMAX_DELAY);
+  writeHalf_ = freeHalf_;
+
+  // The free half plays once the one the DMA is reading has been sent
+  blockClock_ = (halvesSent_ + 1) * AUDIO_BLOCK_SIZE;
+  return buffer_ + writeHalf_ * AUDIO_BLOCK_SIZE;
+}
+
+void DacDmaSink::commitBlock() {
+  // If the DMA moved on while we were writing, part of this block was
+  // played before it was written.
+  if (freeHalf_ != writeHalf_) {
+    stats_.overruns++;
+  } else {
+    blockReady_ = true;
+  }
+  stats_.blocks++;
+}
+
+void DacDmaSink::onHalfSent(uint8_t half) {
+  // The DMA is now reading the half that was being rendered
+  if (!blockReady_) stats_.underruns++;
+  blockReady_ = false;
+  freeHalf_ = half;
+  halvesSent_ = halvesSent_ + 1;
+
+  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+  xSemaphoreGiveFromISR(blockFree_, &xHigherPriorityTaskWoken);
+  portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+}
@@ -1,50 +1,214 @@
 #include "globals.h"
+#include "hardware.h"
 #include "scanKeys.h"
+#include "LockGuard.h"
+#include "canProtocol.h"
+#include "canTxScheduler.h"
+#include "keyScanner.h"
+#include "decodeTask.h"
+#include "profiler.h"
+#include "eventLog.h"
+#include <ES_CAN.h>
 #include <FreeRTOS.h>
 #include <task.h>
 #include <Arduino.h>
 #include <stdint.h>
 
-// Suppose we have a stepSizes array somewhere
-extern const uint32_t stepSizes[12];
-extern volatile uint32_t currentStepSize;
+constexpr uint8_t NUM_OCTAVES = 10;
+
+// Last known key state and sequence number of the module on each octave
+static uint16_t remoteKeys[NUM_OCTAVES];
+static KeyDiffSequence sequences[NUM_OCTAVES];
+
+// Stack numbering the tables above belong to
+static uint16_t stackGeneration;
+
+static CanRxStats stats;
+
+// Passes a press on to `node`, which plays it on arrival
+static void sendHandoff(uint8_t octave, uint8_t key, uint8_t node) {
+    const Handoff handoff = {octave, key, node};
+    CanMessage msg;
+    msg.length = encodeHandoff(handoff, msg.data);
+    canTx.send(CanClass::Control, msg, CONTROL_KEY_HANDOFF + octave * 12 + key);
+    logEvent(LogId::Handoff, octave, key, node);
+}
+
+// Starts or releases a voice for every key in `mask`, following `state`.
+// Presses are only played if they were assigned to this module, and one
+// that would steal is handed on if another module has a voice free. A timed
+// frame lands on its stack sample, otherwise the changes play straight away.
+static void applyKeys(uint8_t octave, uint16_t mask, uint16_t state, uint8_t target,
+                      bool timed, uint16_t time) {
+    const bool play = target == moduleOctave || target == CAN_NODE_ALL;
+    for (uint8_t key = 0; key < 12; key++) {
+        const uint16_t bit = 1u << key;
+        if (!(mask & bit)) continue;
+
+        const uint8_t midi = midiNote(octave, key);
+        const bool pressed = state & bit;
+        uint8_t handTo = CAN_NODE_ALL;
+        {
+            LockGuard lock(sysState.mutex);
+            // Untimed while this module has no stack clock to place it on
+            if (timed && !clockSync.locked()) timed = false;
+            uint32_t at = 0;
+            if (timed) {
+                at = clockSync.toLocal(expandStackTime(time, clockSync.toStack(sampleClock())));
+            }
+
+            if (!pressed) {
+                if (timed) voices.noteOff(midi, at);
+                else voices.noteOff(midi);
+            } else if (play) {
+                if (target == moduleOctave && !voices.hasVoiceFor(midi)) {
+                    handTo = voiceAlloc.handOff(millis());
+                }
+                if (handTo != CAN_NODE_ALL) {
+                    // Another module plays it
+                } else if (timed) {
+                    voices.noteOn(midi, noteStepSize(midi, temperament), at);
+                } else {
+                    voices.noteOn(midi, noteStepSize(midi, temperament));
+                }
+            }
+        }
+        if (handTo != CAN_NODE_ALL) sendHandoff(octave, key, handTo);
+
+        // Keep the last note change in the old 'P'/'R' form for the display
+        RX_Message_Global[0] = pressed ? 'P' : 'R';
+        RX_Message_Global[1] = octave;
+        RX_Message_Global[2] = key;
+    }
+    remoteKeys[octave] = (remoteKeys[octave] & ~mask) | (state & mask);
+}
+
+// Handles one frame from FIFO 0.
+static void decodeNote(const CanMessage& msg) {
+    KeyDiff diff;
+    switch (decodeFrame(msg.data, msg.length, diff)) {
+        case CanDecodeResult::KeyDiff: {
+            // Another module on our octave, as while the stack renumbers.
+            // Our own keys were played when they changed.
+            if (diff.octave == moduleOctave) break;
+
+            // Octaves belong to other modules once the stack is renumbered
+            uint16_t generation;
+            {
+                LockGuard lock(sysState.mutex);
+                generation = stackEnum.generation();
+            }
+            if (generation != stackGeneration) {
+                stackGeneration = generation;
+                for (KeyDiffSequence& s : sequences) s.seen = false;
+                for (uint16_t& keys : remoteKeys) keys = 0;
+            }
+
+            // If frames went missing, resync every key from the full state
+            uint16_t mask = diff.changed;
+            const uint8_t lost = trackSequence(sequences[diff.octave], diff.sequence);
+            if (lost) {
+                stats.lost += lost;
+                mask |= diff.state ^ remoteKeys[diff.octave];
+                logEvent(LogId::SequenceGap, diff.octave, lost);
+            }
+            applyKeys(diff.octave, mask, diff.state, diff.target, diff.timed, diff.time);
+            logEvent(LogId::KeyDiffRx, diff.octave, diff.state, diff.changed);
+            break;
+        }
+        case CanDecodeResult::Legacy:
+            applyKeys(diff.octave, diff.changed, diff.state, diff.target, false, 0);
+            logEvent(LogId::LegacyRx, diff.octave, diff.state, diff.changed);
+            break;
+        case CanDecodeResult::BadVersion:
+            stats.badVersion++;
+            logEvent(LogId::BadVersion, msg.id);
+            break;
+        default:
+            stats.malformed++;
+            logEvent(LogId::Malformed, msg.id, msg.length);
+            break;
+    }
+}
+
+// Plays a press another module had no voice for, if its key is still held.
+// It is never passed on twice, so this module steals for it if it must.
+static void playHandoff(const Handoff& handoff) {
+    if (handoff.node != moduleOctave || handoff.octave >= NUM_OCTAVES) return;
+
+    const uint16_t held = handoff.octave == moduleOctave ? keyScanner.keys() : remoteKeys[handoff.octave];
+    if (!(held & (1u << handoff.key))) return;
+
+    const uint8_t midi = midiNote(handoff.octave, handoff.key);
+    LockGuard lock(sysState.mutex);
+    voices.noteOn(midi, noteStepSize(midi, temperament));
+}
+
+// Handles one frame from FIFO 1. Clock sync goes to the clock estimate,
+// enumeration to the stack numbering, capacity adverts to the voice
+// allocator and handoffs to the voice pool, the rest are only counted.
+static void decodeBulk(const CanMessage& msg) {
+    SyncFrame sync;
+    EnumFrame frame;
+    Handoff handoff;
+    if (msg.id == CAN_ID_SYNC) {
+        stats.sync++;
+        if (decodeSync(msg.data, msg.length, sync)) {
+            LockGuard lock(sysState.mutex);
+            clockSync.onSync(sync, msg.stamp, millis());
+        } else if (decodeEnumStart(msg.data, msg.length, frame)) {
+            LockGuard lock(sysState.mutex);
+            stackEnum.onStart(frame, millis());
+        } else if (decodeEnumClaim(msg.data, msg.length, frame)) {
+            LockGuard lock(sysState.mutex);
+            stackEnum.onClaim(frame, millis());
+        }
+        return;
+    }
+    if (msg.id != CAN_ID_CONTROL) {
+        stats.telemetry++;
+        return;
+    }
+    stats.control++;
+
+    VoiceCapacity capacity;
+    if (decodeCapacity(msg.data, msg.length, capacity)) {
+        LockGuard lock(sysState.mutex);
+        voiceAlloc.onAdvert(capacity, millis());
+    } else if (decodeSyncTime(msg.data, msg.length, sync)) {
+        LockGuard lock(sysState.mutex);
+        clockSync.onSyncTime(sync);
+    } else if (decodeHandoff(msg.data, msg.length, handoff)) {
+        playHandoff(handoff);
+    }
+}
 
 void decodeTask(void *pvParameters) {
-    uint8_t localMsg[8];
+    CanMessage msg;
 
     while(1) {
-        // Wait until a CAN message arrives
-        xQueueReceive(msgInQ, localMsg, portMAX_DELAY);
-
-        // localMsg now has 8 bytes from the CAN frame
-        // e.g. Byte0 = 'P'/'R', Byte1 = octave, Byte2 = note
-        char status = (char)localMsg[0];
-        uint8_t octave = localMsg[1];
-        uint8_t note   = localMsg[2];
-
-        // If you want to store for display, do so with a mutex
-        // For quick test, we can just do:
-        for (int i=0; i<8; i++) {
-            RX_Message_Global[i] = localMsg[i];
+        // Notes first, they are the latency-critical traffic
+        if (msgInQ.pop(msg)) {
+            PROFILE_SCOPE(ProfileSite::Decode);
+            decodeNote(msg);
+            continue;
         }
-
-        // Example: If 'P' => set currentStepSize
-        // If 'R' => release => set stepSize=0
-        if (status == 'R') {
-            currentStepSize = 0;
-        } else if (status == 'P') {
-            // compute from note + octave
-            // shift left/right by (octave-4) if needed
-            // simplified example:
-            currentStepSize = stepSizes[note]; 
+        if (bulkInQ.pop(msg)) {
+            PROFILE_SCOPE(ProfileSite::Decode);
+            decodeBulk(msg);
+            continue;
         }
 
-        // Print for debug
-        Serial.print("Decoded: ");
-        Serial.write(status);
-        Serial.print(" Oct=");
-        Serial.print(octave);
-        Serial.print(" Note=");
-        Serial.println(note);
+        // Both rings are empty, wait for a CAN RX interrupt
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
     }
 }
+
+CanRxStats canRxStats() {
+    CanRxStats result = stats;
+    result.fifoOverruns[0] = CAN_GetRXOverruns(0);
+    result.fifoOverruns[1] = CAN_GetRXOverruns(1);
+    result.ringOverflows[0] = msgInQ.overflows();
+    result.ringOverflows[1] = bulkInQ.overflows();
+    return result;
+}
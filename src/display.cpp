@@ -5,20 +5,87 @@
 #include "globals.h"
 #include "hardware.h"
 #include "LockGuard.h"
+#include "profiler.h"
+#include "eventLog.h"
 #include <ES_CAN.h>
+#include <string.h>
+
+// Frames between transfer rate reports in the event log (1 s)
+constexpr uint8_t DISPLAY_REPORT_FRAMES = 10;
+
+// Largest frame buffer the tile tracking supports (128x32 is 512 bytes)
+constexpr uint16_t DISPLAY_MAX_BUFFER = 128 * 64 / 8;
 
-constexpr uint8_t NUM_KEYS = 12;
 const char* noteNames[NUM_KEYS] = {
   "C", "C#", "D", "D#", "E", "F",
   "F#", "G", "G#", "A", "A#", "B"
 };
 
+// Copy of the frame buffer as the panel has it
+static uint8_t sentBuffer[DISPLAY_MAX_BUFFER];
+static bool sentValid = false;
+
+static DisplayStats stats;
+
+// Sends only the tiles that differ from what the panel already shows. Each
+// tile row goes out as one transfer covering its changed columns, so an
+// unchanged frame costs no I2C time at all.
+static void sendChangedTiles() {
+    uint8_t* buffer = u8g2.getBufferPtr();
+    const uint8_t tileWidth = u8g2.getBufferTileWidth();
+    const uint8_t tileHeight = u8g2.getBufferTileHeight();
+    const uint16_t rowBytes = tileWidth * 8;
+    bool changed = false;
+
+    for (uint8_t row = 0; row < tileHeight; row++) {
+        uint8_t* now = buffer + row * rowBytes;
+        uint8_t* sent = sentBuffer + row * rowBytes;
+
+        // First and last changed tile in this row
+        int16_t first = -1, last = -1;
+        for (uint8_t tile = 0; tile < tileWidth; tile++) {
+            if (sentValid && memcmp(now + tile * 8, sent + tile * 8, 8) == 0) continue;
+            if (first < 0) first = tile;
+            last = tile;
+        }
+        if (first < 0) continue;
+
+        const uint32_t start = micros();
+        u8g2.updateDisplayArea(first, row, last - first + 1, 1);
+        stats.i2cMicros += micros() - start;
+        stats.tilesSent += last - first + 1;
+
+        memcpy(sent + first * 8, now + first * 8, (last - first + 1) * 8);
+        changed = true;
+    }
+
+    sentValid = true;
+    if (changed) stats.framesSent++;
+    else stats.framesSkipped++;
+}
+
+DisplayStats displayStats() {
+    taskENTER_CRITICAL();
+    DisplayStats result = stats;
+    taskEXIT_CRITICAL();
+    return result;
+}
+
 void displayUpdateTask(void *pvParameters) {
     const TickType_t xFrequency = 100 / portTICK_PERIOD_MS;
     TickType_t xLastWakeTime = xTaskGetTickCount();
+    DisplayStats reported = {};
+    uint8_t framesToReport = DISPLAY_REPORT_FRAMES;
+
+    // The tile copy is sized for the largest panel
+    if (u8g2.getBufferTileWidth() * u8g2.getBufferTileHeight() * 8 > DISPLAY_MAX_BUFFER) {
+        Serial.println("Display buffer too large!");
+        while(1);
+    }
 
     while (1) {
         vTaskDelayUntil(&xLastWakeTime, xFrequency);
+        PROFILE_SCOPE(ProfileSite::Display);
 
         // No more polling for CAN here!
 
@@ -53,8 +120,17 @@ void displayUpdateTask(void *pvParameters) {
         u8g2.print(RX_Message_Global[1]);
         u8g2.print(RX_Message_Global[2]);
 
-        u8g2.sendBuffer();
+        sendChangedTiles();
         digitalToggle(LED_BUILTIN);
+
+        // Transfer rate over the last second
+        if (--framesToReport == 0) {
+            framesToReport = DISPLAY_REPORT_FRAMES;
+            DisplayStats now = displayStats();
+            logEvent(LogId::DisplayRate, (now.tilesSent - reported.tilesSent) * 8,
+                     now.i2cMicros - reported.i2cMicros, now.framesSkipped - reported.framesSkipped);
+            reported = now;
+        }
     }
 }
 
@@ -0,0 +1,219 @@
+#include <string.h>
+#include "dspKernels.h"
+
+// Host builds can run the SIMD kernels on the simulator's stand-in
+// intrinsics with -D DSP_KERNELS_EMULATE, so they can be tested there
+#if ((defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP) || defined(DSP_KERNELS_EMULATE)) \
+    && !defined(DSP_KERNELS_PORTABLE)
+#include "stm32_def.h"  // CMSIS SIMD intrinsics
+#define DSP_KERNELS_SIMD 1
+#endif
+
+// 1/3 in Q15 for the soft clip cubic
+constexpr int32_t ONE_THIRD_Q15 = 10923;
+
+static inline int16_t saturate16(int32_t x) {
+  if (x > INT16_MAX) return INT16_MAX;
+  if (x < INT16_MIN) return INT16_MIN;
+  return x;
+}
+
+// Cubic soft clip of a saturated Q15 value
+static inline int16_t clipCubic(int32_t x) {
+  int32_t x2 = (x * x) >> 15;
+  int32_t x3 = (x2 * x) >> 15;
+  return x - ((x3 * ONE_THIRD_Q15) >> 15);
+}
+
+// ---------------------------------------------------------------------
+//                     PORTABLE REFERENCE KERNELS
+// ---------------------------------------------------------------------
+
+void mixPairPortable(int32_t* acc, const int16_t* a, const int16_t* b,
+                     int16_t gainA, int16_t gainB, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    // Unsigned arithmetic wraps the same way as the SMLAD accumulator
+    uint32_t sum = (uint32_t) acc[i];
+    sum += (uint32_t)((int32_t) a[i] * gainA);
+    sum += (uint32_t)((int32_t) b[i] * gainB);
+    acc[i] = (int32_t) sum;
+  }
+}
+
+void applyGainPortable(int16_t* buf, int16_t gain, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    buf[i] = saturate16(((int32_t) buf[i] * gain) >> 15);
+  }
+}
+
+void addSaturatePortable(int16_t* dst, const int16_t* src, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    dst[i] = saturate16((int32_t) dst[i] + src[i]);
+  }
+}
+
+void softClipPortable(const int32_t* in, int16_t* out, uint32_t n, uint8_t shift) {
+  for (uint32_t i = 0; i < n; i++) {
+    out[i] = clipCubic(saturate16(in[i] >> shift));
+  }
+}
+
+void applyRamp(int16_t* buf, uint32_t level, int32_t step, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    level += step;
+    buf[i] = ((int32_t) buf[i] * (int32_t)(level >> 15)) >> 15;
+  }
+}
+
+#ifdef DSP_KERNELS_SIMD
+
+// ---------------------------------------------------------------------
+//                     CORTEX-M4 SIMD KERNELS
+// ---------------------------------------------------------------------
+
+// Two int16 samples as one word; unaligned LDR/STR are fine on the M4
+static inline uint32_t load2(const int16_t* p) {
+  uint32_t word;
+  memcpy(&word, p, sizeof(word));
+  return word;
+}
+
+static inline void store2(int16_t* p, uint32_t word) {
+  memcpy(p, &word, sizeof(word));
+}
+
+void mixPair(int32_t* acc, const int16_t* a, const int16_t* b,
+             int16_t gainA, int16_t gainB, uint32_t n) {
+  const uint32_t gains = __PKHBT((uint32_t)(uint16_t) gainA, (uint32_t) gainB, 16);
+  uint32_t i = 0;
+
+  for (; i + 1 < n; i += 2) {
+    uint32_t wa = load2(a + i);
+    uint32_t wb = load2(b + i);
+    // (a[i], b[i]) and (a[i+1], b[i+1]) as packed pairs
+    uint32_t even = __PKHBT(wa, wb, 16);
+    uint32_t odd = __PKHTB(wb, wa, 16);
+    acc[i] = __SMLAD(even, gains, acc[i]);
+    acc[i + 1] = __SMLAD(odd, gains, acc[i + 1]);
+  }
+  if (i < n) mixPairPortable(acc + i, a + i, b + i, gainA, gainB, n - i);
+}
+
+void applyGain(int16_t* buf, int16_t gain, uint32_t n) {
+  const uint32_t gainLow = (uint16_t) gain;
+  const uint32_t gainHigh = (uint32_t) gain << 16;
+  uint32_t i = 0;
+
+  for (; i + 1 < n; i += 2) {
+    uint32_t w = load2(buf + i);
+    int32_t lo = __SSAT((int32_t) __SMUAD(w, gainLow) >> 15, 16);
+    int32_t hi = __SSAT((int32_t) __SMUAD(w, gainHigh) >> 15, 16);
+    store2(buf + i, __PKHBT((uint32_t) lo, (uint32_t) hi, 16));
+  }
+  if (i < n) applyGainPortable(buf + i, gain, n - i);
+}
+
+void addSaturate(int16_t* dst, const int16_t* src, uint32_t n) {
+  uint32_t i = 0;
+
+  for (; i + 1 < n; i += 2) {
+    store2(dst + i, __QADD16(load2(dst + i), load2(src + i)));
+  }
+  if (i < n) addSaturatePortable(dst + i, src + i, n - i);
+}
+
+void softClip(const int32_t* in, int16_t* out, uint32_t n, uint8_t shift) {
+  for (uint32_t i = 0; i < n; i++) {
+    out[i] = clipCubic(__SSAT(in[i] >> shift, 16));
+  }
+}
+
+#else
+
+void mixPair(int32_t* acc, const int16_t* a, const int16_t* b,
+             int16_t gainA, int16_t gainB, uint32_t n) {
+  mixPairPortable(acc, a, b, gainA, gainB, n);
+}
+
+void applyGain(int16_t* buf, int16_t gain, uint32_t n) {
+  applyGainPortable(buf, gain, n);
+}
+
+void addSaturate(int16_t* dst, const int16_t* src, uint32_t n) {
+  addSaturatePortable(dst, src, n);
+}
+
+void softClip(const int32_t* in, int16_t* out, uint32_t n, uint8_t shift) {
+  softClipPortable(in, out, n, shift);
+}
+
+#endif // DSP_KERNELS_SIMD
+
+#ifdef PROFILE_ENABLED
+
+// ---------------------------------------------------------------------
+//                             BENCHMARK
+// ---------------------------------------------------------------------
+
+#include "profiler.h"
+
+// Block sizes timed, with odd ones for the kernels' single-sample tails
+static const uint16_t BENCH_SIZES[] = {1, 7, 16, 31, 32, 64, 128};
+constexpr uint32_t BENCH_MAX_SIZE = 128;
+constexpr uint32_t BENCH_REPEATS = 64;
+
+static int16_t benchA[BENCH_MAX_SIZE];
+static int16_t benchB[BENCH_MAX_SIZE];
+static int16_t benchOut[BENCH_MAX_SIZE];
+static int32_t benchAcc[BENCH_MAX_SIZE];
+
+// Mean ticks per call of `kernel` on a block of `n`
+template <typename Kernel>
+static float benchTicks(uint32_t n, Kernel kernel) {
+  const uint32_t start = profileNow();
+  for (uint32_t r = 0; r < BENCH_REPEATS; r++) kernel(n);
+  return (float) (profileNow() - start) / BENCH_REPEATS;
+}
+
+template <typename Kernel, typename Portable>
+static void benchKernel(Print& out, const char* name, Kernel kernel, Portable portable) {
+  for (uint16_t n : BENCH_SIZES) {
+    const float ticks = benchTicks(n, kernel);
+    const float portableTicks = benchTicks(n, portable);
+    out.print(name);
+    out.print('\t');
+    out.print(n);
+    out.print('\t');
+    out.print(ticks);
+    out.print('\t');
+    out.print(portableTicks);
+    out.print('\t');
+    out.println(ticks > 0 ? portableTicks / ticks : 0.0f);
+  }
+}
+
+void benchKernels(Print& out) {
+  uint32_t noise = 1;
+  for (uint32_t i = 0; i < BENCH_MAX_SIZE; i++) {
+    noise = noise * 1103515245 + 12345;
+    benchA[i] = noise >> 16;
+    benchB[i] = noise;
+    benchAcc[i] = noise;
+  }
+
+  out.println("kernel\tn\tticks\tportable\tspeedup");
+  benchKernel(out, "mixPair",
+      [](uint32_t n) { mixPair(benchAcc, benchA, benchB, 12000, -9000, n); },
+      [](uint32_t n) { mixPairPortable(benchAcc, benchA, benchB, 12000, -9000, n); });
+  benchKernel(out, "applyGain",
+      [](uint32_t n) { applyGain(benchOut, 30000, n); },
+      [](uint32_t n) { applyGainPortable(benchOut, 30000, n); });
+  benchKernel(out, "addSaturate",
+      [](uint32_t n) { addSaturate(benchOut, benchA, n); },
+      [](uint32_t n) { addSaturatePortable(benchOut, benchA, n); });
+  benchKernel(out, "softClip",
+      [](uint32_t n) { softClip(benchAcc, benchOut, n, 2); },
+      [](uint32_t n) { softClipPortable(benchAcc, benchOut, n, 2); });
+}
+
+#endif // PROFILE_ENABLED
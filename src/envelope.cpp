@@ -0,0 +1,65 @@
+#include "envelope.h"
+#include "audio.h"
+
+EnvelopeRamp Envelope::advance(const EnvelopeParams& params, uint32_t n) {
+  const uint32_t start = level_;
+
+  // Stage changes land on block boundaries, which is fine at control rate
+  switch (stage_) {
+    case EnvelopeStage::Attack: {
+      uint64_t next = (uint64_t) level_ + (uint64_t) params.attackRate * n;
+      if (next >= ENVELOPE_MAX) {
+        level_ = ENVELOPE_MAX;
+        stage_ = EnvelopeStage::Decay;
+      } else {
+        level_ = next;
+      }
+      break;
+    }
+    case EnvelopeStage::Decay: {
+      uint64_t fall = (uint64_t) params.decayRate * n;
+      if (level_ <= params.sustainLevel + fall) {
+        level_ = params.sustainLevel;
+        stage_ = EnvelopeStage::Sustain;
+      } else {
+        level_ -= fall;
+      }
+      break;
+    }
+    case EnvelopeStage::Sustain:
+      level_ = params.sustainLevel;
+      break;
+    case EnvelopeStage::Release: {
+      uint64_t fall = (uint64_t) params.releaseRate * n;
+      if (level_ <= fall) {
+        level_ = 0;
+        stage_ = EnvelopeStage::Idle;
+      } else {
+        level_ -= fall;
+      }
+      break;
+    }
+    default:
+      level_ = 0;
+      break;
+  }
+
+  EnvelopeRamp ramp = {start, ((int32_t) level_ - (int32_t) start) / (int32_t) n};
+  return ramp;
+}
+
+uint32_t envelopeRate(uint16_t ms) {
+  uint32_t samples = (uint32_t) ms * SAMPLE_RATE / 1000;
+  if (samples == 0) samples = 1;
+  return ENVELOPE_MAX / samples;
+}
+
+EnvelopeParams defaultEnvelope() {
+  EnvelopeParams params = {
+    envelopeRate(5),
+    envelopeRate(100),
+    ENVELOPE_MAX / 10 * 7,
+    envelopeRate(50)
+  };
+  return params;
+}
@@ -0,0 +1,93 @@
+#include <Arduino.h>
+#include <STM32FreeRTOS.h>
+#include "eventLog.h"
+#include "mpscRing.h"
+
+// Drain interval for logDrainTask
+constexpr TickType_t LOG_DRAIN_MS = 10;
+
+static MpscRing<LogRecord, LOG_CAPACITY> logRing;
+
+void logEvent(LogId id, uint8_t argCount, uint32_t a, uint32_t b, uint32_t c) {
+  LogRecord record = {micros(), id, argCount, {a, b, c}};
+  logRing.push(record);
+}
+
+uint32_t logDropped() {
+  return logRing.overflows();
+}
+
+#ifdef LOG_TEXT
+
+static const char* const logFormats[(uint8_t) LogId::Count] = {
+#define LOG_EVENT(name, format) format,
+#include "logEvents.def"
+#undef LOG_EVENT
+};
+
+// Prints "time message", with the %u, %d and %x fields filled in
+static void writeRecord(const LogRecord& record) {
+  Serial.print(record.time);
+  Serial.print(' ');
+
+  uint8_t arg = 0;
+  for (const char* p = logFormats[(uint8_t) record.id]; *p; p++) {
+    if (*p != '%' || !p[1]) {
+      Serial.print(*p);
+      continue;
+    }
+    const uint32_t value = arg < record.argCount ? record.args[arg] : 0;
+    switch (*++p) {
+      case 'u': Serial.print(value); arg++; break;
+      case 'd': Serial.print((int32_t) value); arg++; break;
+      case 'x': Serial.print(value, HEX); arg++; break;
+      default: Serial.print(*p); break;
+    }
+  }
+  Serial.println();
+}
+
+#else
+
+static void writeByte(uint8_t b, uint8_t& sum) {
+  Serial.write(b);
+  sum += b;
+}
+
+static void writeWord(uint32_t w, uint8_t& sum) {
+  for (uint8_t i = 0; i < 4; i++) writeByte(w >> (8 * i), sum);
+}
+
+static void writeRecord(const LogRecord& record) {
+  uint8_t sum = 0;
+  writeByte(LOG_SYNC, sum);
+  writeByte((uint8_t) record.id, sum);
+  writeByte(record.argCount, sum);
+  writeWord(record.time, sum);
+  for (uint8_t i = 0; i < record.argCount; i++) writeWord(record.args[i], sum);
+  Serial.write(sum);
+}
+
+#endif // LOG_TEXT
+
+void logDrainTask(void *pvParameters) {
+  const TickType_t xFrequency = LOG_DRAIN_MS / portTICK_PERIOD_MS;
+  TickType_t xLastWakeTime = xTaskGetTickCount();
+  uint32_t reportedDrops = 0;
+
+  while (1) {
+    vTaskDelayUntil(&xLastWakeTime, xFrequency);
+
+    // Serial writes block once the UART buffer is full, which only holds
+    // up this task
+    LogRecord record;
+    while (logRing.pop(record)) writeRecord(record);
+
+    const uint32_t dropped = logDropped();
+    if (dropped != reportedDrops) {
+      LogRecord lost = {micros(), LogId::LogDropped, 1, {dropped - reportedDrops, 0, 0}};
+      writeRecord(lost);
+      reportedDrops = dropped;
+    }
+  }
+}
@@ -0,0 +1,136 @@
+#include "filter.h"
+#include "audio.h"
+#include "constexprMath.h"
+
+constexpr double FILTER_MIN_HZ = 40.0;
+constexpr double FILTER_OCTAVES = 6.75;
+
+// Damping q = 1 / Q. The Chamberlin loop is stable while f^2 + 2fq < 4.
+constexpr int32_t FILTER_DAMPING_MAX = 1 << FILTER_COEF_BITS;          // Q = 1
+constexpr int32_t FILTER_DAMPING_MIN = (1 << FILTER_COEF_BITS) / 10;   // Q = 10
+
+// Input is scaled up by this many bits to keep precision at low cutoffs
+constexpr uint8_t FILTER_HEADROOM = 8;
+constexpr int32_t FILTER_STATE_MAX = 1 << 28;
+
+// Control positions glide 1/2^n of the way to their target each block
+constexpr uint8_t FILTER_SMOOTH_SHIFT = 3;
+
+// ---------------------------------------------------------------------
+//              COMPILE-TIME TABLE GENERATION
+// ---------------------------------------------------------------------
+
+namespace {
+
+constexpr FilterCutoffTable makeCutoffTable() {
+  FilterCutoffTable table{};
+  for (uint32_t i = 0; i <= FILTER_STEPS; i++) {
+    uint32_t pos = i < FILTER_STEPS ? i : FILTER_STEPS - 1;
+    double hz = FILTER_MIN_HZ * constmath::exp2(FILTER_OCTAVES * pos / (FILTER_STEPS - 1));
+    double f = 2 * constmath::sin(constmath::PI * hz / SAMPLE_RATE);
+    table.f[i] = (int32_t) (f * (1 << FILTER_COEF_BITS) + 0.5);
+  }
+  return table;
+}
+
+} // namespace
+
+constexpr FilterCutoffTable filterCutoffTable = makeCutoffTable();
+
+static_assert((double) filterCutoffTable.f[FILTER_STEPS] * filterCutoffTable.f[FILTER_STEPS] +
+              2.0 * filterCutoffTable.f[FILTER_STEPS] * FILTER_DAMPING_MAX <
+              4.0 * (1 << FILTER_COEF_BITS) * (1 << FILTER_COEF_BITS),
+              "Highest cutoff is unstable at minimum resonance");
+
+// ---------------------------------------------------------------------
+//                          FILTER
+// ---------------------------------------------------------------------
+
+static inline int32_t mulCoef(int32_t coef, int32_t x) {
+  return (int32_t) (((int64_t) coef * x) >> FILTER_COEF_BITS);
+}
+
+static inline int32_t clampState(int32_t x) {
+  if (x > FILTER_STATE_MAX) return FILTER_STATE_MAX;
+  if (x < -FILTER_STATE_MAX) return -FILTER_STATE_MAX;
+  return x;
+}
+
+static inline int32_t dampingFor(uint8_t resonance) {
+  return FILTER_DAMPING_MAX -
+         (int32_t) ((int64_t) (FILTER_DAMPING_MAX - FILTER_DAMPING_MIN) * resonance / (FILTER_STEPS - 1));
+}
+
+Filter::Filter()
+    : mode_(FilterMode::LowPass), cutoff_(FILTER_STEPS - 1), resonance_(0),
+      lastMode_(FilterMode::LowPass), cutoffPos_((FILTER_STEPS - 1) << 8),
+      f_(filterCutoffTable.f[FILTER_STEPS - 1]), q_(FILTER_DAMPING_MAX),
+      low_(0), band_(0) {}
+
+void Filter::setCutoff(uint8_t position) {
+  if (position >= FILTER_STEPS) position = FILTER_STEPS - 1;
+  cutoff_.store(position, std::memory_order_relaxed);
+}
+
+void Filter::setResonance(uint8_t position) {
+  if (position >= FILTER_STEPS) position = FILTER_STEPS - 1;
+  resonance_.store(position, std::memory_order_relaxed);
+}
+
+void Filter::process(int16_t* buf, uint32_t n) {
+  if (n == 0) return;
+
+  // Control rate: glide towards the targets and look up this block's end point
+  int32_t cutoffTarget = (int32_t) cutoff_.load(std::memory_order_relaxed) << 8;
+  cutoffPos_ += (cutoffTarget - (int32_t) cutoffPos_) / (1 << FILTER_SMOOTH_SHIFT);
+
+  uint32_t index = cutoffPos_ >> 8;
+  int32_t frac = cutoffPos_ & 0xff;
+  int32_t f0 = filterCutoffTable.f[index];
+  int32_t f1 = filterCutoffTable.f[index + 1];
+  int32_t fEnd = f0 + (int32_t) (((int64_t) (f1 - f0) * frac) >> 8);
+
+  int32_t qTarget = dampingFor(resonance_.load(std::memory_order_relaxed));
+  int32_t qEnd = q_ + (qTarget - q_) / (1 << FILTER_SMOOTH_SHIFT);
+
+  FilterMode mode = mode_.load(std::memory_order_relaxed);
+  if (mode != lastMode_) {
+    low_ = 0;
+    band_ = 0;
+    lastMode_ = mode;
+  }
+  if (mode == FilterMode::Off) {
+    f_ = fEnd;
+    q_ = qEnd;
+    return;
+  }
+
+  // Audio rate: ramp the coefficients across the block
+  const int32_t fStep = (fEnd - f_) / (int32_t) n;
+  const int32_t qStep = (qEnd - q_) / (int32_t) n;
+  int32_t f = f_;
+  int32_t q = q_;
+  int32_t low = low_;
+  int32_t band = band_;
+
+  for (uint32_t i = 0; i < n; i++) {
+    f += fStep;
+    q += qStep;
+
+    int32_t x = (int32_t) buf[i] << FILTER_HEADROOM;
+    low = clampState(low + mulCoef(f, band));
+    int32_t high = x - low - mulCoef(q, band);
+    band = clampState(band + mulCoef(f, high));
+
+    int32_t y = mode == FilterMode::LowPass ? low : mode == FilterMode::HighPass ? high : band;
+    y >>= FILTER_HEADROOM;
+    if (y > INT16_MAX) y = INT16_MAX;
+    if (y < INT16_MIN) y = INT16_MIN;
+    buf[i] = (int16_t) y;
+  }
+
+  low_ = low;
+  band_ = band;
+  f_ = fEnd;
+  q_ = qEnd;
+}
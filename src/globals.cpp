@@ -1,16 +1,39 @@
 #include "globals.h"
+#include "audio.h"
+#include "envelope.h"
 
 SystemState sysState;
-volatile uint32_t currentStepSize = 0;
+SemaphoreHandle_t i2cMutex;
+VoicePool voices;
+VoiceAllocator voiceAlloc;
+ClockSync clockSync;
+StackEnumerator stackEnum;
+Filter filter;
 
-// runtime config
-bool isSender = true;         // default is sender, can be changed
-uint8_t moduleOctave = 4;     // default octave
+// Resonance and cutoff cover every filter position, starting flat and fully
+// open, and speed up on fast sweeps. Release starts at 50 ms.
+KnobBank knobs({
+  {0, FILTER_STEPS - 1, 0, 8},
+  {0, FILTER_STEPS - 1, FILTER_STEPS - 1, 8},
+  {0, sizeof(ENVELOPE_KNOB_TIMES_MS) / sizeof(ENVELOPE_KNOB_TIMES_MS[0]) - 1, 4, 1},
+  {0, MAX_VOLUME, 0, 1}
+});
 
-// Queues and semaphores
-QueueHandle_t msgInQ = NULL;
-QueueHandle_t msgOutQ = NULL;
-SemaphoreHandle_t CAN_TX_Semaphore = NULL;
+Joystick joystick;
+
+// runtime config, until the stack has been numbered
+uint8_t moduleOctave = STACK_BASE_OCTAVE;
+Temperament temperament = Temperament::Equal;
+
+// Event rings
+KeyEventRing keyEventQ;
+CanRing msgInQ;
+CanRing bulkInQ;
+#ifdef MIDI_SERIAL
+MidiRing midiOutQ;
+#endif
+
+// Last received note change, for the display
 uint8_t RX_Message_Global[8] = {0};
 
 
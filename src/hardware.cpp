@@ -1,3 +1,4 @@
+#include <Wire.h>
 #include "hardware.h"
 
 // ---------------------------------------------------------------------
@@ -25,7 +26,11 @@ const int OUTR_PIN = A3;
 const int JOYY_PIN = A0;
 const int JOYX_PIN = A1;
 
+// Knob expander interrupt pin (PA10).
+const int KNOB_INT_PIN = D0;
+
 // Output multiplexer bits.
+const int KNOB_MODE_BIT = 2;
 const int DEN_BIT  = 3;
 const int DRST_BIT = 4;
 const int HKOW_BIT = 5;
@@ -38,8 +43,30 @@ const int HKOE_BIT = 6;
 // Construct display object (using hardware I2C).
 U8G2_SSD1305_128X32_ADAFRUIT_F_HW_I2C u8g2(U8G2_R0);
 
-// Create audio timer object.
-HardwareTimer sampleTimer(TIM1);
+// GPIO port and bit of a pin, for register access from the key scanner.
+struct FastPin {
+  GPIO_TypeDef* port;
+  uint32_t mask;
+};
+
+static FastPin rowPins[3];
+static FastPin renPin;
+static FastPin outPin;
+static FastPin colPins[4];
+
+static FastPin fastPin(int pin) {
+  FastPin p = {digitalPinToPort(pin), digitalPinToBitMask(pin)};
+  return p;
+}
+
+// A single BSRR store sets or resets the pin without a read-modify-write.
+static inline void writeFast(const FastPin& p, bool value) {
+  p.port->BSRR = value ? p.mask : p.mask << 16;
+}
+
+static inline bool readFast(const FastPin& p) {
+  return p.port->IDR & p.mask;
+}
 
 // ---------------------------------------------------------------------
 //              HARDWARE INITIALIZATION FUNCTIONS
@@ -53,7 +80,6 @@ void initHardware() {
   pinMode(REN_PIN, OUTPUT);
   pinMode(OUT_PIN, OUTPUT);
   pinMode(OUTL_PIN, OUTPUT);
-  pinMode(OUTR_PIN, OUTPUT);
   pinMode(LED_BUILTIN, OUTPUT);
 
   // Set input pin modes.
@@ -63,6 +89,17 @@ void initHardware() {
   pinMode(C3_PIN, INPUT);
   pinMode(JOYX_PIN, INPUT);
   pinMode(JOYY_PIN, INPUT);
+
+  // Look up the port registers once for setRow() and readCols().
+  rowPins[0] = fastPin(RA0_PIN);
+  rowPins[1] = fastPin(RA1_PIN);
+  rowPins[2] = fastPin(RA2_PIN);
+  renPin = fastPin(REN_PIN);
+  outPin = fastPin(OUT_PIN);
+  colPins[0] = fastPin(C0_PIN);
+  colPins[1] = fastPin(C1_PIN);
+  colPins[2] = fastPin(C2_PIN);
+  colPins[3] = fastPin(C3_PIN);
 }
 
 void initDisplay() {
@@ -74,10 +111,17 @@ void initDisplay() {
   setOutMuxBit(DEN_BIT, HIGH);  // Enable display power supply.
 }
 
-void initAudio() {
-  // Initialize audio output timer.
-  sampleTimer.setOverflow(22000, HERTZ_FORMAT);
-  sampleTimer.resume();
+uint32_t moduleUid() {
+  // FNV-1a over the 12 bytes of the ID
+  const uint32_t words[3] = {HAL_GetUIDw0(), HAL_GetUIDw1(), HAL_GetUIDw2()};
+  uint32_t hash = 2166136261u;
+  for (uint32_t word : words) {
+    for (uint8_t i = 0; i < 4; i++) {
+      hash ^= (word >> (8 * i)) & 0xff;
+      hash *= 16777619u;
+    }
+  }
+  return hash;
 }
 
 void setOutMuxBit(const uint8_t bitIdx, const bool value) {
@@ -91,24 +135,285 @@ void setOutMuxBit(const uint8_t bitIdx, const bool value) {
   digitalWrite(REN_PIN, LOW);
 }
 
+// u8g2's byte callback wrapped so each transaction holds the bus mutex.
+static SemaphoreHandle_t displayBusMutex = NULL;
+static u8x8_msg_cb displayByteCb = NULL;
+
+static uint8_t lockedDisplayByteCb(u8x8_t* u8x8, uint8_t msg, uint8_t arg_int, void* arg_ptr) {
+  if (msg == U8X8_MSG_BYTE_START_TRANSFER) xSemaphoreTake(displayBusMutex, portMAX_DELAY);
+  uint8_t result = displayByteCb(u8x8, msg, arg_int, arg_ptr);
+  if (msg == U8X8_MSG_BYTE_END_TRANSFER) xSemaphoreGive(displayBusMutex);
+  return result;
+}
+
+void shareDisplayBus(SemaphoreHandle_t mutex) {
+  displayBusMutex = mutex;
+  u8x8_t* u8x8 = u8g2.getU8x8();
+  displayByteCb = u8x8->byte_cb;
+  u8x8->byte_cb = lockedDisplayByteCb;
+}
+
+// ---------------------------------------------------------------------
+//                     KNOB EXPANDER (V2 MODULES)
+// ---------------------------------------------------------------------
+
+constexpr uint8_t PCAL_ADDRESS = 0x21;
+
+// PCAL6408A registers
+constexpr uint8_t PCAL_INPUT       = 0x00;
+constexpr uint8_t PCAL_CONFIG      = 0x03;  // 1 = input
+constexpr uint8_t PCAL_INPUT_LATCH = 0x42;
+constexpr uint8_t PCAL_PULL_ENABLE = 0x43;
+constexpr uint8_t PCAL_PULL_SELECT = 0x44;  // 1 = pull-up
+constexpr uint8_t PCAL_INT_MASK    = 0x45;  // 0 = interrupt enabled
+
+static bool writeExpander(uint8_t reg, uint8_t value) {
+  Wire.beginTransmission(PCAL_ADDRESS);
+  Wire.write(reg);
+  Wire.write(value);
+  return Wire.endTransmission() == 0;
+}
+
+bool initKnobExpander() {
+  // The interrupt output is open drain
+  pinMode(KNOB_INT_PIN, INPUT_PULLUP);
+
+  return writeExpander(PCAL_CONFIG, 0xff)
+      && writeExpander(PCAL_PULL_SELECT, 0xff)
+      && writeExpander(PCAL_PULL_ENABLE, 0xff)
+      && writeExpander(PCAL_INPUT_LATCH, 0xff)
+      && writeExpander(PCAL_INT_MASK, 0x00);
+}
+
+bool readKnobExpander(uint8_t& pins) {
+  Wire.beginTransmission(PCAL_ADDRESS);
+  Wire.write(PCAL_INPUT);
+  if (Wire.endTransmission(false) != 0) return false;
+  if (Wire.requestFrom(PCAL_ADDRESS, (uint8_t) 1) != 1) return false;
+  pins = Wire.read();
+  return true;
+}
+
+void attachKnobInterrupt(void (*isr)()) {
+  attachInterrupt(digitalPinToInterrupt(KNOB_INT_PIN), isr, FALLING);
+}
+
+bool knobInterruptPending() {
+  return digitalRead(KNOB_INT_PIN) == LOW;
+}
+
 // ---------------------------------------------------------------------
 //            HELPER FUNCTIONS FOR KEY SCANNING
 // ---------------------------------------------------------------------
 
-void setRow(uint8_t rowIdx) {
-  digitalWrite(REN_PIN, LOW);  // Disable row selection.
-  digitalWrite(RA0_PIN, rowIdx & 0x01);
-  digitalWrite(RA1_PIN, rowIdx & 0x02);
-  digitalWrite(RA2_PIN, rowIdx & 0x04);
-  digitalWrite(REN_PIN, HIGH); // Enable row selection.
+void setRow(uint8_t rowIdx, bool outBit) {
+  writeFast(renPin, LOW);  // Disable row selection.
+  writeFast(rowPins[0], rowIdx & 0x01);
+  writeFast(rowPins[1], rowIdx & 0x02);
+  writeFast(rowPins[2], rowIdx & 0x04);
+  writeFast(outPin, outBit);
+  writeFast(renPin, HIGH); // Enable row selection, latching outBit.
 }
 
 std::bitset<4> readCols() {
-  std::bitset<4> result;
-  result[0] = digitalRead(C0_PIN);
-  result[1] = digitalRead(C1_PIN);
-  result[2] = digitalRead(C2_PIN);
-  result[3] = digitalRead(C3_PIN);
-  return result;
+  return std::bitset<4>(readColBits());
 }
 
+uint8_t readColBits() {
+  return readFast(colPins[0])
+       | readFast(colPins[1]) << 1
+       | readFast(colPins[2]) << 2
+       | readFast(colPins[3]) << 3;
+}
+
+
+// ---------------------------------------------------------------------
+//                      AUDIO SAMPLE STREAM
+// ---------------------------------------------------------------------
+
+// DMA1 channel 3 request 6 is DAC1 channel 1
+constexpr uint32_t DAC_DMA_REQUEST = 6;
+
+// Interrupt priority, must not be above configMAX_SYSCALL_INTERRUPT_PRIORITY
+constexpr uint32_t DAC_DMA_IRQ_PRIORITY = 5;
+
+static SampleHalfCallback sampleHalfCallback = NULL;
+
+// Completed passes over the buffer, and the samples in one pass
+static volatile uint32_t streamLoops = 0;
+static uint32_t streamLength = 0;
+
+bool startSampleStream(const uint16_t* buffer, uint32_t halfSize, uint32_t sampleRate,
+                       SampleHalfCallback onHalfSent) {
+  sampleHalfCallback = onHalfSent;
+  streamLoops = 0;
+  streamLength = 2 * halfSize;
+
+  // Enable the peripheral clocks
+  RCC->APB1ENR1 |= RCC_APB1ENR1_TIM6EN | RCC_APB1ENR1_DAC1EN;
+  RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
+  (void) RCC->AHB1ENR;
+
+  // The DAC drives the pin directly, it must be in analogue mode
+  pinMode(OUTR_PIN, INPUT_ANALOG);
+
+  // TIM6 generates TRGO on every update event at the sample rate
+  TIM6->CR1 = 0;
+  TIM6->PSC = 0;
+  TIM6->ARR = HAL_RCC_GetPCLK1Freq() / sampleRate - 1;
+  TIM6->CR2 = TIM_CR2_MMS_1;
+  TIM6->EGR = TIM_EGR_UG;
+
+  // DMA1 channel 3: memory to DAC holding register, 16-bit, circular
+  DMA1_Channel3->CCR = 0;
+  DMA1_CSELR->CSELR = (DMA1_CSELR->CSELR & ~DMA_CSELR_C3S) | (DAC_DMA_REQUEST << DMA_CSELR_C3S_Pos);
+  DMA1_Channel3->CPAR = (uint32_t) &DAC1->DHR12R1;
+  DMA1_Channel3->CMAR = (uint32_t) buffer;
+  DMA1_Channel3->CNDTR = 2 * halfSize;
+  DMA1_Channel3->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_DIR
+                     | DMA_CCR_MSIZE_0 | DMA_CCR_PSIZE_0
+                     | DMA_CCR_HTIE | DMA_CCR_TCIE;
+
+  HAL_NVIC_SetPriority(DMA1_Channel3_IRQn, DAC_DMA_IRQ_PRIORITY, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel3_IRQn);
+  DMA1_Channel3->CCR |= DMA_CCR_EN;
+
+  // DAC1 channel 1: buffered output, triggered by TIM6 TRGO (TSEL = 0), DMA requests
+  DAC1->CR &= ~(DAC_CR_EN1 | DAC_CR_TSEL1);
+  DAC1->DHR12R1 = buffer[0];
+  DAC1->CR |= DAC_CR_TEN1 | DAC_CR_DMAEN1 | DAC_CR_EN1;
+
+  TIM6->CR1 |= TIM_CR1_CEN;
+  return true;
+}
+
+void stopSampleStream() {
+  TIM6->CR1 &= ~TIM_CR1_CEN;
+  DMA1_Channel3->CCR &= ~DMA_CCR_EN;
+  HAL_NVIC_DisableIRQ(DMA1_Channel3_IRQn);
+  DAC1->CR &= ~(DAC_CR_DMAEN1 | DAC_CR_EN1);
+}
+
+// Half-transfer and transfer-complete interrupts for the DAC stream
+extern "C" void DMA1_Channel3_IRQHandler(void) {
+  uint32_t flags = DMA1->ISR;
+
+  if (flags & DMA_ISR_HTIF3) {
+    DMA1->IFCR = DMA_IFCR_CHTIF3;
+    if (sampleHalfCallback) sampleHalfCallback(0);
+  }
+  if (flags & DMA_ISR_TCIF3) {
+    DMA1->IFCR = DMA_IFCR_CTCIF3;
+    streamLoops = streamLoops + 1;
+    if (sampleHalfCallback) sampleHalfCallback(1);
+  }
+}
+
+uint32_t sampleClock() {
+  UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+  uint32_t loops = streamLoops;
+  const uint32_t remaining = DMA1_Channel3->CNDTR;
+
+  // The DMA has wrapped but its interrupt hasn't run yet, so the count has
+  // reloaded without the pass being counted
+  if ((DMA1->ISR & DMA_ISR_TCIF3) && remaining > streamLength / 2) loops++;
+  taskEXIT_CRITICAL_FROM_ISR(saved);
+
+  return loops * streamLength + (streamLength - remaining);
+}
+
+// ---------------------------------------------------------------------
+//                           JOYSTICK ADC
+// ---------------------------------------------------------------------
+
+// DMA1 channel 1 request 0 is ADC1
+constexpr uint32_t ADC_DMA_REQUEST = 0;
+
+// ADC1 inputs of the joystick pins: A0 (PA0) is IN5 and A1 (PA1) is IN6
+constexpr uint32_t JOYY_ADC_CHANNEL = 5;
+constexpr uint32_t JOYX_ADC_CHANNEL = 6;
+
+// Longest sampling time, 640.5 ADC clocks, for the joystick's high source impedance
+constexpr uint32_t JOY_ADC_SAMPLE_TIME = 7;
+
+// Calibration and ready flags come up within a few hundred ADC clocks
+constexpr uint32_t ADC_TIMEOUT_US = 1000;
+
+// Y and X alternately, the order of the conversion sequence
+static volatile uint16_t joystickSamples[2 * JOYSTICK_DMA_PAIRS];
+
+static bool waitAdc(volatile uint32_t& reg, uint32_t mask, bool set) {
+  uint32_t start = micros();
+  while (((reg & mask) != 0) != set) {
+    if (micros() - start > ADC_TIMEOUT_US) return false;
+  }
+  return true;
+}
+
+bool startJoystickSampling() {
+  RCC->AHB2ENR |= RCC_AHB2ENR_ADCEN;
+  RCC->AHB1ENR |= RCC_AHB1ENR_DMA1EN;
+  (void) RCC->AHB2ENR;
+
+  pinMode(JOYX_PIN, INPUT_ANALOG);
+  pinMode(JOYY_PIN, INPUT_ANALOG);
+
+  // Synchronous clock, HCLK / 4. With the oversampling each pair of
+  // conversions takes about 1 ms at 80 MHz.
+  ADC1_COMMON->CCR = (ADC1_COMMON->CCR & ~ADC_CCR_CKMODE) | ADC_CCR_CKMODE_1 | ADC_CCR_CKMODE_0;
+
+  // Out of deep power down, then the regulator needs 20 us to start
+  ADC1->CR &= ~ADC_CR_DEEPPWD;
+  ADC1->CR |= ADC_CR_ADVREGEN;
+  delayMicroseconds(20);
+
+  // Single-ended offset calibration
+  ADC1->CR &= ~ADC_CR_ADCALDIF;
+  ADC1->CR |= ADC_CR_ADCAL;
+  if (!waitAdc(ADC1->CR, ADC_CR_ADCAL, false)) return false;
+
+  // Sequence of two: Y then X
+  ADC1->SQR1 = (1 << ADC_SQR1_L_Pos)
+             | (JOYY_ADC_CHANNEL << ADC_SQR1_SQ1_Pos)
+             | (JOYX_ADC_CHANNEL << ADC_SQR1_SQ2_Pos);
+  ADC1->SMPR1 = (JOY_ADC_SAMPLE_TIME << ADC_SMPR1_SMP5_Pos)
+              | (JOY_ADC_SAMPLE_TIME << ADC_SMPR1_SMP6_Pos);
+
+  // Continuous conversion with circular DMA. Each result is the sum of 16
+  // conversions shifted right by 4, so it stays 12 bits.
+  ADC1->CFGR = ADC_CFGR_CONT | ADC_CFGR_DMAEN | ADC_CFGR_DMACFG | ADC_CFGR_OVRMOD;
+  ADC1->CFGR2 = ADC_CFGR2_ROVSE | (3 << ADC_CFGR2_OVSR_Pos) | (4 << ADC_CFGR2_OVSS_Pos);
+
+  // Both axes read centred until the first conversions land
+  for (uint8_t i = 0; i < 2 * JOYSTICK_DMA_PAIRS; i++) joystickSamples[i] = 2048;
+
+  // DMA1 channel 1: ADC data register to memory, 16-bit, circular, no
+  // interrupts. Its transfer complete flag then says the buffer has filled.
+  DMA1_Channel1->CCR = 0;
+  DMA1->IFCR = DMA_IFCR_CGIF1;
+  DMA1_CSELR->CSELR = (DMA1_CSELR->CSELR & ~DMA_CSELR_C1S) | (ADC_DMA_REQUEST << DMA_CSELR_C1S_Pos);
+  DMA1_Channel1->CPAR = (uint32_t) &ADC1->DR;
+  DMA1_Channel1->CMAR = (uint32_t) joystickSamples;
+  DMA1_Channel1->CNDTR = 2 * JOYSTICK_DMA_PAIRS;
+  DMA1_Channel1->CCR = DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_MSIZE_0 | DMA_CCR_PSIZE_0;
+  DMA1_Channel1->CCR |= DMA_CCR_EN;
+
+  ADC1->ISR = ADC_ISR_ADRDY;
+  ADC1->CR |= ADC_CR_ADEN;
+  if (!waitAdc(ADC1->ISR, ADC_ISR_ADRDY, true)) return false;
+
+  ADC1->CR |= ADC_CR_ADSTART;
+  return true;
+}
+
+// The DMA may be half way through a pair, which doesn't matter for a mean
+bool readJoystick(uint16_t& x, uint16_t& y) {
+  uint32_t sumX = 0, sumY = 0;
+  for (uint8_t i = 0; i < JOYSTICK_DMA_PAIRS; i++) {
+    sumY += joystickSamples[2 * i];
+    sumX += joystickSamples[2 * i + 1];
+  }
+  x = sumX / JOYSTICK_DMA_PAIRS;
+  y = sumY / JOYSTICK_DMA_PAIRS;
+  return DMA1->ISR & DMA_ISR_TCIF1;
+}
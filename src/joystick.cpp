@@ -0,0 +1,87 @@
+#include <Arduino.h>
+#include <STM32FreeRTOS.h>
+#include "joystick.h"
+#include "globals.h"
+#include "hardware.h"
+#include "LockGuard.h"
+
+Joystick::Joystick()
+    : centreReadings_(0), centreSumX_(0), centreSumY_(0), centreX_(0), centreY_(0),
+      smoothX_(0), smoothY_(0), x_(0), y_(0) {}
+
+// Offset from the centre in ADC counts to an axis value, before smoothing
+int32_t Joystick::shape(int32_t offset) {
+  const int32_t magnitude = offset < 0 ? -offset : offset;
+  if (magnitude <= JOYSTICK_DEAD_ZONE) return 0;
+
+  int32_t value = (magnitude - JOYSTICK_DEAD_ZONE) * JOYSTICK_FULL_SCALE
+                / (JOYSTICK_SPAN - JOYSTICK_DEAD_ZONE);
+  if (value > JOYSTICK_FULL_SCALE) value = JOYSTICK_FULL_SCALE;
+  return offset < 0 ? -value : value;
+}
+
+int16_t Joystick::rounded(int32_t q8) {
+  return q8 < 0 ? -((-q8 + 128) >> 8) : (q8 + 128) >> 8;
+}
+
+void Joystick::update(uint16_t rawX, uint16_t rawY) {
+  // The stick is taken to be at rest while the centre is averaged
+  if (centreReadings_ < JOYSTICK_CENTRE_READINGS) {
+    centreSumX_ += rawX;
+    centreSumY_ += rawY;
+    if (++centreReadings_ < JOYSTICK_CENTRE_READINGS) return;
+    centreX_ = (centreSumX_ + JOYSTICK_CENTRE_READINGS / 2) / JOYSTICK_CENTRE_READINGS;
+    centreY_ = (centreSumY_ + JOYSTICK_CENTRE_READINGS / 2) / JOYSTICK_CENTRE_READINGS;
+  }
+
+  smoothX_ += ((shape(rawX - centreX_) << 8) - smoothX_) >> JOYSTICK_SMOOTHING_SHIFT;
+  smoothY_ += ((shape(rawY - centreY_) << 8) - smoothY_) >> JOYSTICK_SMOOTHING_SHIFT;
+
+  // The filter stops a few Q8 counts short of its target, so round to the
+  // nearest value to settle on exactly 0 and full scale
+  x_.store(rounded(smoothX_), std::memory_order_relaxed);
+  y_.store(rounded(smoothY_), std::memory_order_relaxed);
+}
+
+// Triangle from -JOYSTICK_FULL_SCALE to JOYSTICK_FULL_SCALE for a 32-bit phase
+static int32_t triangle(uint32_t phase) {
+  const int32_t ramp = (int32_t) (phase >> 16) - 32768;  // -32768..32767
+  const int32_t folded = ramp < 0 ? -ramp : ramp;       // 0..32768
+  return (folded - 16384) * JOYSTICK_FULL_SCALE / 16384;
+}
+
+void joystickTask(void *pvParameters) {
+  const TickType_t xFrequency = JOYSTICK_PERIOD_MS / portTICK_PERIOD_MS;
+  TickType_t xLastWakeTime = xTaskGetTickCount();
+
+  // Vibrato phase step per control period
+  const uint32_t vibratoStep = (uint32_t) ((uint64_t) VIBRATO_RATE_MHZ * JOYSTICK_PERIOD_MS
+                                           * 4294967296ull / 1000000);
+  uint32_t vibratoPhase = 0;
+
+  while (1) {
+    vTaskDelayUntil(&xLastWakeTime, xFrequency);
+
+    // Nothing to centre on until the ADC has filled its buffer
+    uint16_t rawX, rawY;
+    if (!readJoystick(rawX, rawY)) continue;
+    joystick.update(rawX, rawY);
+
+    // X bends, Y sets the vibrato depth whichever way it is pushed
+    const int32_t x = joystick.x();
+    const int32_t y = joystick.y();
+    int32_t cents = x * PITCH_BEND_RANGE_CENTS / JOYSTICK_FULL_SCALE;
+    if (y) {
+      const int32_t depth = (y < 0 ? -y : y) * VIBRATO_DEPTH_CENTS;
+      cents += depth * triangle(vibratoPhase) / JOYSTICK_FULL_SCALE / JOYSTICK_FULL_SCALE;
+      vibratoPhase += vibratoStep;
+    } else {
+      vibratoPhase = 0;
+    }
+
+    if (cents != voices.getPitchBend()) {
+      LockGuard lock(sysState.mutex);
+      voices.setPitchBend(cents);
+    }
+  }
+}
@@ -0,0 +1,115 @@
+#include <Arduino.h>
+#include "keyScanner.h"
+#include "hardware.h"
+#include "profiler.h"
+
+// Interrupt priority, must not be above configMAX_SYSCALL_INTERRUPT_PRIORITY
+constexpr uint32_t KEY_SCAN_IRQ_PRIORITY = 6;
+
+// Row read in each timer slot. Key rows come round every fourth slot and
+// the knob and handshake rows take turns in the remaining one.
+constexpr uint8_t SCAN_SCHEDULE[] = {
+  0, 1, 2, 3,
+  0, 1, 2, 4,
+  0, 1, 2, 5,
+  0, 1, 2, 6
+};
+constexpr uint8_t SCAN_SLOTS = sizeof(SCAN_SCHEDULE);
+
+KeyScanner keyScanner;
+
+static HardwareTimer scanTimer(TIM7);
+
+static void scanTimerISR() {
+  PROFILE_SCOPE(ProfileSite::KeyScanISR);
+  keyScanner.onTick();
+}
+
+KeyScanner::KeyScanner()
+    : events_(nullptr), keys_(0), outBits_(0xff), slot_(0), pendingEvents_(false) {
+  for (uint8_t row = 0; row < SCAN_ROWS; row++) {
+    rows_[row].store(0x0f, std::memory_order_relaxed);
+  }
+  for (uint8_t key = 0; key < NUM_KEYS; key++) {
+    integrator_[key] = 0;
+    settled_[key] = KEY_DEBOUNCE_COUNT;
+  }
+}
+
+bool KeyScanner::begin(KeyEventRing& events) {
+  events_ = &events;
+
+  // Select the first row so the first interrupt has something to read
+  slot_ = 0;
+  uint8_t row = SCAN_SCHEDULE[0];
+  setRow(row, (outBits_.load(std::memory_order_relaxed) >> row) & 1);
+
+  scanTimer.setOverflow(KEY_SCAN_RATE, HERTZ_FORMAT);
+  scanTimer.setInterruptPriority(KEY_SCAN_IRQ_PRIORITY, 0);
+  scanTimer.attachInterrupt(scanTimerISR);
+  scanTimer.resume();
+  return true;
+}
+
+void KeyScanner::end() {
+  scanTimer.pause();
+}
+
+void KeyScanner::setOutBit(uint8_t bit, bool value) {
+  uint8_t mask = 1 << bit;
+  if (value) outBits_.fetch_or(mask, std::memory_order_relaxed);
+  else outBits_.fetch_and(~mask, std::memory_order_relaxed);
+}
+
+void KeyScanner::onTick() {
+  // The row selected last tick has settled, read it and move on
+  uint8_t row = SCAN_SCHEDULE[slot_];
+  uint8_t cols = readColBits();
+  rows_[row].store(cols, std::memory_order_relaxed);
+
+  slot_ = (slot_ + 1) % SCAN_SLOTS;
+  uint8_t next = SCAN_SCHEDULE[slot_];
+  setRow(next, (outBits_.load(std::memory_order_relaxed) >> next) & 1);
+
+  if (row < KEY_ROWS) debounceRow(row, cols);
+
+  // Changes from a whole pass over the key rows are handed over together,
+  // so scanKeysTask can send them as one CAN frame
+  if (row == KEY_ROWS - 1 && pendingEvents_) {
+    pendingEvents_ = false;
+    events_->notify();
+  }
+}
+
+void KeyScanner::debounceRow(uint8_t row, uint8_t cols) {
+  uint32_t keys = keys_.load(std::memory_order_relaxed);
+
+  for (uint8_t col = 0; col < 4; col++) {
+    uint8_t key = row * 4 + col;
+    bool down = !(cols & (1 << col));  // Active low
+    uint8_t& count = integrator_[key];
+    uint8_t& settled = settled_[key];
+    bool pressed = keys & (1u << key);
+
+    // A settled key goes down at once, with the integrator full so its
+    // chatter can't release it
+    if (down && !pressed && settled == KEY_DEBOUNCE_COUNT) count = KEY_DEBOUNCE_COUNT;
+
+    // Otherwise count towards the reading, and only flip state at either end
+    if (down && count < KEY_DEBOUNCE_COUNT) count++;
+    else if (!down && count > 0) count--;
+    if (down) settled = 0;
+    else if (settled < KEY_DEBOUNCE_COUNT) settled++;
+
+    if (pressed ? count != 0 : count != KEY_DEBOUNCE_COUNT) continue;
+
+    // The lockout runs from the release, so its chatter can't press again
+    keys ^= 1u << key;
+    if (pressed) settled = 0;
+    KeyEvent event = {micros(), key, !pressed};
+    // Counts an overflow if scanKeysTask has fallen behind
+    if (events_->push(event, false)) pendingEvents_ = true;
+  }
+
+  keys_.store(keys, std::memory_order_relaxed);
+}
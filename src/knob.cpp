@@ -0,0 +1,81 @@
+#include "knob.h"
+
+// Marks a reading where both pins changed
+constexpr int8_t KNOB_SKIPPED = 2;
+
+// Step for each previous (high two bits) and current A/B state, with A in
+// bit 0 and B in bit 1. Turning up goes 00, 01, 11, 10.
+static const int8_t KNOB_TRANSITIONS[16] = {
+  //  00             01             10             11
+       0,            +1,            -1,  KNOB_SKIPPED,  // from 00
+      -1,             0,  KNOB_SKIPPED,            +1,  // from 01
+      +1,  KNOB_SKIPPED,             0,            -1,  // from 10
+  KNOB_SKIPPED,      -1,            +1,             0   // from 11
+};
+
+KnobBank::KnobBank(const KnobConfig (&configs)[NUM_KNOBS])
+    : steps_(0), missed_(0), lastPins_(0), primed_(false) {
+  for (uint8_t knob = 0; knob < NUM_KNOBS; knob++) {
+    Decoder& d = decoders_[knob];
+    d.config = configs[knob];
+    d.value = clamp(d.config, d.config.initial);
+    d.direction = 0;
+    d.lastStep = 0;
+    values_[knob].store(d.value, std::memory_order_relaxed);
+  }
+}
+
+int16_t KnobBank::clamp(const KnobConfig& config, int32_t value) const {
+  if (value < config.min) return config.min;
+  if (value > config.max) return config.max;
+  return value;
+}
+
+void KnobBank::set(uint8_t knob, int16_t value) {
+  Decoder& d = decoders_[knob];
+  d.value = clamp(d.config, value);
+  values_[knob].store(d.value, std::memory_order_relaxed);
+}
+
+void KnobBank::update(uint8_t pins, uint32_t nowUs) {
+  if (!primed_) {
+    lastPins_ = pins;
+    primed_ = true;
+    return;
+  }
+
+  const uint8_t changed = pins ^ lastPins_;
+  for (uint8_t knob = 0; knob < NUM_KNOBS && changed; knob++) {
+    const uint8_t shift = 2 * (NUM_KNOBS - 1 - knob);
+    if (!((changed >> shift) & 0b11)) continue;
+
+    Decoder& d = decoders_[knob];
+    const uint8_t index = ((lastPins_ >> shift) & 0b11) << 2 | ((pins >> shift) & 0b11);
+    int8_t delta = KNOB_TRANSITIONS[index];
+    if (delta == KNOB_SKIPPED) {
+      missed_.fetch_add(1, std::memory_order_relaxed);
+      delta = 2 * d.direction;
+      if (!delta) continue;
+    } else {
+      steps_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Steps in a hurry in the same direction count more. A reversal
+    // always starts at single steps.
+    const int8_t direction = delta > 0 ? 1 : -1;
+    int32_t gain = 1;
+    if (direction == d.direction && d.config.maxAccel > 1) {
+      const uint32_t interval = nowUs - d.lastStep;
+      if (interval < KNOB_ACCEL_REFERENCE_US) {
+        gain = interval ? KNOB_ACCEL_REFERENCE_US / interval : d.config.maxAccel;
+        if (gain > d.config.maxAccel) gain = d.config.maxAccel;
+      }
+    }
+    d.direction = direction;
+    d.lastStep = nowUs;
+
+    d.value = clamp(d.config, d.value + delta * gain);
+    values_[knob].store(d.value, std::memory_order_relaxed);
+  }
+  lastPins_ = pins;
+}
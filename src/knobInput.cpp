@@ -0,0 +1,165 @@
+#include <Arduino.h>
+#include <atomic>
+#include <STM32FreeRTOS.h>
+#include "knobInput.h"
+#include "globals.h"
+#include "hardware.h"
+#include "envelope.h"
+#include "LockGuard.h"
+#include "keyScanner.h"
+#include "taskNotify.h"
+#include "profiler.h"
+#include "eventLog.h"
+
+// After a failed read the expander is tried again this soon
+constexpr uint32_t KNOB_RETRY_MS = 5;
+
+static KnobStats stats;
+static std::atomic<bool> onExpander(false);
+
+// Set by the interrupt, cleared by the read that serves it
+static TaskHandle_t knobTaskHandle = NULL;
+static std::atomic<bool> interruptPending(false);
+static std::atomic<uint32_t> interruptTime(0);
+static std::atomic<uint32_t> interruptCount(0);
+
+// Owned by updateKnobs()
+static bool primed = false;
+static uint8_t lastPins = 0;
+static int16_t lastReleaseSetting = -1;
+
+void updateKnobs(uint8_t pins) {
+    if (primed && pins != lastPins) stats.readings++;
+    primed = true;
+    lastPins = pins;
+    knobs.update(pins, micros());
+
+    int16_t releaseSetting = knobs.get(KNOB_RELEASE);
+    if (releaseSetting != lastReleaseSetting) {
+        LockGuard lock(sysState.mutex);
+        EnvelopeParams envelope = voices.getEnvelope();
+        envelope.releaseRate = envelopeRate(ENVELOPE_KNOB_TIMES_MS[releaseSetting]);
+        voices.setEnvelope(envelope);
+        lastReleaseSetting = releaseSetting;
+    }
+
+    // The filter smooths the steps itself, so no lock is needed
+    filter.setCutoff(knobs.get(KNOB_CUTOFF));
+    filter.setResonance(knobs.get(KNOB_RESONANCE));
+}
+
+// The expander pulls its interrupt line low on the first change since the
+// last read, and latches the pin so a short pulse isn't lost.
+static void knobISR() {
+    PROFILE_SCOPE(ProfileSite::KnobISR);
+    interruptCount.fetch_add(1, std::memory_order_relaxed);
+    if (!interruptPending.exchange(true)) interruptTime.store(micros());
+    notifyTaskFromISR(knobTaskHandle);
+}
+
+void knobInputBegin(TaskHandle_t task) {
+    knobTaskHandle = task;
+
+    // KNOB_MODE low takes the knobs off the key matrix columns
+    keyScanner.setOutBit(KNOB_MODE_BIT, LOW);
+    shareDisplayBus(i2cMutex);
+    onExpander.store(true);
+    attachKnobInterrupt(knobISR);
+}
+
+bool knobsOnExpander() {
+    return onExpander.load();
+}
+
+// Reads the expander until its interrupt line is released. A change that
+// lands while a read is in flight keeps the line low, so it is picked up
+// by the next pass rather than waiting for another edge. Returns false if
+// a read failed, which leaves the line low, and the worst interrupt
+// latency served in `worst`.
+static bool readExpander(uint32_t& worst) {
+    PROFILE_SCOPE(ProfileSite::Knobs);
+    worst = 0;
+
+    do {
+        const bool served = interruptPending.exchange(false);
+        const uint32_t since = interruptTime.load();
+
+        uint8_t pins;
+        bool ok;
+        {
+            LockGuard lock(i2cMutex);
+            ok = readKnobExpander(pins);
+        }
+        if (!ok) {
+            // Served by the retry instead
+            if (served) interruptPending.store(true);
+            stats.readFailures++;
+            return false;
+        }
+        updateKnobs(pins);
+
+        if (served) {
+            const uint32_t latency = micros() - since;
+            stats.latencyCount++;
+            stats.totalLatency += latency;
+            if (latency > stats.maxLatency) stats.maxLatency = latency;
+            if (latency > worst) worst = latency;
+        }
+    } while (knobInterruptPending());
+
+    return true;
+}
+
+KnobStats knobStats() {
+    taskENTER_CRITICAL();
+    KnobStats result = stats;
+    taskEXIT_CRITICAL();
+    result.transitions = knobs.steps();
+    result.missed = knobs.missed();
+    result.interrupts = interruptCount.load(std::memory_order_relaxed);
+    return result;
+}
+
+void knobInputTask(void *pvParameters) {
+    // Woken by the expander interrupt. Once a second the knob activity is
+    // logged, if there was any.
+    const TickType_t reportPeriod = 1000 / portTICK_PERIOD_MS;
+    const TickType_t retryPeriod = KNOB_RETRY_MS / portTICK_PERIOD_MS;
+    TickType_t nextReport = xTaskGetTickCount() + reportPeriod;
+    KnobStats reported = {};
+    uint32_t periodMaxLatency = 0;
+
+    // The first read sets the starting positions and clears anything
+    // latched while the expander was being configured
+    uint32_t latency;
+    bool retry = !readExpander(latency);
+
+    while (1) {
+        TickType_t now = xTaskGetTickCount();
+        TickType_t wait = (int32_t) (nextReport - now) > 0 ? nextReport - now : 0;
+        if (retry && wait > retryPeriod) wait = retryPeriod;
+
+        // The interrupt is on the falling edge, so after a failed read the
+        // line stays low and no edge comes again until a read succeeds. It
+        // is checked on every wake-up, and soon after a failure.
+        const bool notified = ulTaskNotifyTake(pdTRUE, wait);
+        if (notified || knobInterruptPending()) {
+            retry = !readExpander(latency);
+            if (latency > periodMaxLatency) periodMaxLatency = latency;
+        }
+
+        if ((int32_t) (xTaskGetTickCount() - nextReport) >= 0) {
+            nextReport += reportPeriod;
+            KnobStats current = knobStats();
+            if (current.readings != reported.readings) {
+                logEvent(LogId::KnobRate, current.transitions - reported.transitions,
+                         current.missed - reported.missed, periodMaxLatency);
+            }
+            if (current.readFailures != reported.readFailures) {
+                logEvent(LogId::KnobReadFailed, current.readFailures - reported.readFailures);
+            }
+            reported = current;
+            periodMaxLatency = 0;
+        }
+    }
+}
@@ -10,54 +10,54 @@
 #include "hardware.h"
 #include "scanKeys.h"
 #include "display.h"
-#include "knob.h"  
+#include "knobInput.h"
+#include "joystick.h"
+#include "voiceAllocator.h"
+#include "clockSync.h"
+#include "stackEnum.h"
+#include "midi.h"
 #include "can_tx_task.h"
 #include "decodeTask.h"
-
-
-// ---------------------------------------------------------------------
-//                     AUDIO & KEY PARAMETERS
-// ---------------------------------------------------------------------
-
-const uint32_t SAMPLE_RATE = 22000;
-constexpr float BASE_FREQ = 440.0;
-constexpr uint8_t NUM_KEYS = 12;
-constexpr uint8_t MAX_VOLUME = 8;
-
-// Create an atomic variable and a knob instance.
-std::atomic<int8_t> knob3Rotation(0);
-Knob knob3Class(knob3Rotation);
-
-// Audio sampling ISR – calculates waveform value and writes to the analogue output.
-void sampleISR() {
-  static uint32_t phaseAcc = 0;
-  phaseAcc += currentStepSize;
-  int32_t Vout = (phaseAcc >> 24) - 128;
-  Vout = Vout >> (MAX_VOLUME - knob3Class.getRotation());
-  // Convert from signed (-128..127) to unsigned (0..255) and write output.
-  analogWrite(OUTR_PIN, (Vout + 128)/20);
+#include "audio.h"
+#include "dacDmaSink.h"
+#include "keyScanner.h"
+#include "taskNotify.h"
+#include "canTxScheduler.h"
+#include "profiler.h"
+#include "eventLog.h"
+
+
+// For receiving: empty the FIFO into its ring, then wake decodeTask once.
+// Each frame is stamped with the sample clock for clock sync.
+static void drainRxFifo(uint32_t fifo, CanRing& ring) {
+  CanMessage rxMsg = {};
+  bool received = false;
+
+  while (CAN_RX(rxMsg.id, rxMsg.data, &rxMsg.length, fifo) == 0) {
+    rxMsg.stamp = sampleClock();
+    ring.push(rxMsg, false);
+    received = true;
+  }
+  if (received) ring.notify();
 }
 
-// For receiving:
+// FIFO 0: note events
 void CAN_RX_ISR(void) {
-  uint32_t rxID = 0;
-  uint8_t rxData[8] = {0};
-
-  // Read from hardware
-  CAN_RX(rxID, rxData);
+  PROFILE_SCOPE(ProfileSite::CanRxISR);
+  drainRxFifo(0, msgInQ);
+}
 
-  // Push to msgInQ
-  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-  xQueueSendFromISR(msgInQ, rxData, &xHigherPriorityTaskWoken);
-  portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+// FIFO 1: clock sync, enumeration, control and telemetry
+void CAN_RX1_ISR(void) {
+  PROFILE_SCOPE(ProfileSite::CanRx1ISR);
+  drainRxFifo(1, bulkInQ);
 }
 
 // For transmitting:
 void CAN_TX_ISR(void) {
-  // A mailbox just freed up
-  BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-  xSemaphoreGiveFromISR(CAN_TX_Semaphore, &xHigherPriorityTaskWoken);
-  portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
+  // A mailbox just freed up, let CAN_TX_Task refill it
+  PROFILE_SCOPE(ProfileSite::CanTxISR);
+  canTx.onMailboxFree();
 }
 
 
@@ -66,65 +66,139 @@ void setup() {
   initHardware();
   initDisplay();
 
-  // 2) Serial
+  // 2) Serial, debug text or MIDI
+#ifdef MIDI_SERIAL
+  Serial.begin(MIDI_SERIAL_BAUD);
+#else
   Serial.begin(9600);
   Serial.println("Hello World");
+#endif
 
-  // 3) Audio timer
-  sampleTimer.attachInterrupt(sampleISR);
-  initAudio();
-
-  // 4) Create the global mutex for shared state
+  // 3) Create the global mutex for shared state
   sysState.mutex = xSemaphoreCreateMutex();
   if (sysState.mutex == NULL) {
       Serial.println("Mutex creation failed!");
       while (1);
   }
+  i2cMutex = xSemaphoreCreateMutex();
+  if (i2cMutex == NULL) {
+      Serial.println("I2C mutex creation failed!");
+      while (1);
+  }
 
-  // -------------------- NEW CODE BELOW --------------------
-  // 5) Create the incoming CAN queue (36 items, each 8 bytes)
-  msgInQ = xQueueCreate(36, 8);
-  if (!msgInQ) {
-    Serial.println("msgInQ creation failed!");
+#ifdef PROFILE_ENABLED
+  // Execution time statistics, dumped by sending 'p' over serial unless
+  // the port carries MIDI
+  profilerBegin();
+#endif
+
+  // 4) Audio output: DMA from a double buffer to the DAC
+  if (!dacSink.begin(SAMPLE_RATE)) {
+    Serial.println("Audio output init failed!");
     while(1);
   }
 
-  // 6) Create the outgoing CAN queue
-  msgOutQ = xQueueCreate(36, 8);
-  if (!msgOutQ) {
-    Serial.println("msgOutQ creation failed!");
+  // 5) Joystick: the ADC converts both axes continuously into a DMA buffer
+  if (!startJoystickSampling()) {
+    Serial.println("Joystick ADC init failed!");
     while(1);
   }
 
-  // 7) Create the counting semaphore for 3 Tx mailboxes
-  CAN_TX_Semaphore = xSemaphoreCreateCounting(3, 3);
-  if (!CAN_TX_Semaphore) {
-    Serial.println("CAN_TX_Semaphore creation failed!");
+  // -------------------- NEW CODE BELOW --------------------
+  // 6) Create tasks
+  // Existing tasks. scanKeys only wakes for key events, so it can sit just
+  // below the audio generator without starving anything.
+  TaskHandle_t scanKeysHandle, displayUpdateHandle, decodeHandle, canTxHandle;
+  xTaskCreate(scanKeysTask, "scanKeys", 214, NULL, 3, &scanKeysHandle);
+  xTaskCreate(displayUpdateTask, "displayUpdate", 512, NULL, 2, &displayUpdateHandle);
+
+  // NEW tasks:
+  // decodeTask to handle incoming messages from msgInQ and bulkInQ
+  xTaskCreate(decodeTask, "decodeTask", 256, NULL, 2, &decodeHandle);
+
+  // CAN_TX_Task feeds the mailboxes from the TX scheduler
+  xTaskCreate(CAN_TX_Task, "canTxTask", 256, NULL, 3, &canTxHandle);
+
+  // audioGenTask renders sample blocks, it has the tightest deadline
+  xTaskCreate(audioGenTask, "audioGen", 256, &dacSink, 4, NULL);
+
+#ifdef MIDI_SERIAL
+  // midiTask owns the serial port, so the event log and the profiler's
+  // commands stay off it. It plays MIDI input as decodeTask plays the bus.
+  TaskHandle_t midiHandle;
+  xTaskCreate(midiTask, "midi", 256, NULL, 2, &midiHandle);
+#else
+  // logDrainTask writes the event log to serial whenever nothing else is running
+  xTaskCreate(logDrainTask, "logDrain", 256, NULL, 1, NULL);
+
+#ifdef PROFILE_ENABLED
+  xTaskCreate(profilerTask, "profiler", 256, NULL, 1, NULL);
+#endif
+#endif // MIDI_SERIAL
+
+  // knobInputTask reads the knobs on V2 modules, whenever the expander
+  // interrupts. It preempts the display between I2C transactions. V1
+  // modules have no expander and scanKeys polls the knobs from the matrix.
+  TaskHandle_t knobHandle = NULL;
+  if (initKnobExpander()) {
+    xTaskCreate(knobInputTask, "knobInput", 256, NULL, 3, &knobHandle);
+  }
+
+  // voiceAllocTask advertises this module's free voices to the stack
+  xTaskCreate(voiceAllocTask, "voiceAlloc", 128, NULL, 2, NULL);
+
+  // joystickTask bends every voice from the joystick at a fixed control rate
+  xTaskCreate(joystickTask, "joystick", 128, NULL, 2, NULL);
+
+  // clockSyncTask sends the stack clock while this module is its master.
+  // It sits with the TX task, as its follow-up carries the time of a Sync
+  // that has just gone.
+  TaskHandle_t clockSyncHandle;
+  clockSync.setNode(moduleOctave);
+  xTaskCreate(clockSyncTask, "clockSync", 128, NULL, 3, &clockSyncHandle);
+
+  // stackEnumTask numbers the stack from the handshake lines and sets the
+  // octave. It passes the turn on as soon as its Claim has gone.
+  TaskHandle_t stackEnumHandle;
+  xTaskCreate(stackEnumTask, "stackEnum", 128, NULL, 3, &stackEnumHandle);
+
+  // 7) Each queue wakes its consumer task, before any producer starts
+  keyEventQ.setNotify(notifyTaskFromISR, scanKeysHandle);
+  msgInQ.setNotify(notifyTaskFromISR, decodeHandle);
+  bulkInQ.setNotify(notifyTaskFromISR, decodeHandle);
+  canTx.setNotify(notifyTask, notifyTaskFromISR, canTxHandle);
+  if (knobHandle) knobInputBegin(knobHandle);
+  clockSyncBegin(clockSyncHandle);
+  stackEnumBegin(stackEnumHandle);
+#ifdef MIDI_SERIAL
+  midiOutQ.setNotify(notifyTask, midiHandle);
+#endif
+
+  // 8) Key scanning: timer interrupt feeding debounced events to scanKeysTask
+  if (!keyScanner.begin(keyEventQ)) {
+    Serial.println("Key scanner init failed!");
     while(1);
   }
 
-  // 8) Initialize and start CAN
-  CAN_Init(true);
-  setCANFilter(0x123,0x7ff);
+  // 9) Initialize and start CAN on the stack's bus. Notes and bulk traffic
+  // use separate FIFOs.
+  if (CAN_Init(false, CAN_BIT_RATE) != 0) {
+    Serial.println("CAN bit timing failed!");
+    while(1);
+  }
+  setCANFilterBank(0, true, CAN_ID_NOTE, CAN_ID_LEGACY_NOTE, 0);
+  setCANFilterBank(1, false, CAN_ID_CONTROL, CAN_BULK_FILTER_MASK, 1);
+  setCANFilterBank(2, true, CAN_ID_SYNC, CAN_ID_SYNC, 1);
 
-  // 9) Register the Rx and Tx ISRs
+  // 10) Register the Rx and Tx ISRs
   CAN_RegisterRX_ISR(CAN_RX_ISR);
+  CAN_RegisterRX1_ISR(CAN_RX1_ISR);
   CAN_RegisterTX_ISR(CAN_TX_ISR);
 
-  CAN_Start();
-
-  // 10) Create tasks
-  // Existing tasks
-  TaskHandle_t scanKeysHandle, displayUpdateHandle;
-  xTaskCreate(scanKeysTask, "scanKeys", 214, NULL, 1, &scanKeysHandle);
-  xTaskCreate(displayUpdateTask, "displayUpdate", 512, NULL, 2, &displayUpdateHandle);
+  // Count error state changes, bus-off is recovered from in hardware
+  CAN_RegisterSCE_ISR();
 
-  // NEW tasks:
-  // decodeTask to handle incoming messages from msgInQ
-  xTaskCreate(decodeTask, "decodeTask", 256, NULL, 2, NULL);
-
-  // CAN_TX_Task to handle outgoing messages from msgOutQ
-  xTaskCreate(CAN_TX_Task, "canTxTask", 256, NULL, 3, NULL);
+  CAN_Start();
 
   // 11) Start scheduler
   vTaskStartScheduler();
@@ -0,0 +1,180 @@
+#include <Arduino.h>
+#include <STM32FreeRTOS.h>
+#include "midi.h"
+#include "globals.h"
+#include "tuning.h"
+#include "LockGuard.h"
+#include "profiler.h"
+
+MidiParser::MidiParser() : status_(0), needed_(0), count_(0), data1_(0), sysex_(false), stats_() {}
+
+uint32_t MidiParser::parse(const uint8_t* bytes, uint32_t n, MidiMessage* out) {
+  uint32_t messages = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    const uint8_t b = bytes[i];
+
+    if (b < 0x80) {
+      if (sysex_) {
+        stats_.sysex++;
+      } else if (!status_) {
+        stats_.stray++;
+      } else if (++count_ < needed_) {
+        data1_ = b;
+      } else {
+        // Complete. Channel messages keep their status running, system
+        // common ones don't.
+        count_ = 0;
+        if (status_ >= MIDI_SYSEX) status_ = 0;
+        else out[messages++] = needed_ == 1 ? MidiMessage{status_, b, 0} : MidiMessage{status_, data1_, b};
+      }
+      continue;
+    }
+
+    // Real-time bytes can come between any two bytes and change nothing
+    if (b >= MIDI_REALTIME) {
+      stats_.realtime++;
+      continue;
+    }
+
+    // Any other status ends a system exclusive message, and drops a message
+    // that hadn't got all its data
+    sysex_ = b == MIDI_SYSEX;
+    count_ = 0;
+    needed_ = midiDataLength(b);
+    status_ = sysex_ || needed_ == 0 ? 0 : b;
+  }
+  stats_.bytes += n;
+  stats_.messages += messages;
+  return messages;
+}
+
+uint8_t encodeMidi(const MidiMessage& msg, uint8_t& running, uint8_t* out) {
+  uint8_t n = 0;
+  if (msg.status != running) {
+    out[n++] = msg.status;
+    running = msg.status;
+  }
+  out[n++] = msg.data1 & 0x7f;
+  if (midiDataLength(msg.status) == 2) out[n++] = msg.data2 & 0x7f;
+  return n;
+}
+
+// ---------------------------------------------------------------------
+//                                 TASK
+// ---------------------------------------------------------------------
+
+#ifdef MIDI_SERIAL
+
+static MidiParser parser;
+static MidiStats stats;
+
+// Batches, kept off the task's stack
+static uint8_t inBytes[MIDI_BATCH_BYTES];
+static MidiMessage inMessages[MIDI_BATCH_BYTES];
+static uint8_t outBytes[MIDI_BATCH_BYTES];
+
+void midiSendKey(uint8_t note, bool pressed) {
+  midiOutQ.push(midiKeyMessage(note, pressed), false);
+}
+
+void midiFlush() {
+  if (!midiOutQ.empty()) midiOutQ.notify();
+}
+
+// Plays a message on this module's voices. Call with sysState.mutex held.
+static void playMessage(const MidiMessage& msg) {
+  switch (msg.type()) {
+    case MIDI_NOTE_ON:
+      if (msg.data2) {
+        voices.noteOn(msg.data1, noteStepSize(msg.data1, temperament));
+        break;
+      }
+      // A note on with no velocity is a note off
+      voices.noteOff(msg.data1);
+      break;
+    case MIDI_NOTE_OFF:
+      voices.noteOff(msg.data1);
+      break;
+    case MIDI_CONTROL_CHANGE:
+      if (msg.data1 == MIDI_CC_ALL_SOUND_OFF || msg.data1 == MIDI_CC_ALL_NOTES_OFF) voices.allNotesOff();
+      break;
+    default:
+      break;
+  }
+}
+
+// Writes every queued key event. Running status starts again with each
+// write, so a receiver that joins part way through is only lost for one.
+static void writeKeys() {
+  uint32_t messages = 0, total = 0, n = 0;
+  uint8_t running = 0;
+  MidiMessage msg;
+  while (midiOutQ.pop(msg)) {
+    n += encodeMidi(msg, running, outBytes + n);
+    messages++;
+    if (n + 3 > MIDI_BATCH_BYTES) {
+      Serial.write(outBytes, n);
+      total += n;
+      n = 0;
+      running = 0;
+    }
+  }
+  if (n) Serial.write(outBytes, n);
+  total += n;
+
+  taskENTER_CRITICAL();
+  stats.outMessages += messages;
+  stats.outBytes += total;
+  taskEXIT_CRITICAL();
+}
+
+// Parses whatever has arrived a batch at a time, and plays each batch under
+// one lock
+static void readNotes() {
+  int available;
+  while ((available = Serial.available()) > 0) {
+    const uint32_t n = (uint32_t) available < MIDI_BATCH_BYTES ? available : MIDI_BATCH_BYTES;
+    Serial.readBytes(inBytes, n);
+    const uint32_t count = parser.parse(inBytes, n, inMessages);
+    if (count) {
+      LockGuard lock(sysState.mutex);
+      for (uint32_t i = 0; i < count; i++) playMessage(inMessages[i]);
+    }
+
+    taskENTER_CRITICAL();
+    stats.in = parser.stats();
+    stats.batches++;
+    if (n > stats.maxBatch) stats.maxBatch = n;
+    taskEXIT_CRITICAL();
+  }
+}
+
+void midiTask(void *pvParameters) {
+  // The input is polled, so a burst of bytes costs one wake-up rather than
+  // one per byte. Key events wake the task as soon as a scan pass is queued.
+  const TickType_t period = MIDI_POLL_MS / portTICK_PERIOD_MS;
+  TickType_t nextPoll = xTaskGetTickCount();
+
+  while (1) {
+    TickType_t now = xTaskGetTickCount();
+    TickType_t wait = (int32_t) (nextPoll - now) > 0 ? nextPoll - now : 0;
+    ulTaskNotifyTake(pdTRUE, wait);
+    PROFILE_SCOPE(ProfileSite::Midi);
+
+    writeKeys();
+    if ((int32_t) (xTaskGetTickCount() - nextPoll) >= 0) {
+      nextPoll += period;
+      readNotes();
+    }
+  }
+}
+
+MidiStats midiStats() {
+  taskENTER_CRITICAL();
+  MidiStats result = stats;
+  taskEXIT_CRITICAL();
+  result.outDropped = midiOutQ.overflows();
+  return result;
+}
+
+#endif // MIDI_SERIAL
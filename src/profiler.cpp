@@ -0,0 +1,112 @@
+#include "profiler.h"
+#include "dspKernels.h"
+
+#ifdef PROFILE_ENABLED
+
+#include <STM32FreeRTOS.h>
+
+// Command poll interval for profilerTask
+constexpr TickType_t PROFILER_POLL_MS = 100;
+
+static const char* const siteNames[(uint8_t) ProfileSite::Count] = {
+  "scanKeys", "display", "decode", "canTx", "audioGen", "knobs",
+  "keyScanISR", "dacISR", "canRxISR", "canRx1ISR", "canTxISR", "knobISR", "midi"
+};
+
+static ProfileStats stats[(uint8_t) ProfileSite::Count];
+
+uint32_t profileTicksPerUs() {
+#ifdef ARDUINO
+  return SystemCoreClock / 1000000;
+#else
+  return 1000;
+#endif
+}
+
+void profilerBegin() {
+#ifdef ARDUINO
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+  profilerReset();
+}
+
+void profileRecord(ProfileSite site, uint32_t ticks) {
+  ProfileStats& s = stats[(uint8_t) site];
+  const uint8_t bucket = ticks ? 31 - __builtin_clz(ticks) : 0;
+
+  // Masks interrupts up to the kernel priority, so this works from both
+  // contexts and a dump never sees half an update
+  UBaseType_t saved = taskENTER_CRITICAL_FROM_ISR();
+  if (s.count == 0 || ticks < s.min) s.min = ticks;
+  if (ticks > s.max) s.max = ticks;
+  s.count++;
+  s.total += ticks;
+  s.histogram[bucket]++;
+  taskEXIT_CRITICAL_FROM_ISR(saved);
+}
+
+ProfileStats profileStats(ProfileSite site) {
+  taskENTER_CRITICAL();
+  ProfileStats s = stats[(uint8_t) site];
+  taskEXIT_CRITICAL();
+  return s;
+}
+
+void profilerReset() {
+  taskENTER_CRITICAL();
+  for (ProfileStats& s : stats) s = ProfileStats{};
+  taskEXIT_CRITICAL();
+}
+
+void profilerDump(Print& out) {
+  const float ticksPerUs = profileTicksPerUs();
+
+  out.println("site\tcount\tmin us\tmean us\tmax us");
+  for (uint8_t i = 0; i < (uint8_t) ProfileSite::Count; i++) {
+    const ProfileStats s = profileStats((ProfileSite) i);
+    if (s.count == 0) continue;
+
+    out.print(siteNames[i]);
+    out.print('\t');
+    out.print(s.count);
+    out.print('\t');
+    out.print(s.min / ticksPerUs);
+    out.print('\t');
+    out.print((float) s.total / s.count / ticksPerUs);
+    out.print('\t');
+    out.println(s.max / ticksPerUs);
+
+    // Non-empty buckets as log2(ticks):count
+    out.print("  hist");
+    for (uint8_t b = 0; b < PROFILE_BUCKETS; b++) {
+      if (!s.histogram[b]) continue;
+      out.print(' ');
+      out.print(b);
+      out.print(':');
+      out.print(s.histogram[b]);
+    }
+    out.println();
+  }
+}
+
+void profilerTask(void *pvParameters) {
+  const TickType_t xFrequency = PROFILER_POLL_MS / portTICK_PERIOD_MS;
+  TickType_t xLastWakeTime = xTaskGetTickCount();
+
+  while (1) {
+    vTaskDelayUntil(&xLastWakeTime, xFrequency);
+
+    while (Serial.available()) {
+      switch (Serial.read()) {
+        case 'p': profilerDump(Serial); break;
+        case 'r': profilerReset(); break;
+        case 'k': benchKernels(Serial); break;
+        default: break;
+      }
+    }
+  }
+}
+
+#endif // PROFILE_ENABLED
@@ -2,127 +2,169 @@
 #include <bitset>
 #include <STM32FreeRTOS.h>
 #include <atomic>
-#include <cmath>
 #include <ES_CAN.h>
 #include "scanKeys.h"
+#include "tuning.h"
 #include "globals.h"
 #include "hardware.h"
 #include "LockGuard.h"
-#include "knob.h"
+#include "knobInput.h"
 #include "can_tx_task.h"
 #include "decodeTask.h"
+#include "keyScanner.h"
+#include "canProtocol.h"
+#include "canTxScheduler.h"
+#include "clockSync.h"
+#include "profiler.h"
+#include "eventLog.h"
+#include "midi.h"
+
+
+// Key changes from one scanner pass, waiting to be sent
+struct PendingKeys {
+    KeyDiff diff;
+    uint8_t target[NUM_KEYS];  // Module picked to play each pending press
+    uint32_t seenAt;           // Stack sample the pass started on, if diff.timed
+};
 
+// Notes the stack sample the scanner saw `event` on, which starts a pass.
+// Its frames are timed noteLatency() after it, so every other module plays
+// them together. This module plays its own presses straight away.
+// Call with sysState.mutex held.
+static void schedulePass(const KeyEvent& event, PendingKeys& pending) {
+    KeyDiff& diff = pending.diff;
+    diff.timed = NOTE_LATENCY_SAMPLES > 0 && clockSync.locked();
+    if (!diff.timed) return;
+
+    const uint32_t since = (micros() - event.time) * (SAMPLE_RATE / 1000) / 1000;
+    pending.seenAt = clockSync.toStack(sampleClock() - since);
+}
 
-// Audio and key constants
-const uint32_t SAMPLE_RATE = 22000;
-constexpr float BASE_FREQ = 440.0;
-constexpr uint8_t NUM_KEYS = 12;
+// Frames sendKeyDiff() sends for the pending changes: one for each module
+// the presses were assigned to, or one for releases alone
+static uint8_t passFrames(const PendingKeys& pending) {
+    const KeyDiff& diff = pending.diff;
+    uint8_t targets[NUM_KEYS];
+    uint8_t frames = 0;
+    for (uint8_t key = 0; key < NUM_KEYS; key++) {
+        if (!(diff.changed & diff.state & (1u << key))) continue;
+        uint8_t i = 0;
+        while (i < frames && targets[i] != pending.target[key]) i++;
+        if (i == frames) targets[frames++] = pending.target[key];
+    }
+    return frames ? frames : 1;
+}
 
-// Helper to calculate step size
-const uint32_t calcStepSize(float freq) {
-  return (uint32_t)((pow(2, 32) * freq) / SAMPLE_RATE);
+// Sends the pending key changes to the other modules, one frame for each
+// module the presses were assigned to. Releases go in the first frame.
+static void sendKeyDiff(PendingKeys& pending) {
+    KeyDiff& diff = pending.diff;
+    diff.octave = moduleOctave;
+    uint16_t left = diff.changed;
+
+    // The pass's last frame goes out behind the notes already queued and the
+    // rest of the pass
+    if (diff.timed && left) {
+        const uint32_t ahead = canTx.stats(CanClass::Note).depth + passFrames(pending) - 1;
+        diff.time = (pending.seenAt + noteLatency(ahead)) & KEY_DIFF_TIME_MASK;
+    }
+
+    while (left) {
+        // The lowest pending press picks the module for this frame
+        uint16_t keys = left & ~diff.state;
+        bool targeted = false;
+        for (uint8_t key = 0; key < NUM_KEYS; key++) {
+            const uint16_t bit = 1u << key;
+            if (!(left & diff.state & bit)) continue;
+            if (!targeted) {
+                diff.target = pending.target[key];
+                targeted = true;
+            }
+            if (pending.target[key] == diff.target) keys |= bit;
+        }
+        if (!targeted) diff.target = CAN_NODE_ALL;
+        diff.changed = keys;
+        left &= ~keys;
+
+        CanMessage TX_Message;
+        TX_Message.length = encodeKeyDiff(diff, TX_Message.data);
+
+        // Notes have the highest priority on the bus. If the queue is full the
+        // message is dropped and counted rather than stalling the scanner.
+        canTx.send(CanClass::Note, TX_Message);
+        logEvent(LogId::KeyDiffTx, diff.octave, diff.state, diff.changed);
+        diff.sequence++;
+    }
+    diff.changed = 0;
 }
 
-// Precalculate step sizes for each musical key
-const uint32_t stepSizes[NUM_KEYS] = {
-  calcStepSize(BASE_FREQ * pow(2, -9.0/12)),  // C
-  calcStepSize(BASE_FREQ * pow(2, -8.0/12)),  // C#
-  calcStepSize(BASE_FREQ * pow(2, -7.0/12)),  // D
-  calcStepSize(BASE_FREQ * pow(2, -6.0/12)),  // D#
-  calcStepSize(BASE_FREQ * pow(2, -5.0/12)),  // E
-  calcStepSize(BASE_FREQ * pow(2, -4.0/12)),  // F
-  calcStepSize(BASE_FREQ * pow(2, -3.0/12)),  // F#
-  calcStepSize(BASE_FREQ * pow(2, -2.0/12)),  // G
-  calcStepSize(BASE_FREQ * pow(2, -1.0/12)),  // G#
-  calcStepSize(BASE_FREQ * pow(2,  0.0/12)),  // A (440 Hz)
-  calcStepSize(BASE_FREQ * pow(2,  1.0/12)),  // A#
-  calcStepSize(BASE_FREQ * pow(2,  2.0/12))   // B
-};
+// Plays a debounced key change here if the allocator picks this module, and
+// adds it to the pending changes. Releases go to every module, whoever
+// played the note.
+static void handleKeyEvent(const KeyEvent& event, PendingKeys& pending) {
+    const uint8_t note = midiNote(moduleOctave, event.key);
+    KeyDiff& diff = pending.diff;
+    {
+        LockGuard lock(sysState.mutex);
+        if (!diff.changed) schedulePass(event, pending);
+
+        if (event.pressed) {
+            const uint8_t target = voiceAlloc.assign(millis());
+            if (target == moduleOctave || target == CAN_NODE_ALL) {
+                voices.noteOn(note, noteStepSize(note, temperament));
+            }
+            pending.target[event.key] = target;
+        } else {
+            voices.noteOff(note);
+        }
 
-// Knob externs (defined in main.cpp)
-extern std::atomic<int8_t> knob3Rotation;
-extern Knob knob3Class;
+        // Key bits in the shared state stay active-low
+        sysState.inputs = ~keyScanner.keys() & ((1u << NUM_KEYS) - 1);
+    }
 
-void scanKeysTask(void *pvParameters) {
-    const TickType_t xFrequency = 20 / portTICK_PERIOD_MS;
-    TickType_t xLastWakeTime = xTaskGetTickCount();
+    const uint16_t bit = 1u << event.key;
+    diff.changed |= bit;
+    if (event.pressed) diff.state |= bit;
+    else diff.state &= ~bit;
 
-    // Keep track of previous state to detect changes
-    static std::bitset<32> previousInputs;
+    // Every key event goes out as MIDI as well, whoever plays the note
+    midiSendKey(note, event.pressed);
+}
 
-    while (1) {
-        vTaskDelayUntil(&xLastWakeTime, xFrequency);
-
-        std::bitset<32> localInputs;
-        uint8_t lastPressedKey = 255;
-        bool keyPressed = false;
-        uint32_t localStepSize = 0;
-
-        // 1) Scan rows 0..2 for key presses
-        for (uint8_t row = 0; row < 3; row++) {
-            setRow(row);
-            delayMicroseconds(3);
-            std::bitset<4> cols = readCols();
-            for (uint8_t col = 0; col < 4; col++) {
-                uint8_t keyIndex = row * 4 + col;
-                if (keyIndex < NUM_KEYS) {
-                    localInputs[keyIndex] = cols[col];
-                    if (cols[col] == 0) {  // active-low => key is pressed
-                        lastPressedKey = keyIndex;
-                        keyPressed = true;
-                    }
-                }
-            }
-        }
+// Reads the knobs from the scanner's latest row snapshots. Knobs 3 and 2
+// are on row 3, knobs 1 and 0 on row 4.
+static void pollKnobs() {
+    updateKnobs(keyScanner.rowBits(3) | keyScanner.rowBits(4) << 4);
+}
 
-        // 2) Update localStepSize if a key is pressed
-        if (keyPressed) {
-            localStepSize = stepSizes[lastPressedKey];
-        }
+void scanKeysTask(void *pvParameters) {
+    // The matrix itself is scanned by the key scanner's timer interrupt. This
+    // task is notified for each key event, and polls the knobs every 20 ms
+    // on V1 modules. V2 modules read them in knobInputTask instead.
+    const TickType_t knobPeriod = 20 / portTICK_PERIOD_MS;
+    TickType_t nextKnobPoll = xTaskGetTickCount();
+    PendingKeys pending = {};
 
-        // 3) Read knob state on row 3
-        setRow(3);
-        delayMicroseconds(3);
-        std::bitset<4> knobCols = readCols();
-        uint8_t knobA = knobCols[0];
-        uint8_t knobB = knobCols[1];
-        knob3Class.updateState(knobA, knobB);
-        knob3Class.constrainRotation();
-        //Serial.println(knob3Class.getRotation());
-
-        // 4) Compare with previousInputs to detect key changes
-        for (uint8_t i = 0; i < NUM_KEYS; i++) {
-            bool wasPressed = (previousInputs[i] == 0); // active-low
-            bool isPressed  = (localInputs[i]   == 0);
-
-            if (wasPressed != isPressed) {
-                // Key state changed
-                // Create a local message
-                uint8_t TX_Message[8] = {0};
-
-                // Byte 0: 'P' (0x50) if pressed, 'R' (0x52) if released
-                TX_Message[0] = isPressed ? 'P' : 'R';
-
-                // Byte 1: Octave (example: fixed 4 or do your own mapping)
-                TX_Message[1] = 4;
-
-                // Byte 2: Note number 0..11
-                TX_Message[2] = i;
-
-                // Send over CAN with ID 0x123
-                xQueueSend(msgOutQ, TX_Message, portMAX_DELAY);
-            }
+    while (1) {
+        TickType_t now = xTaskGetTickCount();
+        TickType_t wait = (int32_t) (nextKnobPoll - now) > 0 ? nextKnobPoll - now : 0;
+
+        ulTaskNotifyTake(pdTRUE, wait);
+        PROFILE_SCOPE(ProfileSite::ScanKeys);
+
+        // Everything from one scanner pass goes out together. A key that
+        // changes twice before then flushes the frames, so no edge is lost.
+        KeyEvent event;
+        while (keyEventQ.pop(event)) {
+            if (pending.diff.changed & (1u << event.key)) sendKeyDiff(pending);
+            handleKeyEvent(event, pending);
         }
+        sendKeyDiff(pending);
+        midiFlush();
 
-        // 5) Update the global shared state
-        {
-            LockGuard lock(sysState.mutex);
-            sysState.inputs = localInputs;
-            currentStepSize = localStepSize;
+        if ((int32_t) (xTaskGetTickCount() - nextKnobPoll) >= 0) {
+            nextKnobPoll += knobPeriod;
+            if (!knobsOnExpander()) pollKnobs();
         }
-
-        // 6) Store current as previous for next iteration
-        previousInputs = localInputs;
     }
 }
-
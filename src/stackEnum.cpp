@@ -0,0 +1,286 @@
+#include <Arduino.h>
+#include <atomic>
+#include <STM32FreeRTOS.h>
+#include "stackEnum.h"
+#include "globals.h"
+#include "hardware.h"
+#include "LockGuard.h"
+#include "canTxScheduler.h"
+#include "taskNotify.h"
+#include "eventLog.h"
+
+// The handshake inputs are read in this column of the rows that latch the
+// outputs, and read low while the neighbour's output is on
+constexpr uint8_t HANDSHAKE_COL = 3;
+
+static bool due(uint32_t at, uint32_t nowMs) {
+  return (int32_t) (nowMs - at) >= 0;
+}
+
+StackEnumerator::StackEnumerator()
+    : uid_(0), state_(EnumState::Booting), round_(0), roundStart_(0), deadline_(0),
+      restart_(false), joinPending_(false), joinAt_(0),
+      west_(false), east_(false), westCount_(0), eastCount_(0), roundWest_(false), roundEast_(false),
+      eastOn_(true), highest_(-1), claimed_(0), last_(false),
+      generation_(0), position_(0), count_(1), uids_(), stats_() {}
+
+void StackEnumerator::begin(uint32_t uid, uint32_t nowMs) {
+  uid_ = uid;
+  state_ = EnumState::Booting;
+  roundStart_ = nowMs;
+  deadline_ = nowMs + ENUM_BOOT_MS;
+  eastOn_ = true;
+}
+
+void StackEnumerator::debounce(bool west, bool east) {
+  if (west == west_) westCount_ = 0;
+  else if (++westCount_ >= ENUM_DEBOUNCE_POLLS) {
+    west_ = west;
+    westCount_ = 0;
+  }
+
+  if (east == east_) eastCount_ = 0;
+  else if (++eastCount_ >= ENUM_DEBOUNCE_POLLS) {
+    east_ = east;
+    eastCount_ = 0;
+  }
+}
+
+void StackEnumerator::enterRound(uint8_t round, uint32_t nowMs) {
+  if (state_ != EnumState::Settling) stats_.rounds++;
+  round_ = round;
+  state_ = EnumState::Settling;
+  roundStart_ = nowMs;
+  deadline_ = nowMs + ENUM_SETTLE_MS;
+  restart_ = false;
+  joinPending_ = false;
+  eastOn_ = true;
+  highest_ = -1;
+  last_ = false;
+  for (uint32_t& uid : uids_) uid = 0;
+}
+
+EnumSend StackEnumerator::start(uint32_t nowMs, EnumFrame& frame) {
+  enterRound(round_ + 1, nowMs);
+  stats_.starts++;
+  frame = EnumFrame{round_, 0, false, uid_};
+  return EnumSend::Start;
+}
+
+EnumSend StackEnumerator::claim(uint8_t position, EnumFrame& frame) {
+  claimed_ = position;
+  last_ = !roundEast_;
+  if (position < STACK_MAX_MODULES) uids_[position] = uid_;
+  highest_ = position;
+  state_ = EnumState::Claiming;
+  stats_.claims++;
+  frame = EnumFrame{round_, position, last_, uid_};
+  return EnumSend::Claim;
+}
+
+void StackEnumerator::finish(uint8_t count, uint32_t nowMs) {
+  state_ = EnumState::Done;
+  position_ = claimed_;
+  count_ = count;
+  eastOn_ = true;
+  joinPending_ = false;
+  deadline_ = nowMs + ENUM_SETTLE_MS;
+  generation_++;
+  stats_.doneAt = nowMs;
+}
+
+// Alone, there is nobody to tell
+EnumSend StackEnumerator::alone(uint32_t nowMs) {
+  roundWest_ = roundEast_ = false;
+  claimed_ = 0;
+  finish(1, nowMs);
+  return EnumSend::None;
+}
+
+EnumSend StackEnumerator::poll(bool west, bool east, uint32_t nowMs, EnumFrame& frame) {
+  debounce(west, east);
+  if (restart_) return start(nowMs, frame);
+
+  switch (state_) {
+    case EnumState::Booting:
+      if (!due(deadline_, nowMs)) return EnumSend::None;
+      if (!west_ && !east_) return alone(nowMs);
+      // The west end starts the first round. The others wait for it, but
+      // not for ever, in case it never does.
+      if (!west_ || due(deadline_ + ENUM_ROUND_TIMEOUT_MS, nowMs)) return start(nowMs, frame);
+      return EnumSend::None;
+
+    case EnumState::Settling:
+      if (!due(deadline_, nowMs)) return EnumSend::None;
+      if (!west_ && !east_) return alone(nowMs);
+      roundWest_ = west_;
+      roundEast_ = east_;
+      if (!west_) return claim(0, frame);
+      state_ = EnumState::Waiting;
+      return EnumSend::None;
+
+    case EnumState::Waiting:
+      // The west neighbour has claimed and let go of its east output. Its
+      // Claim left the bus before that, so it has been counted.
+      if (!west_) return claim(highest_ + 1, frame);
+      break;
+
+    case EnumState::Claiming:
+    case EnumState::Passed:
+      break;
+
+    case EnumState::Done: {
+      if (!due(deadline_, nowMs)) return EnumSend::None;
+      if (west_ == roundWest_ && east_ == roundEast_) {
+        joinPending_ = false;
+        return EnumSend::None;
+      }
+
+      // A neighbour came or went
+      if (!west_ && !east_) return alone(nowMs);
+      const bool joined = (west_ && !roundWest_) || (east_ && !roundEast_);
+      if (joined) {
+        if (!joinPending_) {
+          joinPending_ = true;
+          joinAt_ = nowMs + ENUM_BOOT_MS;
+        }
+        if (!due(joinAt_, nowMs)) return EnumSend::None;
+      }
+      return start(nowMs, frame);
+    }
+  }
+
+  if (due(roundStart_ + ENUM_ROUND_TIMEOUT_MS, nowMs)) {
+    stats_.timeouts++;
+    return start(nowMs, frame);
+  }
+  return EnumSend::None;
+}
+
+void StackEnumerator::onStart(const EnumFrame& frame, uint32_t nowMs) {
+  // Starts that cross while settling make one round, the highest number wins
+  uint8_t round = frame.round;
+  if (state_ == EnumState::Settling && round < round_) round = round_;
+  enterRound(round, nowMs);
+}
+
+void StackEnumerator::onClaim(const EnumFrame& frame, uint32_t nowMs) {
+  if (frame.round != round_ || state_ == EnumState::Booting || state_ == EnumState::Done) return;
+
+  if (frame.position < STACK_MAX_MODULES) uids_[frame.position] = frame.uid;
+  if ((int16_t) frame.position > highest_) highest_ = frame.position;
+  if (!frame.last) return;
+
+  // The east end has claimed. If this module hasn't, it was missed, and
+  // the round is started again.
+  if (state_ == EnumState::Passed) finish(frame.position + 1, nowMs);
+  else restart_ = true;
+}
+
+void StackEnumerator::onClaimSent(uint32_t nowMs) {
+  if (state_ != EnumState::Claiming) return;
+  if (last_) {
+    finish(claimed_ + 1, nowMs);
+    return;
+  }
+  // Now every module has the Claim, pass the turn east
+  state_ = EnumState::Passed;
+  eastOn_ = false;
+}
+
+// ---------------------------------------------------------------------
+//                                 TASK
+// ---------------------------------------------------------------------
+
+static TaskHandle_t enumTaskHandle = NULL;
+static std::atomic<bool> claimSent(false);
+
+// Runs in the CAN TX interrupt as the Claim leaves the bus
+static void onClaimLeft() {
+  claimSent.store(true, std::memory_order_relaxed);
+  notifyTaskFromISR(enumTaskHandle);
+}
+
+void stackEnumBegin(TaskHandle_t task) {
+  enumTaskHandle = task;
+  canTx.setSentHook(CanMsgType::EnumClaim, onClaimLeft);
+}
+
+// Takes on the octave from a finished round. A new octave is a new node ID,
+// so held notes are let go, the other modules' voices are learnt again and
+// the clock master is elected again.
+static void applyPosition(uint8_t& count, uint8_t& position) {
+  LockGuard lock(sysState.mutex);
+  const uint8_t octave = stackEnum.octave();
+  const bool renumbered = octave != moduleOctave;
+  const bool changed = renumbered || stackEnum.count() != count;
+
+  if (renumbered) {
+    moduleOctave = octave;
+    clockSync.setNode(octave);
+    voices.allNotesOff();
+  }
+  if (changed && count) voiceAlloc.forget();
+
+  count = stackEnum.count();
+  position = stackEnum.position();
+}
+
+void stackEnumTask(void *pvParameters) {
+  // The turn can only pass east once our Claim has gone, so the TX
+  // interrupt wakes the task as well as the poll period
+  const TickType_t period = ENUM_POLL_MS / portTICK_PERIOD_MS;
+  TickType_t nextPoll = xTaskGetTickCount();
+  uint16_t applied = 0;
+  uint8_t count = 0, position = 0;
+
+  keyScanner.setOutBit(HKOW_BIT, true);
+  keyScanner.setOutBit(HKOE_BIT, true);
+  {
+    LockGuard lock(sysState.mutex);
+    stackEnum.begin(moduleUid(), millis());
+  }
+
+  while (1) {
+    TickType_t now = xTaskGetTickCount();
+    TickType_t wait = (int32_t) (nextPoll - now) > 0 ? nextPoll - now : 0;
+    ulTaskNotifyTake(pdTRUE, wait);
+
+    const bool sent = claimSent.exchange(false, std::memory_order_relaxed);
+    const bool pollDue = (int32_t) (xTaskGetTickCount() - nextPoll) >= 0;
+    if (!sent && !pollDue) continue;
+    if (pollDue) nextPoll += period;
+
+    const bool west = !(keyScanner.rowBits(HKOW_BIT) & (1 << HANDSHAKE_COL));
+    const bool east = !(keyScanner.rowBits(HKOE_BIT) & (1 << HANDSHAKE_COL));
+
+    EnumFrame frame;
+    EnumSend send = EnumSend::None;
+    bool eastOut, online;
+    uint16_t generation;
+    {
+      LockGuard lock(sysState.mutex);
+      if (sent) stackEnum.onClaimSent(millis());
+      if (pollDue) send = stackEnum.poll(west, east, millis(), frame);
+      eastOut = stackEnum.eastOutput();
+      online = stackEnum.online();
+      generation = stackEnum.generation();
+    }
+
+    keyScanner.setOutBit(HKOE_BIT, eastOut);
+    canTx.setOnline(online);
+
+    if (send != EnumSend::None) {
+      CanMessage msg;
+      msg.length = send == EnumSend::Start ? encodeEnumStart(frame, msg.data)
+                                           : encodeEnumClaim(frame, msg.data);
+      canTx.send(CanClass::Sync, msg);
+    }
+
+    if (generation != applied) {
+      applied = generation;
+      applyPosition(count, position);
+      logEvent(LogId::StackNumbered, position, count, moduleOctave);
+    }
+  }
+}
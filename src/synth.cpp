@@ -0,0 +1,27 @@
+#include "synth.h"
+#include "audio.h"
+#include "audioSink.h"
+#include "dspKernels.h"
+
+// Q16 gain from a 16-bit mix to the 12-bit output. Full scale is 1/20 of the
+// DAC range, the same level the original 8-bit analogWrite path produced.
+constexpr int32_t OUTPUT_LEVEL = 65536 / 16 / 20;
+
+static int16_t mixBlock[AUDIO_BLOCK_SIZE];
+
+// Q15 gain for each volume step, 6 dB apart like the original right shift
+static const int16_t volumeGain[MAX_VOLUME + 1] = {
+  128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32767
+};
+
+void renderBlock(VoicePool& pool, Filter& filter, uint8_t volume, uint16_t* out, uint32_t n) {
+  if (volume > MAX_VOLUME) volume = MAX_VOLUME;
+
+  pool.mixBlock(mixBlock, n);
+  filter.process(mixBlock, n);
+  applyGain(mixBlock, volumeGain[volume], n);
+  // Rounded, so what a silent filter leaves below one step sits on the midpoint
+  for (uint32_t i = 0; i < n; i++) {
+    out[i] = DAC_MIDPOINT + ((mixBlock[i] * OUTPUT_LEVEL + 0x8000) >> 16);
+  }
+}
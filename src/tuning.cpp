@@ -0,0 +1,110 @@
+#include "tuning.h"
+#include "audio.h"
+#include "constexprMath.h"
+
+// ---------------------------------------------------------------------
+//              COMPILE-TIME TABLE GENERATION
+// ---------------------------------------------------------------------
+
+namespace {
+
+// Frequency ratio of each pitch class above C
+struct ScaleRatios {
+  double ratio[NOTES_PER_OCTAVE];
+};
+
+constexpr ScaleRatios scales[(uint8_t) Temperament::Count] = {
+  // Equal
+  {{1.0, constmath::exp2(1 / 12.0), constmath::exp2(2 / 12.0), constmath::exp2(3 / 12.0), constmath::exp2(4 / 12.0), constmath::exp2(5 / 12.0),
+    constmath::exp2(6 / 12.0), constmath::exp2(7 / 12.0), constmath::exp2(8 / 12.0), constmath::exp2(9 / 12.0), constmath::exp2(10 / 12.0), constmath::exp2(11 / 12.0)}},
+  // Just
+  {{1.0, 16 / 15.0, 9 / 8.0, 6 / 5.0, 5 / 4.0, 4 / 3.0,
+    45 / 32.0, 3 / 2.0, 8 / 5.0, 5 / 3.0, 9 / 5.0, 15 / 8.0}},
+  // Pythagorean
+  {{1.0, 256 / 243.0, 9 / 8.0, 32 / 27.0, 81 / 64.0, 4 / 3.0,
+    729 / 512.0, 3 / 2.0, 128 / 81.0, 27 / 16.0, 16 / 9.0, 243 / 128.0}},
+  // Quarter-comma meantone, from the cents of each degree
+  {{1.0, constmath::exp2(76.049 / 1200), constmath::exp2(193.157 / 1200), constmath::exp2(310.265 / 1200),
+    constmath::exp2(386.314 / 1200), constmath::exp2(503.422 / 1200), constmath::exp2(579.471 / 1200),
+    constmath::exp2(696.579 / 1200), constmath::exp2(772.627 / 1200), constmath::exp2(889.735 / 1200),
+    constmath::exp2(1006.843 / 1200), constmath::exp2(1082.892 / 1200)}}
+};
+
+struct StepTable {
+  uint32_t step[NUM_MIDI_NOTES];
+};
+
+constexpr StepTable makeStepTable(Temperament temperament) {
+  StepTable table{};
+  // Equal-tempered C in the octave below MIDI note 0
+  const double c0 = REFERENCE_FREQ * constmath::exp2((0 - (int) REFERENCE_NOTE) / 12.0);
+  for (uint32_t note = 0; note < NUM_MIDI_NOTES; note++) {
+    double freq = c0 * constmath::exp2(note / NOTES_PER_OCTAVE)
+                * scales[(uint8_t) temperament].ratio[note % NOTES_PER_OCTAVE];
+    table.step[note] = (uint32_t)(freq * 4294967296.0 / SAMPLE_RATE + 0.5);
+  }
+  return table;
+}
+
+// Q30 ratios for whole semitones and for single cents within a semitone
+struct BendRatios {
+  uint32_t semitone[NOTES_PER_OCTAVE];
+  uint32_t cent[100];
+};
+
+constexpr BendRatios makeBendRatios() {
+  BendRatios ratios{};
+  for (uint32_t i = 0; i < NOTES_PER_OCTAVE; i++) {
+    ratios.semitone[i] = (uint32_t)(constmath::exp2(i / 12.0) * (1u << 30) + 0.5);
+  }
+  for (uint32_t i = 0; i < 100; i++) {
+    ratios.cent[i] = (uint32_t)(constmath::exp2(i / 1200.0) * (1u << 30) + 0.5);
+  }
+  return ratios;
+}
+
+} // namespace
+
+// ---------------------------------------------------------------------
+//                     TABLES (FLASH)
+// ---------------------------------------------------------------------
+
+constexpr StepTable stepTables[(uint8_t) Temperament::Count] = {
+  makeStepTable(Temperament::Equal),
+  makeStepTable(Temperament::Just),
+  makeStepTable(Temperament::Pythagorean),
+  makeStepTable(Temperament::Meantone)
+};
+
+constexpr BendRatios bendRatios = makeBendRatios();
+
+// A4 must come out at exactly 440 Hz
+static_assert(stepTables[0].step[REFERENCE_NOTE] == (uint32_t)(440.0 * 4294967296.0 / SAMPLE_RATE + 0.5),
+              "equal temperament reference pitch");
+
+uint32_t noteStepSize(uint8_t note, Temperament temperament) {
+  if (note >= NUM_MIDI_NOTES) note = NUM_MIDI_NOTES - 1;
+  if (temperament >= Temperament::Count) temperament = Temperament::Equal;
+  return stepTables[(uint8_t) temperament].step[note];
+}
+
+uint32_t bendStepSize(uint32_t stepSize, int32_t cents) {
+  // Split into whole octaves and a positive remainder of semitones and cents
+  int32_t octaves = cents / 1200;
+  int32_t rest = cents % 1200;
+  if (rest < 0) {
+    rest += 1200;
+    octaves--;
+  }
+
+  uint64_t step = stepSize;
+  step = (step * bendRatios.semitone[rest / 100]) >> 30;
+  step = (step * bendRatios.cent[rest % 100]) >> 30;
+
+  if (octaves >= 0) {
+    step <<= octaves;
+  } else {
+    step >>= -octaves;
+  }
+  return step > UINT32_MAX ? UINT32_MAX : (uint32_t) step;
+}
@@ -0,0 +1,202 @@
+#include <Arduino.h>
+#include <STM32FreeRTOS.h>
+#include "voiceAllocator.h"
+#include "globals.h"
+#include "LockGuard.h"
+#include "canTxScheduler.h"
+#include "eventLog.h"
+
+VoiceAllocator::VoiceAllocator() : nodes_(), lastSteal_(CAN_NODE_ALL), stats_() {}
+
+VoiceAllocator::Node* VoiceAllocator::find(uint8_t node) {
+  for (Node& n : nodes_) {
+    if (n.active && n.capacity.node == node) return &n;
+  }
+  return nullptr;
+}
+
+VoiceAllocator::Node* VoiceAllocator::add() {
+  for (uint8_t i = 1; i < MAX_SYNTH_NODES; i++) {
+    if (!nodes_[i].active) return &nodes_[i];
+  }
+  return nullptr;
+}
+
+void VoiceAllocator::expire(uint32_t nowMs) {
+  for (uint8_t i = 1; i < MAX_SYNTH_NODES; i++) {
+    Node& n = nodes_[i];
+    if (n.active && nowMs - n.lastSeen > CAPACITY_TIMEOUT_MS) {
+      n.active = false;
+      stats_.nodesLost++;
+    }
+  }
+}
+
+void VoiceAllocator::setLocal(const VoiceCapacity& capacity, uint32_t nowMs) {
+  nodes_[0].capacity = capacity;
+  nodes_[0].lastSeen = nowMs;
+  nodes_[0].active = true;
+  expire(nowMs);
+}
+
+void VoiceAllocator::onAdvert(const VoiceCapacity& capacity, uint32_t nowMs) {
+  // From a module on our node while the stack renumbers
+  if (nodes_[0].active && capacity.node == nodes_[0].capacity.node) return;
+
+  Node* n = find(capacity.node);
+  if (n == nullptr) n = add();
+  if (n == nullptr) return;
+
+  n->capacity = capacity;
+  n->lastSeen = nowMs;
+  n->active = true;
+}
+
+void VoiceAllocator::forget() {
+  for (uint8_t i = 1; i < MAX_SYNTH_NODES; i++) nodes_[i].active = false;
+  lastSteal_ = CAN_NODE_ALL;
+}
+
+// Every voice is held. The full nodes take turns in node order, starting
+// after the one that took the last steal.
+VoiceAllocator::Node* VoiceAllocator::pickSteal() {
+  Node* next = nullptr;
+  Node* first = nullptr;
+  for (Node& n : nodes_) {
+    if (!n.active) continue;
+    const uint8_t id = n.capacity.node;
+    if (first == nullptr || id < first->capacity.node) first = &n;
+    if (id > lastSteal_ || lastSteal_ == CAN_NODE_ALL) {
+      if (next == nullptr || id < next->capacity.node) next = &n;
+    }
+  }
+  Node* chosen = next ? next : first;
+  lastSteal_ = chosen->capacity.node;
+  return chosen;
+}
+
+// Most idle voices, then most releasing ones, then the lowest node
+bool VoiceAllocator::better(const VoiceCapacity& c, const VoiceCapacity& best) {
+  return c.idle != best.idle ? c.idle > best.idle
+       : c.releasing != best.releasing ? c.releasing > best.releasing
+       : c.node < best.node;
+}
+
+// Takes the voice a note will use from the cached counts
+void VoiceAllocator::charge(VoiceCapacity& capacity) {
+  if (capacity.idle) capacity.idle--;
+  else if (capacity.releasing) capacity.releasing--;
+}
+
+uint8_t VoiceAllocator::assign(uint32_t nowMs) {
+  expire(nowMs);
+
+  Node* best = nullptr;
+  bool remote = false;
+  for (uint8_t i = 0; i < MAX_SYNTH_NODES; i++) {
+    Node& n = nodes_[i];
+    if (!n.active) continue;
+    if (i > 0) remote = true;
+    if (best == nullptr || better(n.capacity, best->capacity)) best = &n;
+  }
+
+  if (!remote) {
+    stats_.broadcast++;
+    return CAN_NODE_ALL;
+  }
+
+  // Charge the note to the chosen node until its next advert
+  if (best->capacity.idle || best->capacity.releasing) {
+    charge(best->capacity);
+  } else {
+    best = pickSteal();
+    stats_.steals++;
+  }
+
+  if (best == &nodes_[0]) stats_.local++;
+  else stats_.remote++;
+  return best->capacity.node;
+}
+
+uint8_t VoiceAllocator::handOff(uint32_t nowMs) {
+  expire(nowMs);
+
+  Node* best = nullptr;
+  for (uint8_t i = 1; i < MAX_SYNTH_NODES; i++) {
+    Node& n = nodes_[i];
+    if (!n.active || !(n.capacity.idle || n.capacity.releasing)) continue;
+    if (best == nullptr || better(n.capacity, best->capacity)) best = &n;
+  }
+  if (best == nullptr) return CAN_NODE_ALL;
+
+  charge(best->capacity);
+  stats_.handoffs++;
+  return best->capacity.node;
+}
+
+uint8_t VoiceAllocator::nodeCount() const {
+  uint8_t count = 0;
+  for (const Node& n : nodes_) {
+    if (n.active) count++;
+  }
+  return count;
+}
+
+uint16_t VoiceAllocator::totalVoices() const {
+  uint16_t total = 0;
+  for (const Node& n : nodes_) {
+    if (n.active) total += n.capacity.total;
+  }
+  return total;
+}
+
+static VoiceCapacity localCapacity() {
+  const VoiceCounts counts = voices.counts();
+  VoiceCapacity capacity;
+  capacity.node = moduleOctave;
+  capacity.idle = MAX_VOICES - counts.held - counts.releasing;
+  capacity.releasing = counts.releasing;
+  capacity.total = MAX_VOICES;
+  return capacity;
+}
+
+void voiceAllocTask(void *pvParameters) {
+  // Voices are freed by the mixer as well as by note on/off, so the pool is
+  // polled. An advert goes out when the counts change, or on the heartbeat.
+  const TickType_t xFrequency = CAPACITY_POLL_MS / portTICK_PERIOD_MS;
+  TickType_t xLastWakeTime = xTaskGetTickCount();
+  VoiceCapacity advertised = {};
+  uint32_t lastAdvert = 0;
+  bool sent = false;
+  uint32_t nodesLost = 0;
+
+  while (1) {
+    vTaskDelayUntil(&xLastWakeTime, xFrequency);
+
+    const uint32_t now = millis();
+    const VoiceCapacity capacity = localCapacity();
+    uint32_t lost;
+    uint8_t nodes;
+    {
+      LockGuard lock(sysState.mutex);
+      voiceAlloc.setLocal(capacity, now);
+      lost = voiceAlloc.stats().nodesLost;
+      nodes = voiceAlloc.nodeCount();
+    }
+
+    if (!sent || capacity.node != advertised.node || capacity.idle != advertised.idle || capacity.releasing != advertised.releasing
+        || now - lastAdvert >= CAPACITY_HEARTBEAT_MS) {
+      CanMessage msg;
+      msg.length = encodeCapacity(capacity, msg.data);
+      canTx.send(CanClass::Control, msg, CONTROL_KEY_CAPACITY);
+      advertised = capacity;
+      lastAdvert = now;
+      sent = true;
+    }
+
+    if (lost != nodesLost) {
+      logEvent(LogId::NodeLost, lost - nodesLost, nodes);
+      nodesLost = lost;
+    }
+  }
+}
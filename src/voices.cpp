@@ -0,0 +1,301 @@
+#include "voices.h"
+#include "tuning.h"
+#include "dspKernels.h"
+
+VoicePool::VoicePool(StealPolicy policy)
+    : ageCounter_(0), policy_(policy), waveform_(Waveform::Saw), pitchBend_(0),
+      envelopes_{defaultEnvelope(), defaultEnvelope()}, envelopeVersion_(0), nextBlock_(0), rendered_(0), gateStats_(), steals_(0) {
+    for (Voice& v : voices_) {
+        v.state.store(VoiceState::Idle, std::memory_order_relaxed);
+        v.triggers.store(0, std::memory_order_relaxed);
+        for (uint8_t slot = 0; slot < 2; slot++) {
+            v.stepSize[slot].store(0, std::memory_order_relaxed);
+            v.table[slot].store(sawTables.level[0], std::memory_order_relaxed);
+            v.baseStep[slot] = 0;
+        }
+        v.level.store(0, std::memory_order_relaxed);
+        v.startAt.store(0, std::memory_order_relaxed);
+        v.stopAt.store(0, std::memory_order_relaxed);
+        v.stopped.store(0, std::memory_order_relaxed);
+        v.age = 0;
+        v.note = 0;
+        v.phaseAcc = 0;
+        v.lastTrigger = 0;
+    }
+}
+
+Voice* VoicePool::findVoice(uint8_t note) {
+    for (Voice& v : voices_) {
+        if (v.state.load(std::memory_order_acquire) != VoiceState::Idle && v.note == note) return &v;
+    }
+    return nullptr;
+}
+
+Voice* VoicePool::allocateVoice() {
+    // Prefer a free voice, then the quietest one that is already releasing
+    Voice* released = nullptr;
+    for (Voice& v : voices_) {
+        VoiceState state = v.state.load(std::memory_order_acquire);
+        if (state == VoiceState::Idle) return &v;
+        if (state == VoiceState::Released &&
+            (released == nullptr || v.level.load(std::memory_order_relaxed) <
+                                    released->level.load(std::memory_order_relaxed))) {
+            released = &v;
+        }
+    }
+    if (released) return released;
+
+    // Every voice is held, pick a victim according to the policy
+    if (policy_ == StealPolicy::None) return nullptr;
+
+    Voice* victim = &voices_[0];
+    for (Voice& v : voices_) {
+        if (policy_ == StealPolicy::Quietest) {
+            if (v.level.load(std::memory_order_relaxed) < victim->level.load(std::memory_order_relaxed)) victim = &v;
+            continue;
+        }
+        // Ages are compared as a difference so that counter wrap is harmless
+        int32_t delta = (int32_t)(v.age - victim->age);
+        if (policy_ == StealPolicy::Oldest ? delta < 0 : delta > 0) victim = &v;
+    }
+    steals_++;
+    return victim;
+}
+
+void VoicePool::setStep(Voice& v, uint8_t slot) {
+    const uint32_t stepSize = v.baseStep[slot];
+    uint32_t step = pitchBend_ ? bendStepSize(stepSize, pitchBend_) : stepSize;
+    v.table[slot].store(wavetableFor(waveform_, step), std::memory_order_relaxed);
+    v.stepSize[slot].store(step, std::memory_order_release);
+}
+
+void VoicePool::setEnvelope(const EnvelopeParams& params) {
+    const uint32_t version = envelopeVersion_.load(std::memory_order_relaxed) + 1;
+    envelopes_[version & 1] = params;
+    envelopeVersion_.store(version, std::memory_order_release);
+}
+
+EnvelopeParams VoicePool::getEnvelope() const {
+    return envelopes_[envelopeVersion_.load(std::memory_order_relaxed) & 1];
+}
+
+void VoicePool::setPitchBend(int32_t cents) {
+    if (cents == pitchBend_) return;
+    pitchBend_ = cents;
+    for (Voice& v : voices_) {
+        if (v.state.load(std::memory_order_acquire) == VoiceState::Idle) continue;
+        setStep(v, 0);
+        setStep(v, 1);
+    }
+}
+
+// Counts a gate that was given a sample index, and clamps a bad one
+uint32_t VoicePool::countGate(uint32_t at) {
+    const uint32_t now = clock();
+    gateStats_.timed++;
+
+    const int32_t late = (int32_t) (now - at);
+    if (late > 0) {
+        gateStats_.late++;
+        if ((uint32_t) late > gateStats_.maxLate) gateStats_.maxLate = late;
+    }
+    return at - now > MAX_GATE_AHEAD && late <= 0 ? now : at;
+}
+
+bool VoicePool::noteOn(uint8_t note, uint32_t stepSize) {
+    return startNote(note, stepSize, clock());
+}
+
+bool VoicePool::noteOn(uint8_t note, uint32_t stepSize, uint32_t at) {
+    return startNote(note, stepSize, countGate(at));
+}
+
+bool VoicePool::startNote(uint8_t note, uint32_t stepSize, uint32_t at) {
+    Voice* v = findVoice(note);
+    if (v == nullptr) v = allocateVoice();
+    if (v == nullptr) return false;
+
+    v->note = note;
+    v->age = ageCounter_++;
+
+    // The mixer restarts the envelope on `at` when it sees a new trigger
+    // count, and switches to the new note's step from there
+    const uint32_t trigger = v->triggers.load(std::memory_order_relaxed) + 1;
+    v->baseStep[trigger & 1] = stepSize;
+    setStep(*v, trigger & 1);
+    v->startAt.store(at, std::memory_order_relaxed);
+    v->triggers.store(trigger, std::memory_order_release);
+    v->state.store(VoiceState::Held, std::memory_order_release);
+    return true;
+}
+
+void VoicePool::noteOff(uint8_t note) {
+    stopNote(note, clock());
+}
+
+void VoicePool::noteOff(uint8_t note, uint32_t at) {
+    stopNote(note, countGate(at));
+}
+
+void VoicePool::stopNote(uint8_t note, uint32_t at) {
+    for (Voice& v : voices_) {
+        VoiceState held = VoiceState::Held;
+        if (v.note == note && v.state.load(std::memory_order_relaxed) == VoiceState::Held) {
+            v.stopAt.store(at, std::memory_order_relaxed);
+            v.stopped.store(v.triggers.load(std::memory_order_relaxed), std::memory_order_release);
+            v.state.compare_exchange_strong(held, VoiceState::Released, std::memory_order_acq_rel);
+        }
+    }
+}
+
+void VoicePool::allNotesOff() {
+    const uint32_t now = clock();
+    for (Voice& v : voices_) {
+        VoiceState held = VoiceState::Held;
+        if (v.state.load(std::memory_order_relaxed) != VoiceState::Held) continue;
+        v.stopAt.store(now, std::memory_order_relaxed);
+        v.stopped.store(v.triggers.load(std::memory_order_relaxed), std::memory_order_release);
+        v.state.compare_exchange_strong(held, VoiceState::Released, std::memory_order_acq_rel);
+    }
+}
+
+// Offset of sample `at` in the block of `n` samples from `blockStart`: 0 if
+// it is already due, `n` if it is in a later block
+static uint32_t gateOffset(uint32_t at, uint32_t blockStart, uint32_t n) {
+    const int32_t offset = (int32_t) (at - blockStart);
+    if (offset <= 0) return 0;
+    return (uint32_t) offset < n ? offset : n;
+}
+
+// Runs the oscillator and envelope for `n` samples, which may be none
+void VoicePool::renderSegment(Voice& v, const EnvelopeParams& envelope, int16_t* out, uint32_t n) {
+    if (n == 0) return;
+    EnvelopeRamp ramp = v.env.advance(envelope, n);
+
+    // Step and table of the note sounding, sampled once per segment
+    const uint8_t slot = v.lastTrigger & 1;
+    const uint32_t step = v.stepSize[slot].load(std::memory_order_acquire);
+    const int16_t* table = v.table[slot].load(std::memory_order_relaxed);
+
+    uint32_t phase = v.phaseAcc;
+    for (uint32_t i = 0; i < n; i++) {
+        phase += step;
+        out[i] = wavetableLookup(table, phase);
+    }
+    v.phaseAcc = phase;
+    applyRamp(out, ramp.start, ramp.step, n);
+}
+
+bool VoicePool::renderVoice(Voice& v, const EnvelopeParams& envelope, int16_t* out, uint32_t n,
+                            uint32_t blockStart) {
+    VoiceState state = v.state.load(std::memory_order_acquire);
+    if (state == VoiceState::Idle) return false;
+
+    // A new trigger count restarts the envelope on its sample. Until then the
+    // voice plays out the note it had, held or releasing, or stays silent if
+    // that has finished.
+    uint32_t triggerAt = n;
+    const uint32_t triggers = v.triggers.load(std::memory_order_acquire);
+    if (triggers != v.lastTrigger) {
+        triggerAt = gateOffset(v.startAt.load(std::memory_order_relaxed), blockStart, n);
+    }
+    if (triggerAt == n && triggers != v.lastTrigger && v.env.idle()) return false;
+
+    // The block is split where the gates land. A note-off releases the note
+    // it was given for, so the note being taken over still releases on time
+    // and a release never lands before the trigger it follows.
+    const uint32_t stopped = v.stopped.load(std::memory_order_acquire);
+    const uint32_t releaseAt = gateOffset(v.stopAt.load(std::memory_order_relaxed), blockStart, n);
+    uint32_t done = 0;
+    if (stopped == v.lastTrigger && releaseAt < triggerAt) {
+        renderSegment(v, envelope, out, releaseAt);
+        v.env.release();
+        done = releaseAt;
+    }
+    if (triggerAt < n) {
+        renderSegment(v, envelope, out + done, triggerAt - done);
+        v.lastTrigger = triggers;
+        v.env.trigger();
+        done = triggerAt;
+        if (stopped == triggers) {
+            const uint32_t at = releaseAt > done ? releaseAt : done;
+            if (at < n) {
+                renderSegment(v, envelope, out + done, at - done);
+                v.env.release();
+                done = at;
+            }
+        }
+    }
+    renderSegment(v, envelope, out + done, n - done);
+    v.level.store(v.env.level(), std::memory_order_relaxed);
+
+    // Free the voice once the release has finished, unless a note-on got there first
+    if (v.env.idle() && triggers == v.lastTrigger) {
+        VoiceState released = VoiceState::Released;
+        v.state.compare_exchange_strong(released, VoiceState::Idle, std::memory_order_acq_rel);
+    }
+    return true;
+}
+
+void VoicePool::mixBlock(int16_t* out, uint32_t n) {
+    const uint32_t blockStart = nextBlock_;
+    nextBlock_ = blockStart + n;
+
+    // Gates for this block that arrive from here on are late
+    rendered_.store(nextBlock_, std::memory_order_release);
+
+    // The envelope as it stands, for the whole block
+    EnvelopeParams envelope;
+    uint32_t version = envelopeVersion_.load(std::memory_order_acquire);
+    while (true) {
+        envelope = envelopes_[version & 1];
+        std::atomic_thread_fence(std::memory_order_acquire);
+        const uint32_t now = envelopeVersion_.load(std::memory_order_relaxed);
+        if (now == version) break;
+        version = now;
+    }
+
+    for (uint32_t i = 0; i < n; i++) mixBuffer_[i] = 0;
+
+    uint8_t pending = 0;
+    for (Voice& v : voices_) {
+        if (!renderVoice(v, envelope, voiceBuffer_[pending], n, blockStart)) continue;
+
+        if (++pending == 2) {
+            mixPair(mixBuffer_, voiceBuffer_[0], voiceBuffer_[1], VOICE_GAIN, VOICE_GAIN, n);
+            pending = 0;
+        }
+    }
+    if (pending) {
+        mixPair(mixBuffer_, voiceBuffer_[0], voiceBuffer_[0], VOICE_GAIN, 0, n);
+    }
+
+    // Round off rather than wrap when many voices line up
+    softClip(mixBuffer_, out, n, 15);
+}
+
+uint8_t VoicePool::activeCount() const {
+    uint8_t count = 0;
+    for (const Voice& v : voices_) {
+        if (v.state.load(std::memory_order_relaxed) != VoiceState::Idle) count++;
+    }
+    return count;
+}
+
+bool VoicePool::hasVoiceFor(uint8_t note) const {
+    for (const Voice& v : voices_) {
+        VoiceState state = v.state.load(std::memory_order_acquire);
+        if (state != VoiceState::Held || v.note == note) return true;
+    }
+    return false;
+}
+
+VoiceCounts VoicePool::counts() const {
+    VoiceCounts counts = {0, 0};
+    for (const Voice& v : voices_) {
+        VoiceState state = v.state.load(std::memory_order_relaxed);
+        if (state == VoiceState::Held) counts.held++;
+        else if (state == VoiceState::Released) counts.releasing++;
+    }
+    return counts;
+}
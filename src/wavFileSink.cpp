@@ -0,0 +1,66 @@
+// Host build only, the firmware streams to the DAC instead
+#ifndef ARDUINO
+
+#include "wavFileSink.h"
+
+// Write a little-endian integer of `bytes` bytes
+static void writeLE(FILE* f, uint32_t value, uint8_t bytes) {
+  for (uint8_t i = 0; i < bytes; i++) {
+    fputc((value >> (8 * i)) & 0xff, f);
+  }
+}
+
+void WavFileSink::writeHeader() {
+  const uint32_t dataBytes = samples_ * 2;
+
+  fseek(file_, 0, SEEK_SET);
+  fwrite("RIFF", 1, 4, file_);
+  writeLE(file_, 36 + dataBytes, 4);
+  fwrite("WAVEfmt ", 1, 8, file_);
+  writeLE(file_, 16, 4);               // fmt chunk size
+  writeLE(file_, 1, 2);                // PCM
+  writeLE(file_, 1, 2);                // Mono
+  writeLE(file_, sampleRate_, 4);
+  writeLE(file_, sampleRate_ * 2, 4);  // Byte rate
+  writeLE(file_, 2, 2);                // Block align
+  writeLE(file_, 16, 2);               // Bits per sample
+  fwrite("data", 1, 4, file_);
+  writeLE(file_, dataBytes, 4);
+}
+
+bool WavFileSink::begin(uint32_t sampleRate) {
+  file_ = fopen(path_, "wb");
+  if (!file_) return false;
+
+  sampleRate_ = sampleRate;
+  samples_ = 0;
+  writeHeader();
+  return true;
+}
+
+uint16_t* WavFileSink::acquireBlock() {
+  blockClock_ = samples_;
+  return block_;
+}
+
+void WavFileSink::commitBlock() {
+  if (!file_) return;
+
+  // Convert unsigned 12-bit to signed 16-bit
+  for (uint32_t i = 0; i < AUDIO_BLOCK_SIZE; i++) {
+    int16_t s = (int16_t)((block_[i] - DAC_MIDPOINT) << 4);
+    writeLE(file_, (uint16_t) s, 2);
+  }
+  samples_ += AUDIO_BLOCK_SIZE;
+  stats_.blocks++;
+}
+
+void WavFileSink::end() {
+  if (!file_) return;
+
+  writeHeader();
+  fclose(file_);
+  file_ = nullptr;
+}
+
+#endif // ARDUINO
@@ -0,0 +1,102 @@
+#include "wavetable.h"
+#include "constexprMath.h"
+
+// ---------------------------------------------------------------------
+//              COMPILE-TIME TABLE GENERATION
+// ---------------------------------------------------------------------
+
+namespace {
+
+struct SineCycle {
+  double value[WAVETABLE_SIZE];
+};
+
+// One cycle of sine, so harmonic h at sample i is cycle[(h * i) % size]
+constexpr SineCycle makeSineCycle() {
+  SineCycle cycle{};
+  for (uint32_t i = 0; i < WAVETABLE_SIZE; i++) {
+    cycle.value[i] = constmath::sin(2 * constmath::PI * i / WAVETABLE_SIZE);
+  }
+  return cycle;
+}
+
+constexpr SineCycle sineCycle = makeSineCycle();
+
+// Fourier coefficient of harmonic h for each waveform
+constexpr double harmonic(Waveform wave, uint32_t h) {
+  switch (wave) {
+    case Waveform::Saw:
+      // Rising ramp, matching the original phaseAcc sawtooth
+      return -2.0 / (constmath::PI * h);
+    case Waveform::Square:
+      return (h % 2) ? 4.0 / (constmath::PI * h) : 0.0;
+    case Waveform::Triangle:
+      if (h % 2 == 0) return 0.0;
+      return ((h / 2) % 2 ? -8.0 : 8.0) / (constmath::PI * constmath::PI * h * h);
+    default:
+      return h == 1 ? 1.0 : 0.0;
+  }
+}
+
+// Harmonics that stay below Nyquist for every step size in a level
+constexpr uint32_t harmonicLimit(uint8_t level) {
+  uint32_t limit = 1u << (WAVETABLE_LEVELS - 1 - level);
+  return limit < WAVETABLE_SIZE / 2 ? limit : WAVETABLE_SIZE / 2 - 1;
+}
+
+// Additive synthesis of each level with Lanczos sigma factors to tame the
+// Gibbs overshoot, normalised to full scale.
+constexpr WavetableSet makeTables(Waveform wave) {
+  WavetableSet set{};
+  for (uint8_t level = 0; level < WAVETABLE_LEVELS; level++) {
+    const uint32_t limit = harmonicLimit(level);
+    double cycle[WAVETABLE_SIZE] = {};
+    double peak = 0;
+
+    for (uint32_t h = 1; h <= limit; h++) {
+      double coef = harmonic(wave, h);
+      if (coef == 0.0) continue;
+      double x = constmath::PI * h / (limit + 1);
+      coef *= constmath::sin(x) / x;
+      for (uint32_t i = 0; i < WAVETABLE_SIZE; i++) {
+        cycle[i] += coef * sineCycle.value[(h * i) % WAVETABLE_SIZE];
+      }
+    }
+
+    for (uint32_t i = 0; i < WAVETABLE_SIZE; i++) {
+      double mag = cycle[i] < 0 ? -cycle[i] : cycle[i];
+      if (mag > peak) peak = mag;
+    }
+    for (uint32_t i = 0; i < WAVETABLE_SIZE; i++) {
+      double scaled = cycle[i] * 32767.0 / peak;
+      set.level[level][i] = (int16_t)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+    }
+    set.level[level][WAVETABLE_SIZE] = set.level[level][0];
+  }
+  return set;
+}
+
+} // namespace
+
+// ---------------------------------------------------------------------
+//                     TABLES (FLASH)
+// ---------------------------------------------------------------------
+
+constexpr WavetableSet sawTables = makeTables(Waveform::Saw);
+constexpr WavetableSet squareTables = makeTables(Waveform::Square);
+constexpr WavetableSet triangleTables = makeTables(Waveform::Triangle);
+constexpr WavetableSet sineTables = makeTables(Waveform::Sine);
+
+const int16_t* wavetableFor(Waveform wave, uint32_t stepSize) {
+  // The top set bit of the step size selects the octave
+  int8_t level = (stepSize ? 31 - __builtin_clz(stepSize) : 0) - WAVETABLE_LOWEST_BIT;
+  if (level < 0) level = 0;
+  if (level >= WAVETABLE_LEVELS) level = WAVETABLE_LEVELS - 1;
+
+  switch (wave) {
+    case Waveform::Square:   return squareTables.level[level];
+    case Waveform::Triangle: return triangleTables.level[level];
+    case Waveform::Sine:     return sineTables.level[level];
+    default:                 return sawTables.level[level];
+  }
+}
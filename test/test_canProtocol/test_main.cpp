@@ -0,0 +1,242 @@
+#include <unity.h>
+#include <string.h>
+#include "canProtocol.h"
+
+static uint8_t data[8];
+static KeyDiff diff;
+
+static KeyDiff makeDiff(uint8_t octave, uint8_t sequence, uint16_t state, uint16_t changed,
+                        uint8_t target) {
+  KeyDiff d;
+  d.octave = octave;
+  d.sequence = sequence;
+  d.state = state;
+  d.changed = changed;
+  d.target = target;
+  d.timed = false;
+  d.time = 0;
+  return d;
+}
+
+static void assertSameDiff(const KeyDiff& expected, const KeyDiff& actual) {
+  TEST_ASSERT_EQUAL_UINT8(expected.octave, actual.octave);
+  TEST_ASSERT_EQUAL_UINT8(expected.sequence, actual.sequence);
+  TEST_ASSERT_EQUAL_HEX16(expected.state, actual.state);
+  TEST_ASSERT_EQUAL_HEX16(expected.changed, actual.changed);
+  TEST_ASSERT_EQUAL_UINT8(expected.target, actual.target);
+  TEST_ASSERT_EQUAL(expected.timed, actual.timed);
+  if (expected.timed) TEST_ASSERT_EQUAL_HEX16(expected.time, actual.time);
+}
+
+void setUp() {
+  memset(data, 0xa5, sizeof(data));
+  memset(&diff, 0, sizeof(diff));
+}
+
+void tearDown() {}
+
+void test_untimed_key_diff_round_trips() {
+  const KeyDiff sent = makeDiff(4, 17, 0x0a51, 0x0f0f, 3);
+  const uint8_t length = encodeKeyDiff(sent, data);
+  TEST_ASSERT_EQUAL_UINT8(KEY_DIFF_TARGET_LENGTH, length);
+  TEST_ASSERT_EQUAL(CanDecodeResult::KeyDiff, decodeFrame(data, length, diff));
+  assertSameDiff(sent, diff);
+}
+
+void test_every_node_target_round_trips() {
+  const KeyDiff sent = makeDiff(0, 0, 0x0001, 0x0001, CAN_NODE_ALL);
+  const uint8_t length = encodeKeyDiff(sent, data);
+  TEST_ASSERT_EQUAL(CanDecodeResult::KeyDiff, decodeFrame(data, length, diff));
+  assertSameDiff(sent, diff);
+}
+
+void test_timed_key_diff_round_trips() {
+  KeyDiff sent = makeDiff(9, 255, 0x0fff, 0x0fff, 14);
+  sent.timed = true;
+  const uint16_t times[] = {0, 0x0123, KEY_DIFF_TIME_MASK};
+  for (uint16_t time : times) {
+    sent.time = time;
+    const uint8_t length = encodeKeyDiff(sent, data);
+    TEST_ASSERT_EQUAL_UINT8(KEY_DIFF_TIMED_LENGTH, length);
+    TEST_ASSERT_EQUAL(CanDecodeResult::KeyDiff, decodeFrame(data, length, diff));
+    assertSameDiff(sent, diff);
+  }
+}
+
+void test_key_bits_above_twelve_are_dropped() {
+  const KeyDiff sent = makeDiff(2, 1, 0xf801, 0xf002, 1);
+  TEST_ASSERT_EQUAL(CanDecodeResult::KeyDiff, decodeFrame(data, encodeKeyDiff(sent, data), diff));
+  TEST_ASSERT_EQUAL_HEX16(0x0801, diff.state);
+  TEST_ASSERT_EQUAL_HEX16(0x0002, diff.changed);
+}
+
+void test_short_key_diff_plays_everywhere_on_arrival() {
+  // Modules without voice allocation send the first six bytes only
+  const KeyDiff sent = makeDiff(5, 9, 0x0100, 0x0180, 2);
+  encodeKeyDiff(sent, data);
+  TEST_ASSERT_EQUAL(CanDecodeResult::KeyDiff, decodeFrame(data, KEY_DIFF_LENGTH, diff));
+  TEST_ASSERT_EQUAL_UINT8(CAN_NODE_ALL, diff.target);
+  TEST_ASSERT_FALSE(diff.timed);
+  TEST_ASSERT_EQUAL_HEX16(0x0100, diff.state);
+  TEST_ASSERT_EQUAL_HEX16(0x0180, diff.changed);
+}
+
+void test_newer_version_is_rejected() {
+  encodeKeyDiff(makeDiff(1, 0, 0, 1, 0), data);
+  data[0] = (2 << 4) | (uint8_t) CanMsgType::KeyDiff;
+  TEST_ASSERT_EQUAL(CanDecodeResult::BadVersion, decodeFrame(data, KEY_DIFF_TARGET_LENGTH, diff));
+  data[0] = 0x00;
+  TEST_ASSERT_EQUAL(CanDecodeResult::BadVersion, decodeFrame(data, KEY_DIFF_TARGET_LENGTH, diff));
+}
+
+void test_malformed_frames_are_rejected() {
+  const uint8_t length = encodeKeyDiff(makeDiff(3, 0, 0, 1, 0), data);
+  TEST_ASSERT_EQUAL(CanDecodeResult::Malformed, decodeFrame(data, 0, diff));
+  TEST_ASSERT_EQUAL(CanDecodeResult::Malformed, decodeFrame(data, 2, diff));
+  TEST_ASSERT_EQUAL(CanDecodeResult::Malformed, decodeFrame(data, KEY_DIFF_LENGTH - 1, diff));
+
+  data[0] = (CAN_PROTOCOL_VERSION << 4) | (uint8_t) CanMsgType::Capacity;
+  TEST_ASSERT_EQUAL(CanDecodeResult::Malformed, decodeFrame(data, length, diff));
+
+  encodeKeyDiff(makeDiff(10, 0, 0, 1, 0), data);
+  TEST_ASSERT_EQUAL(CanDecodeResult::Malformed, decodeFrame(data, length, diff));
+}
+
+void test_legacy_press_and_release() {
+  const uint8_t press[3] = {'P', 6, 11};
+  TEST_ASSERT_EQUAL(CanDecodeResult::Legacy, decodeFrame(press, 3, diff));
+  assertSameDiff(makeDiff(6, 0, 1u << 11, 1u << 11, CAN_NODE_ALL), diff);
+
+  const uint8_t release[8] = {'R', 0, 0, 0, 0, 0, 0, 0};
+  TEST_ASSERT_EQUAL(CanDecodeResult::Legacy, decodeFrame(release, 8, diff));
+  assertSameDiff(makeDiff(0, 0, 0, 1, CAN_NODE_ALL), diff);
+}
+
+void test_legacy_out_of_range_is_rejected() {
+  const uint8_t badNote[3] = {'P', 4, 12};
+  const uint8_t badOctave[3] = {'R', 10, 0};
+  TEST_ASSERT_EQUAL(CanDecodeResult::Malformed, decodeFrame(badNote, 3, diff));
+  TEST_ASSERT_EQUAL(CanDecodeResult::Malformed, decodeFrame(badOctave, 3, diff));
+}
+
+void test_sequence_counts_gaps() {
+  KeyDiffSequence tracker = {};
+  TEST_ASSERT_EQUAL_UINT8(0, trackSequence(tracker, 40));
+  TEST_ASSERT_EQUAL_UINT8(0, trackSequence(tracker, 41));
+  TEST_ASSERT_EQUAL_UINT8(3, trackSequence(tracker, 45));
+  TEST_ASSERT_EQUAL_UINT8(0, trackSequence(tracker, 46));
+}
+
+void test_sequence_gap_across_wrap() {
+  KeyDiffSequence tracker = {};
+  trackSequence(tracker, 254);
+  TEST_ASSERT_EQUAL_UINT8(0, trackSequence(tracker, 255));
+  TEST_ASSERT_EQUAL_UINT8(0, trackSequence(tracker, 0));
+  TEST_ASSERT_EQUAL_UINT8(2, trackSequence(tracker, 3));
+
+  trackSequence(tracker, 253);
+  TEST_ASSERT_EQUAL_UINT8(3, trackSequence(tracker, 1));
+}
+
+void test_sequence_restarts_after_reset() {
+  KeyDiffSequence tracker = {};
+  trackSequence(tracker, 10);
+  tracker.seen = false;
+  TEST_ASSERT_EQUAL_UINT8(0, trackSequence(tracker, 200));
+  TEST_ASSERT_EQUAL_UINT8(0, trackSequence(tracker, 201));
+}
+
+void test_capacity_round_trips() {
+  const VoiceCapacity sent = {7, 3, 2, 8};
+  VoiceCapacity got;
+  const uint8_t length = encodeCapacity(sent, data);
+  TEST_ASSERT_EQUAL_UINT8(CAPACITY_LENGTH, length);
+  TEST_ASSERT_TRUE(decodeCapacity(data, length, got));
+  TEST_ASSERT_EQUAL_UINT8(7, got.node);
+  TEST_ASSERT_EQUAL_UINT8(3, got.idle);
+  TEST_ASSERT_EQUAL_UINT8(2, got.releasing);
+  TEST_ASSERT_EQUAL_UINT8(8, got.total);
+
+  TEST_ASSERT_FALSE(decodeCapacity(data, length - 1, got));
+  data[2] = 7;
+  TEST_ASSERT_FALSE(decodeCapacity(data, length, got));
+}
+
+void test_handoff_round_trips() {
+  const Handoff sent = {5, 11, 6};
+  Handoff got;
+  const uint8_t length = encodeHandoff(sent, data);
+  TEST_ASSERT_EQUAL_UINT8(HANDOFF_LENGTH, length);
+  TEST_ASSERT_TRUE(decodeHandoff(data, length, got));
+  TEST_ASSERT_EQUAL_UINT8(5, got.octave);
+  TEST_ASSERT_EQUAL_UINT8(11, got.key);
+  TEST_ASSERT_EQUAL_UINT8(6, got.node);
+
+  // A handoff is never read as a capacity advert
+  VoiceCapacity capacity;
+  TEST_ASSERT_FALSE(decodeCapacity(data, length, capacity));
+  TEST_ASSERT_FALSE(decodeHandoff(data, length - 1, got));
+  data[2] = 12;
+  TEST_ASSERT_FALSE(decodeHandoff(data, length, got));
+}
+
+void test_sync_frames_round_trip() {
+  SyncFrame sent = {2, 99, 0xdeadbeef};
+  SyncFrame got;
+  uint8_t length = encodeSync(sent, data);
+  TEST_ASSERT_TRUE(decodeSync(data, length, got));
+  TEST_ASSERT_FALSE(decodeSyncTime(data, length, got));
+  TEST_ASSERT_EQUAL_UINT8(2, got.master);
+  TEST_ASSERT_EQUAL_UINT8(99, got.sequence);
+
+  length = encodeSyncTime(sent, data);
+  TEST_ASSERT_FALSE(decodeSync(data, length, got));
+  TEST_ASSERT_TRUE(decodeSyncTime(data, length, got));
+  TEST_ASSERT_EQUAL_UINT8(99, got.sequence);
+  TEST_ASSERT_EQUAL_HEX32(0xdeadbeef, got.time);
+  TEST_ASSERT_FALSE(decodeSyncTime(data, length - 1, got));
+
+  // A sync is never read as a key diff
+  TEST_ASSERT_EQUAL(CanDecodeResult::Malformed, decodeFrame(data, length, diff));
+}
+
+void test_enumeration_frames_round_trip() {
+  EnumFrame sent = {5, 0, false, 0x12345678};
+  EnumFrame got;
+  uint8_t length = encodeEnumStart(sent, data);
+  TEST_ASSERT_TRUE(decodeEnumStart(data, length, got));
+  TEST_ASSERT_FALSE(decodeEnumClaim(data, length, got));
+  TEST_ASSERT_EQUAL_UINT8(5, got.round);
+  TEST_ASSERT_EQUAL_HEX32(0x12345678, got.uid);
+
+  sent.position = 127;
+  sent.last = true;
+  length = encodeEnumClaim(sent, data);
+  TEST_ASSERT_FALSE(decodeEnumStart(data, length, got));
+  TEST_ASSERT_TRUE(decodeEnumClaim(data, length, got));
+  TEST_ASSERT_EQUAL_UINT8(127, got.position);
+  TEST_ASSERT_TRUE(got.last);
+  TEST_ASSERT_EQUAL_HEX32(0x12345678, got.uid);
+  TEST_ASSERT_FALSE(decodeEnumClaim(data, length - 1, got));
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_untimed_key_diff_round_trips);
+  RUN_TEST(test_every_node_target_round_trips);
+  RUN_TEST(test_timed_key_diff_round_trips);
+  RUN_TEST(test_key_bits_above_twelve_are_dropped);
+  RUN_TEST(test_short_key_diff_plays_everywhere_on_arrival);
+  RUN_TEST(test_newer_version_is_rejected);
+  RUN_TEST(test_malformed_frames_are_rejected);
+  RUN_TEST(test_legacy_press_and_release);
+  RUN_TEST(test_legacy_out_of_range_is_rejected);
+  RUN_TEST(test_sequence_counts_gaps);
+  RUN_TEST(test_sequence_gap_across_wrap);
+  RUN_TEST(test_sequence_restarts_after_reset);
+  RUN_TEST(test_capacity_round_trips);
+  RUN_TEST(test_handoff_round_trips);
+  RUN_TEST(test_sync_frames_round_trip);
+  RUN_TEST(test_enumeration_frames_round_trip);
+  return UNITY_END();
+}
@@ -0,0 +1,92 @@
+#include <unity.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "clockSync.h"
+#include "audio.h"
+
+// Sync pairs from a master and a module whose crystals differ by `ppm`, fed
+// straight into a ClockSync. Receive stamps are up to `jitterUs` late, and
+// the master can restart its clock after `restartAt` Syncs.
+
+constexpr uint32_t SYNCS = 200;
+constexpr uint32_t SETTLE = 50;
+
+// Once settled the module must stay within a sample of the master, halfway
+// between Syncs where its estimate is furthest from one, and judge the
+// drift within 2 ppm
+static void replay(int32_t ppm, uint32_t localStart, uint32_t stackStart, uint32_t jitterUs,
+                   uint32_t restartAt) {
+  ClockSync sync;
+  sync.setNode(5);
+  uint32_t noise = 1;
+  uint64_t restartUs = 0;
+  int32_t maxError = 0;
+
+  // Both clocks at true time `us`
+  auto local = [&](uint64_t us) {
+    return localStart + (uint32_t) (us * SAMPLE_RATE * (1000000 + ppm) / 1000000000000ull);
+  };
+  auto stack = [&](uint64_t us) {
+    return stackStart + (uint32_t) ((us - restartUs) * SAMPLE_RATE / 1000000);
+  };
+
+  for (uint32_t i = 1; i <= SYNCS; i++) {
+    const uint64_t at = (uint64_t) i * SYNC_PERIOD_MS * 1000;
+    if (restartAt && i == restartAt + 1) {
+      restartUs = at;
+      stackStart = 0;
+    }
+    noise = noise * 1103515245 + 12345;
+    const uint32_t late = jitterUs ? (noise >> 16) % (jitterUs + 1) : 0;
+
+    const SyncFrame frame = {4, (uint8_t) i, stack(at)};
+    sync.onSync(frame, local(at + late), at / 1000);
+    sync.onSyncTime(frame);
+
+    const uint64_t probe = at + SYNC_PERIOD_MS * 500;
+    if (i > SETTLE && (!restartAt || i > restartAt + SETTLE)) {
+      const int32_t error = abs((int32_t) (sync.toStack(local(probe)) - stack(probe)));
+      if (error > maxError) maxError = error;
+    }
+  }
+
+  const ClockSyncStats stats = sync.stats();
+  TEST_ASSERT_TRUE(stats.locked);
+  TEST_ASSERT_LESS_OR_EQUAL_INT32(1, maxError);
+  TEST_ASSERT_INT32_WITHIN(2000, -ppm * 1000, stats.driftPpb);
+  TEST_ASSERT_EQUAL_UINT32(restartAt ? 1 : 0, stats.steps);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_same_rate() {
+  replay(0, 1000, 5000, 0, 0);
+}
+
+void test_100_ppm_fast() {
+  replay(100, 1000, 5000, 0, 0);
+}
+
+void test_200_ppm_slow_with_jitter() {
+  replay(-200, 77777, 3, 40, 0);
+}
+
+void test_both_clocks_wrap() {
+  replay(150, 0xfffff000, 0xffffff00, 20, 0);
+}
+
+void test_master_restarts() {
+  replay(-80, 1000, 0x12345678, 20, 100);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_same_rate);
+  RUN_TEST(test_100_ppm_fast);
+  RUN_TEST(test_200_ppm_slow_with_jitter);
+  RUN_TEST(test_both_clocks_wrap);
+  RUN_TEST(test_master_restarts);
+  return UNITY_END();
+}
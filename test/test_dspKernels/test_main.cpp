@@ -0,0 +1,155 @@
+#include <unity.h>
+#include <stdint.h>
+#include <string.h>
+#include "dspKernels.h"
+
+// Each kernel against its portable version, which it must match bit for
+// bit. Host builds run the SIMD kernels on the simulator's stand-in
+// intrinsics (DSP_KERNELS_EMULATE), so this checks their packing, odd
+// tails and saturation.
+
+constexpr uint32_t MAX_N = 67;
+
+// Odd sizes leave a single sample for the portable tail
+static const uint32_t SIZES[] = {0, 1, 2, 3, 15, 16, 31, 32, 33, 64, MAX_N};
+
+// Gains including both ends of Q15
+static const int16_t GAINS[] = {0, 1, -1, 16384, 32767, -32767, -32768};
+
+static uint32_t noise;
+
+// Random samples, with every few at full scale either way
+static void fill(int16_t* buf, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    noise = noise * 1103515245 + 12345;
+    const uint32_t pick = (noise >> 8) % 8;
+    buf[i] = pick == 0 ? INT16_MIN : pick == 1 ? INT16_MAX : (int16_t) (noise >> 16);
+  }
+}
+
+static void fill32(int32_t* buf, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    noise = noise * 1103515245 + 12345;
+    const uint32_t pick = (noise >> 8) % 8;
+    buf[i] = pick == 0 ? INT32_MIN : pick == 1 ? INT32_MAX : (int32_t) (noise ^ noise << 13);
+  }
+}
+
+void setUp() {
+  noise = 1;
+}
+
+void tearDown() {}
+
+void test_mixPair_matches_portable() {
+  for (uint32_t n : SIZES) {
+    for (int16_t gainA : GAINS) {
+      for (int16_t gainB : GAINS) {
+        int16_t a[MAX_N], b[MAX_N];
+        int32_t acc[MAX_N], expected[MAX_N];
+        fill(a, n);
+        fill(b, n);
+        fill32(acc, n);
+        memcpy(expected, acc, n * sizeof(acc[0]));
+
+        mixPair(acc, a, b, gainA, gainB, n);
+        mixPairPortable(expected, a, b, gainA, gainB, n);
+        TEST_ASSERT_EQUAL_INT32_ARRAY(expected, acc, n);
+      }
+    }
+  }
+}
+
+void test_mixPair_wraps_like_smlad() {
+  // Both products at their largest push past INT32_MAX and wrap
+  int16_t a[2] = {INT16_MIN, INT16_MIN};
+  int16_t b[2] = {INT16_MIN, INT16_MIN};
+  int32_t acc[2] = {INT32_MAX, 0};
+  mixPair(acc, a, b, INT16_MIN, INT16_MIN, 2);
+  TEST_ASSERT_EQUAL_INT32((int32_t) (0x7fffffffu + 0x80000000u), acc[0]);
+  TEST_ASSERT_EQUAL_INT32(INT32_MIN, acc[1]);
+}
+
+void test_applyGain_matches_portable() {
+  for (uint32_t n : SIZES) {
+    for (int16_t gain : GAINS) {
+      int16_t buf[MAX_N], expected[MAX_N];
+      fill(buf, n);
+      memcpy(expected, buf, n * sizeof(buf[0]));
+
+      applyGain(buf, gain, n);
+      applyGainPortable(expected, gain, n);
+      TEST_ASSERT_EQUAL_INT16_ARRAY(expected, buf, n);
+    }
+  }
+}
+
+void test_applyGain_saturates_minus_full_scale() {
+  // -1 * -1 in Q15 is one past the largest positive value
+  int16_t buf[3] = {INT16_MIN, INT16_MIN, INT16_MAX};
+  applyGain(buf, INT16_MIN, 3);
+  TEST_ASSERT_EQUAL_INT16(INT16_MAX, buf[0]);
+  TEST_ASSERT_EQUAL_INT16(INT16_MAX, buf[1]);
+  TEST_ASSERT_EQUAL_INT16(-INT16_MAX, buf[2]);
+}
+
+void test_addSaturate_matches_portable() {
+  for (uint32_t n : SIZES) {
+    int16_t dst[MAX_N], src[MAX_N], expected[MAX_N];
+    fill(dst, n);
+    fill(src, n);
+    memcpy(expected, dst, n * sizeof(dst[0]));
+
+    addSaturate(dst, src, n);
+    addSaturatePortable(expected, src, n);
+    TEST_ASSERT_EQUAL_INT16_ARRAY(expected, dst, n);
+  }
+}
+
+void test_addSaturate_clamps_both_ways() {
+  int16_t dst[3] = {INT16_MAX, INT16_MIN, -5};
+  const int16_t src[3] = {1, -1, 7};
+  addSaturate(dst, src, 3);
+  TEST_ASSERT_EQUAL_INT16(INT16_MAX, dst[0]);
+  TEST_ASSERT_EQUAL_INT16(INT16_MIN, dst[1]);
+  TEST_ASSERT_EQUAL_INT16(2, dst[2]);
+}
+
+void test_softClip_matches_portable() {
+  for (uint32_t n : SIZES) {
+    for (uint8_t shift = 0; shift <= 16; shift += 2) {
+      int32_t in[MAX_N];
+      int16_t out[MAX_N], expected[MAX_N];
+      fill32(in, n);
+
+      softClip(in, out, n, shift);
+      softClipPortable(in, expected, n, shift);
+      TEST_ASSERT_EQUAL_INT16_ARRAY(expected, out, n);
+    }
+  }
+}
+
+void test_softClip_is_odd_and_bounded() {
+  const int32_t in[4] = {INT32_MAX, INT32_MIN, 1000, -1000};
+  int16_t out[4];
+  softClip(in, out, 4, 0);
+  // Two thirds of full scale at either end, close to unity for small
+  // values. Shifts round down, so negative values can come out one lower.
+  TEST_ASSERT_INT_WITHIN(2, 21845, out[0]);
+  TEST_ASSERT_INT_WITHIN(2, -21845, out[1]);
+  TEST_ASSERT_INT_WITHIN(1, 1000, out[2]);
+  TEST_ASSERT_INT_WITHIN(1, -out[2], out[3]);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_mixPair_matches_portable);
+  RUN_TEST(test_mixPair_wraps_like_smlad);
+  RUN_TEST(test_applyGain_matches_portable);
+  RUN_TEST(test_applyGain_saturates_minus_full_scale);
+  RUN_TEST(test_addSaturate_matches_portable);
+  RUN_TEST(test_addSaturate_clamps_both_ways);
+  RUN_TEST(test_softClip_matches_portable);
+  RUN_TEST(test_softClip_is_odd_and_bounded);
+  return UNITY_END();
+}
@@ -0,0 +1,74 @@
+#include <unity.h>
+#include <stdint.h>
+#include "knob.h"
+
+// A/B sequences from one knob, replayed through a KnobBank. States are
+// B << 1 | A as digits, the first one only sets where the knob starts.
+
+constexpr uint8_t KNOB = 1;
+
+// Replays `states` `stepUs` apart and checks where the knob ends up
+static void replay(KnobConfig config, uint32_t stepUs, const char* states, int16_t value,
+                   uint32_t missed) {
+  KnobConfig configs[NUM_KNOBS] = {{0, 8, 0, 1}, {0, 8, 0, 1}, {0, 8, 0, 1}, {0, 8, 0, 1}};
+  configs[KNOB] = config;
+  KnobBank bank(configs);
+
+  const uint8_t shift = 2 * (NUM_KNOBS - 1 - KNOB);
+  uint32_t now = 0;
+  for (const char* s = states; *s; s++) {
+    bank.update((0xff & ~(0b11 << shift)) | (*s - '0') << shift, now);
+    now += stepUs;
+  }
+  TEST_ASSERT_EQUAL_INT16(value, bank.get(KNOB));
+  TEST_ASSERT_EQUAL_UINT32(missed, bank.missed());
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_detent_up() {
+  replay({0, 8, 0, 1}, 40000, "32013", 4, 0);
+}
+
+void test_detent_down() {
+  replay({0, 8, 4, 1}, 40000, "31023", 0, 0);
+}
+
+void test_contact_bounce() {
+  replay({0, 8, 4, 1}, 1000, "323232013", 8, 0);
+}
+
+void test_skipped_state() {
+  replay({0, 8, 4, 1}, 1000, "3203", 8, 1);
+}
+
+void test_clamped_at_the_top() {
+  replay({0, 8, 6, 1}, 40000, "320132013", 8, 0);
+}
+
+void test_slow_sweep() {
+  replay({0, 127, 0, 8}, 20000, "32013201320132013", 16, 0);
+}
+
+void test_fast_sweep_accelerates() {
+  replay({0, 127, 0, 8}, 2000, "32013201320132013", 121, 0);
+}
+
+void test_reversal_drops_back() {
+  replay({0, 127, 0, 8}, 2000, "3201320131023", 32, 0);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_detent_up);
+  RUN_TEST(test_detent_down);
+  RUN_TEST(test_contact_bounce);
+  RUN_TEST(test_skipped_state);
+  RUN_TEST(test_clamped_at_the_top);
+  RUN_TEST(test_slow_sweep);
+  RUN_TEST(test_fast_sweep_accelerates);
+  RUN_TEST(test_reversal_drops_back);
+  return UNITY_END();
+}
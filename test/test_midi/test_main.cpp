@@ -0,0 +1,168 @@
+#include <unity.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include "midi.h"
+
+// Short byte sequences, in hex, must give the channel messages listed as
+// status, data1, data2 triples, whole and a byte at a time. A long stream of
+// random messages must come back as it was made.
+
+// Random channel messages, mostly on running status, with real-time bytes
+// inside them and system exclusive and system common messages between them
+constexpr uint32_t STREAM_MESSAGES = 300000;
+
+static std::vector<uint8_t> hexBytes(const char* hex) {
+  std::vector<uint8_t> bytes;
+  for (const char* p = hex; *p; p++) {
+    if (*p == ' ') continue;
+    bytes.push_back((uint8_t) strtoul(std::string(p, 2).c_str(), nullptr, 16));
+    p++;
+  }
+  return bytes;
+}
+
+static void assertSameMessages(const std::vector<MidiMessage>& expected,
+                               const std::vector<MidiMessage>& actual) {
+  TEST_ASSERT_EQUAL_UINT32(expected.size(), actual.size());
+  for (size_t i = 0; i < expected.size(); i++) {
+    TEST_ASSERT_EQUAL_HEX8(expected[i].status, actual[i].status);
+    TEST_ASSERT_EQUAL_HEX8(expected[i].data1, actual[i].data1);
+    TEST_ASSERT_EQUAL_HEX8(expected[i].data2, actual[i].data2);
+  }
+}
+
+// Parses `bytes` in batches of up to `batch`, or of random sizes up to
+// MIDI_BATCH_BYTES if `batch` is 0
+static std::vector<MidiMessage> parseAll(MidiParser& parser, const std::vector<uint8_t>& bytes, uint32_t batch) {
+  std::vector<MidiMessage> messages;
+  MidiMessage out[MIDI_BATCH_BYTES];
+  uint32_t noise = 7;
+  for (size_t i = 0; i < bytes.size();) {
+    noise = noise * 1103515245 + 12345;
+    uint32_t n = batch ? batch : 1 + (noise >> 16) % MIDI_BATCH_BYTES;
+    n = std::min<uint32_t>(n, bytes.size() - i);
+    const uint32_t count = parser.parse(&bytes[i], n, out);
+    messages.insert(messages.end(), out, out + count);
+    i += n;
+  }
+  return messages;
+}
+
+static void replay(const char* hex, const char* expectedHex, uint32_t stray) {
+  const std::vector<uint8_t> bytes = hexBytes(hex);
+  const std::vector<uint8_t> triples = hexBytes(expectedHex);
+  std::vector<MidiMessage> expected;
+  for (size_t i = 0; i + 2 < triples.size(); i += 3) {
+    expected.push_back(MidiMessage{triples[i], triples[i + 1], triples[i + 2]});
+  }
+
+  MidiParser whole, bytewise;
+  assertSameMessages(expected, parseAll(whole, bytes, MIDI_BATCH_BYTES));
+  assertSameMessages(expected, parseAll(bytewise, bytes, 1));
+  TEST_ASSERT_EQUAL_UINT32(stray, whole.stats().stray);
+  TEST_ASSERT_EQUAL_UINT32(stray, bytewise.stats().stray);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_note_on_and_off() {
+  replay("90 3c 40 80 3c 00", "90 3c 40 80 3c 00", 0);
+}
+
+void test_running_status() {
+  replay("90 3c 40 3e 40 3c 00", "90 3c 40 90 3e 40 90 3c 00", 0);
+}
+
+void test_one_data_byte() {
+  replay("c5 07 08 d0 30", "c5 07 00 c5 08 00 d0 30 00", 0);
+}
+
+void test_real_time_inside_a_message() {
+  replay("90 f8 3c fe 40 fa", "90 3c 40", 0);
+}
+
+void test_sysex_ends_running_status() {
+  replay("90 3c 40 f0 7e 01 02 f7 3e 40", "90 3c 40", 2);
+}
+
+void test_system_common_ends_running_status() {
+  replay("b0 07 64 f2 10 20 07 50", "b0 07 64", 2);
+}
+
+void test_data_before_any_status() {
+  replay("3c 40 90 3c 40", "90 3c 40", 2);
+}
+
+void test_status_cuts_a_message_short() {
+  replay("90 3c 80 3c 00", "80 3c 00", 0);
+}
+
+void test_tune_request() {
+  replay("e0 00 40 f6 00 40", "e0 00 40", 2);
+}
+
+void test_long_stream_round_trips() {
+  static const uint8_t TYPES[] = {MIDI_NOTE_ON, MIDI_NOTE_ON, MIDI_NOTE_ON, MIDI_NOTE_OFF,
+                                  MIDI_CONTROL_CHANGE, MIDI_PROGRAM_CHANGE, MIDI_CHANNEL_PRESSURE, MIDI_PITCH_BEND};
+  std::vector<uint8_t> bytes;
+  std::vector<MidiMessage> expected;
+  uint32_t noise = 1;
+  auto next = [&](uint32_t range) {
+    noise = noise * 1103515245 + 12345;
+    return (noise >> 8) % range;
+  };
+  uint8_t running = 0;
+
+  for (uint32_t i = 0; i < STREAM_MESSAGES; i++) {
+    const uint32_t roll = next(100);
+    if (roll < 2) {
+      bytes.push_back(MIDI_SYSEX);
+      for (uint32_t n = next(12); n > 0; n--) bytes.push_back(next(0x80));
+      bytes.push_back(MIDI_SYSEX_END);
+      running = 0;
+    } else if (roll < 3) {
+      bytes.push_back(0xf2);
+      bytes.push_back(next(0x80));
+      bytes.push_back(next(0x80));
+      running = 0;
+    }
+
+    // A single channel mostly, as from one controller, so status runs
+    const uint8_t status = TYPES[next(8)] | (next(8) ? 0 : next(16));
+    const MidiMessage msg = {status, (uint8_t) next(0x80),
+                             (uint8_t) (midiDataLength(status) == 2 ? next(0x80) : 0)};
+    uint8_t encoded[3];
+    const uint8_t n = encodeMidi(msg, running, encoded);
+    const uint32_t clockAt = next(20) == 0 ? next(n) : n;
+    for (uint8_t b = 0; b < n; b++) {
+      if (b == clockAt) bytes.push_back(MIDI_REALTIME);
+      bytes.push_back(encoded[b]);
+    }
+    expected.push_back(msg);
+  }
+
+  MidiParser parser;
+  assertSameMessages(expected, parseAll(parser, bytes, 0));
+  TEST_ASSERT_EQUAL_UINT32(0, parser.stats().stray);
+  TEST_ASSERT_EQUAL_UINT32(STREAM_MESSAGES, parser.stats().messages);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_note_on_and_off);
+  RUN_TEST(test_running_status);
+  RUN_TEST(test_one_data_byte);
+  RUN_TEST(test_real_time_inside_a_message);
+  RUN_TEST(test_sysex_ends_running_status);
+  RUN_TEST(test_system_common_ends_running_status);
+  RUN_TEST(test_data_before_any_status);
+  RUN_TEST(test_status_cuts_a_message_short);
+  RUN_TEST(test_tune_request);
+  RUN_TEST(test_long_stream_round_trips);
+  return UNITY_END();
+}
@@ -0,0 +1,158 @@
+#include <unity.h>
+#include <atomic>
+#include <thread>
+#include "spscRing.h"
+
+typedef SpscRing<uint32_t, 8> SmallRing;
+
+// Items pushed across two threads, enough to lap a small ring many times.
+// Both sides yield while they wait, so it runs on a single core too.
+constexpr uint32_t STRESS_ITEMS = 1000000;
+
+static uint32_t notified;
+
+static void countNotify(void* context) {
+  notified += *(uint32_t*) context;
+}
+
+void setUp() {
+  notified = 0;
+}
+
+void tearDown() {}
+
+void test_pops_in_push_order() {
+  SmallRing ring;
+  uint32_t item;
+  TEST_ASSERT_FALSE(ring.pop(item));
+  for (uint32_t i = 0; i < 5; i++) TEST_ASSERT_TRUE(ring.push(i));
+  TEST_ASSERT_EQUAL_UINT32(5, ring.size());
+  for (uint32_t i = 0; i < 5; i++) {
+    TEST_ASSERT_TRUE(ring.pop(item));
+    TEST_ASSERT_EQUAL_UINT32(i, item);
+  }
+  TEST_ASSERT_TRUE(ring.empty());
+}
+
+void test_overflow_drops_and_counts() {
+  SmallRing ring;
+  uint32_t item;
+  for (uint32_t i = 0; i < SmallRing::capacity(); i++) TEST_ASSERT_TRUE(ring.push(i));
+
+  // Every slot is usable, the next push is dropped and leaves the ring as it was
+  TEST_ASSERT_FALSE(ring.push(100));
+  TEST_ASSERT_FALSE(ring.push(101));
+  TEST_ASSERT_EQUAL_UINT32(2, ring.overflows());
+  TEST_ASSERT_EQUAL_UINT32(SmallRing::capacity(), ring.size());
+
+  TEST_ASSERT_TRUE(ring.pop(item));
+  TEST_ASSERT_EQUAL_UINT32(0, item);
+  TEST_ASSERT_TRUE(ring.push(8));
+  for (uint32_t i = 1; i <= 8; i++) {
+    TEST_ASSERT_TRUE(ring.pop(item));
+    TEST_ASSERT_EQUAL_UINT32(i, item);
+  }
+  TEST_ASSERT_EQUAL_UINT32(2, ring.overflows());
+}
+
+void test_counters_wrap() {
+  // Full and empty still tell apart as the counters pass 2^32
+  SmallRing ring(0xffffffff - 3);
+  uint32_t item, next = 0, expected = 0;
+  for (uint32_t lap = 0; lap < 4; lap++) {
+    while (ring.push(next)) next++;
+    TEST_ASSERT_EQUAL_UINT32(SmallRing::capacity(), ring.size());
+    for (uint32_t i = 0; i < 3; i++) {
+      TEST_ASSERT_TRUE(ring.pop(item));
+      TEST_ASSERT_EQUAL_UINT32(expected++, item);
+    }
+  }
+  while (ring.pop(item)) TEST_ASSERT_EQUAL_UINT32(expected++, item);
+  TEST_ASSERT_EQUAL_UINT32(next, expected);
+  TEST_ASSERT_TRUE(ring.empty());
+  TEST_ASSERT_EQUAL_UINT32(4, ring.overflows());
+}
+
+void test_notify_after_push() {
+  SmallRing ring;
+  uint32_t one = 1;
+  ring.setNotify(countNotify, &one);
+
+  ring.push(1);
+  TEST_ASSERT_EQUAL_UINT32(1, notified);
+
+  // A batch wakes the consumer once
+  ring.push(2, false);
+  ring.push(3, false);
+  TEST_ASSERT_EQUAL_UINT32(1, notified);
+  ring.notify();
+  TEST_ASSERT_EQUAL_UINT32(2, notified);
+}
+
+void test_two_threads_keep_order() {
+  // The producer pushes a count, retrying when full, while the consumer
+  // checks every item arrives once and in order
+  SmallRing ring;
+  std::atomic<uint32_t> retries(0);
+  std::thread producer([&]() {
+    for (uint32_t i = 0; i < STRESS_ITEMS; i++) {
+      while (!ring.push(i)) {
+        retries.fetch_add(1, std::memory_order_relaxed);
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  uint32_t expected = 0, wrong = 0, item;
+  while (expected < STRESS_ITEMS) {
+    if (!ring.pop(item)) {
+      std::this_thread::yield();
+      continue;
+    }
+    if (item != expected) wrong++;
+    expected = item + 1;
+  }
+  producer.join();
+
+  TEST_ASSERT_EQUAL_UINT32(0, wrong);
+  TEST_ASSERT_TRUE(ring.empty());
+  TEST_ASSERT_EQUAL_UINT32(retries.load(), ring.overflows());
+}
+
+void test_two_threads_copy_whole_items() {
+  // Items wider than a word are never seen half written
+  struct Wide {
+    uint32_t a, b, c, d;
+  };
+  SpscRing<Wide, 4> ring;
+  std::thread producer([&]() {
+    for (uint32_t i = 0; i < STRESS_ITEMS / 4; i++) {
+      const Wide w = {i, ~i, i * 3, i ^ 0x5a5a5a5a};
+      while (!ring.push(w)) std::this_thread::yield();
+    }
+  });
+
+  uint32_t seen = 0, torn = 0;
+  Wide w;
+  while (seen < STRESS_ITEMS / 4) {
+    if (!ring.pop(w)) {
+      std::this_thread::yield();
+      continue;
+    }
+    if (w.b != ~w.a || w.c != w.a * 3 || w.d != (w.a ^ 0x5a5a5a5a) || w.a != seen) torn++;
+    seen++;
+  }
+  producer.join();
+  TEST_ASSERT_EQUAL_UINT32(0, torn);
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_pops_in_push_order);
+  RUN_TEST(test_overflow_drops_and_counts);
+  RUN_TEST(test_counters_wrap);
+  RUN_TEST(test_notify_after_push);
+  RUN_TEST(test_two_threads_keep_order);
+  RUN_TEST(test_two_threads_copy_whole_items);
+  return UNITY_END();
+}
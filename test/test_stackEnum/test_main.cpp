@@ -0,0 +1,204 @@
+#include <unity.h>
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+#include "stackEnum.h"
+#include "canProtocol.h"
+
+// A stack of StackEnumerators in slots from west to east, wired through
+// their handshake lines and a shared bus with frame times. Neighbouring
+// modules are connected, so taking a module out splits the stack in two.
+// Modules power up at `bootMs`, or are plugged in and out by the events.
+
+constexpr uint16_t ABSENT = 0xffff;
+
+struct EnumEvent {
+  uint32_t atMs;  // 0 for none
+  uint8_t slot;
+  bool present;
+};
+
+// Virtual time after the last change the stack has to settle in
+constexpr uint32_t RUN_MS = 1500;
+constexpr uint32_t STEP_US = 50;
+
+// Each module polls a little out of step with the others
+constexpr uint32_t PHASE_US = 350;
+
+struct Module {
+  bool present;
+  uint64_t bootUs;
+  StackEnumerator enumerator;
+};
+
+struct Frame {
+  uint8_t from;
+  CanMessage msg;
+};
+
+// Runs the stack until RUN_MS after the last change. Every module must then
+// know its place in the run of modules it is connected to, with no round
+// timed out, and each change must have taken a round of at most two Starts
+// and a Claim per module.
+static void numberStack(uint8_t slots, const uint16_t (&bootMs)[STACK_MAX_MODULES],
+                        const EnumEvent (&events)[2]) {
+  std::vector<Module> modules(slots);
+  std::vector<Frame> bus;
+  uint64_t busFreeAt = 0;
+  uint32_t frames = 0, lastChangeMs = 0, changes = 0;
+
+  auto plug = [&](uint8_t slot, uint64_t now) {
+    modules[slot].present = true;
+    modules[slot].bootUs = now;
+    modules[slot].enumerator = StackEnumerator();
+    modules[slot].enumerator.begin(0x5eed0100 + slot, now / 1000);
+  };
+  // Neighbours' outputs, as seen at slot i's inputs
+  auto westIn = [&](uint8_t i) {
+    return i > 0 && modules[i - 1].present && modules[i - 1].enumerator.eastOutput();
+  };
+  auto eastIn = [&](uint8_t i) {
+    return i + 1 < slots && modules[i + 1].present;
+  };
+  auto connected = [&](uint8_t a, uint8_t b) {
+    for (uint8_t i = std::min(a, b); i <= std::max(a, b); i++) {
+      if (!modules[i].present) return false;
+    }
+    return true;
+  };
+
+  for (const EnumEvent& e : events) {
+    if (!e.atMs) continue;
+    lastChangeMs = std::max(lastChangeMs, e.atMs);
+    changes++;
+  }
+  for (uint8_t i = 0; i < slots; i++) {
+    if (bootMs[i] == ABSENT) continue;
+    lastChangeMs = std::max<uint32_t>(lastChangeMs, bootMs[i]);
+
+    // A module that powers up once the others have started numbering joins
+    // like one plugged in
+    if (bootMs[i] >= ENUM_BOOT_MS) changes++;
+  }
+  const uint64_t endUs = (uint64_t) (lastChangeMs + RUN_MS) * 1000;
+
+  for (uint64_t now = 0; now < endUs; now += STEP_US) {
+    for (uint8_t i = 0; i < slots; i++) {
+      if (bootMs[i] != ABSENT && now == (uint64_t) bootMs[i] * 1000) plug(i, now);
+    }
+    for (const EnumEvent& e : events) {
+      if (!e.atMs || now != (uint64_t) e.atMs * 1000) continue;
+      if (e.present) plug(e.slot, now);
+      else modules[e.slot].present = false;
+    }
+
+    // The frame on the bus reaches its stack, then its Claim frees the
+    // sender's turn
+    if (!bus.empty() && now >= busFreeAt) {
+      const Frame frame = bus.front();
+      bus.erase(bus.begin());
+      EnumFrame f;
+      const bool start = decodeEnumStart(frame.msg.data, frame.msg.length, f);
+      if (!start) decodeEnumClaim(frame.msg.data, frame.msg.length, f);
+      for (uint8_t i = 0; i < slots; i++) {
+        if (i == frame.from || !connected(i, frame.from)) continue;
+        if (start) modules[i].enumerator.onStart(f, now / 1000);
+        else modules[i].enumerator.onClaim(f, now / 1000);
+      }
+      if (!start && modules[frame.from].present) modules[frame.from].enumerator.onClaimSent(now / 1000);
+      if (!bus.empty()) busFreeAt = now + canFrameBits(bus.front().msg.length) * 1000000ull / CAN_BIT_RATE;
+    }
+
+    for (uint8_t i = 0; i < slots; i++) {
+      Module& m = modules[i];
+      const uint64_t phase = m.bootUs + i * PHASE_US;
+      if (!m.present || now < phase || (now - phase) % (ENUM_POLL_MS * 1000)) continue;
+
+      EnumFrame f;
+      const EnumSend send = m.enumerator.poll(westIn(i), eastIn(i), now / 1000, f);
+      if (send == EnumSend::None || !m.enumerator.online()) continue;
+
+      Frame frame;
+      frame.from = i;
+      frame.msg.id = CAN_ID_SYNC;
+      frame.msg.length = send == EnumSend::Start ? encodeEnumStart(f, frame.msg.data)
+                                                 : encodeEnumClaim(f, frame.msg.data);
+      if (bus.empty()) busFreeAt = now + canFrameBits(frame.msg.length) * 1000000ull / CAN_BIT_RATE;
+      bus.push_back(frame);
+      frames++;
+    }
+  }
+
+  for (uint8_t i = 0; i < slots; i++) {
+    if (!modules[i].present) continue;
+    uint8_t first = i, last = i;
+    while (first > 0 && modules[first - 1].present) first--;
+    while (last + 1 < slots && modules[last + 1].present) last++;
+
+    const StackEnumerator& e = modules[i].enumerator;
+    TEST_ASSERT_EQUAL(EnumState::Done, e.state());
+    TEST_ASSERT_EQUAL_UINT8(i - first, e.position());
+    TEST_ASSERT_EQUAL_UINT8(last - first + 1, e.count());
+    TEST_ASSERT_EQUAL_UINT32(0, e.stats().timeouts);
+  }
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32((1 + changes) * (2 + slots), frames);
+}
+
+void setUp() {}
+
+void tearDown() {}
+
+void test_lone_module() {
+  numberStack(1, {0}, {});
+}
+
+void test_2_modules() {
+  numberStack(2, {0, 3}, {});
+}
+
+void test_4_modules() {
+  numberStack(4, {5, 0, 9, 2}, {});
+}
+
+void test_8_modules() {
+  numberStack(8, {7, 3, 0, 5, 1, 6, 2, 4}, {});
+}
+
+void test_staggered_boot() {
+  numberStack(4, {0, 60, 150, 400}, {});
+}
+
+void test_west_end_boots_last() {
+  numberStack(4, {400, 0, 10, 20}, {});
+}
+
+void test_plugged_in_east() {
+  numberStack(4, {0, 2, 4, ABSENT}, {{1000, 3, true}});
+}
+
+void test_plugged_in_west() {
+  numberStack(4, {ABSENT, 0, 2, 4}, {{1000, 0, true}});
+}
+
+void test_middle_unplugged() {
+  numberStack(5, {0, 1, 2, 3, 4}, {{1000, 2, false}});
+}
+
+void test_module_reseated() {
+  numberStack(4, {0, 1, 2, 3}, {{1000, 1, false}, {1300, 1, true}});
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_lone_module);
+  RUN_TEST(test_2_modules);
+  RUN_TEST(test_4_modules);
+  RUN_TEST(test_8_modules);
+  RUN_TEST(test_staggered_boot);
+  RUN_TEST(test_west_end_boots_last);
+  RUN_TEST(test_plugged_in_east);
+  RUN_TEST(test_plugged_in_west);
+  RUN_TEST(test_middle_unplugged);
+  RUN_TEST(test_module_reseated);
+  return UNITY_END();
+}
@@ -0,0 +1,136 @@
+#include <unity.h>
+#include <stdint.h>
+#include <string.h>
+#include "voices.h"
+#include "tuning.h"
+
+// Two pools given the same notes, one of them with an extra note-on for a
+// later sample. Their output must match sample for sample until then, so
+// the voice it takes over keeps its pitch, envelope and release.
+
+// Long enough for the latest gate below whatever AUDIO_BLOCK_SIZE is
+constexpr uint32_t SAMPLES = 1024;
+constexpr uint32_t BLOCKS = SAMPLES / AUDIO_BLOCK_SIZE;
+
+static int16_t plain[SAMPLES];
+static int16_t scheduled[SAMPLES];
+
+static void render(VoicePool& pool, int16_t* out, uint32_t blocks) {
+  for (uint32_t i = 0; i < blocks; i++) pool.mixBlock(out + i * AUDIO_BLOCK_SIZE, AUDIO_BLOCK_SIZE);
+}
+
+static void playBoth(VoicePool& a, VoicePool& b, uint8_t first, uint8_t count) {
+  for (uint8_t note = first; note < first + count; note++) {
+    a.noteOn(note, noteStepSize(note));
+    b.noteOn(note, noteStepSize(note));
+  }
+}
+
+// Renders both pools and checks they part at `from` samples in
+static void assertPartAt(VoicePool& a, VoicePool& b, uint32_t from) {
+  render(a, plain, BLOCKS);
+  render(b, scheduled, BLOCKS);
+  TEST_ASSERT_EQUAL_INT16_ARRAY(plain, scheduled, from);
+  TEST_ASSERT_TRUE(memcmp(plain + from, scheduled + from, (SAMPLES - from) * sizeof(int16_t)) != 0);
+}
+
+void setUp() {
+  memset(plain, 0, sizeof(plain));
+  memset(scheduled, 0, sizeof(scheduled));
+}
+
+void tearDown() {}
+
+void test_timed_note_starts_on_its_sample() {
+  VoicePool pool;
+  pool.noteOn(60, noteStepSize(60), 100);
+  render(pool, plain, BLOCKS);
+
+  for (uint32_t i = 0; i < 100; i++) TEST_ASSERT_EQUAL_INT16(0, plain[i]);
+  bool sounding = false;
+  for (uint32_t i = 100; i < SAMPLES; i++) sounding |= plain[i] != 0;
+  TEST_ASSERT_TRUE(sounding);
+  TEST_ASSERT_EQUAL_UINT32(1, pool.gateStats().timed);
+  TEST_ASSERT_EQUAL_UINT32(0, pool.gateStats().late);
+}
+
+void test_releasing_voice_plays_out_until_taken_over() {
+  VoicePool a, b;
+  playBoth(a, b, 60, MAX_VOICES);
+  render(a, plain, 4);
+  render(b, scheduled, 4);
+  a.noteOff(60);
+  b.noteOff(60);
+  render(a, plain, 1);
+  render(b, scheduled, 1);
+
+  // The only free voice is the one releasing note 60
+  TEST_ASSERT_TRUE(b.hasVoiceFor(90));
+  b.noteOn(90, noteStepSize(90), b.clock() + 300);
+  TEST_ASSERT_EQUAL_UINT8(0, b.counts().releasing);
+  assertPartAt(a, b, 300);
+}
+
+void test_held_voice_is_stolen_on_its_sample() {
+  VoicePool a, b;
+  playBoth(a, b, 60, MAX_VOICES);
+  render(a, plain, 2);
+  render(b, scheduled, 2);
+
+  // A held note retriggers its own voice, a new one has to steal
+  TEST_ASSERT_TRUE(b.hasVoiceFor(60));
+  TEST_ASSERT_FALSE(b.hasVoiceFor(90));
+  b.noteOn(90, noteStepSize(90), b.clock() + 150);
+  TEST_ASSERT_EQUAL_UINT32(1, b.steals());
+  assertPartAt(a, b, 150);
+}
+
+void test_bend_reaches_a_waiting_note_and_the_one_it_takes_over() {
+  VoicePool a, b;
+  playBoth(a, b, 60, MAX_VOICES);
+  render(a, plain, 1);
+  render(b, scheduled, 1);
+  b.noteOn(90, noteStepSize(90), b.clock() + 200);
+  a.setPitchBend(150);
+  b.setPitchBend(150);
+  assertPartAt(a, b, 200);
+}
+
+void test_envelope_applies_from_the_next_block() {
+  VoicePool a, b;
+  playBoth(a, b, 60, 1);
+  render(a, plain, 1);
+  render(b, scheduled, 1);
+
+  EnvelopeParams envelope = b.getEnvelope();
+  envelope.attackRate /= 4;
+  b.setEnvelope(envelope);
+  TEST_ASSERT_EQUAL_UINT32(envelope.attackRate, b.getEnvelope().attackRate);
+  render(a, plain, 1);
+  render(b, scheduled, 1);
+  TEST_ASSERT_TRUE(memcmp(plain, scheduled, AUDIO_BLOCK_SIZE * sizeof(int16_t)) != 0);
+}
+
+// A release never lands before the note it stops, so the note is gated off
+// on its first sample and the voice comes free
+void test_note_off_before_its_trigger_frees_the_voice() {
+  VoicePool pool;
+  pool.noteOn(60, noteStepSize(60), 100);
+  pool.noteOff(60, 50);
+  TEST_ASSERT_EQUAL_UINT8(1, pool.counts().releasing);
+  render(pool, plain, BLOCKS);
+
+  for (uint32_t i = 0; i < SAMPLES; i++) TEST_ASSERT_EQUAL_INT16(0, plain[i]);
+  TEST_ASSERT_EQUAL_UINT8(0, pool.activeCount());
+}
+
+int main(int argc, char** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_timed_note_starts_on_its_sample);
+  RUN_TEST(test_releasing_voice_plays_out_until_taken_over);
+  RUN_TEST(test_held_voice_is_stolen_on_its_sample);
+  RUN_TEST(test_bend_reaches_a_waiting_note_and_the_one_it_takes_over);
+  RUN_TEST(test_note_off_before_its_trigger_frees_the_voice);
+  RUN_TEST(test_envelope_applies_from_the_next_block);
+  return UNITY_END();
+}
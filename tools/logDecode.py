@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Turns the firmware's binary event log back into text.
+
+The log drain task writes each record as a frame (see include/eventLog.h):
+
+    0xa5, id, argCount, time (u32), args (u32 each), checksum
+
+with little-endian words and a checksum that is the low byte of the sum of
+the bytes before it. Record formats come from include/logEvents.def. Bytes
+that aren't part of a valid frame, such as Serial.println() output, are
+passed through unchanged.
+
+    tools/logDecode.py capture.bin
+    tools/logDecode.py /dev/ttyACM0 --baud 9600   (needs pyserial)
+    pio device monitor --raw | tools/logDecode.py
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+LOG_SYNC = 0xA5
+LOG_MAX_ARGS = 3
+
+DEFAULT_DEF = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "include", "logEvents.def")
+
+
+def load_formats(path):
+    """Event formats in ID order, as numbered by the LOG_EVENT X-macro."""
+    pattern = re.compile(r'^\s*LOG_EVENT\(\s*(\w+)\s*,\s*"((?:[^"\\]|\\.)*)"\s*\)')
+    formats = []
+    with open(path) as f:
+        for line in f:
+            match = pattern.match(line)
+            if match:
+                formats.append((match.group(1), match.group(2)))
+    return formats
+
+
+def format_record(fmt, args):
+    """Fills %u, %d and %x the way the firmware's text mode does."""
+    values = iter(args)
+
+    def field(match):
+        kind = match.group(1)
+        if kind == "%":
+            return "%"
+        value = next(values, 0)
+        if kind == "d":
+            return str(value - (1 << 32) if value & 0x80000000 else value)
+        if kind == "x":
+            return "%X" % value
+        return str(value)
+
+    return re.sub(r"%([udx%])", field, fmt)
+
+
+def decode(chunks, formats, out):
+    """Decodes a stream of byte chunks, writing text to `out`."""
+    buf = bytearray()
+    for chunk in chunks:
+        buf += chunk
+        i = 0
+        while i < len(buf):
+            if buf[i] != LOG_SYNC:
+                # Pass text through up to the next possible frame
+                end = buf.find(LOG_SYNC, i)
+                end = len(buf) if end < 0 else end
+                out.write(buf[i:end].decode("latin-1"))
+                i = end
+                continue
+
+            if len(buf) - i < 3:
+                break
+            record_id, arg_count = buf[i + 1], buf[i + 2]
+            size = 3 + 4 * (1 + arg_count) + 1
+            if record_id >= len(formats) or arg_count > LOG_MAX_ARGS:
+                out.write(chr(buf[i]))
+                i += 1
+                continue
+            if len(buf) - i < size:
+                break
+
+            frame = buf[i:i + size]
+            if sum(frame[:-1]) & 0xFF != frame[-1]:
+                out.write(chr(buf[i]))
+                i += 1
+                continue
+
+            words = struct.unpack("<%dI" % (1 + arg_count), bytes(frame[3:-1]))
+            out.write("%10u %s\n" % (words[0], format_record(formats[record_id][1], words[1:])))
+            i += size
+        del buf[:i]
+        out.flush()
+    if buf:
+        out.write(buf.decode("latin-1"))
+
+
+def read_chunks(source):
+    while True:
+        data = source.read(256) if not hasattr(source, "in_waiting") else source.read(max(1, source.in_waiting))
+        if not data:
+            return
+        yield data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("input", nargs="?", help="capture file or serial port (default stdin)")
+    parser.add_argument("--baud", type=int, default=9600, help="baud rate for a serial port")
+    parser.add_argument("--def", dest="def_path", default=DEFAULT_DEF, help="path to logEvents.def")
+    args = parser.parse_args()
+
+    formats = load_formats(args.def_path)
+
+    if args.input is None:
+        source = sys.stdin.buffer
+    elif args.input.startswith(("/dev/", "COM")):
+        import serial
+        source = serial.Serial(args.input, args.baud)
+    else:
+        source = open(args.input, "rb")
+
+    try:
+        decode(read_chunks(source), formats, sys.stdout)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()